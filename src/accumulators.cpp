@@ -4,6 +4,7 @@
 
 #include "accumulators.h"
 #include "accumulatormap.h"
+#include "blockstream.h"
 #include "chainparams.h"
 #include "main.h"
 #include "txdb.h"
@@ -245,24 +246,17 @@ bool CalculateAccumulatorCheckpoint(int nHeight, uint256& nCheckpoint, Accumulat
         return true;
     }
 
-    CBlockIndex *pindex = chainActive[nHeightCheckpoint - 20];
-
-    while (pindex->nHeight < nHeight - 10) {
+    // Blocks below the zerocoin start height are not eligible for accumulation
+    std::vector<CBlockIndex*> vAccumulate = GetChainRange(chainActive, std::max(nHeightCheckpoint - 20, Params().Zerocoin_StartHeight()), nHeight - 11);
+    CBlockStream stream(vAccumulate);
+    CBlockIndex* pindex;
+    CBlock block;
+    while (stream.Next(pindex, block)) {
         // checking whether we should stop this process due to a shutdown request
         if (ShutdownRequested())
             return false;
 
-        //make sure this block is eligible for accumulation
-        if (pindex->nHeight < Params().Zerocoin_StartHeight()) {
-            pindex = chainActive[pindex->nHeight + 1];
-            continue;
-        }
-
         //grab mints from this block
-        CBlock block;
-        if(!ReadBlockFromDisk(block, pindex))
-            return error("%s: failed to read block from disk", __func__);
-
         std::list<PublicCoin> listPubcoins;
         if (!BlockToPubcoinList(block, listPubcoins, fFilterInvalid))
             return error("%s: failed to get zerocoin mintlist from block %d", __func__, pindex->nHeight);
@@ -275,8 +269,9 @@ bool CalculateAccumulatorCheckpoint(int nHeight, uint256& nCheckpoint, Accumulat
             if(!mapAccumulators.Accumulate(pubcoin, true))
                 return error("%s: failed to add pubcoin to accumulator at height %d", __func__, pindex->nHeight);
         }
-        pindex = chainActive.Next(pindex);
     }
+    if (stream.Failed())
+        return error("%s: failed to read block from disk", __func__);
 
     // if there were no new mints found, the accumulator checkpoint will be the same as the last checkpoint
     if (nTotalMintsFound == 0)
@@ -344,31 +339,23 @@ int ComputeAccumulatedCoins(int nHeightEnd, libzerocoin::CoinDenomination denom)
 }
 
 int AddBlockMintsToAccumulator(const libzerocoin::PublicCoin& coin, const int nHeightMintAdded, const CBlockIndex* pindex,
-                           libzerocoin::Accumulator* accumulator, bool isWitness)
+                           const CBlock& block, libzerocoin::Accumulator* accumulator, bool isWitness)
 {
-    // if this block contains mints of the denomination that is being spent, then add them to the witness
-    int nMintsAdded = 0;
-    if (pindex->MintedDenomination(coin.getDenomination())) {
-        //grab mints from this block
-        CBlock block;
-        if(!ReadBlockFromDisk(block, pindex))
-            return error("%s: failed to read block from disk while adding pubcoins to witness", __func__);
-
-        list<PublicCoin> listPubcoins;
-        if(!BlockToPubcoinList(block, listPubcoins, true))
-            return error("%s: failed to get zerocoin mintlist from block %n\n", __func__, pindex->nHeight);
+    list<PublicCoin> listPubcoins;
+    if(!BlockToPubcoinList(block, listPubcoins, true))
+        return error("%s: failed to get zerocoin mintlist from block %n\n", __func__, pindex->nHeight);
 
-        //add the mints to the witness
-        for (const PublicCoin& pubcoin : listPubcoins) {
-            if (pubcoin.getDenomination() != coin.getDenomination())
-                continue;
+    //add the mints to the witness
+    int nMintsAdded = 0;
+    for (const PublicCoin& pubcoin : listPubcoins) {
+        if (pubcoin.getDenomination() != coin.getDenomination())
+            continue;
 
-            if (isWitness && pindex->nHeight == nHeightMintAdded && pubcoin.getValue() == coin.getValue())
-                continue;
+        if (isWitness && pindex->nHeight == nHeightMintAdded && pubcoin.getValue() == coin.getValue())
+            continue;
 
-            accumulator->increment(pubcoin.getValue());
-            ++nMintsAdded;
-        }
+        accumulator->increment(pubcoin.getValue());
+        ++nMintsAdded;
     }
 
     return nMintsAdded;
@@ -459,6 +446,7 @@ bool GenerateAccumulatorWitness(const PublicCoin &coin, Accumulator& accumulator
     nMintsAdded = 0;
     RandomizeSecurityLevel(nSecurityLevel); //make security level not always the same and predictable
     libzerocoin::Accumulator witnessAccumulator = accumulator;
+    std::vector<CBlockIndex*> vMintBlocks;
     while (pindex) {
         if (pindex->nHeight != nAccStartHeight && pindex->pprev->nAccumulatorCheckpoint != pindex->nAccumulatorCheckpoint)
             ++nCheckpointsAdded;
@@ -477,9 +465,18 @@ bool GenerateAccumulatorWitness(const PublicCoin &coin, Accumulator& accumulator
             break;
         }
 
-        nMintsAdded += AddBlockMintsToAccumulator(coin, nHeightMintAdded, pindex, &witnessAccumulator, true);
+        // only blocks that contain mints of the denomination being spent add to the witness
+        if (pindex->MintedDenomination(coin.getDenomination()))
+            vMintBlocks.push_back(pindex);
         pindex = chainActive.Next(pindex);
     }
+
+    CBlockStream stream(vMintBlocks);
+    CBlock block;
+    while (stream.Next(pindex, block))
+        nMintsAdded += AddBlockMintsToAccumulator(coin, nHeightMintAdded, pindex, block, &witnessAccumulator, true);
+    if (stream.Failed())
+        return error("%s: failed to read block from disk while adding pubcoins to witness", __func__);
     witness.resetValue(witnessAccumulator, coin);
     if (!witness.VerifyWitness(accumulator, coin))
         return error("%s: failed to verify witness", __func__);
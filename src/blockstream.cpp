@@ -0,0 +1,109 @@
+// Copyright (c) 2018-2019 The PDG developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockstream.h"
+
+#include <algorithm>
+
+#include <boost/bind.hpp>
+
+CBlockStream::CBlockStream(const std::vector<CBlockIndex*>& vIndexIn, bool fReadUndoIn, int nThreads) : vIndex(vIndexIn), fReadUndo(fReadUndoIn), nNextRead(0), nNextUse(0), fAbort(false), fFailed(false)
+{
+    if (nThreads <= 0)
+        nThreads = std::min((int)boost::thread::hardware_concurrency(), MAX_BLOCK_STREAM_THREADS);
+    nThreads = std::max(1, std::min(nThreads, (int)std::max(vIndex.size(), (size_t)1)));
+
+    vSlots.resize(nThreads * BLOCK_STREAM_WINDOW_PER_THREAD);
+    for (int i = 0; i < nThreads; i++)
+        threadGroup.create_thread(boost::bind(&CBlockStream::ReadThread, this));
+}
+
+CBlockStream::~CBlockStream()
+{
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        fAbort = true;
+        cond.notify_all();
+    }
+    threadGroup.join_all();
+}
+
+void CBlockStream::ReadThread()
+{
+    while (true) {
+        size_t nPos;
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            while (!fAbort && nNextRead < vIndex.size() && nNextRead >= nNextUse + vSlots.size())
+                cond.wait(lock);
+            if (fAbort || nNextRead >= vIndex.size())
+                return;
+            nPos = nNextRead++;
+        }
+
+        // The slot is ours until it is marked ready
+        Slot& slot = vSlots[nPos % vSlots.size()];
+        const CBlockIndex* pindex = vIndex[nPos];
+        slot.fBlockOk = ReadBlockFromDisk(slot.block, pindex);
+        slot.fUndoOk = false;
+        if (slot.fBlockOk && fReadUndo && pindex->pprev) {
+            CDiskBlockPos pos = pindex->GetUndoPos();
+            slot.fUndoOk = !pos.IsNull() && slot.undo.ReadFromDisk(pos, pindex->pprev->GetBlockHash());
+        }
+
+        boost::unique_lock<boost::mutex> lock(mutex);
+        slot.fReady = true;
+        cond.notify_all();
+    }
+}
+
+bool CBlockStream::Next(CBlockIndex*& pindex, CBlock& block, CBlockUndo& undo, bool& fHaveUndo)
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    if (fFailed || nNextUse >= vIndex.size())
+        return false;
+
+    Slot& slot = vSlots[nNextUse % vSlots.size()];
+    while (!slot.fReady)
+        cond.wait(lock);
+
+    pindex = vIndex[nNextUse];
+    if (!slot.fBlockOk) {
+        fFailed = true;
+        return false;
+    }
+
+    block = std::move(slot.block);
+    fHaveUndo = slot.fUndoOk;
+    if (fHaveUndo)
+        undo.vtxundo.swap(slot.undo.vtxundo);
+    slot.block.SetNull();
+    slot.undo.vtxundo.clear();
+    slot.fReady = false;
+
+    nNextUse++;
+    cond.notify_all();
+    return true;
+}
+
+bool CBlockStream::Next(CBlockIndex*& pindex, CBlock& block)
+{
+    CBlockUndo undoUnused;
+    bool fHaveUndo;
+    return Next(pindex, block, undoUnused, fHaveUndo);
+}
+
+std::vector<CBlockIndex*> GetChainRange(const CChain& chain, int nHeightStart, int nHeightEnd)
+{
+    std::vector<CBlockIndex*> vIndex;
+    if (nHeightEnd < 0 || nHeightEnd > chain.Height())
+        nHeightEnd = chain.Height();
+    if (nHeightStart < 0)
+        nHeightStart = 0;
+    if (nHeightEnd >= nHeightStart)
+        vIndex.reserve(nHeightEnd - nHeightStart + 1);
+    for (int nHeight = nHeightStart; nHeight <= nHeightEnd; nHeight++)
+        vIndex.push_back(chain[nHeight]);
+    return vIndex;
+}
@@ -0,0 +1,80 @@
+// Copyright (c) 2018-2019 The PDG developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef PDG_BLOCKSTREAM_H
+#define PDG_BLOCKSTREAM_H
+
+#include "main.h"
+
+#include <vector>
+
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+
+/** Upper bound on the reader threads of a block stream; reading is disk bound */
+static const int MAX_BLOCK_STREAM_THREADS = 4;
+/** Blocks each reader thread may have decoded ahead of the consumer */
+static const int BLOCK_STREAM_WINDOW_PER_THREAD = 16;
+
+/**
+ * Reads a list of blocks, and optionally their undo data, from disk on
+ * background threads and hands them back in list order. Reader threads stay
+ * at most a bounded window of blocks ahead of the consumer, so a long walk
+ * over the chain runs at disk bandwidth without holding the chain in memory.
+ *
+ * The reader threads take no locks besides the stream's own; the caller must
+ * make sure the listed block index entries stay valid while it is open,
+ * usually by holding cs_main.
+ */
+class CBlockStream
+{
+private:
+    struct Slot {
+        CBlock block;
+        CBlockUndo undo;
+        bool fReady;
+        bool fBlockOk;
+        bool fUndoOk;
+        Slot() : fReady(false), fBlockOk(false), fUndoOk(false) {}
+    };
+
+    std::vector<CBlockIndex*> vIndex;
+    bool fReadUndo;
+    std::vector<Slot> vSlots;
+    size_t nNextRead;
+    size_t nNextUse;
+    bool fAbort;
+    bool fFailed;
+    boost::mutex mutex;
+    boost::condition_variable cond;
+    boost::thread_group threadGroup;
+
+    void ReadThread();
+
+public:
+    /** Stream the given blocks in the given order. nThreads <= 0 picks a default. */
+    CBlockStream(const std::vector<CBlockIndex*>& vIndexIn, bool fReadUndoIn = false, int nThreads = 0);
+    ~CBlockStream();
+
+    /**
+     * Move the next block into block and its undo data into undo. fHaveUndo
+     * tells whether undo data was requested, present and readable. Returns
+     * false at the end of the stream, or when a block could not be read, in
+     * which case Failed() is set and pindex names the unreadable block.
+     */
+    bool Next(CBlockIndex*& pindex, CBlock& block, CBlockUndo& undo, bool& fHaveUndo);
+    bool Next(CBlockIndex*& pindex, CBlock& block);
+
+    /** Total number of blocks in the stream */
+    size_t Size() const { return vIndex.size(); }
+    /** Number of blocks handed out so far */
+    size_t Position() const { return nNextUse; }
+    bool Failed() const { return fFailed; }
+};
+
+/** The entries of chain from height nHeightStart to nHeightEnd inclusive, or to the tip if nHeightEnd < 0 */
+std::vector<CBlockIndex*> GetChainRange(const CChain& chain, int nHeightStart, int nHeightEnd = -1);
+
+#endif // PDG_BLOCKSTREAM_H
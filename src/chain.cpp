@@ -6,6 +6,8 @@
 
 #include "chain.h"
 
+#include <new>
+
 using namespace std;
 
 /**
@@ -118,3 +120,52 @@ std::string CDBFileHeaderOnly::ToString() const
                      removed);
     return str;
 }
+
+/**
+ * CBlockIndexArena implementation
+ */
+void* CBlockIndexArena::AllocateRaw()
+{
+    LOCK(cs);
+    nAllocated++;
+    if (!vFree.empty()) {
+        CBlockIndex* pindex = vFree.back();
+        vFree.pop_back();
+        return pindex;
+    }
+    if (nUsedInChunk == CHUNK_ENTRIES) {
+        vChunks.push_back(static_cast<CBlockIndex*>(::operator new(sizeof(CBlockIndex) * CHUNK_ENTRIES)));
+        nUsedInChunk = 0;
+    }
+    return vChunks.back() + nUsedInChunk++;
+}
+
+CBlockIndex* CBlockIndexArena::Allocate()
+{
+    return new (AllocateRaw()) CBlockIndex();
+}
+
+CBlockIndex* CBlockIndexArena::Allocate(const CBlock& block)
+{
+    return new (AllocateRaw()) CBlockIndex(block);
+}
+
+void CBlockIndexArena::Free(CBlockIndex* pindex)
+{
+    pindex->~CBlockIndex();
+    LOCK(cs);
+    nAllocated--;
+    vFree.push_back(pindex);
+}
+
+size_t CBlockIndexArena::Size() const
+{
+    LOCK(cs);
+    return nAllocated;
+}
+
+size_t CBlockIndexArena::MemoryUsage() const
+{
+    LOCK(cs);
+    return vChunks.size() * CHUNK_ENTRIES * sizeof(CBlockIndex);
+}
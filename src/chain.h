@@ -9,6 +9,7 @@
 
 #include "pow.h"
 #include "primitives/block.h"
+#include "sync.h"
 #include "tinyformat.h"
 #include "uint256.h"
 #include "util.h"
@@ -233,6 +234,18 @@ enum BlockStatus {
     BLOCK_FAILED_MASK = BLOCK_FAILED_VALID | BLOCK_FAILED_CHILD,
 };
 
+/** Zerocoin supply per denomination, as recorded for each block */
+typedef std::map<libzerocoin::CoinDenomination, int64_t> ZerocoinSupplyMap;
+
+/** A supply map with every denomination at zero */
+inline ZerocoinSupplyMap GetEmptyZerocoinSupplyMap()
+{
+    ZerocoinSupplyMap mapSupply;
+    for (auto& denom : libzerocoin::zerocoinDenomList)
+        mapSupply.insert(std::make_pair(denom, 0));
+    return mapSupply;
+}
+
 /** The block chain is a tree shaped structure starting with the
  * genesis block at the root, with each block potentially having multiple
  * candidates to be the next block. A blockindex may have multiple pprev pointing
@@ -312,9 +325,14 @@ public:
     uint32_t nSequenceId;
     
     //! zerocoin specific fields
-    std::map<libzerocoin::CoinDenomination, int64_t> mapZerocoinSupply;
     std::vector<libzerocoin::CoinDenomination> vMintDenominationsInBlock;
-    
+
+    //! Zerocoin supply after this block. It is rarely needed for blocks away
+    //! from the tip, so it lives in a side table and is read back from the
+    //! block tree on demand instead of being held by every entry.
+    ZerocoinSupplyMap GetZerocoinSupplyMap() const;
+    void SetZerocoinSupplyMap(const ZerocoinSupplyMap& mapSupply);
+
     void SetNull()
     {
         phashBlock = NULL;
@@ -344,10 +362,6 @@ public:
         nBits = 0;
         nNonce = 0;
         nAccumulatorCheckpoint = 0;
-        // Start supply of each denomination with 0s
-        for (auto& denom : libzerocoin::zerocoinDenomList) {
-            mapZerocoinSupply.insert(make_pair(denom, 0));
-        }
         vMintDenominationsInBlock.clear();
     }
 
@@ -424,6 +438,7 @@ public:
 
     int64_t GetZerocoinSupply() const
     {
+        ZerocoinSupplyMap mapZerocoinSupply = GetZerocoinSupplyMap();
         int64_t nTotal = 0;
         for (auto& denom : libzerocoin::zerocoinDenomList) {
             nTotal += libzerocoin::ZerocoinDenominationToAmount(denom) * mapZerocoinSupply.at(denom);
@@ -545,6 +560,39 @@ public:
     const CBlockIndex* GetAncestor(int height) const;
 };
 
+/**
+ * Allocates block index entries in large chunks rather than one heap block
+ * each, which saves the allocator overhead and keeps entries that were
+ * loaded together close in memory. Entries are never freed individually;
+ * mapBlockIndex never releases them either.
+ */
+class CBlockIndexArena
+{
+private:
+    static const size_t CHUNK_ENTRIES = 4096;
+
+    mutable CCriticalSection cs;
+    std::vector<CBlockIndex*> vChunks;
+    std::vector<CBlockIndex*> vFree;
+    size_t nUsedInChunk;
+    size_t nAllocated;
+
+    void* AllocateRaw();
+
+public:
+    CBlockIndexArena() : nUsedInChunk(CHUNK_ENTRIES), nAllocated(0) {}
+
+    CBlockIndex* Allocate();
+    CBlockIndex* Allocate(const CBlock& block);
+    /** Give back an entry that never made it into mapBlockIndex, for reuse */
+    void Free(CBlockIndex* pindex);
+
+    /** Number of entries handed out */
+    size_t Size() const;
+    /** Bytes reserved for entries, including unused room in the last chunk */
+    size_t MemoryUsage() const;
+};
+
 class CFileIndex {
 public:
     const uint256 *hashFile;
@@ -557,16 +605,19 @@ class CDiskBlockIndex : public CBlockIndex
 public:
     uint256 hashPrev;
     uint256 hashNext;
+    ZerocoinSupplyMap mapZerocoinSupply;
 
     CDiskBlockIndex()
     {
         hashPrev = uint256();
         hashNext = uint256();
+        mapZerocoinSupply = GetEmptyZerocoinSupplyMap();
     }
 
     explicit CDiskBlockIndex(CBlockIndex* pindex) : CBlockIndex(*pindex)
     {
         hashPrev = (pprev ? pprev->GetBlockHash() : uint256());
+        mapZerocoinSupply = pindex->GetZerocoinSupplyMap();
     }
 
     ADD_SERIALIZE_METHODS;
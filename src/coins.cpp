@@ -76,13 +76,18 @@ bool CCoinsViewBacked::GetStats(CCoinsStats& stats) const { return base->GetStat
 
 CCoinsKeyHasher::CCoinsKeyHasher() : salt(GetRandHash()) {}
 
-CCoinsViewCache::CCoinsViewCache(CCoinsView* baseIn) : CCoinsViewBacked(baseIn), hasModifier(false), hashBlock(0) {}
+CCoinsViewCache::CCoinsViewCache(CCoinsView* baseIn) : CCoinsViewBacked(baseIn), hasModifier(false), hashBlock(0), cachedCoinsUsage(0) {}
 
 CCoinsViewCache::~CCoinsViewCache()
 {
     assert(!hasModifier);
 }
 
+size_t CCoinsViewCache::DynamicMemoryUsage() const
+{
+    return memusage::DynamicUsage(cacheCoins) + cachedCoinsUsage;
+}
+
 CCoinsMap::const_iterator CCoinsViewCache::FetchCoins(const uint256& txid) const
 {
     CCoinsMap::iterator it = cacheCoins.find(txid);
@@ -98,6 +103,7 @@ CCoinsMap::const_iterator CCoinsViewCache::FetchCoins(const uint256& txid) const
         // version as fresh.
         ret->second.flags = CCoinsCacheEntry::FRESH;
     }
+    cachedCoinsUsage += ret->second.coins.DynamicMemoryUsage();
     return ret;
 }
 
@@ -115,6 +121,7 @@ CCoinsModifier CCoinsViewCache::ModifyCoins(const uint256& txid)
 {
     assert(!hasModifier);
     std::pair<CCoinsMap::iterator, bool> ret = cacheCoins.insert(std::make_pair(txid, CCoinsCacheEntry()));
+    size_t cachedCoinUsage = 0;
     if (ret.second) {
         if (!base->GetCoins(txid, ret.first->second.coins)) {
             // The parent view does not have this entry; mark it as fresh.
@@ -124,10 +131,12 @@ CCoinsModifier CCoinsViewCache::ModifyCoins(const uint256& txid)
             // The parent view only has a pruned entry for this; mark it as fresh.
             ret.first->second.flags = CCoinsCacheEntry::FRESH;
         }
+    } else {
+        cachedCoinUsage = ret.first->second.coins.DynamicMemoryUsage();
     }
     // Assume that whenever ModifyCoins is called, the entry will be modified.
     ret.first->second.flags |= CCoinsCacheEntry::DIRTY;
-    return CCoinsModifier(*this, ret.first);
+    return CCoinsModifier(*this, ret.first, cachedCoinUsage);
 }
 
 const CCoins* CCoinsViewCache::AccessCoins(const uint256& txid) const
@@ -177,6 +186,7 @@ bool CCoinsViewCache::BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlockIn
                     assert(it->second.flags & CCoinsCacheEntry::FRESH);
                     CCoinsCacheEntry& entry = cacheCoins[it->first];
                     entry.coins.swap(it->second.coins);
+                    cachedCoinsUsage += entry.coins.DynamicMemoryUsage();
                     entry.flags = CCoinsCacheEntry::DIRTY | CCoinsCacheEntry::FRESH;
                 }
             } else {
@@ -184,10 +194,13 @@ bool CCoinsViewCache::BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlockIn
                     // The grandparent does not have an entry, and the child is
                     // modified and being pruned. This means we can just delete
                     // it from the parent.
+                    cachedCoinsUsage -= itUs->second.coins.DynamicMemoryUsage();
                     cacheCoins.erase(itUs);
                 } else {
                     // A normal modification.
+                    cachedCoinsUsage -= itUs->second.coins.DynamicMemoryUsage();
                     itUs->second.coins.swap(it->second.coins);
+                    cachedCoinsUsage += itUs->second.coins.DynamicMemoryUsage();
                     itUs->second.flags |= CCoinsCacheEntry::DIRTY;
                 }
             }
@@ -203,6 +216,7 @@ bool CCoinsViewCache::Flush()
 {
     bool fOk = base->BatchWrite(cacheCoins, hashBlock);
     cacheCoins.clear();
+    cachedCoinsUsage = 0;
     return fOk;
 }
 
@@ -264,7 +278,7 @@ double CCoinsViewCache::GetPriority(const CTransaction& tx, int nHeight) const
     return tx.ComputePriority(dResult);
 }
 
-CCoinsModifier::CCoinsModifier(CCoinsViewCache& cache_, CCoinsMap::iterator it_) : cache(cache_), it(it_)
+CCoinsModifier::CCoinsModifier(CCoinsViewCache& cache_, CCoinsMap::iterator it_, size_t usage) : cache(cache_), it(it_), cachedCoinUsage(usage)
 {
     assert(!cache.hasModifier);
     cache.hasModifier = true;
@@ -275,7 +289,140 @@ CCoinsModifier::~CCoinsModifier()
     assert(cache.hasModifier);
     cache.hasModifier = false;
     it->second.coins.Cleanup();
+    cache.cachedCoinsUsage -= cachedCoinUsage; // Subtract the old usage
     if ((it->second.flags & CCoinsCacheEntry::FRESH) && it->second.coins.IsPruned()) {
         cache.cacheCoins.erase(it);
+    } else {
+        // If the coin still exists after the modification, add the new usage
+        cache.cachedCoinsUsage += it->second.coins.DynamicMemoryUsage();
     }
 }
+
+CCoinsViewFrozen::CCoinsViewFrozen(CCoinsView* baseIn) : CCoinsViewBacked(baseIn), hashFrozenBlock(0), fPending(false), fWriting(false), nFrozenUsage(0) {}
+
+void CCoinsViewFrozen::WaitForWrite(boost::unique_lock<boost::mutex>& lock) const
+{
+    while (fWriting)
+        cond.wait(lock);
+}
+
+// Entries are only frozen by BatchWrite(), which runs on the same thread as
+// the reads through the cache on top. Anything not found here is therefore
+// either already written to the base or was never changed.
+bool CCoinsViewFrozen::GetCoins(const uint256& txid, CCoins& coins) const
+{
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        CCoinsMap::const_iterator it = mapFrozen.find(txid);
+        if (it != mapFrozen.end()) {
+            coins = it->second.coins;
+            return true;
+        }
+    }
+    return base->GetCoins(txid, coins);
+}
+
+bool CCoinsViewFrozen::HaveCoins(const uint256& txid) const
+{
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        CCoinsMap::const_iterator it = mapFrozen.find(txid);
+        if (it != mapFrozen.end())
+            return !it->second.coins.vout.empty();
+    }
+    return base->HaveCoins(txid);
+}
+
+uint256 CCoinsViewFrozen::GetBestBlock() const
+{
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        if (fPending && hashFrozenBlock != uint256(0))
+            return hashFrozenBlock;
+    }
+    return base->GetBestBlock();
+}
+
+bool CCoinsViewFrozen::BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlockIn)
+{
+    boost::unique_lock<boost::mutex> lock(cs);
+    WaitForWrite(lock);
+    if (mapFrozen.empty()) {
+        mapFrozen.swap(mapCoins);
+    } else {
+        // A failed write left changes behind; newer ones replace them
+        for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end(); ++it) {
+            if (it->second.flags & CCoinsCacheEntry::DIRTY)
+                mapFrozen[it->first] = it->second;
+            else
+                mapFrozen.insert(*it);
+        }
+        mapCoins.clear();
+    }
+    nFrozenUsage = 0;
+    for (CCoinsMap::const_iterator it = mapFrozen.begin(); it != mapFrozen.end(); ++it)
+        nFrozenUsage += it->second.coins.DynamicMemoryUsage();
+    if (hashBlockIn != uint256(0))
+        hashFrozenBlock = hashBlockIn;
+    fPending = true;
+    return true;
+}
+
+bool CCoinsViewFrozen::GetStats(CCoinsStats& stats) const
+{
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        WaitForWrite(lock);
+    }
+    return base->GetStats(stats);
+}
+
+bool CCoinsViewFrozen::WriteFrozen()
+{
+    uint256 hashBlock;
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        WaitForWrite(lock);
+        if (!fPending)
+            return true;
+        fWriting = true;
+        hashBlock = hashFrozenBlock;
+    }
+
+    // mapFrozen is only read from here on, so lookups can go on without the lock
+    bool fOk = false;
+    try {
+        fOk = base->BatchWrite(mapFrozen, hashBlock);
+    } catch (...) {
+        boost::unique_lock<boost::mutex> lock(cs);
+        fWriting = false;
+        cond.notify_all();
+        throw;
+    }
+
+    CCoinsMap mapWritten;
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        fWriting = false;
+        if (fOk) {
+            mapWritten.swap(mapFrozen);
+            hashFrozenBlock = 0;
+            fPending = false;
+            nFrozenUsage = 0;
+        }
+        cond.notify_all();
+    }
+    return fOk;
+}
+
+bool CCoinsViewFrozen::HasPending() const
+{
+    boost::unique_lock<boost::mutex> lock(cs);
+    return fPending;
+}
+
+size_t CCoinsViewFrozen::DynamicMemoryUsage() const
+{
+    boost::unique_lock<boost::mutex> lock(cs);
+    return memusage::DynamicUsage(mapFrozen) + nFrozenUsage;
+}
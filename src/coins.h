@@ -8,8 +8,10 @@
 #define BITCOIN_COINS_H
 
 #include "compressor.h"
+#include "memusage.h"
 #include "script/standard.h"
 #include "serialize.h"
+#include "sync.h"
 #include "uint256.h"
 #include "undo.h"
 
@@ -284,6 +286,16 @@ public:
                 return false;
         return true;
     }
+
+    //! heap memory owned by this entry: the vout array and every script in it
+    size_t DynamicMemoryUsage() const
+    {
+        size_t ret = memusage::DynamicUsage(vout);
+        BOOST_FOREACH (const CTxOut& out, vout) {
+            ret += memusage::DynamicUsage(*static_cast<const std::vector<unsigned char>*>(&out.scriptPubKey));
+        }
+        return ret;
+    }
 };
 
 class CCoinsKeyHasher
@@ -399,7 +411,8 @@ class CCoinsModifier
 private:
     CCoinsViewCache& cache;
     CCoinsMap::iterator it;
-    CCoinsModifier(CCoinsViewCache& cache_, CCoinsMap::iterator it_);
+    size_t cachedCoinUsage; // Cached memory usage of the CCoins object before modification
+    CCoinsModifier(CCoinsViewCache& cache_, CCoinsMap::iterator it_, size_t usage);
 
 public:
     CCoins* operator->() { return &it->second.coins; }
@@ -422,6 +435,9 @@ protected:
     mutable uint256 hashBlock;
     mutable CCoinsMap cacheCoins;
 
+    /* Cached dynamic memory usage for the inner CCoins objects. */
+    mutable size_t cachedCoinsUsage;
+
 public:
     CCoinsViewCache(CCoinsView* baseIn);
     ~CCoinsViewCache();
@@ -457,6 +473,9 @@ public:
     //! Calculate the size of the cache (in number of transactions)
     unsigned int GetCacheSize() const;
 
+    //! Calculate the heap memory used by the cache, map overhead included
+    size_t DynamicMemoryUsage() const;
+
     /** 
      * Amount of pdg coming in to a transaction
      * Note that lightweight clients may not know anything besides the hash of previous transactions,
@@ -482,4 +501,50 @@ private:
     CCoinsMap::const_iterator FetchCoins(const uint256& txid) const;
 };
 
+/**
+ * CCoinsView that holds one set of flushed changes while they are written to
+ * its base. BatchWrite() only takes over the changes, so a cache on top can be
+ * emptied under cs_main without waiting for the database; WriteFrozen() then
+ * writes them from another thread, and reads are answered from the frozen
+ * entries until it is done. Only one set is written at a time: BatchWrite()
+ * waits for a write in progress, and merges into changes a failed write left.
+ *
+ * The base must not modify the map passed to its BatchWrite(), as it is read
+ * concurrently; CCoinsViewDB leaves it untouched.
+ */
+class CCoinsViewFrozen : public CCoinsViewBacked
+{
+private:
+    mutable CWaitableCriticalSection cs;
+    mutable CConditionVariable cond;
+    CCoinsMap mapFrozen;
+    uint256 hashFrozenBlock;
+    //! Whether mapFrozen and hashFrozenBlock still need to be written
+    bool fPending;
+    //! Whether WriteFrozen() is running; mapFrozen is not modified meanwhile
+    bool fWriting;
+    size_t nFrozenUsage;
+
+    void WaitForWrite(boost::unique_lock<boost::mutex>& lock) const;
+
+public:
+    CCoinsViewFrozen(CCoinsView* baseIn);
+
+    bool GetCoins(const uint256& txid, CCoins& coins) const;
+    bool HaveCoins(const uint256& txid) const;
+    uint256 GetBestBlock() const;
+    bool BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock);
+    //! Waits for a write in progress, so the statistics match the best block
+    bool GetStats(CCoinsStats& stats) const;
+
+    //! Write the frozen changes to the base. On failure they are kept and retried with the next write.
+    bool WriteFrozen();
+
+    //! Whether there are changes that have not been written yet
+    bool HasPending() const;
+
+    //! Calculate the heap memory used by the frozen changes
+    size_t DynamicMemoryUsage() const;
+};
+
 #endif // BITCOIN_COINS_H
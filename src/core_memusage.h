@@ -0,0 +1,54 @@
+// Copyright (c) 2015 The Bitcoin developers
+// Copyright (c) 2018-2019 The PDG developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef PDG_CORE_MEMUSAGE_H
+#define PDG_CORE_MEMUSAGE_H
+
+#include "memusage.h"
+#include "primitives/transaction.h"
+
+static inline size_t RecursiveDynamicUsage(const CScript& script)
+{
+    return memusage::DynamicUsage(*static_cast<const std::vector<unsigned char>*>(&script));
+}
+
+static inline size_t RecursiveDynamicUsage(const CTxIn& in)
+{
+    return RecursiveDynamicUsage(in.scriptSig);
+}
+
+static inline size_t RecursiveDynamicUsage(const CTxOut& out)
+{
+    return RecursiveDynamicUsage(out.scriptPubKey);
+}
+
+/** Memory held by the metadata of a file transaction: the comment, the RSA public key or the encrypted file meta */
+static inline size_t RecursiveDynamicUsage(int32_t type, const CTransactionMeta& meta)
+{
+    if (type == TX_FILE_PAYMENT_REQUEST) {
+        const CPaymentRequest& request = static_cast<const CPaymentRequest&>(meta);
+        return memusage::MallocUsage(sizeof(CPaymentRequest)) + memusage::MallocUsage(request.sComment.capacity());
+    } else if (type == TX_FILE_PAYMENT_CONFIRM) {
+        const CPaymentConfirm& confirm = static_cast<const CPaymentConfirm&>(meta);
+        return memusage::MallocUsage(sizeof(CPaymentConfirm)) + memusage::DynamicUsage(confirm.vfPublicKey);
+    } else if (type == TX_FILE_TRANSFER) {
+        const CFileMeta& fileMeta = static_cast<const CFileMeta&>(meta);
+        return memusage::MallocUsage(sizeof(CFileMeta)) + memusage::DynamicUsage(fileMeta.vfEncodedMeta);
+    }
+    return memusage::MallocUsage(sizeof(CTransactionMeta));
+}
+
+static inline size_t RecursiveDynamicUsage(const CTransaction& tx)
+{
+    size_t mem = memusage::DynamicUsage(tx.vin) + memusage::DynamicUsage(tx.vout) + memusage::DynamicUsage(tx.vfiles);
+    for (std::vector<CTxIn>::const_iterator it = tx.vin.begin(); it != tx.vin.end(); it++)
+        mem += RecursiveDynamicUsage(*it);
+    for (std::vector<CTxOut>::const_iterator it = tx.vout.begin(); it != tx.vout.end(); it++)
+        mem += RecursiveDynamicUsage(*it);
+    mem += RecursiveDynamicUsage(tx.type, tx.meta.get());
+    return mem;
+}
+
+#endif // PDG_CORE_MEMUSAGE_H
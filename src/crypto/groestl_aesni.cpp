@@ -0,0 +1,165 @@
+// Copyright (c) 2018-2019 The PDG developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+// Groestl-512 with AES-NI, for the 64 byte messages of the Quark chain.
+//
+// The state is kept as eight rows of 16 bytes. Groestl's SubBytes is the AES
+// S-box, so aesenclast with a zero key does it once a shuffle has cancelled
+// AES ShiftRows; the same shuffle applies ShiftBytes, which also moves bytes
+// within a row. MixBytes works on whole rows with byte-wise doubling.
+
+#include "crypto/quark.h"
+
+#ifdef ENABLE_QUARK_X86
+
+#include <immintrin.h>
+
+namespace groestl_aesni
+{
+namespace
+{
+#define TARGET __attribute__((target("aes,ssse3")))
+
+/** Mask for pshufb undoing AES ShiftRows and rotating the row left by n bytes */
+#define SHUF(n) _mm_setr_epi8(                                                                                          \
+    (0 + n) & 15, (13 + n) & 15, (10 + n) & 15, (7 + n) & 15, (4 + n) & 15, (1 + n) & 15, (14 + n) & 15, (11 + n) & 15, \
+    (8 + n) & 15, (5 + n) & 15, (2 + n) & 15, (15 + n) & 15, (12 + n) & 15, (9 + n) & 15, (6 + n) & 15, (3 + n) & 15)
+
+#define MUL2(x) _mm_xor_si128(_mm_add_epi8(x, x), _mm_and_si128(_mm_cmpgt_epi8(zero, x), c1b))
+
+/** SubBytes and ShiftBytes of one row: aesenclast applies ShiftRows and SubBytes, the shuffle cancels the first */
+#define SUB_SHIFT(x, n) x = _mm_aesenclast_si128(_mm_shuffle_epi8(x, SHUF(n)), zero)
+
+/**
+ * b[i] = 2.a[i] + 2.a[i+1] + 3.a[i+2] + 4.a[i+3] + 5.a[i+4] + 3.a[i+5] + 5.a[i+6] + 7.a[i+7]
+ *      = 2.(X + 2.Y) + Z with X, Y, Z sums of rows sharing s[i] = a[i] + a[i+1]
+ */
+#define MIX_ROW(b, a0, a2, a5, a7, s0, s3, s4, s6)                               \
+    do {                                                                         \
+        __m128i x = _mm_xor_si128(_mm_xor_si128(s0, a2), _mm_xor_si128(a5, a7)); \
+        __m128i y = _mm_xor_si128(s3, s6);                                       \
+        __m128i z = _mm_xor_si128(_mm_xor_si128(a2, s4), s6);                    \
+        y = MUL2(y);                                                             \
+        x = _mm_xor_si128(x, y);                                                 \
+        b = _mm_xor_si128(MUL2(x), z);                                           \
+    } while (0)
+
+#define MIX_BYTES                                                       \
+    do {                                                                \
+        __m128i s0 = _mm_xor_si128(a0, a1), s1 = _mm_xor_si128(a1, a2); \
+        __m128i s2 = _mm_xor_si128(a2, a3), s3 = _mm_xor_si128(a3, a4); \
+        __m128i s4 = _mm_xor_si128(a4, a5), s5 = _mm_xor_si128(a5, a6); \
+        __m128i s6 = _mm_xor_si128(a6, a7), s7 = _mm_xor_si128(a7, a0); \
+        __m128i b0, b1, b2, b3, b4, b5, b6, b7;                         \
+        MIX_ROW(b0, a0, a2, a5, a7, s0, s3, s4, s6);                    \
+        MIX_ROW(b1, a1, a3, a6, a0, s1, s4, s5, s7);                    \
+        MIX_ROW(b2, a2, a4, a7, a1, s2, s5, s6, s0);                    \
+        MIX_ROW(b3, a3, a5, a0, a2, s3, s6, s7, s1);                    \
+        MIX_ROW(b4, a4, a6, a1, a3, s4, s7, s0, s2);                    \
+        MIX_ROW(b5, a5, a7, a2, a4, s5, s0, s1, s3);                    \
+        MIX_ROW(b6, a6, a0, a3, a5, s6, s1, s2, s4);                    \
+        MIX_ROW(b7, a7, a1, a4, a6, s7, s2, s3, s5);                    \
+        a0 = b0; a1 = b1; a2 = b2; a3 = b3;                             \
+        a4 = b4; a5 = b5; a6 = b6; a7 = b7;                             \
+    } while (0)
+
+#define LOAD_STATE(s) \
+    __m128i a0 = s[0], a1 = s[1], a2 = s[2], a3 = s[3], a4 = s[4], a5 = s[5], a6 = s[6], a7 = s[7]
+#define STORE_STATE(s) \
+    s[0] = a0, s[1] = a1, s[2] = a2, s[3] = a3, s[4] = a4, s[5] = a5, s[6] = a6, s[7] = a7
+
+TARGET void PermP(__m128i* s)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i c1b = _mm_set1_epi8(0x1b);
+    const __m128i rc = _mm_setr_epi8(0x00, 0x10, 0x20, 0x30, 0x40, 0x50, 0x60, 0x70,
+        (char)0x80, (char)0x90, (char)0xa0, (char)0xb0, (char)0xc0, (char)0xd0, (char)0xe0, (char)0xf0);
+    LOAD_STATE(s);
+    for (int r = 0; r < 14; r++) {
+        a0 = _mm_xor_si128(a0, _mm_xor_si128(rc, _mm_set1_epi8(r)));
+        SUB_SHIFT(a0, 0);
+        SUB_SHIFT(a1, 1);
+        SUB_SHIFT(a2, 2);
+        SUB_SHIFT(a3, 3);
+        SUB_SHIFT(a4, 4);
+        SUB_SHIFT(a5, 5);
+        SUB_SHIFT(a6, 6);
+        SUB_SHIFT(a7, 11);
+        MIX_BYTES;
+    }
+    STORE_STATE(s);
+}
+
+TARGET void PermQ(__m128i* s)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i c1b = _mm_set1_epi8(0x1b);
+    const __m128i ones = _mm_set1_epi8((char)0xff);
+    const __m128i rc = _mm_setr_epi8((char)0xff, (char)0xef, (char)0xdf, (char)0xcf, (char)0xbf, (char)0xaf, (char)0x9f, (char)0x8f,
+        0x7f, 0x6f, 0x5f, 0x4f, 0x3f, 0x2f, 0x1f, 0x0f);
+    LOAD_STATE(s);
+    for (int r = 0; r < 14; r++) {
+        a0 = _mm_xor_si128(a0, ones);
+        a1 = _mm_xor_si128(a1, ones);
+        a2 = _mm_xor_si128(a2, ones);
+        a3 = _mm_xor_si128(a3, ones);
+        a4 = _mm_xor_si128(a4, ones);
+        a5 = _mm_xor_si128(a5, ones);
+        a6 = _mm_xor_si128(a6, ones);
+        a7 = _mm_xor_si128(a7, _mm_xor_si128(rc, _mm_set1_epi8(r)));
+        SUB_SHIFT(a0, 1);
+        SUB_SHIFT(a1, 3);
+        SUB_SHIFT(a2, 5);
+        SUB_SHIFT(a3, 11);
+        SUB_SHIFT(a4, 0);
+        SUB_SHIFT(a5, 2);
+        SUB_SHIFT(a6, 4);
+        SUB_SHIFT(a7, 6);
+        MIX_BYTES;
+    }
+    STORE_STATE(s);
+}
+} // namespace
+
+TARGET void Groestl512_64(unsigned char* out, const unsigned char* in)
+{
+    // Rows of the padded block: the input, 0x80, and a block count of one
+    unsigned char rows[8][16];
+    for (int i = 0; i < 8; i++) {
+        for (int j = 0; j < 8; j++)
+            rows[i][j] = in[j * 8 + i];
+        for (int j = 8; j < 16; j++)
+            rows[i][j] = 0;
+    }
+    rows[0][8] = 0x80;
+    rows[7][15] = 0x01;
+
+    __m128i h[8], m[8], p[8];
+    for (int i = 0; i < 8; i++) {
+        m[i] = _mm_loadu_si128((const __m128i*)rows[i]);
+        h[i] = _mm_setzero_si128();
+    }
+    // The IV holds the output size in bits, 0x0200 in the last two bytes of the state
+    h[6] = _mm_setr_epi8(0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 2);
+
+    // Compression of the single block, then the output transformation
+    for (int i = 0; i < 8; i++)
+        p[i] = _mm_xor_si128(h[i], m[i]);
+    PermP(p);
+    PermQ(m);
+    for (int i = 0; i < 8; i++) {
+        h[i] = _mm_xor_si128(h[i], _mm_xor_si128(p[i], m[i]));
+        p[i] = h[i];
+    }
+    PermP(p);
+    for (int i = 0; i < 8; i++)
+        _mm_storeu_si128((__m128i*)rows[i], _mm_xor_si128(p[i], h[i]));
+    // The digest is the last 64 bytes, the right half of every row
+    for (int i = 0; i < 8; i++)
+        for (int j = 8; j < 16; j++)
+            out[(j - 8) * 8 + i] = rows[i][j];
+}
+} // namespace groestl_aesni
+
+#endif // ENABLE_QUARK_X86
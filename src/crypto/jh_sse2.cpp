@@ -0,0 +1,175 @@
+// Copyright (c) 2018-2019 The PDG developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+// JH-512 with SSE2, for the 64 byte messages of the Quark chain.
+//
+// This is the bitsliced form the sph code uses, with each 128-bit state word
+// in one register instead of two 64-bit halves. Words are kept byte swapped
+// like sph does, which leaves every step of the round unchanged.
+
+#include "crypto/quark.h"
+
+#ifdef ENABLE_QUARK_X86
+
+#include <emmintrin.h>
+
+namespace jh_sse2
+{
+namespace
+{
+/** A big endian constant as it reads from memory on this little endian target */
+#define C64E(x) (((x) >> 56) | (((x) >> 40) & 0xff00ULL) | (((x) >> 24) & 0xff0000ULL) | (((x) >> 8) & 0xff000000ULL) | \
+                 (((x) << 8) & 0xff00000000ULL) | (((x) << 24) & 0xff0000000000ULL) | (((x) << 40) & 0xff000000000000ULL) | ((x) << 56))
+
+/** Round constants, even then odd word for each of the 42 rounds */
+const uint64_t C[168] = {
+    C64E(0x72d5dea2df15f867ULL), C64E(0x7b84150ab7231557ULL), C64E(0x81abd6904d5a87f6ULL), C64E(0x4e9f4fc5c3d12b40ULL),
+    C64E(0xea983ae05c45fa9cULL), C64E(0x03c5d29966b2999aULL), C64E(0x660296b4f2bb538aULL), C64E(0xb556141a88dba231ULL),
+    C64E(0x03a35a5c9a190edbULL), C64E(0x403fb20a87c14410ULL), C64E(0x1c051980849e951dULL), C64E(0x6f33ebad5ee7cddcULL),
+    C64E(0x10ba139202bf6b41ULL), C64E(0xdc786515f7bb27d0ULL), C64E(0x0a2c813937aa7850ULL), C64E(0x3f1abfd2410091d3ULL),
+    C64E(0x422d5a0df6cc7e90ULL), C64E(0xdd629f9c92c097ceULL), C64E(0x185ca70bc72b44acULL), C64E(0xd1df65d663c6fc23ULL),
+    C64E(0x976e6c039ee0b81aULL), C64E(0x2105457e446ceca8ULL), C64E(0xeef103bb5d8e61faULL), C64E(0xfd9697b294838197ULL),
+    C64E(0x4a8e8537db03302fULL), C64E(0x2a678d2dfb9f6a95ULL), C64E(0x8afe7381f8b8696cULL), C64E(0x8ac77246c07f4214ULL),
+    C64E(0xc5f4158fbdc75ec4ULL), C64E(0x75446fa78f11bb80ULL), C64E(0x52de75b7aee488bcULL), C64E(0x82b8001e98a6a3f4ULL),
+    C64E(0x8ef48f33a9a36315ULL), C64E(0xaa5f5624d5b7f989ULL), C64E(0xb6f1ed207c5ae0fdULL), C64E(0x36cae95a06422c36ULL),
+    C64E(0xce2935434efe983dULL), C64E(0x533af974739a4ba7ULL), C64E(0xd0f51f596f4e8186ULL), C64E(0x0e9dad81afd85a9fULL),
+    C64E(0xa7050667ee34626aULL), C64E(0x8b0b28be6eb91727ULL), C64E(0x47740726c680103fULL), C64E(0xe0a07e6fc67e487bULL),
+    C64E(0x0d550aa54af8a4c0ULL), C64E(0x91e3e79f978ef19eULL), C64E(0x8676728150608dd4ULL), C64E(0x7e9e5a41f3e5b062ULL),
+    C64E(0xfc9f1fec4054207aULL), C64E(0xe3e41a00cef4c984ULL), C64E(0x4fd794f59dfa95d8ULL), C64E(0x552e7e1124c354a5ULL),
+    C64E(0x5bdf7228bdfe6e28ULL), C64E(0x78f57fe20fa5c4b2ULL), C64E(0x05897cefee49d32eULL), C64E(0x447e9385eb28597fULL),
+    C64E(0x705f6937b324314aULL), C64E(0x5e8628f11dd6e465ULL), C64E(0xc71b770451b920e7ULL), C64E(0x74fe43e823d4878aULL),
+    C64E(0x7d29e8a3927694f2ULL), C64E(0xddcb7a099b30d9c1ULL), C64E(0x1d1b30fb5bdc1be0ULL), C64E(0xda24494ff29c82bfULL),
+    C64E(0xa4e7ba31b470bfffULL), C64E(0x0d324405def8bc48ULL), C64E(0x3baefc3253bbd339ULL), C64E(0x459fc3c1e0298ba0ULL),
+    C64E(0xe5c905fdf7ae090fULL), C64E(0x947034124290f134ULL), C64E(0xa271b701e344ed95ULL), C64E(0xe93b8e364f2f984aULL),
+    C64E(0x88401d63a06cf615ULL), C64E(0x47c1444b8752afffULL), C64E(0x7ebb4af1e20ac630ULL), C64E(0x4670b6c5cc6e8ce6ULL),
+    C64E(0xa4d5a456bd4fca00ULL), C64E(0xda9d844bc83e18aeULL), C64E(0x7357ce453064d1adULL), C64E(0xe8a6ce68145c2567ULL),
+    C64E(0xa3da8cf2cb0ee116ULL), C64E(0x33e906589a94999aULL), C64E(0x1f60b220c26f847bULL), C64E(0xd1ceac7fa0d18518ULL),
+    C64E(0x32595ba18ddd19d3ULL), C64E(0x509a1cc0aaa5b446ULL), C64E(0x9f3d6367e4046bbaULL), C64E(0xf6ca19ab0b56ee7eULL),
+    C64E(0x1fb179eaa9282174ULL), C64E(0xe9bdf7353b3651eeULL), C64E(0x1d57ac5a7550d376ULL), C64E(0x3a46c2fea37d7001ULL),
+    C64E(0xf735c1af98a4d842ULL), C64E(0x78edec209e6b6779ULL), C64E(0x41836315ea3adba8ULL), C64E(0xfac33b4d32832c83ULL),
+    C64E(0xa7403b1f1c2747f3ULL), C64E(0x5940f034b72d769aULL), C64E(0xe73e4e6cd2214ffdULL), C64E(0xb8fd8d39dc5759efULL),
+    C64E(0x8d9b0c492b49ebdaULL), C64E(0x5ba2d74968f3700dULL), C64E(0x7d3baed07a8d5584ULL), C64E(0xf5a5e9f0e4f88e65ULL),
+    C64E(0xa0b8a2f436103b53ULL), C64E(0x0ca8079e753eec5aULL), C64E(0x9168949256e8884fULL), C64E(0x5bb05c55f8babc4cULL),
+    C64E(0xe3bb3b99f387947bULL), C64E(0x75daf4d6726b1c5dULL), C64E(0x64aeac28dc34b36dULL), C64E(0x6c34a550b828db71ULL),
+    C64E(0xf861e2f2108d512aULL), C64E(0xe3db643359dd75fcULL), C64E(0x1cacbcf143ce3fa2ULL), C64E(0x67bbd13c02e843b0ULL),
+    C64E(0x330a5bca8829a175ULL), C64E(0x7f34194db416535cULL), C64E(0x923b94c30e794d1eULL), C64E(0x797475d7b6eeaf3fULL),
+    C64E(0xeaa8d4f7be1a3921ULL), C64E(0x5cf47e094c232751ULL), C64E(0x26a32453ba323cd2ULL), C64E(0x44a3174a6da6d5adULL),
+    C64E(0xb51d3ea6aff2c908ULL), C64E(0x83593d98916b3c56ULL), C64E(0x4cf87ca17286604dULL), C64E(0x46e23ecc086ec7f6ULL),
+    C64E(0x2f9833b3b1bc765eULL), C64E(0x2bd666a5efc4e62aULL), C64E(0x06f4b6e8bec1d436ULL), C64E(0x74ee8215bcef2163ULL),
+    C64E(0xfdc14e0df453c969ULL), C64E(0xa77d5ac406585826ULL), C64E(0x7ec1141606e0fa16ULL), C64E(0x7e90af3d28639d3fULL),
+    C64E(0xd2c9f2e3009bd20cULL), C64E(0x5faace30b7d40c30ULL), C64E(0x742a5116f2e03298ULL), C64E(0x0deb30d8e3cef89aULL),
+    C64E(0x4bc59e7bb5f17992ULL), C64E(0xff51e66e048668d3ULL), C64E(0x9b234d57e6966731ULL), C64E(0xcce6a6f3170a7505ULL),
+    C64E(0xb17681d913326cceULL), C64E(0x3c175284f805a262ULL), C64E(0xf42bcbb378471547ULL), C64E(0xff46548223936a48ULL),
+    C64E(0x38df58074e5e6565ULL), C64E(0xf2fc7c89fc86508eULL), C64E(0x31702e44d00bca86ULL), C64E(0xf04009a23078474eULL),
+    C64E(0x65a0ee39d1f73883ULL), C64E(0xf75ee937e42c3abdULL), C64E(0x2197b2260113f86fULL), C64E(0xa344edd1ef9fdee7ULL),
+    C64E(0x8ba0df15762592d9ULL), C64E(0x3c85f7f612dc42beULL), C64E(0xd8a7ec7cab27b07eULL), C64E(0x538d7ddaaa3ea8deULL),
+    C64E(0xaa25ce93bd0269d8ULL), C64E(0x5af643fd1a7308f9ULL), C64E(0xc05fefda174a19a5ULL), C64E(0x974d66334cfd216aULL),
+    C64E(0x35b49831db411570ULL), C64E(0xea1e0fbbedcd549bULL), C64E(0x9ad063a151974072ULL), C64E(0xf6759dbf91476fe2ULL)};
+
+const uint64_t IV512[16] = {
+    C64E(0x6fd14b963e00aa17ULL), C64E(0x636a2e057a15d543ULL), C64E(0x8a225e8d0c97ef0bULL), C64E(0xe9341259f2b3c361ULL),
+    C64E(0x891da0c1536f801eULL), C64E(0x2aa9056bea2b6d80ULL), C64E(0x588eccdb2075baa6ULL), C64E(0xa90f3a76baf83bf7ULL),
+    C64E(0x0169e60541e34a69ULL), C64E(0x46b58a8e2e6fe65aULL), C64E(0x1047a7d0c1843c24ULL), C64E(0x3b6e71b12d5ac199ULL),
+    C64E(0xcf57f6ec9db1f856ULL), C64E(0xa706887c5716b156ULL), C64E(0xe3c2fcdfe68517fbULL), C64E(0x545a4678cc8cdd4bULL)};
+
+#define LOAD(p) _mm_loadu_si128((const __m128i*)(p))
+
+/** The 4-bit S-boxes picked by the bits of c, bitsliced over four words */
+#define SB(x0, x1, x2, x3, c)                             \
+    do {                                                  \
+        __m128i tmp;                                      \
+        x3 = _mm_xor_si128(x3, ones);                     \
+        x0 = _mm_xor_si128(x0, _mm_andnot_si128(x2, c));  \
+        tmp = _mm_xor_si128(c, _mm_and_si128(x0, x1));    \
+        x0 = _mm_xor_si128(x0, _mm_and_si128(x2, x3));    \
+        x3 = _mm_xor_si128(x3, _mm_andnot_si128(x1, x2)); \
+        x1 = _mm_xor_si128(x1, _mm_and_si128(x0, x2));    \
+        x2 = _mm_xor_si128(x2, _mm_andnot_si128(x3, x0)); \
+        x0 = _mm_xor_si128(x0, _mm_or_si128(x1, x3));     \
+        x3 = _mm_xor_si128(x3, _mm_and_si128(x1, x2));    \
+        x1 = _mm_xor_si128(x1, _mm_and_si128(tmp, x0));   \
+        x2 = _mm_xor_si128(x2, tmp);                      \
+    } while (0)
+
+/** The MDS linear transformation */
+#define LB(x0, x1, x2, x3, x4, x5, x6, x7)             \
+    do {                                               \
+        x4 = _mm_xor_si128(x4, x1);                    \
+        x5 = _mm_xor_si128(x5, x2);                    \
+        x6 = _mm_xor_si128(_mm_xor_si128(x6, x3), x0); \
+        x7 = _mm_xor_si128(x7, x0);                    \
+        x0 = _mm_xor_si128(x0, x5);                    \
+        x1 = _mm_xor_si128(x1, x6);                    \
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x7), x4); \
+        x3 = _mm_xor_si128(x3, x4);                    \
+    } while (0)
+
+/** Swap adjacent groups of 1, 2 or 4 bits; bigger groups are moved by shuffles */
+#define WZ(x, c, n) x = _mm_or_si128(_mm_and_si128(_mm_srli_epi64(x, n), c), _mm_slli_epi64(_mm_and_si128(x, c), n))
+#define W0(x) WZ(x, c55, 1)
+#define W1(x) WZ(x, c33, 2)
+#define W2(x) WZ(x, c0f, 4)
+#define W3(x) x = _mm_or_si128(_mm_srli_epi16(x, 8), _mm_slli_epi16(x, 8))
+#define W4(x) x = _mm_shufflehi_epi16(_mm_shufflelo_epi16(x, 0xb1), 0xb1)
+#define W5(x) x = _mm_shuffle_epi32(x, 0xb1)
+#define W6(x) x = _mm_shuffle_epi32(x, 0x4e)
+
+/** Round r, the permutation of the odd words cycles through W0 to W6 */
+#define ROUND(r, w)                                                 \
+    do {                                                            \
+        __m128i ce = LOAD(C + 4 * (r)), co = LOAD(C + 4 * (r) + 2); \
+        SB(h0, h2, h4, h6, ce);                                     \
+        SB(h1, h3, h5, h7, co);                                     \
+        LB(h0, h2, h4, h6, h1, h3, h5, h7);                         \
+        w(h1);                                                      \
+        w(h3);                                                      \
+        w(h5);                                                      \
+        w(h7);                                                      \
+    } while (0)
+} // namespace
+
+void JH512_64(unsigned char* out, const unsigned char* in)
+{
+    const __m128i ones = _mm_set1_epi32(-1);
+    const __m128i c55 = _mm_set1_epi8(0x55);
+    const __m128i c33 = _mm_set1_epi8(0x33);
+    const __m128i c0f = _mm_set1_epi8(0x0f);
+
+    __m128i h0 = LOAD(IV512), h1 = LOAD(IV512 + 2), h2 = LOAD(IV512 + 4), h3 = LOAD(IV512 + 6);
+    __m128i h4 = LOAD(IV512 + 8), h5 = LOAD(IV512 + 10), h6 = LOAD(IV512 + 12), h7 = LOAD(IV512 + 14);
+
+    // The message fills one block, the padding a second one: 0x80, zeros, and the length in bits
+    __m128i m0 = LOAD(in), m1 = LOAD(in + 16), m2 = LOAD(in + 32), m3 = LOAD(in + 48);
+    for (int block = 0; block < 2; block++) {
+        h0 = _mm_xor_si128(h0, m0);
+        h1 = _mm_xor_si128(h1, m1);
+        h2 = _mm_xor_si128(h2, m2);
+        h3 = _mm_xor_si128(h3, m3);
+        for (int r = 0; r < 42; r += 7) {
+            ROUND(r, W0);
+            ROUND(r + 1, W1);
+            ROUND(r + 2, W2);
+            ROUND(r + 3, W3);
+            ROUND(r + 4, W4);
+            ROUND(r + 5, W5);
+            ROUND(r + 6, W6);
+        }
+        h4 = _mm_xor_si128(h4, m0);
+        h5 = _mm_xor_si128(h5, m1);
+        h6 = _mm_xor_si128(h6, m2);
+        h7 = _mm_xor_si128(h7, m3);
+
+        m0 = _mm_cvtsi32_si128(0x80);
+        m1 = m2 = _mm_setzero_si128();
+        m3 = _mm_set_epi32(0x00020000, 0, 0, 0); // 512, big endian in the last bytes
+    }
+
+    _mm_storeu_si128((__m128i*)out, h4);
+    _mm_storeu_si128((__m128i*)(out + 16), h5);
+    _mm_storeu_si128((__m128i*)(out + 32), h6);
+    _mm_storeu_si128((__m128i*)(out + 48), h7);
+}
+} // namespace jh_sse2
+
+#endif // ENABLE_QUARK_X86
@@ -0,0 +1,132 @@
+// Copyright (c) 2018-2019 The PDG developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+// Keccak-512 for the 64 byte messages of the Quark chain, built for BMI2.
+//
+// The message and its padding fit one 72 byte block, so the state is loaded
+// directly, permuted once and read back. The unrolled rounds let the compiler
+// keep all 25 lanes in registers; andn and rorx from BMI1/BMI2 replace the
+// not-and and rotate sequences the portable sph code has to use.
+
+#include "crypto/quark.h"
+
+#ifdef ENABLE_QUARK_X86
+
+#include "crypto/common.h"
+
+namespace keccak_bmi
+{
+namespace
+{
+const uint64_t RC[24] = {
+    0x0000000000000001ULL, 0x0000000000008082ULL, 0x800000000000808aULL, 0x8000000080008000ULL,
+    0x000000000000808bULL, 0x0000000080000001ULL, 0x8000000080008081ULL, 0x8000000000008009ULL,
+    0x000000000000008aULL, 0x0000000000000088ULL, 0x0000000080008009ULL, 0x000000008000000aULL,
+    0x000000008000808bULL, 0x800000000000008bULL, 0x8000000000008089ULL, 0x8000000000008003ULL,
+    0x8000000000008002ULL, 0x8000000000000080ULL, 0x000000000000800aULL, 0x800000008000000aULL,
+    0x8000000080008081ULL, 0x8000000000008080ULL, 0x0000000080000001ULL, 0x8000000080008008ULL};
+
+#define ROTL(x, n) (((x) << (n)) | ((x) >> (64 - (n))))
+
+/** Theta, rho, pi, chi and iota on the lanes of a, writing them to e */
+#define ROUND(a, e, rc)                                                               \
+    do {                                                                              \
+        uint64_t c0 = a##00 ^ a##05 ^ a##10 ^ a##15 ^ a##20;                          \
+        uint64_t c1 = a##01 ^ a##06 ^ a##11 ^ a##16 ^ a##21;                          \
+        uint64_t c2 = a##02 ^ a##07 ^ a##12 ^ a##17 ^ a##22;                          \
+        uint64_t c3 = a##03 ^ a##08 ^ a##13 ^ a##18 ^ a##23;                          \
+        uint64_t c4 = a##04 ^ a##09 ^ a##14 ^ a##19 ^ a##24;                          \
+        uint64_t d0 = c4 ^ ROTL(c1, 1), d1 = c0 ^ ROTL(c2, 1), d2 = c1 ^ ROTL(c3, 1); \
+        uint64_t d3 = c2 ^ ROTL(c4, 1), d4 = c3 ^ ROTL(c0, 1);                        \
+        uint64_t b0, b1, b2, b3, b4;                                                  \
+        b0 = a##00 ^ d0;                                                              \
+        b1 = ROTL(a##06 ^ d1, 44);                                                    \
+        b2 = ROTL(a##12 ^ d2, 43);                                                    \
+        b3 = ROTL(a##18 ^ d3, 21);                                                    \
+        b4 = ROTL(a##24 ^ d4, 14);                                                    \
+        e##00 = b0 ^ (~b1 & b2) ^ (rc);                                               \
+        e##01 = b1 ^ (~b2 & b3);                                                      \
+        e##02 = b2 ^ (~b3 & b4);                                                      \
+        e##03 = b3 ^ (~b4 & b0);                                                      \
+        e##04 = b4 ^ (~b0 & b1);                                                      \
+        b0 = ROTL(a##03 ^ d3, 28);                                                    \
+        b1 = ROTL(a##09 ^ d4, 20);                                                    \
+        b2 = ROTL(a##10 ^ d0, 3);                                                     \
+        b3 = ROTL(a##16 ^ d1, 45);                                                    \
+        b4 = ROTL(a##22 ^ d2, 61);                                                    \
+        e##05 = b0 ^ (~b1 & b2);                                                      \
+        e##06 = b1 ^ (~b2 & b3);                                                      \
+        e##07 = b2 ^ (~b3 & b4);                                                      \
+        e##08 = b3 ^ (~b4 & b0);                                                      \
+        e##09 = b4 ^ (~b0 & b1);                                                      \
+        b0 = ROTL(a##01 ^ d1, 1);                                                     \
+        b1 = ROTL(a##07 ^ d2, 6);                                                     \
+        b2 = ROTL(a##13 ^ d3, 25);                                                    \
+        b3 = ROTL(a##19 ^ d4, 8);                                                     \
+        b4 = ROTL(a##20 ^ d0, 18);                                                    \
+        e##10 = b0 ^ (~b1 & b2);                                                      \
+        e##11 = b1 ^ (~b2 & b3);                                                      \
+        e##12 = b2 ^ (~b3 & b4);                                                      \
+        e##13 = b3 ^ (~b4 & b0);                                                      \
+        e##14 = b4 ^ (~b0 & b1);                                                      \
+        b0 = ROTL(a##04 ^ d4, 27);                                                    \
+        b1 = ROTL(a##05 ^ d0, 36);                                                    \
+        b2 = ROTL(a##11 ^ d1, 10);                                                    \
+        b3 = ROTL(a##17 ^ d2, 15);                                                    \
+        b4 = ROTL(a##23 ^ d3, 56);                                                    \
+        e##15 = b0 ^ (~b1 & b2);                                                      \
+        e##16 = b1 ^ (~b2 & b3);                                                      \
+        e##17 = b2 ^ (~b3 & b4);                                                      \
+        e##18 = b3 ^ (~b4 & b0);                                                      \
+        e##19 = b4 ^ (~b0 & b1);                                                      \
+        b0 = ROTL(a##02 ^ d2, 62);                                                    \
+        b1 = ROTL(a##08 ^ d3, 55);                                                    \
+        b2 = ROTL(a##14 ^ d4, 39);                                                    \
+        b3 = ROTL(a##15 ^ d0, 41);                                                    \
+        b4 = ROTL(a##21 ^ d1, 2);                                                     \
+        e##20 = b0 ^ (~b1 & b2);                                                      \
+        e##21 = b1 ^ (~b2 & b3);                                                      \
+        e##22 = b2 ^ (~b3 & b4);                                                      \
+        e##23 = b3 ^ (~b4 & b0);                                                      \
+        e##24 = b4 ^ (~b0 & b1);                                                      \
+    } while (0)
+
+#define DECL_STATE(a)                                                                                   \
+    uint64_t a##00, a##01, a##02, a##03, a##04, a##05, a##06, a##07, a##08, a##09, a##10, a##11, a##12, \
+        a##13, a##14, a##15, a##16, a##17, a##18, a##19, a##20, a##21, a##22, a##23, a##24
+} // namespace
+
+__attribute__((target("bmi,bmi2"))) void Keccak512_64(unsigned char* out, const unsigned char* in)
+{
+    DECL_STATE(A);
+    DECL_STATE(E);
+    A00 = ReadLE64(in);
+    A01 = ReadLE64(in + 8);
+    A02 = ReadLE64(in + 16);
+    A03 = ReadLE64(in + 24);
+    A04 = ReadLE64(in + 32);
+    A05 = ReadLE64(in + 40);
+    A06 = ReadLE64(in + 48);
+    A07 = ReadLE64(in + 56);
+    // Keccak padding: 0x01 after the message, 0x80 in the last byte of the 72 byte block
+    A08 = 0x8000000000000001ULL;
+    A09 = A10 = A11 = A12 = A13 = A14 = A15 = A16 = A17 = A18 = A19 = A20 = A21 = A22 = A23 = A24 = 0;
+
+    for (int r = 0; r < 24; r += 2) {
+        ROUND(A, E, RC[r]);
+        ROUND(E, A, RC[r + 1]);
+    }
+
+    WriteLE64(out, A00);
+    WriteLE64(out + 8, A01);
+    WriteLE64(out + 16, A02);
+    WriteLE64(out + 24, A03);
+    WriteLE64(out + 32, A04);
+    WriteLE64(out + 40, A05);
+    WriteLE64(out + 48, A06);
+    WriteLE64(out + 56, A07);
+}
+} // namespace keccak_bmi
+
+#endif // ENABLE_QUARK_X86
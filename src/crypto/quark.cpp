@@ -0,0 +1,154 @@
+// Copyright (c) 2018-2019 The PDG developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "crypto/quark.h"
+
+#include "crypto/sph_blake.h"
+#include "crypto/sph_bmw.h"
+#include "crypto/sph_groestl.h"
+#include "crypto/sph_jh.h"
+#include "crypto/sph_keccak.h"
+#include "crypto/sph_skein.h"
+
+#ifdef ENABLE_QUARK_X86
+#include <cpuid.h>
+
+namespace groestl_aesni
+{
+void Groestl512_64(unsigned char* out, const unsigned char* in);
+}
+namespace jh_sse2
+{
+void JH512_64(unsigned char* out, const unsigned char* in);
+}
+namespace keccak_bmi
+{
+void Keccak512_64(unsigned char* out, const unsigned char* in);
+}
+#endif
+
+namespace
+{
+/** One 512-bit sph hash of a 64 byte message */
+#define SPH_HASH512_64(Name, name)                                 \
+    void Name##512Sph(unsigned char* out, const unsigned char* in) \
+    {                                                              \
+        sph_##name##512_context ctx;                               \
+        sph_##name##512_init(&ctx);                                \
+        sph_##name##512(&ctx, in, 64);                             \
+        sph_##name##512_close(&ctx, out);                          \
+    }
+
+SPH_HASH512_64(Blake, blake)
+SPH_HASH512_64(Bmw, bmw)
+SPH_HASH512_64(Groestl, groestl)
+SPH_HASH512_64(Jh, jh)
+SPH_HASH512_64(Keccak, keccak)
+SPH_HASH512_64(Skein, skein)
+
+typedef void (*Hash512Fn)(unsigned char* out, const unsigned char* in);
+
+Hash512Fn Groestl512 = Groestl512Sph;
+Hash512Fn Jh512 = Jh512Sph;
+Hash512Fn Keccak512 = Keccak512Sph;
+
+/** The bit of a round's output that picks one of two hashes for the next round */
+inline bool Branch(const uint64_t* hash)
+{
+    return ((const unsigned char*)hash)[0] & 8;
+}
+
+#ifdef ENABLE_QUARK_X86
+/** AES-NI for SubBytes and SSSE3 for the shuffles around it */
+bool HaveAESNI()
+{
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+        return false;
+    return (ecx & (1 << 25)) && (ecx & (1 << 9));
+}
+
+/** BMI1 for andn, BMI2 for rorx */
+bool HaveBMI2()
+{
+    unsigned int eax, ebx, ecx, edx;
+    if (__get_cpuid_max(0, NULL) < 7)
+        return false;
+    __cpuid_count(7, 0, eax, ebx, ecx, edx);
+    return (ebx & (1 << 3)) && (ebx & (1 << 8));
+}
+#endif
+} // namespace
+
+void Quark(unsigned char* out, const unsigned char* data, size_t len)
+{
+    // Rounds alternate between two word aligned buffers
+    uint64_t a[8], b[8];
+    unsigned char* pa = (unsigned char*)a;
+    unsigned char* pb = (unsigned char*)b;
+
+    sph_blake512_context ctx_blake;
+    sph_blake512_init(&ctx_blake);
+    sph_blake512(&ctx_blake, data, len);
+    sph_blake512_close(&ctx_blake, pa);
+
+    Bmw512Sph(pb, pa);
+    if (Branch(b))
+        Groestl512(pa, pb);
+    else
+        Skein512Sph(pa, pb);
+    Groestl512(pb, pa);
+    Jh512(pa, pb);
+    if (Branch(a))
+        Blake512Sph(pb, pa);
+    else
+        Bmw512Sph(pb, pa);
+    Keccak512(pa, pb);
+    Skein512Sph(pb, pa);
+    if (Branch(b))
+        Keccak512(out, pb);
+    else
+        Jh512(out, pb);
+}
+
+void Groestl512_64(unsigned char* out, const unsigned char* in)
+{
+    Groestl512(out, in);
+}
+
+void JH512_64(unsigned char* out, const unsigned char* in)
+{
+    Jh512(out, in);
+}
+
+void Keccak512_64(unsigned char* out, const unsigned char* in)
+{
+    Keccak512(out, in);
+}
+
+std::string QuarkAutoDetect()
+{
+    std::string ret = "sph";
+#ifdef ENABLE_QUARK_X86
+    if (HaveAESNI()) {
+        Groestl512 = groestl_aesni::Groestl512_64;
+        ret += ", groestl-aesni";
+    }
+    // SSE2 is part of x86-64
+    Jh512 = jh_sse2::JH512_64;
+    ret += ", jh-sse2";
+    if (HaveBMI2()) {
+        Keccak512 = keccak_bmi::Keccak512_64;
+        ret += ", keccak-bmi2";
+    }
+#endif
+    return ret;
+}
+
+void QuarkUseGeneric()
+{
+    Groestl512 = Groestl512Sph;
+    Jh512 = Jh512Sph;
+    Keccak512 = Keccak512Sph;
+}
@@ -0,0 +1,42 @@
+// Copyright (c) 2018-2019 The PDG developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef PDG_CRYPTO_QUARK_H
+#define PDG_CRYPTO_QUARK_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__amd64__)) && \
+    (defined(__clang__) || __GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+/** SIMD versions of Groestl, JH and Keccak are compiled in, QuarkAutoDetect() decides which are used */
+#define ENABLE_QUARK_X86 1
+#endif
+
+/** Size of the Quark chain output, block hashes keep the first half */
+static const size_t QUARK_OUTPUT_SIZE = 64;
+
+/**
+ * Quark of len bytes at data: nine rounds of Blake, BMW, Groestl, JH, Keccak
+ * and Skein at 512 bits, three of them picked by a bit of the previous round.
+ */
+void Quark(unsigned char* out, const unsigned char* data, size_t len);
+
+/** Groestl-512 of a 64 byte message, the input size of every Quark round after the first */
+void Groestl512_64(unsigned char* out, const unsigned char* in);
+/** JH-512 of a 64 byte message */
+void JH512_64(unsigned char* out, const unsigned char* in);
+/** Keccak-512 of a 64 byte message */
+void Keccak512_64(unsigned char* out, const unsigned char* in);
+
+/**
+ * Switch to the fastest Groestl, JH and Keccak this CPU runs and return a
+ * description of them. Call before starting threads that hash.
+ */
+std::string QuarkAutoDetect();
+/** Switch back to the portable sph implementations */
+void QuarkUseGeneric();
+
+#endif // PDG_CRYPTO_QUARK_H
@@ -334,10 +334,19 @@ bool CFileRepositoryManager::RenameTmpOriginalFileBlockDisk(int tmpFileNumber)
 }
 
 void CFileRepositoryManager::FlushBlockFiles() {
-    if (vFileRepositoryBlockInfo.empty())
-        return;
+    int nLastBlockIndex;
+    unsigned int nLastBlockSize;
+    {
+        // Called from the chainstate flusher: READ_LOCK is the exclusive one,
+        // so SaveFile and the recycler can't move the last file meanwhile
+        READ_LOCK(cs_RepositoryReadWriteLock);
+        if (vFileRepositoryBlockInfo.empty())
+            return;
+        nLastBlockIndex = nLastFileRepositoryBlock;
+        nLastBlockSize = vFileRepositoryBlockInfo[nLastBlockIndex].nBlockSize;
+    }
 
-    FlushFileRepositoryBlock(nLastFileRepositoryBlock, vFileRepositoryBlockInfo[nLastFileRepositoryBlock].nBlockSize);
+    FlushFileRepositoryBlock(nLastBlockIndex, nLastBlockSize);
 }
 
 void CFileRepositoryManager::FlushFileRepositoryBlock(int nLastBlockIndex, unsigned int nLastBlockSize, bool fFinalize, bool isTmp) {
@@ -6,6 +6,7 @@
 #include <boost/assign/list_of.hpp>
 #include <boost/lexical_cast.hpp>
 
+#include "crypto/common.h"
 #include "db.h"
 #include "kernel.h"
 #include "script/interpreter.h"
@@ -13,6 +14,8 @@
 #include "util.h"
 #include "stakeinput.h"
 
+#include <boost/thread.hpp>
+
 using namespace std;
 
 bool fTestNet = false; //Params().NetworkID() == CBaseChainParams::TESTNET;
@@ -240,13 +243,54 @@ bool ComputeNextStakeModifier(const CBlockIndex* pindexPrev, uint64_t& nStakeMod
     return true;
 }
 
+/** A kernel stake modifier and the last block its lookup went through */
+struct CStakeModifierCacheEntry {
+    uint64_t nStakeModifier;
+    int nStakeModifierHeight;
+    int64_t nStakeModifierTime;
+    int nHeightLast;
+};
+
+static CCriticalSection cs_stakeModifierCache;
+static std::map<uint256, CStakeModifierCacheEntry> mapStakeModifierCache;
+//! Bumped on invalidation, so lookups that raced with a disconnect are not cached
+static uint64_t nStakeModifierCacheGeneration = 0;
+
+void InvalidateStakeModifierCache(int nHeight)
+{
+    LOCK(cs_stakeModifierCache);
+    nStakeModifierCacheGeneration++;
+    for (std::map<uint256, CStakeModifierCacheEntry>::iterator it = mapStakeModifierCache.begin(); it != mapStakeModifierCache.end();) {
+        if (it->second.nHeightLast >= nHeight)
+            mapStakeModifierCache.erase(it++);
+        else
+            ++it;
+    }
+}
+
 // The stake modifier used to hash for a stake kernel is chosen as the stake
-// modifier about a selection interval later than the coin generating the kernel
+// modifier about a selection interval later than the coin generating the kernel.
+// Every input from the same block gets the same one, so results are cached
+// until a block they depend on is disconnected.
 bool GetKernelStakeModifier(uint256 hashBlockFrom, uint64_t& nStakeModifier, int& nStakeModifierHeight, int64_t& nStakeModifierTime, bool fPrintProofOfStake)
 {
     nStakeModifier = 0;
     if (!mapBlockIndex.count(hashBlockFrom))
         return error("GetKernelStakeModifier() : block not indexed");
+
+    uint64_t nGeneration;
+    {
+        LOCK(cs_stakeModifierCache);
+        std::map<uint256, CStakeModifierCacheEntry>::const_iterator it = mapStakeModifierCache.find(hashBlockFrom);
+        if (it != mapStakeModifierCache.end()) {
+            nStakeModifier = it->second.nStakeModifier;
+            nStakeModifierHeight = it->second.nStakeModifierHeight;
+            nStakeModifierTime = it->second.nStakeModifierTime;
+            return true;
+        }
+        nGeneration = nStakeModifierCacheGeneration;
+    }
+
     const CBlockIndex* pindexFrom = mapBlockIndex[hashBlockFrom];
     nStakeModifierHeight = pindexFrom->nHeight;
     nStakeModifierTime = pindexFrom->GetBlockTime();
@@ -269,6 +313,20 @@ bool GetKernelStakeModifier(uint256 hashBlockFrom, uint64_t& nStakeModifier, int
         }
     }
     nStakeModifier = pindex->nStakeModifier;
+
+    CStakeModifierCacheEntry entry;
+    entry.nStakeModifier = nStakeModifier;
+    entry.nStakeModifierHeight = nStakeModifierHeight;
+    entry.nStakeModifierTime = nStakeModifierTime;
+    entry.nHeightLast = pindex->nHeight;
+    {
+        LOCK(cs_stakeModifierCache);
+        if (nGeneration == nStakeModifierCacheGeneration) {
+            if (mapStakeModifierCache.size() >= MAX_STAKE_MODIFIER_CACHE_SIZE)
+                mapStakeModifierCache.clear();
+            mapStakeModifierCache[hashBlockFrom] = entry;
+        }
+    }
     return true;
 }
 
@@ -282,18 +340,41 @@ bool stakeTargetHit(uint256 hashProofOfStake, int64_t nValueIn, uint256 bnTarget
     return hashProofOfStake < (bnCoinDayWeight * bnTargetPerCoinDay);
 }
 
-bool CheckStake(const CDataStream& ssUniqueID, CAmount nValueIn, const uint64_t nStakeModifier, const uint256& bnTarget,
-                unsigned int nTimeBlockFrom, unsigned int& nTimeTx, uint256& hashProofOfStake)
+CStakeKernel::CStakeKernel(uint64_t nStakeModifier, unsigned int nTimeBlockFrom, const CDataStream& ssUniqueID, CAmount nValueIn, const uint256& bnTargetPerCoinDay)
 {
     CDataStream ss(SER_GETHASH, 0);
-    ss << nStakeModifier << nTimeBlockFrom << ssUniqueID << nTimeTx;
-    hashProofOfStake = Hash(ss.begin(), ss.end());
-    //LogPrintf("%s: modifier:%d nTimeBlockFrom:%d nTimeTx:%d hash:%s\n", __func__, nStakeModifier, nTimeBlockFrom, nTimeTx, hashProofOfStake.GetHex());
+    ss << nStakeModifier << nTimeBlockFrom << ssUniqueID;
+    hasher.Write((const unsigned char*)&ss[0], ss.size());
 
-    return stakeTargetHit(hashProofOfStake, nValueIn, bnTarget);
+    //get the stake weight - weight is equal to coin amount
+    uint256 bnCoinDayWeight = uint256(nValueIn) / 100;
+    bnTarget = bnCoinDayWeight * bnTargetPerCoinDay;
 }
 
-bool Stake(CStakeInput* stakeInput, unsigned int nBits, unsigned int nTimeBlockFrom, unsigned int& nTimeTx, uint256& hashProofOfStake)
+uint256 CStakeKernel::GetHash(unsigned int nTimeTx) const
+{
+    unsigned char buf[CSHA256::OUTPUT_SIZE];
+    unsigned char time[4];
+    WriteLE32(time, nTimeTx);
+    CSHA256(hasher).Write(time, sizeof(time)).Finalize(buf);
+    uint256 hash;
+    CSHA256().Write(buf, sizeof(buf)).Finalize(hash.begin());
+    return hash;
+}
+
+bool CStakeKernel::Check(unsigned int nTimeTx, uint256& hashProofOfStake) const
+{
+    hashProofOfStake = GetHash(nTimeTx);
+    return hashProofOfStake < bnTarget;
+}
+
+bool CheckStake(const CDataStream& ssUniqueID, CAmount nValueIn, const uint64_t nStakeModifier, const uint256& bnTarget,
+                unsigned int nTimeBlockFrom, unsigned int& nTimeTx, uint256& hashProofOfStake)
+{
+    return CStakeKernel(nStakeModifier, nTimeBlockFrom, ssUniqueID, nValueIn, bnTarget).Check(nTimeTx, hashProofOfStake);
+}
+
+bool GetStakeKernel(CStakeInput* stakeInput, unsigned int nBits, unsigned int nTimeBlockFrom, unsigned int nTimeTx, CStakeKernel& kernel)
 {
     if (nTimeTx < nTimeBlockFrom)
         return error("CheckStakeKernelHash() : nTime violation");
@@ -311,34 +392,93 @@ bool Stake(CStakeInput* stakeInput, unsigned int nBits, unsigned int nTimeBlockF
     if (!stakeInput->GetModifier(nStakeModifier))
         return error("failed to get kernel stake modifier");
 
-    bool fSuccess = false;
-    unsigned int nTryTime = 0;
-    int nHeightStart = chainActive.Height();
-    int nHashDrift = 45;
-    CDataStream ssUniqueID = stakeInput->GetUniqueness();
-    CAmount nValueIn = stakeInput->GetValue();
-    for (int i = 0; i < nHashDrift; i++) //iterate the hashing
-    {
-        //new block came in, move on
-        if (chainActive.Height() != nHeightStart)
-            break;
+    kernel = CStakeKernel(nStakeModifier, nTimeBlockFrom, stakeInput->GetUniqueness(), stakeInput->GetValue(), bnTargetPerCoinDay);
+    return true;
+}
 
-        //hash this iteration
-        nTryTime = nTimeTx + nHashDrift - i;
+/** Kernels are handed out to the search threads one at a time, in list order */
+class CStakeKernelSearch
+{
+private:
+    const std::vector<CStakeKernel>& vKernels;
+    unsigned int nTimeTx;
+    int nHeightStart;
+    boost::mutex mutex;
+    size_t nNext;
+    size_t nBest;
+    std::vector<std::pair<unsigned int, uint256> > vHits;
+
+public:
+    CStakeKernelSearch(const std::vector<CStakeKernel>& vKernelsIn, size_t nStart, unsigned int nTimeTxIn)
+        : vKernels(vKernelsIn), nTimeTx(nTimeTxIn), nHeightStart(chainActive.Height()), nNext(nStart), nBest(vKernelsIn.size()), vHits(vKernelsIn.size()) {}
+
+    void Run()
+    {
+        while (true) {
+            size_t i;
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                // Nothing after an earlier hit can be chosen
+                if (nNext >= nBest)
+                    return;
+                i = nNext++;
+            }
+            for (int j = 0; j < STAKE_HASH_DRIFT; j++) {
+                //new block came in, move on
+                if (chainActive.Height() != nHeightStart)
+                    return;
+
+                unsigned int nTryTime = nTimeTx + STAKE_HASH_DRIFT - j;
+                uint256 hashProofOfStake;
+                if (vKernels[i].Check(nTryTime, hashProofOfStake)) {
+                    vHits[i] = std::make_pair(nTryTime, hashProofOfStake);
+                    boost::unique_lock<boost::mutex> lock(mutex);
+                    nBest = std::min(nBest, i);
+                    return;
+                }
+            }
+        }
+    }
 
-        // if stake hash does not meet the target then continue to next iteration
-        if (!CheckStake(ssUniqueID, nValueIn, nStakeModifier, bnTargetPerCoinDay, nTimeBlockFrom, nTryTime, hashProofOfStake))
-            continue;
+    int GetResult(unsigned int& nTimeFound, uint256& hashProofOfStake) const
+    {
+        if (nBest >= vKernels.size())
+            return -1;
+        nTimeFound = vHits[nBest].first;
+        hashProofOfStake = vHits[nBest].second;
+        return nBest;
+    }
+};
 
-        fSuccess = true; // if we make it this far then we have successfully created a stake hash
-        //LogPrintf("%s: hashproof=%s\n", __func__, hashProofOfStake.GetHex());
-        nTimeTx = nTryTime;
-        break;
+int SearchStakeKernels(const std::vector<CStakeKernel>& vKernels, size_t nStart, unsigned int nTimeTx, unsigned int& nTimeFound, uint256& hashProofOfStake, int nThreads)
+{
+    if (nThreads <= 0)
+        nThreads = boost::thread::hardware_concurrency();
+    size_t nInputs = nStart < vKernels.size() ? vKernels.size() - nStart : 0;
+    nThreads = std::max(1, std::min(nThreads, std::min(MAX_STAKE_KERNEL_THREADS, (int)(nInputs / STAKE_KERNEL_INPUTS_PER_THREAD))));
+
+    CStakeKernelSearch search(vKernels, nStart, nTimeTx);
+    if (nThreads > 1) {
+        boost::thread_group threadGroup;
+        for (int i = 0; i < nThreads; i++)
+            threadGroup.create_thread(boost::bind(&CStakeKernelSearch::Run, &search));
+        threadGroup.join_all();
+    } else {
+        search.Run();
     }
 
     mapHashedBlocks.clear();
     mapHashedBlocks[chainActive.Tip()->nHeight] = GetTime(); //store a time stamp of when we last hashed on this block
-    return fSuccess;
+    return search.GetResult(nTimeFound, hashProofOfStake);
+}
+
+bool Stake(CStakeInput* stakeInput, unsigned int nBits, unsigned int nTimeBlockFrom, unsigned int& nTimeTx, uint256& hashProofOfStake)
+{
+    std::vector<CStakeKernel> vKernels(1);
+    if (!GetStakeKernel(stakeInput, nBits, nTimeBlockFrom, nTimeTx, vKernels[0]))
+        return false;
+
+    return SearchStakeKernels(vKernels, 0, nTimeTx, nTimeTx, hashProofOfStake) == 0;
 }
 
 // Check kernel hash target and coinstake signature
@@ -5,9 +5,12 @@
 #ifndef BITCOIN_KERNEL_H
 #define BITCOIN_KERNEL_H
 
+#include "crypto/sha256.h"
 #include "main.h"
 #include "stakeinput.h"
 
+#include <vector>
+
 
 // MODIFIER_INTERVAL: time to elapse before new modifier is computed
 static const unsigned int MODIFIER_INTERVAL = 60;
@@ -19,12 +22,57 @@ extern unsigned int getIntervalVersion(bool fTestNet);
 // ratio of group interval length between the last group and the first group
 static const int MODIFIER_INTERVAL_RATIO = 3;
 
+//! Kernel stake modifiers remembered by GetKernelStakeModifier
+static const size_t MAX_STAKE_MODIFIER_CACHE_SIZE = 50000;
+
 // Compute the hash modifier for proof-of-stake
 bool GetKernelStakeModifier(uint256 hashBlockFrom, uint64_t& nStakeModifier, int& nStakeModifierHeight, int64_t& nStakeModifierTime, bool fPrintProofOfStake);
+// Forget cached kernel stake modifiers whose lookup went through the block at nHeight or above
+void InvalidateStakeModifierCache(int nHeight);
 bool ComputeNextStakeModifier(const CBlockIndex* pindexPrev, uint64_t& nStakeModifier, bool& fGeneratedStakeModifier);
 
+//! Timestamps tried per stake input, counting back from the drift limit
+static const int STAKE_HASH_DRIFT = 45;
+//! Threads searching for a kernel, 0 for one per core
+static const int DEFAULT_STAKE_THREADS = 0;
+//! Upper bound on -stakethreads
+static const int MAX_STAKE_KERNEL_THREADS = 16;
+//! Fewer inputs per thread than this are searched on the calling thread
+static const size_t STAKE_KERNEL_INPUTS_PER_THREAD = 32;
+
+/**
+ * Kernel hash of one stake input. The part of the hashed data that does not
+ * change between tries (stake modifier, time of the block the input is from
+ * and the input's uniqueness) is hashed once; a try only hashes nTimeTx on a
+ * copy of the SHA-256 midstate.
+ */
+class CStakeKernel
+{
+private:
+    CSHA256 hasher;
+    //! Target per coin day weighted by the input value
+    uint256 bnTarget;
+
+public:
+    CStakeKernel() : bnTarget(0) {}
+    CStakeKernel(uint64_t nStakeModifier, unsigned int nTimeBlockFrom, const CDataStream& ssUniqueID, CAmount nValueIn, const uint256& bnTargetPerCoinDay);
+
+    uint256 GetHash(unsigned int nTimeTx) const;
+    //! Sets hashProofOfStake and returns whether it meets the target
+    bool Check(unsigned int nTimeTx, uint256& hashProofOfStake) const;
+};
+
 bool CheckStake(const CDataStream& ssUniqueID, CAmount nValueIn, const uint64_t nStakeModifier, const uint256& bnTarget, unsigned int nTimeBlockFrom, unsigned int& nTimeTx, uint256& hashProofOfStake);
 bool stakeTargetHit(uint256 hashProofOfStake, int64_t nValueIn, uint256 bnTargetPerCoinDay);
+//! Set up the kernel of a stake input for staking at nTimeTx; fails if the input may not stake then
+bool GetStakeKernel(CStakeInput* stakeInput, unsigned int nBits, unsigned int nTimeBlockFrom, unsigned int nTimeTx, CStakeKernel& kernel);
+/**
+ * Try the kernels from nStart on for STAKE_HASH_DRIFT timestamps after nTimeTx,
+ * on up to nThreads threads (0: one per core). Returns the index of the first
+ * kernel in list order that meets its target, setting nTimeFound and
+ * hashProofOfStake, or -1 if none does or a new block came in.
+ */
+int SearchStakeKernels(const std::vector<CStakeKernel>& vKernels, size_t nStart, unsigned int nTimeTx, unsigned int& nTimeFound, uint256& hashProofOfStake, int nThreads = 1);
 bool Stake(CStakeInput* stakeInput, unsigned int nBits, unsigned int nTimeBlockFrom, unsigned int& nTimeTx, uint256& hashProofOfStake);
 
 // Check kernel hash target and coinstake signature
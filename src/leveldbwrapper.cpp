@@ -5,8 +5,13 @@
 #include "leveldbwrapper.h"
 
 #include "util.h"
+#include "utilstrencodings.h"
 
+#include <algorithm>
+
+#include <boost/algorithm/string.hpp>
 #include <boost/filesystem.hpp>
+#include <boost/foreach.hpp>
 
 #include <leveldb/cache.h>
 #include <leveldb/env.h>
@@ -27,14 +32,117 @@ void HandleError(const leveldb::Status& status) throw(leveldb_error)
     throw leveldb_error("Unknown database error");
 }
 
-static leveldb::Options GetOptions(size_t nCacheSize)
+std::string CLevelDBProfile::ToString() const
+{
+    return strprintf("compression=%d,blocksize=%u,maxopenfiles=%d,bloombits=%d,cache=%d,writebuffer=%d,mincache=%u",
+        fCompression, nBlockSize >> 10, nMaxOpenFiles, nBloomBits, nCachePercent, nWriteBufferPercent, nMinCacheSize >> 20);
+}
+
+bool ParseLevelDBProfile(const std::string& strSpec, CLevelDBProfile& profile, std::string& strError)
+{
+    std::vector<std::string> vSettings;
+    boost::split(vSettings, strSpec, boost::is_any_of(","));
+    BOOST_FOREACH (const std::string& strSetting, vSettings) {
+        size_t nPos = strSetting.find('=');
+        int64_t nValue;
+        if (nPos == std::string::npos || !ParseInt64(strSetting.substr(nPos + 1), &nValue) || nValue < 0) {
+            strError = strprintf("expected <key>=<number>, got '%s'", strSetting);
+            return false;
+        }
+        std::string strKey = strSetting.substr(0, nPos);
+        if (strKey == "compression")
+            profile.fCompression = nValue != 0;
+        else if (strKey == "blocksize" && nValue >= 1 && nValue <= 1024)
+            profile.nBlockSize = nValue << 10;
+        else if (strKey == "maxopenfiles" && nValue >= 16)
+            profile.nMaxOpenFiles = nValue;
+        else if (strKey == "bloombits" && nValue <= 32)
+            profile.nBloomBits = nValue;
+        else if (strKey == "cache" && nValue <= 100)
+            profile.nCachePercent = nValue;
+        else if (strKey == "writebuffer" && nValue <= 50)
+            profile.nWriteBufferPercent = nValue;
+        else if (strKey == "mincache" && nValue <= 1024)
+            profile.nMinCacheSize = nValue << 20;
+        else {
+            strError = strprintf("unknown key or value out of range in '%s'", strSetting);
+            return false;
+        }
+    }
+    if (profile.nCachePercent + 2 * profile.nWriteBufferPercent > 100) {
+        strError = "cache plus two write buffers exceeds 100 percent";
+        return false;
+    }
+    return true;
+}
+
+/** Built-in profiles; databases not listed use the defaults, which suit the chainstate */
+static CLevelDBProfile GetDefaultLevelDBProfile(const std::string& strName)
+{
+    CLevelDBProfile profile;
+    if (strName == "blockindex") {
+        // Appended to while syncing and read back in one sweep at startup
+        profile.nBlockSize = 16 << 10;
+        profile.nCachePercent = 25;
+        profile.nWriteBufferPercent = 37;
+    } else if (strName == "fileindex") {
+        // Larger records, mostly scanned by prefix
+        profile.fCompression = true;
+        profile.nBlockSize = 16 << 10;
+        profile.nMinCacheSize = 4 << 20;
+    } else if (strName == "zerocoin") {
+        // Point lookups of serials and pubcoins that are mostly not there
+        profile.nBloomBits = 14;
+        profile.nMinCacheSize = 8 << 20;
+    } else if (strName == "sporks") {
+        profile.nMaxOpenFiles = 16;
+    }
+    return profile;
+}
+
+CLevelDBProfile GetLevelDBProfile(const std::string& strName)
+{
+    CLevelDBProfile profile = GetDefaultLevelDBProfile(strName);
+    BOOST_FOREACH (const std::string& strArg, mapMultiArgs["-dbprofile"]) {
+        size_t nPos = strArg.find(':');
+        if (nPos == std::string::npos || strArg.substr(0, nPos) != strName)
+            continue;
+        std::string strError;
+        if (!ParseLevelDBProfile(strArg.substr(nPos + 1), profile, strError))
+            LogPrintf("Ignoring -dbprofile=%s: %s\n", strArg, strError);
+    }
+    return profile;
+}
+
+bool CheckLevelDBProfileArgs(std::string& strError)
+{
+    static const char* const pszNames[] = {"chainstate", "blockindex", "fileindex", "zerocoin", "sporks"};
+    BOOST_FOREACH (const std::string& strArg, mapMultiArgs["-dbprofile"]) {
+        size_t nPos = strArg.find(':');
+        std::string strName = strArg.substr(0, nPos);
+        if (nPos == std::string::npos || std::find(pszNames, pszNames + ARRAYLEN(pszNames), strName) == pszNames + ARRAYLEN(pszNames)) {
+            strError = strprintf("unknown database in '%s'", strArg);
+            return false;
+        }
+        CLevelDBProfile profile = GetDefaultLevelDBProfile(strName);
+        if (!ParseLevelDBProfile(strArg.substr(nPos + 1), profile, strError)) {
+            strError = strprintf("%s in '%s'", strError, strArg);
+            return false;
+        }
+    }
+    return true;
+}
+
+static leveldb::Options GetOptions(size_t nCacheSize, const CLevelDBProfile& profile)
 {
     leveldb::Options options;
-    options.block_cache = leveldb::NewLRUCache(nCacheSize / 2);
-    options.write_buffer_size = nCacheSize / 4; // up to two write buffers may be held in memory simultaneously
-    options.filter_policy = leveldb::NewBloomFilterPolicy(10);
-    options.compression = leveldb::kNoCompression;
-    options.max_open_files = 64;
+    nCacheSize = std::max(nCacheSize, profile.nMinCacheSize);
+    options.block_cache = leveldb::NewLRUCache(nCacheSize / 100 * profile.nCachePercent);
+    options.write_buffer_size = nCacheSize / 100 * profile.nWriteBufferPercent; // up to two write buffers may be held in memory simultaneously
+    options.filter_policy = profile.nBloomBits ? leveldb::NewBloomFilterPolicy(profile.nBloomBits) : NULL;
+    options.compression = profile.fCompression ? leveldb::kSnappyCompression : leveldb::kNoCompression;
+    options.block_size = profile.nBlockSize;
+    options.max_open_files = profile.nMaxOpenFiles;
     if (leveldb::kMajorVersion > 1 || (leveldb::kMajorVersion == 1 && leveldb::kMinorVersion >= 16)) {
         // LevelDB versions before 1.16 consider short writes to be corruption. Only trigger error
         // on corruption in later versions.
@@ -43,14 +151,15 @@ static leveldb::Options GetOptions(size_t nCacheSize)
     return options;
 }
 
-CLevelDBWrapper::CLevelDBWrapper(const boost::filesystem::path& path, size_t nCacheSize, bool fMemory, bool fWipe)
+CLevelDBWrapper::CLevelDBWrapper(const boost::filesystem::path& path, size_t nCacheSize, bool fMemory, bool fWipe, const std::string& strProfile)
 {
+    CLevelDBProfile profile = GetLevelDBProfile(strProfile);
     penv = NULL;
     readoptions.verify_checksums = true;
     iteroptions.verify_checksums = true;
     iteroptions.fill_cache = false;
     syncoptions.sync = true;
-    options = GetOptions(nCacheSize);
+    options = GetOptions(nCacheSize, profile);
     options.create_if_missing = true;
     if (fMemory) {
         penv = leveldb::NewMemEnv(leveldb::Env::Default());
@@ -61,7 +170,7 @@ CLevelDBWrapper::CLevelDBWrapper(const boost::filesystem::path& path, size_t nCa
             leveldb::DestroyDB(path.string(), options);
         }
         TryCreateDirectory(path);
-        LogPrintf("Opening LevelDB in %s\n", path.string());
+        LogPrintf("Opening LevelDB in %s (%s)\n", path.string(), profile.ToString());
     }
     leveldb::Status status = leveldb::DB::Open(options, path.string(), &pdb);
     HandleError(status);
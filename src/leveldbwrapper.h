@@ -24,6 +24,41 @@ public:
 
 void HandleError(const leveldb::Status& status) throw(leveldb_error);
 
+/**
+ * Tunable LevelDB settings for one database. Each database opens with a
+ * built-in profile suited to its access pattern, which can be adjusted with
+ * -dbprofile=<database>:<key>=<value>[,<key>=<value>...].
+ */
+struct CLevelDBProfile {
+    //! compress table blocks (snappy, when LevelDB was built with it)
+    bool fCompression;
+    //! approximate size of user data packed per block, in bytes
+    size_t nBlockSize;
+    //! number of open files that can be used by the DB
+    int nMaxOpenFiles;
+    //! bloom filter bits per key, 0 for none
+    int nBloomBits;
+    //! share of the cache budget for the block cache, in percent
+    int nCachePercent;
+    //! share of the cache budget for each of the (up to two) write buffers, in percent
+    int nWriteBufferPercent;
+    //! cache budget used when the caller passes less, in bytes
+    size_t nMinCacheSize;
+
+    CLevelDBProfile() : fCompression(false), nBlockSize(4096), nMaxOpenFiles(64), nBloomBits(10), nCachePercent(50), nWriteBufferPercent(25), nMinCacheSize(0) {}
+
+    std::string ToString() const;
+};
+
+/** Apply overrides of the form key=value[,key=value...] to profile */
+bool ParseLevelDBProfile(const std::string& strSpec, CLevelDBProfile& profile, std::string& strError);
+
+/** The built-in profile of the named database with any -dbprofile overrides applied */
+CLevelDBProfile GetLevelDBProfile(const std::string& strName);
+
+/** Check all -dbprofile arguments, so that mistakes are reported at startup */
+bool CheckLevelDBProfileArgs(std::string& strError);
+
 /** Batch of changes queued to be written to a CLevelDBWrapper */
 class CLevelDBBatch
 {
@@ -86,7 +121,7 @@ private:
     leveldb::DB* pdb;
 
 public:
-    CLevelDBWrapper(const boost::filesystem::path& path, size_t nCacheSize, bool fMemory = false, bool fWipe = false);
+    CLevelDBWrapper(const boost::filesystem::path& path, size_t nCacheSize, bool fMemory = false, bool fWipe = false, const std::string& strProfile = "");
     ~CLevelDBWrapper();
 
     template <typename K, typename V>
@@ -12,7 +12,9 @@
 #include "accumulatormap.h"
 #include "addrman.h"
 #include "alert.h"
+#include "blockencodings.h"
 #include "blocksignature.h"
+#include "blockstream.h"
 #include "chainparams.h"
 #include "checkpoints.h"
 #include "checkqueue.h"
@@ -24,6 +26,7 @@
 #include "merkleblock.h"
 #include "net.h"
 #include "obfuscation.h"
+#include "orphanpool.h"
 #include "pow.h"
 #include "spork.h"
 #include "sporkdb.h"
@@ -35,6 +38,7 @@
 #include "util.h"
 #include "utilmoneystr.h"
 #include "validationinterface.h"
+#include "zpivspendcache.h"
 
 #include "primitives/zerocoin.h"
 #include "libzerocoin/Denominations.h"
@@ -68,6 +72,7 @@ using namespace libzerocoin;
 CCriticalSection cs_main;
 
 BlockMap mapBlockIndex;
+CBlockIndexArena blockIndexArena;
 map<uint256, uint256> mapProofOfStake;
 set<pair<COutPoint, unsigned int> > setStakeSeen;
 map<COutPoint, int> mapStakeSpent;
@@ -84,7 +89,7 @@ bool fTxIndex = true;
 bool fIsBareMultisigStd = true;
 bool fCheckBlockIndex = false;
 bool fVerifyingBlocks = false;
-unsigned int nCoinCacheSize = 5000;
+size_t nCoinCacheUsage = 5000 * 300;
 bool fAlerts = DEFAULT_ALERTS;
 
 unsigned int nStakeMinAge = 60 * 60;
@@ -103,12 +108,7 @@ CFileFeeRate minFileFee = CFileFeeRate(50);
 
 CTxMemPool mempool(::minRelayTxFee);
 
-struct COrphanTx {
-    CTransaction tx;
-    NodeId fromPeer;
-};
-map<uint256, COrphanTx> mapOrphanTransactions;
-map<uint256, set<uint256> > mapOrphanTransactionsByPrev;
+COrphanPool orphanpool;
 map<uint256, int64_t> mapRejectedBlocks;
 map<uint256, int64_t> mapZerocoinspends; //txid, time received
 
@@ -117,8 +117,6 @@ CCriticalSection cs_MapMaturationPaymentConfirmTransactions;
 
 template <typename Item> Item* FindByNodeIn(const vector<Item> &items, const NodeId nodeId);
 
-void EraseOrphansFor(NodeId peer);
-
 static void CheckBlockIndex();
 CNode *FindFreeNode(const set<NodeId> &nodes);
 void RemoveHasFileRequestsByNode(const NodeId pNode);
@@ -230,6 +228,59 @@ set<CBlockIndex*> setDirtyBlockIndex;
 set<int> setDirtyFileInfo;
 } // anon namespace
 
+/** Blocks this far below the tip have their zerocoin supply dropped from memory once written */
+static const int ZEROCOIN_SUPPLY_CACHE_DEPTH = 100;
+
+/**
+ * Zerocoin supply of block index entries that were connected, changed or
+ * looked at recently. The supply of every other block stays in its block
+ * tree record and is read back when asked for.
+ */
+static CCriticalSection cs_zerocoinSupply;
+static std::map<const CBlockIndex*, ZerocoinSupplyMap> mapZerocoinSupplyCache;
+
+ZerocoinSupplyMap CBlockIndex::GetZerocoinSupplyMap() const
+{
+    {
+        LOCK(cs_zerocoinSupply);
+        std::map<const CBlockIndex*, ZerocoinSupplyMap>::const_iterator it = mapZerocoinSupplyCache.find(this);
+        if (it != mapZerocoinSupplyCache.end())
+            return it->second;
+    }
+
+    // Entries created in this session are seeded in AddToBlockIndex, so
+    // anything else must have its record in the block tree
+    CDiskBlockIndex diskindex;
+    if (!phashBlock || !pblocktree || !pblocktree->ReadBlockIndex(GetBlockHash(), diskindex)) {
+        LogPrintf("%s : no block tree record for %s\n", __func__, phashBlock ? GetBlockHash().ToString() : "(unnamed)");
+        assert(!"cannot load zerocoin supply from the block tree");
+    }
+
+    // Someone may have set a newer supply while we were reading
+    LOCK(cs_zerocoinSupply);
+    return mapZerocoinSupplyCache.insert(std::make_pair(this, diskindex.mapZerocoinSupply)).first->second;
+}
+
+void CBlockIndex::SetZerocoinSupplyMap(const ZerocoinSupplyMap& mapSupply)
+{
+    LOCK(cs_zerocoinSupply);
+    mapZerocoinSupplyCache[this] = mapSupply;
+}
+
+/** Forget the zerocoin supply of blocks away from the tip whose index entry is on disk */
+static void PruneZerocoinSupplyCache()
+{
+    int nHeightKeep = chainActive.Height() - ZEROCOIN_SUPPLY_CACHE_DEPTH;
+    LOCK(cs_zerocoinSupply);
+    std::map<const CBlockIndex*, ZerocoinSupplyMap>::iterator it = mapZerocoinSupplyCache.begin();
+    while (it != mapZerocoinSupplyCache.end()) {
+        if (it->first->nHeight < nHeightKeep && !setDirtyBlockIndex.count(const_cast<CBlockIndex*>(it->first)))
+            mapZerocoinSupplyCache.erase(it++);
+        else
+            ++it;
+    }
+}
+
 map<uint256, FilePending> filesPendingMap;
 CCriticalSection cs_FilesPendingMap;
 
@@ -293,6 +344,13 @@ struct CNodeState {
     //! Whether we consider this a preferred download peer.
     bool fPreferredDownload;
 
+    //! Whether this peer has told us it understands compact blocks.
+    bool fProvidesHeaderAndIDs;
+    //! Whether this peer wants new blocks announced with a "cmpctblock" rather than an inv.
+    bool fPreferHeaderAndIDs;
+    //! Compact blocks from this peer that wait for a "blocktxn" to be completed.
+    map<uint256, PartiallyDownloadedBlock> mapPartialBlocks;
+
     list<QueuedBlock> vFilesInFlight;
     int nFilesInFlight;
     //end region
@@ -309,6 +367,8 @@ struct CNodeState {
         nStallingSince = 0;
         nBlocksInFlight = 0;
         fPreferredDownload = false;
+        fProvidesHeaderAndIDs = false;
+        fPreferHeaderAndIDs = false;
     }
 };
 
@@ -368,7 +428,7 @@ void FinalizeNode(NodeId nodeid)
 
     BOOST_FOREACH (const QueuedBlock& entry, state->vBlocksInFlight)
         mapBlocksInFlight.erase(entry.hash);
-    EraseOrphansFor(nodeid);
+    orphanpool.EraseForPeer(nodeid);
     nPreferredDownload -= state->fPreferredDownload;
 
     mapNodeState.erase(nodeid);
@@ -610,91 +670,12 @@ CBlockIndex* FindForkInGlobalIndex(const CChain& chain, const CBlockLocator& loc
 }
 
 CCoinsViewCache* pcoinsTip = NULL;
+CCoinsViewFrozen* pcoinsFrozen = NULL;
 CBlockTreeDB* pblocktree = NULL;
 CBlockFileTreeDB* pblockfiletree = NULL;
 CZerocoinDB* zerocoinDB = NULL;
 CSporkDB* pSporkDB = NULL;
 
-//////////////////////////////////////////////////////////////////////////////
-//
-// mapOrphanTransactions
-//
-
-bool AddOrphanTx(const CTransaction& tx, NodeId peer)
-{
-    uint256 hash = tx.GetHash();
-    if (mapOrphanTransactions.count(hash))
-        return false;
-
-    // Ignore big transactions, to avoid a
-    // send-big-orphans memory exhaustion attack. If a peer has a legitimate
-    // large transaction with a missing parent then we assume
-    // it will rebroadcast it later, after the parent transaction(s)
-    // have been mined or received.
-    // 10,000 orphans, each of which is at most 5,000 bytes big is
-    // at most 500 megabytes of orphans:
-    unsigned int sz = tx.GetSerializeSize(SER_NETWORK, CTransaction::CURRENT_VERSION);
-    if (sz > 5000) {
-        LogPrint("mempool", "ignoring large orphan tx (size: %u, hash: %s)\n", sz, hash.ToString());
-        return false;
-    }
-
-    mapOrphanTransactions[hash].tx = tx;
-    mapOrphanTransactions[hash].fromPeer = peer;
-    BOOST_FOREACH (const CTxIn& txin, tx.vin)
-        mapOrphanTransactionsByPrev[txin.prevout.hash].insert(hash);
-
-    LogPrint("mempool", "stored orphan tx %s (mapsz %u prevsz %u)\n", hash.ToString(),
-        mapOrphanTransactions.size(), mapOrphanTransactionsByPrev.size());
-    return true;
-}
-
-void static EraseOrphanTx(uint256 hash)
-{
-    map<uint256, COrphanTx>::iterator it = mapOrphanTransactions.find(hash);
-    if (it == mapOrphanTransactions.end())
-        return;
-    BOOST_FOREACH (const CTxIn& txin, it->second.tx.vin) {
-        map<uint256, set<uint256> >::iterator itPrev = mapOrphanTransactionsByPrev.find(txin.prevout.hash);
-        if (itPrev == mapOrphanTransactionsByPrev.end())
-            continue;
-        itPrev->second.erase(hash);
-        if (itPrev->second.empty())
-            mapOrphanTransactionsByPrev.erase(itPrev);
-    }
-    mapOrphanTransactions.erase(it);
-}
-
-void EraseOrphansFor(NodeId peer)
-{
-    int nErased = 0;
-    map<uint256, COrphanTx>::iterator iter = mapOrphanTransactions.begin();
-    while (iter != mapOrphanTransactions.end()) {
-        map<uint256, COrphanTx>::iterator maybeErase = iter++; // increment to avoid iterator becoming invalid
-        if (maybeErase->second.fromPeer == peer) {
-            EraseOrphanTx(maybeErase->second.tx.GetHash());
-            ++nErased;
-        }
-    }
-    if (nErased > 0) LogPrint("mempool", "Erased %d orphan tx from peer %d\n", nErased, peer);
-}
-
-
-unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans)
-{
-    unsigned int nEvicted = 0;
-    while (mapOrphanTransactions.size() > nMaxOrphans) {
-        // Evict a random orphan:
-        uint256 randomhash = GetRandHash();
-        map<uint256, COrphanTx>::iterator it = mapOrphanTransactions.lower_bound(randomhash);
-        if (it == mapOrphanTransactions.end())
-            it = mapOrphanTransactions.begin();
-        EraseOrphanTx(it->first);
-        ++nEvicted;
-    }
-    return nEvicted;
-}
-
 bool IsStandardTx(const CTransaction& tx, string& reason)
 {
     AssertLockHeld(cs_main);
@@ -1377,7 +1358,13 @@ bool ContextualCheckZerocoinSpend(const CTransaction& tx, const CoinSpend& spend
     return true;
 }
 
-bool CheckZerocoinSpend(const CTransaction& tx, bool fVerifySignature, CValidationState& state)
+/** Whether zerocoin spend proofs are checked: they are skipped while syncing blocks older than a day */
+static bool ZerocoinProofsRequired()
+{
+    return !IsInitialBlockDownload() && (GetTime() - chainActive.Tip()->GetBlockTime() < (60 * 60 * 24));
+}
+
+bool CheckZerocoinSpend(const CTransaction& tx, bool fVerifySignature, CValidationState& state, std::vector<CZerocoinSpendCheck>* pvChecks)
 {
     //max needed non-mint outputs should be 2 - one for redemption address and a possible 2nd for change
     if (tx.vout.size() > 2) {
@@ -1432,12 +1419,20 @@ bool CheckZerocoinSpend(const CTransaction& tx, bool fVerifySignature, CValidati
                 return state.DoS(100, error("%s: Zerocoinspend could not find accumulator associated with checksum %s", __func__, HexStr(BEGIN(nChecksum), END(nChecksum))));
             }
 
-            Accumulator accumulator(Params().Zerocoin_Params(chainActive.Height() < Params().Zerocoin_Block_V2_Start()),
-                                    newSpend.getDenomination(), bnAccumulatorValue);
+            bool fUseV1Params = chainActive.Height() < Params().Zerocoin_Block_V2_Start();
+            Accumulator accumulator(Params().Zerocoin_Params(fUseV1Params), newSpend.getDenomination(), bnAccumulatorValue);
 
-            //Check that the coin has been accumulated
-            if(!newSpend.Verify(accumulator))
-                    return state.DoS(100, error("CheckZerocoinSpend(): zerocoin spend did not verify"));
+            //Check that the coin has been accumulated, unless this exact proof already verified
+            uint256 hashProof = GetZerocoinSpendCacheKey(newSpend, accumulator, fUseV1Params);
+            if (IsZerocoinSpendVerified(hashProof)) {
+                // nothing to do
+            } else if (pvChecks) {
+                pvChecks->push_back(CZerocoinSpendCheck(newSpend, accumulator, tx.GetHash(), hashProof));
+            } else if (!newSpend.Verify(accumulator)) {
+                return state.DoS(100, error("CheckZerocoinSpend(): zerocoin spend did not verify"));
+            } else {
+                SetZerocoinSpendVerified(hashProof);
+            }
         }
 
         if (serials.count(newSpend.getCoinSerialNumber()))
@@ -1457,7 +1452,7 @@ bool CheckZerocoinSpend(const CTransaction& tx, bool fVerifySignature, CValidati
     return fValidated;
 }
 
-bool CheckTransaction(const CTransaction& tx, bool fZerocoinActive, CValidationState& state)
+bool CheckTransaction(const CTransaction& tx, bool fZerocoinActive, CValidationState& state, bool fVerifyZerocoinProofs)
 {
     // Basic checks that don't depend on any context
     if (tx.vin.empty())
@@ -1512,7 +1507,7 @@ bool CheckTransaction(const CTransaction& tx, bool fZerocoinActive, CValidationS
             }
 
             // Do not require signature verification if this is initial sync and a block over 24 hours old
-            bool fVerifySignature = !IsInitialBlockDownload() && (GetTime() - chainActive.Tip()->GetBlockTime() < (60*60*24));
+            bool fVerifySignature = fVerifyZerocoinProofs && ZerocoinProofsRequired();
             if (!CheckZerocoinSpend(tx, fVerifySignature, state))
                 return state.DoS(100, error("CheckTransaction() : invalid zerocoin spend"));
         }
@@ -1607,9 +1602,66 @@ CAmount GetMinRelayFee(const CTransaction& tx, unsigned int nBytes, bool fAllowF
 }
 
 
-bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransaction& tx, bool fLimitFree, bool* pfMissingInputs, bool fRejectInsaneFee, bool ignoreFees)
+/** Check for a transaction lock or a mempool transaction already spending one of the inputs */
+static bool CheckMempoolConflicts(CTxMemPool& pool, CValidationState& state, const CTransaction& tx)
+{
+    // ----------- swiftTX transaction scanning -----------
+
+    BOOST_FOREACH (const CTxIn& in, tx.vin) {
+        if (mapLockedInputs.count(in.prevout)) {
+            if (mapLockedInputs[in.prevout] != tx.GetHash()) {
+                return state.DoS(0,
+                    error("AcceptToMemoryPool : conflicts with existing transaction lock: %s", tx.GetHash().ToString()),
+                    REJECT_INVALID, "tx-lock-conflict");
+            }
+        }
+    }
+
+    // Check for conflicts with in-memory transactions
+    if (!tx.IsZerocoinSpend()) {
+        LOCK(pool.cs); // protect pool.mapNextTx
+        for (unsigned int i = 0; i < tx.vin.size(); i++) {
+            COutPoint outpoint = tx.vin[i].prevout;
+            if (pool.mapNextTx.count(outpoint)) {
+                // Disable replacement feature for now
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+/**
+ * The checks that depend on the rest of the pool rather than the chain: the
+ * fee a full pool asks for and the package limits.
+ */
+static bool CheckMempoolPackage(CTxMemPool& pool, CValidationState& state, const CMempoolAccept& accept, unsigned int nSize)
+{
+    const CTransaction& tx = accept.tx;
+    uint256 hash = tx.GetHash();
+
+    // A full pool only takes transactions paying more than what it last evicted
+    if (!accept.fObfuscation && !accept.ignoreFees) {
+        CAmount mempoolRejectFee = pool.GetMinFee(GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000).GetFee(nSize);
+        if (accept.fLimitFree && mempoolRejectFee > 0 && accept.nFees < mempoolRejectFee && !tx.IsZerocoinSpend())
+            return state.DoS(0, error("AcceptToMemoryPool : mempool min fee not met %s, %d < %d",
+                                    hash.ToString(), accept.nFees, mempoolRejectFee),
+                REJECT_INSUFFICIENTFEE, "mempool min fee not met");
+    }
+
+    // Keep unconfirmed chains short enough to be mined and evicted as packages
+    std::string errString;
+    if (!pool.CheckPackageLimits(tx, nSize, GetArg("-limitancestorcount", DEFAULT_ANCESTOR_LIMIT), GetArg("-limitancestorsize", DEFAULT_ANCESTOR_SIZE_LIMIT) * 1000,
+                                 GetArg("-limitdescendantcount", DEFAULT_DESCENDANT_LIMIT), GetArg("-limitdescendantsize", DEFAULT_DESCENDANT_SIZE_LIMIT) * 1000, errString))
+        return state.DoS(0, error("AcceptToMemoryPool : %s %s", errString, hash.ToString()),
+            REJECT_NONSTANDARD, "too-long-mempool-chain");
+    return true;
+}
+
+bool PrepareMempoolAccept(CTxMemPool& pool, CValidationState& state, CMempoolAccept& accept, bool* pfMissingInputs)
 {
     AssertLockHeld(cs_main);
+    const CTransaction& tx = accept.tx;
     if (pfMissingInputs)
         *pfMissingInputs = false;
 
@@ -1617,7 +1669,16 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransa
     if (GetAdjustedTime() > GetSporkValue(SPORK_16_ZEROCOIN_MAINTENANCE_MODE) && tx.ContainsZerocoins())
         return state.DoS(10, error("AcceptToMemoryPool : Zerocoin transactions are temporarily disabled for maintenance"), REJECT_INVALID, "bad-tx");
 
-    if (!CheckTransaction(tx, chainActive.Height() >= Params().Zerocoin_StartHeight(), state))
+    bool fZerocoinActive = chainActive.Height() >= Params().Zerocoin_StartHeight();
+    if (!accept.fCheckedTx || accept.fZerocoinActive != fZerocoinActive) {
+        if (!CheckTransaction(tx, fZerocoinActive, state, false))
+            return state.DoS(100, error("AcceptToMemoryPool: : CheckTransaction failed"), REJECT_INVALID, "bad-tx");
+        accept.fCheckedTx = true;
+        accept.fZerocoinActive = fZerocoinActive;
+    }
+
+    // The proofs are verified with the scripts, the accumulators are looked up here
+    if (fZerocoinActive && tx.IsZerocoinSpend() && ZerocoinProofsRequired() && !CheckZerocoinSpend(tx, true, state, &accept.vZerocoinChecks))
         return state.DoS(100, error("AcceptToMemoryPool: : CheckTransaction failed"), REJECT_INVALID, "bad-tx");
 
     // Coinbase is only valid in a block, not as a loose transaction
@@ -1644,208 +1705,290 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransa
         return false;
     }
 
-    // ----------- swiftTX transaction scanning -----------
+    if (!CheckMempoolConflicts(pool, state, tx))
+        return false;
 
-    BOOST_FOREACH (const CTxIn& in, tx.vin) {
-        if (mapLockedInputs.count(in.prevout)) {
-            if (mapLockedInputs[in.prevout] != tx.GetHash()) {
-                return state.DoS(0,
-                    error("AcceptToMemoryPool : conflicts with existing transaction lock: %s", reason),
-                    REJECT_INVALID, "tx-lock-conflict");
-            }
-        }
-    }
+    accept.hashBestBlock = chainActive.Tip()->GetBlockHash();
+    accept.nTransactionsUpdated = pool.GetTransactionsUpdated();
+    accept.nHeight = chainActive.Height();
 
-    // Check for conflicts with in-memory transactions
-    if (!tx.IsZerocoinSpend()) {
-        LOCK(pool.cs); // protect pool.mapNextTx
-        for (unsigned int i = 0; i < tx.vin.size(); i++) {
-            COutPoint outpoint = tx.vin[i].prevout;
-            if (pool.mapNextTx.count(outpoint)) {
-                // Disable replacement feature for now
-                return false;
-            }
-        }
-    }
+    CCoinsViewCache& view = accept.view;
+    CAmount nValueIn = 0;
+    if(tx.IsZerocoinSpend()){
+        nValueIn = tx.GetZerocoinSpent();
 
+        //Check that txid is not already in the chain
+        int nHeightTx = 0;
+        if (IsTransactionInChain(tx.GetHash(), nHeightTx))
+            return state.Invalid(error("AcceptToMemoryPool : zPDG spend tx %s already in block %d",
+                                       tx.GetHash().GetHex(), nHeightTx), REJECT_DUPLICATE, "bad-txns-inputs-spent");
 
-    {
-        CCoinsView dummy;
-        CCoinsViewCache view(&dummy);
+        //Check for double spending of serial #'s
+        for (const CTxIn& txIn : tx.vin) {
+            if (!txIn.scriptSig.IsZerocoinSpend())
+                continue;
+            CoinSpend spend = TxInToZerocoinSpend(txIn);
+            if (!ContextualCheckZerocoinSpend(tx, spend, chainActive.Tip(), 0))
+                return state.Invalid(error("%s: ContextualCheckZerocoinSpend failed for tx %s", __func__,
+                                           tx.GetHash().GetHex()), REJECT_INVALID, "bad-txns-invalid-zpdg");
+        }
+    } else {
+        LOCK(pool.cs);
+        CCoinsViewMemPool viewMemPool(pcoinsTip, pool);
+        view.SetBackend(viewMemPool);
 
-        CAmount nValueIn = 0;
-        if(tx.IsZerocoinSpend()){
-            nValueIn = tx.GetZerocoinSpent();
+        // do we already have it?
+        if (view.HaveCoins(hash))
+            return false;
 
-            //Check that txid is not already in the chain
-            int nHeightTx = 0;
-            if (IsTransactionInChain(tx.GetHash(), nHeightTx))
-                return state.Invalid(error("AcceptToMemoryPool : zPDG spend tx %s already in block %d",
-                                           tx.GetHash().GetHex(), nHeightTx), REJECT_DUPLICATE, "bad-txns-inputs-spent");
+        // do all inputs exist?
+        // Note that this does not check for the presence of actual outputs (see the next check for that),
+        // only helps filling in pfMissingInputs (to determine missing vs spent).
+        for (const CTxIn& txin : tx.vin) {
+            if (!view.HaveCoins(txin.prevout.hash)) {
+                if (pfMissingInputs)
+                    *pfMissingInputs = true;
+                return false;
+            }
 
-            //Check for double spending of serial #'s
-            for (const CTxIn& txIn : tx.vin) {
-                if (!txIn.scriptSig.IsZerocoinSpend())
-                    continue;
-                CoinSpend spend = TxInToZerocoinSpend(txIn);
-                if (!ContextualCheckZerocoinSpend(tx, spend, chainActive.Tip(), 0))
-                    return state.Invalid(error("%s: ContextualCheckZerocoinSpend failed for tx %s", __func__,
-                                               tx.GetHash().GetHex()), REJECT_INVALID, "bad-txns-invalid-zpdg");
+            //Check for invalid/fraudulent inputs
+            if (!ValidOutPoint(txin.prevout, chainActive.Height())) {
+                return state.Invalid(error("%s : tried to spend invalid input %s in tx %s", __func__, txin.prevout.ToString(),
+                                            tx.GetHash().GetHex()), REJECT_INVALID, "bad-txns-invalid-inputs");
             }
-        } else {
-            LOCK(pool.cs);
-            CCoinsViewMemPool viewMemPool(pcoinsTip, pool);
-            view.SetBackend(viewMemPool);
+        }
 
-            // do we already have it?
-            if (view.HaveCoins(hash))
-                return false;
+        // Check that zPDG mints are not already known
+        if (tx.IsZerocoinMint()) {
+            for (auto& out : tx.vout) {
+                if (!out.IsZerocoinMint())
+                    continue;
 
-            // do all inputs exist?
-            // Note that this does not check for the presence of actual outputs (see the next check for that),
-            // only helps filling in pfMissingInputs (to determine missing vs spent).
-            for (const CTxIn& txin : tx.vin) {
-                if (!view.HaveCoins(txin.prevout.hash)) {
-                    if (pfMissingInputs)
-                        *pfMissingInputs = true;
-                    return false;
-                }
+                PublicCoin coin(Params().Zerocoin_Params(false));
+                if (!TxOutToPublicCoin(out, coin, state))
+                    return state.Invalid(error("%s: failed final check of zerocoinmint for tx %s", __func__, tx.GetHash().GetHex()));
 
-                //Check for invalid/fraudulent inputs
-                if (!ValidOutPoint(txin.prevout, chainActive.Height())) {
-                    return state.Invalid(error("%s : tried to spend invalid input %s in tx %s", __func__, txin.prevout.ToString(),
-                                                tx.GetHash().GetHex()), REJECT_INVALID, "bad-txns-invalid-inputs");
-                }
+                if (!ContextualCheckZerocoinMint(tx, coin, chainActive.Tip()))
+                    return state.Invalid(error("%s: zerocoin mint failed contextual check", __func__));
             }
+        }
 
-            // Check that zPDG mints are not already known
-            if (tx.IsZerocoinMint()) {
-                for (auto& out : tx.vout) {
-                    if (!out.IsZerocoinMint())
-                        continue;
+        // are the actual inputs available?
+        if (!view.HaveInputs(tx))
+            return state.Invalid(error("AcceptToMemoryPool : inputs already spent"),
+                REJECT_DUPLICATE, "bad-txns-inputs-spent");
 
-                    PublicCoin coin(Params().Zerocoin_Params(false));
-                    if (!TxOutToPublicCoin(out, coin, state))
-                        return state.Invalid(error("%s: failed final check of zerocoinmint for tx %s", __func__, tx.GetHash().GetHex()));
+        // Bring the best block into scope
+        view.GetBestBlock();
 
-                    if (!ContextualCheckZerocoinMint(tx, coin, chainActive.Tip()))
-                        return state.Invalid(error("%s: zerocoin mint failed contextual check", __func__));
-                }
-            }
+        nValueIn = view.GetValueIn(tx);
 
-            // are the actual inputs available?
-            if (!view.HaveInputs(tx))
-                return state.Invalid(error("AcceptToMemoryPool : inputs already spent"),
-                    REJECT_DUPLICATE, "bad-txns-inputs-spent");
+        // we have all inputs cached now, so switch back to dummy, so we don't need to keep lock on mempool
+        view.SetBackend(accept.dummy);
+    }
 
-            // Bring the best block into scope
-            view.GetBestBlock();
+    // Check for non-standard pay-to-script-hash in inputs
+    if (Params().RequireStandard() && !AreInputsStandard(tx, view))
+        return error("AcceptToMemoryPool: : nonstandard transaction input");
 
-            nValueIn = view.GetValueIn(tx);
+    // Check that the transaction doesn't have an excessive number of
+    // sigops, making it impossible to mine. Since the coinbase transaction
+    // itself can contain sigops MAX_TX_SIGOPS is less than
+    // MAX_BLOCK_SIGOPS; we still consider this an invalid rather than
+    // merely non-standard transaction.
+    if (!tx.IsZerocoinSpend()) {
+        unsigned int nSigOps = GetLegacySigOpCount(tx);
+        unsigned int nMaxSigOps = MAX_TX_SIGOPS_CURRENT;
+        nSigOps += GetP2SHSigOpCount(tx, view);
+        if(nSigOps > nMaxSigOps)
+            return state.DoS(0,
+                             error("AcceptToMemoryPool : too many sigops %s, %d > %d",
+                                   hash.ToString(), nSigOps, nMaxSigOps),
+                             REJECT_NONSTANDARD, "bad-txns-too-many-sigops");
+    }
 
-            // we have all inputs cached now, so switch back to dummy, so we don't need to keep lock on mempool
-            view.SetBackend(dummy);
-        }
+    CAmount nValueOut = tx.GetValueOut();
+    CAmount nFees = nValueIn - nValueOut;
+    accept.nFees = nFees;
+    if (!tx.IsZerocoinSpend())
+        accept.dPriority = view.GetPriority(tx, chainActive.Height());
 
-        // Check for non-standard pay-to-script-hash in inputs
-        if (Params().RequireStandard() && !AreInputsStandard(tx, view))
-            return error("AcceptToMemoryPool: : nonstandard transaction input");
+    unsigned int nSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
 
-        // Check that the transaction doesn't have an excessive number of
-        // sigops, making it impossible to mine. Since the coinbase transaction
-        // itself can contain sigops MAX_TX_SIGOPS is less than
-        // MAX_BLOCK_SIGOPS; we still consider this an invalid rather than
-        // merely non-standard transaction.
-        if (!tx.IsZerocoinSpend()) {
-            unsigned int nSigOps = GetLegacySigOpCount(tx);
-            unsigned int nMaxSigOps = MAX_TX_SIGOPS_CURRENT;
-            nSigOps += GetP2SHSigOpCount(tx, view);
-            if(nSigOps > nMaxSigOps)
-                return state.DoS(0,
-                                 error("AcceptToMemoryPool : too many sigops %s, %d > %d",
-                                       hash.ToString(), nSigOps, nMaxSigOps),
-                                 REJECT_NONSTANDARD, "bad-txns-too-many-sigops");
+    // Don't accept it if it can't get into a block
+    // but prioritise dstx and don't check fees for it
+    if (mapObfuscationBroadcastTxes.count(hash)) {
+        accept.fObfuscation = true;
+    } else if (!accept.ignoreFees) {
+        CAmount txMinFee = GetMinRelayFee(tx, nSize, true);
+        if (accept.fLimitFree && nFees < txMinFee && !tx.IsZerocoinSpend()) // TODO: FEE CHECK
+            return state.DoS(0, error("AcceptToMemoryPool : not enough fees %s, %d < %d",
+                                    hash.ToString(), nFees, txMinFee),
+                REJECT_INSUFFICIENTFEE, "insufficient fee");
+
+        // Require that free transactions have sufficient priority to be mined in the next block.
+        if (tx.IsZerocoinMint()) {
+            if(nFees < Params().Zerocoin_MintFee() * tx.GetZerocoinMintCount())
+                return state.DoS(0, false, REJECT_INSUFFICIENTFEE, "insufficient fee for zerocoinmint");
+        } else if (!tx.IsZerocoinSpend() && GetBoolArg("-relaypriority", true) && nFees < ::minRelayTxFee.GetFee(nSize) && !AllowFree(view.GetPriority(tx, chainActive.Height() + 1))) {
+            return state.DoS(0, false, REJECT_INSUFFICIENTFEE, "insufficient priority");
         }
 
-        CAmount nValueOut = tx.GetValueOut();
-        CAmount nFees = nValueIn - nValueOut;
-        double dPriority = 0;
-        if (!tx.IsZerocoinSpend())
-            view.GetPriority(tx, chainActive.Height());
+        // Free transactions are rate limited when they are inserted
+        accept.fRateLimit = accept.fLimitFree && !accept.fBypassRateLimit && nFees < ::minRelayTxFee.GetFee(nSize) && !tx.IsZerocoinSpend();
+    }
 
-        CTxMemPoolEntry entry(tx, nFees, GetTime(), dPriority, chainActive.Height());
-        unsigned int nSize = entry.GetTxSize();
+    if (accept.fRejectInsaneFee && nFees > ::minRelayTxFee.GetFee(nSize) * 10000) // TODO: FEE CHECK
+        return error("AcceptToMemoryPool: : insane fees %s, %d > %d",
+            hash.ToString(),
+            nFees, ::minRelayTxFee.GetFee(nSize) * 10000);
 
-        // Don't accept it if it can't get into a block
-        // but prioritise dstx and don't check fees for it
-        if (mapObfuscationBroadcastTxes.count(hash)) {
-            mempool.PrioritiseTransaction(hash, hash.ToString(), 1000, 0.1 * COIN);
-        } else if (!ignoreFees) {
-            CAmount txMinFee = GetMinRelayFee(tx, nSize, true);
-            if (fLimitFree && nFees < txMinFee && !tx.IsZerocoinSpend()) // TODO: FEE CHECK
-                return state.DoS(0, error("AcceptToMemoryPool : not enough fees %s, %d < %d",
-                                        hash.ToString(), nFees, txMinFee),
-                    REJECT_INSUFFICIENTFEE, "insufficient fee");
+    if (!CheckMempoolPackage(pool, state, accept, nSize))
+        return false;
 
-            // Require that free transactions have sufficient priority to be mined in the next block.
-            if (tx.IsZerocoinMint()) {
-                if(nFees < Params().Zerocoin_MintFee() * tx.GetZerocoinMintCount())
-                    return state.DoS(0, false, REJECT_INSUFFICIENTFEE, "insufficient fee for zerocoinmint");
-            } else if (!tx.IsZerocoinSpend() && GetBoolArg("-relaypriority", true) && nFees < ::minRelayTxFee.GetFee(nSize) && !AllowFree(view.GetPriority(tx, chainActive.Height() + 1))) {
-                return state.DoS(0, false, REJECT_INSUFFICIENTFEE, "insufficient priority");
-            }
+    // Check against previous transactions. Only the input values and
+    // maturity are checked here, the scripts go to VerifyMempoolAccept.
+    // This is done last to help prevent CPU exhaustion denial-of-service attacks.
+    if (!CheckInputs(tx, state, view, true, STANDARD_SCRIPT_VERIFY_FLAGS, true, &accept.vScriptChecks))
+        return error("AcceptToMemoryPool: : ConnectInputs failed %s", hash.ToString());
+    CheckInputs(tx, state, view, true, MANDATORY_SCRIPT_VERIFY_FLAGS, true, &accept.vMandatoryChecks);
+    assert(accept.vScriptChecks.size() == accept.vMandatoryChecks.size());
 
-            // Continuously rate-limit free (really, very-low-fee) transactions
-            // This mitigates 'penny-flooding' -- sending thousands of free transactions just to
-            // be annoying or make others' transactions take longer to confirm.
-            if (fLimitFree && nFees < ::minRelayTxFee.GetFee(nSize) && !tx.IsZerocoinSpend()) {
-                static CCriticalSection csFreeLimiter;
-                static double dFreeCount;
-                static int64_t nLastTime;
-                int64_t nNow = GetTime();
+    return true;
+}
 
-                LOCK(csFreeLimiter);
+bool VerifyMempoolAccept(CValidationState& state, CMempoolAccept& accept)
+{
+    uint256 hash = accept.tx.GetHash();
+    BOOST_FOREACH (CZerocoinSpendCheck& check, accept.vZerocoinChecks) {
+        if (!check())
+            return state.DoS(100, error("AcceptToMemoryPool: : CheckTransaction failed"), REJECT_INVALID, "bad-tx");
+    }
 
-                // Use an exponentially decaying ~10-minute window:
-                dFreeCount *= pow(1.0 - 1.0 / 600.0, (double)(nNow - nLastTime));
-                nLastTime = nNow;
-                // -limitfreerelay unit is thousand-bytes-per-minute
-                // At default rate it would take over a month to fill 1GB
-                if (dFreeCount >= GetArg("-limitfreerelay", 30) * 10 * 1000)
-                    return state.DoS(0, error("AcceptToMemoryPool : free transaction rejected by rate limiter"),
-                        REJECT_INSUFFICIENTFEE, "rate limited free transaction");
-                LogPrint("mempool", "Rate limit dFreeCount: %g => %g\n", dFreeCount, dFreeCount + nSize);
-                dFreeCount += nSize;
-            }
+    for (unsigned int i = 0; i < accept.vScriptChecks.size(); i++) {
+        CScriptCheck& check = accept.vScriptChecks[i];
+        if (check())
+            continue;
+        // Check whether the failure was caused by a non-mandatory script
+        // verification check, such as non-standard DER encodings or non-null
+        // dummy arguments; if so, don't trigger DoS protection to avoid
+        // splitting the network between upgraded and non-upgraded nodes.
+        if (accept.vMandatoryChecks[i]())
+            state.Invalid(false, REJECT_NONSTANDARD, strprintf("non-mandatory-script-verify-flag (%s)", ScriptErrorString(check.GetScriptError())));
+        else
+            state.DoS(100, false, REJECT_INVALID, strprintf("mandatory-script-verify-flag-failed (%s)", ScriptErrorString(accept.vMandatoryChecks[i].GetScriptError())));
+        return error("AcceptToMemoryPool: : ConnectInputs failed %s", hash.ToString());
+    }
+
+    // Check again against just the consensus-critical mandatory script
+    // verification flags, in case of bugs in the standard flags that cause
+    // transactions to pass as valid when they're actually invalid. For
+    // instance the STRICTENC flag was incorrectly allowing certain
+    // CHECKSIG NOT scripts to pass, even though they were invalid.
+    //
+    // There is a similar check in CreateNewBlock() to prevent creating
+    // invalid blocks, however allowing such transactions into the mempool
+    // can be exploited as a DoS attack.
+    BOOST_FOREACH (CScriptCheck& check, accept.vMandatoryChecks) {
+        if (!check()) {
+            state.DoS(100, false, REJECT_INVALID, strprintf("mandatory-script-verify-flag-failed (%s)", ScriptErrorString(check.GetScriptError())));
+            return error("AcceptToMemoryPool: : BUG! PLEASE REPORT THIS! ConnectInputs failed against MANDATORY but not STANDARD flags %s", hash.ToString());
         }
+    }
+    return true;
+}
 
-        if (fRejectInsaneFee && nFees > ::minRelayTxFee.GetFee(nSize) * 10000) // TODO: FEE CHECK
-            return error("AcceptToMemoryPool: : insane fees %s, %d > %d",
-                hash.ToString(),
-                nFees, ::minRelayTxFee.GetFee(nSize) * 10000);
+/**
+ * Redo the lookups of a prepared transaction after the mempool changed on
+ * the same tip. The inputs are identified by txid, so those still there have
+ * the scripts and values that were verified and only their presence, the
+ * conflicts and the pool dependent checks can differ.
+ */
+static bool RecheckMempoolAccept(CTxMemPool& pool, CValidationState& state, CMempoolAccept& accept, bool* pfMissingInputs)
+{
+    const CTransaction& tx = accept.tx;
+    if (pfMissingInputs)
+        *pfMissingInputs = false;
 
-        // Check against previous transactions
-        // This is done last to help prevent CPU exhaustion denial-of-service attacks.
-        if (!CheckInputs(tx, state, view, true, STANDARD_SCRIPT_VERIFY_FLAGS, true)) {
-            return error("AcceptToMemoryPool: : ConnectInputs failed %s", hash.ToString());
-        }
+    if (pool.exists(tx.GetHash()))
+        return false;
+    if (!CheckMempoolConflicts(pool, state, tx))
+        return false;
 
-        // Check again against just the consensus-critical mandatory script
-        // verification flags, in case of bugs in the standard flags that cause
-        // transactions to pass as valid when they're actually invalid. For
-        // instance the STRICTENC flag was incorrectly allowing certain
-        // CHECKSIG NOT scripts to pass, even though they were invalid.
-        //
-        // There is a similar check in CreateNewBlock() to prevent creating
-        // invalid blocks, however allowing such transactions into the mempool
-        // can be exploited as a DoS attack.
-        if (!CheckInputs(tx, state, view, true, MANDATORY_SCRIPT_VERIFY_FLAGS, true)) {
-            return error("AcceptToMemoryPool: : BUG! PLEASE REPORT THIS! ConnectInputs failed against MANDATORY but not STANDARD flags %s", hash.ToString());
+    if (!tx.IsZerocoinSpend()) {
+        LOCK(pool.cs);
+        CCoinsViewMemPool viewMemPool(pcoinsTip, pool);
+        CCoinsViewCache view(&viewMemPool);
+        for (const CTxIn& txin : tx.vin) {
+            if (!view.HaveCoins(txin.prevout.hash)) {
+                if (pfMissingInputs)
+                    *pfMissingInputs = true;
+                return false;
+            }
         }
+        if (!view.HaveInputs(tx))
+            return state.Invalid(error("AcceptToMemoryPool : inputs already spent"),
+                REJECT_DUPLICATE, "bad-txns-inputs-spent");
+    }
 
-        // Store transaction in memory
-        pool.addUnchecked(hash, entry);
+    if (!CheckMempoolPackage(pool, state, accept, ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION)))
+        return false;
+    accept.nTransactionsUpdated = pool.GetTransactionsUpdated();
+    return true;
+}
+
+bool FinishMempoolAccept(CTxMemPool& pool, CValidationState& state, CMempoolAccept& accept, bool* pfMissingInputs)
+{
+    AssertLockHeld(cs_main);
+    if (chainActive.Tip()->GetBlockHash() != accept.hashBestBlock) {
+        CMempoolAccept retry(accept.tx, accept.fLimitFree, accept.fRejectInsaneFee, accept.ignoreFees);
+        retry.nAcceptTime = accept.nAcceptTime;
+        retry.fBypassRateLimit = accept.fBypassRateLimit;
+        if (!PrepareMempoolAccept(pool, state, retry, pfMissingInputs) || !VerifyMempoolAccept(state, retry))
+            return false;
+        return FinishMempoolAccept(pool, state, retry, pfMissingInputs);
     }
+    if (pool.GetTransactionsUpdated() != accept.nTransactionsUpdated && !RecheckMempoolAccept(pool, state, accept, pfMissingInputs))
+        return false;
+
+    const CTransaction& tx = accept.tx;
+    uint256 hash = tx.GetHash();
+    CTxMemPoolEntry entry(tx, accept.nFees, accept.nAcceptTime ? accept.nAcceptTime : GetTime(), accept.dPriority, accept.nHeight);
+    unsigned int nSize = entry.GetTxSize();
+
+    if (accept.fObfuscation)
+        mempool.PrioritiseTransaction(hash, hash.ToString(), 1000, 0.1 * COIN);
+
+    // Continuously rate-limit free (really, very-low-fee) transactions
+    // This mitigates 'penny-flooding' -- sending thousands of free transactions just to
+    // be annoying or make others' transactions take longer to confirm.
+    if (accept.fRateLimit) {
+        static CCriticalSection csFreeLimiter;
+        static double dFreeCount;
+        static int64_t nLastTime;
+        int64_t nNow = GetTime();
+
+        LOCK(csFreeLimiter);
+
+        // Use an exponentially decaying ~10-minute window:
+        dFreeCount *= pow(1.0 - 1.0 / 600.0, (double)(nNow - nLastTime));
+        nLastTime = nNow;
+        // -limitfreerelay unit is thousand-bytes-per-minute
+        // At default rate it would take over a month to fill 1GB
+        if (dFreeCount >= GetArg("-limitfreerelay", 30) * 10 * 1000)
+            return state.DoS(0, error("AcceptToMemoryPool : free transaction rejected by rate limiter"),
+                REJECT_INSUFFICIENTFEE, "rate limited free transaction");
+        LogPrint("mempool", "Rate limit dFreeCount: %g => %g\n", dFreeCount, dFreeCount + nSize);
+        dFreeCount += nSize;
+    }
+
+    // Store transaction in memory
+    pool.addUnchecked(hash, entry);
+
+    // Make room by evicting the lowest fee rate packages, which may be this one
+    pool.TrimToSize(GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000);
+    if (!pool.exists(hash))
+        return state.DoS(0, false, REJECT_INSUFFICIENTFEE, "mempool full");
 
     SyncWithWallets(tx, NULL);
 
@@ -1856,6 +1999,31 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransa
     return true;
 }
 
+/**
+ * AcceptToMemoryPool for a transaction that was accepted before, at
+ * nAcceptTime. The fee checks apply as usual, the free relay rate limit
+ * does not.
+ */
+static bool AcceptToMemoryPoolWithTime(CTxMemPool& pool, CValidationState& state, const CTransaction& tx, bool fLimitFree, bool* pfMissingInputs, int64_t nAcceptTime)
+{
+    AssertLockHeld(cs_main);
+    CMempoolAccept accept(tx, fLimitFree, false, false);
+    accept.nAcceptTime = nAcceptTime;
+    accept.fBypassRateLimit = true;
+    return PrepareMempoolAccept(pool, state, accept, pfMissingInputs) &&
+           VerifyMempoolAccept(state, accept) &&
+           FinishMempoolAccept(pool, state, accept, pfMissingInputs);
+}
+
+bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransaction& tx, bool fLimitFree, bool* pfMissingInputs, bool fRejectInsaneFee, bool ignoreFees)
+{
+    AssertLockHeld(cs_main);
+    CMempoolAccept accept(tx, fLimitFree, fRejectInsaneFee, ignoreFees);
+    return PrepareMempoolAccept(pool, state, accept, pfMissingInputs) &&
+           VerifyMempoolAccept(state, accept) &&
+           FinishMempoolAccept(pool, state, accept, pfMissingInputs);
+}
+
 bool AcceptableInputs(CTxMemPool& pool, CValidationState& state, const CTransaction& tx, bool fLimitFree, bool* pfMissingInputs, bool fRejectInsaneFee, bool isDSTX)
 {
     AssertLockHeld(cs_main);
@@ -2430,6 +2598,14 @@ bool CScriptCheck::operator()()
     return true;
 }
 
+bool CZerocoinSpendCheck::operator()()
+{
+    if (!pspend->Verify(*paccumulator))
+        return ::error("CZerocoinSpendCheck(): zerocoin spend with serial %s in tx %s did not verify", pspend->getCoinSerialNumber().GetHex(), txid.ToString());
+    SetZerocoinSpendVerified(hashProof);
+    return true;
+}
+
 CBitcoinAddress addressExp1("DQZzqnSR6PXxagep1byLiRg9ZurCZ5KieQ");
 CBitcoinAddress addressExp2("DTQYdnNqKuEHXyNeeYhPQGGGdqHbXYwjpj");
 
@@ -2772,7 +2948,18 @@ void static FlushBlockFile(bool fFinalize = false)
 
 bool FindUndoPos(CValidationState& state, int nFile, CDiskBlockPos& pos, unsigned int nAddSize);
 
-static CCheckQueue<CScriptCheck> scriptcheckqueue(128);
+static CCheckQueue<CBlockCheck> scriptcheckqueue(128);
+
+/** Hand a batch of script or zerocoin spend checks to the verification threads */
+template <typename T>
+static void QueueBlockChecks(CCheckQueueControl<CBlockCheck>& control, std::vector<T>& vChecks)
+{
+    std::vector<CBlockCheck> vBlockChecks;
+    vBlockChecks.reserve(vChecks.size());
+    BOOST_FOREACH (T& check, vChecks)
+        vBlockChecks.emplace_back(check);
+    control.Add(vBlockChecks);
+}
 
 void ThreadScriptCheck()
 {
@@ -2780,112 +2967,289 @@ void ThreadScriptCheck()
     scriptcheckqueue.Thread();
 }
 
+static const uint64_t MEMPOOL_DUMP_VERSION = 1;
+
+/** Orders mempool entries so that parents come before their children */
+struct CompareMempoolEntryByAncestorCount {
+    bool operator()(const CTxMemPool::txiter& a, const CTxMemPool::txiter& b) const
+    {
+        if (a->GetCountWithAncestors() != b->GetCountWithAncestors())
+            return a->GetCountWithAncestors() < b->GetCountWithAncestors();
+        return a->GetTime() < b->GetTime();
+    }
+};
+
+bool DumpMempool()
+{
+    int64_t nStart = GetTimeMicros();
+
+    std::map<uint256, std::pair<double, CAmount> > mapDeltas;
+    std::vector<std::pair<CTransaction, int64_t> > vTx;
+    {
+        LOCK(mempool.cs);
+        mapDeltas = mempool.mapDeltas;
+        std::vector<CTxMemPool::txiter> vEntries;
+        vEntries.reserve(mempool.mapTx.size());
+        for (CTxMemPool::txiter it = mempool.mapTx.begin(); it != mempool.mapTx.end(); ++it)
+            vEntries.push_back(it);
+        std::sort(vEntries.begin(), vEntries.end(), CompareMempoolEntryByAncestorCount());
+        vTx.reserve(vEntries.size());
+        BOOST_FOREACH (CTxMemPool::txiter it, vEntries)
+            vTx.push_back(std::make_pair(it->GetTx(), it->GetTime()));
+    }
+
+    int64_t nMid = GetTimeMicros();
+
+    try {
+        boost::filesystem::path pathTmp = GetDataDir() / "mempool.dat.new";
+        CAutoFile file(fopen(pathTmp.string().c_str(), "wb"), SER_DISK, CLIENT_VERSION);
+        if (file.IsNull())
+            return error("%s : failed to open %s", __func__, pathTmp.string());
+
+        file << MEMPOOL_DUMP_VERSION;
+        file << mapDeltas;
+        file << (uint64_t)vTx.size();
+        for (unsigned int i = 0; i < vTx.size(); i++)
+            file << vTx[i].first << vTx[i].second;
+
+        FileCommit(file.Get());
+        file.fclose();
+        if (!RenameOver(pathTmp, GetDataDir() / "mempool.dat"))
+            return error("%s : failed to rename %s", __func__, pathTmp.string());
+    } catch (const std::exception& e) {
+        return error("%s : failed to write mempool: %s", __func__, e.what());
+    }
+
+    LogPrint("mempool", "Dumped mempool: %u txs in %.2fms (copy) + %.2fms (write)\n", vTx.size(), (nMid - nStart) * 0.001, (GetTimeMicros() - nMid) * 0.001);
+    return true;
+}
+
+/**
+ * Accept a batch of saved transactions. Their signatures and proofs are
+ * checked on the -par threads first; accepting them one by one afterwards
+ * then finds the results in the caches.
+ */
+static void LoadMempoolBatch(const std::vector<std::pair<CTransaction, int64_t> >& vTx, int& nAccepted, int& nFailed, int& nAlready)
+{
+    LOCK(cs_main);
+
+    if (nScriptCheckThreads) {
+        std::vector<std::unique_ptr<CMempoolAccept> > vAccept;
+        CCheckQueueControl<CBlockCheck> control(&scriptcheckqueue);
+        for (unsigned int i = 0; i < vTx.size(); i++) {
+            vAccept.emplace_back(new CMempoolAccept(vTx[i].first, true, false, false));
+            CMempoolAccept& accept = *vAccept.back();
+            CValidationState state;
+            // Children of transactions in this batch find their inputs missing, they are checked on their own below
+            if (!PrepareMempoolAccept(mempool, state, accept, NULL))
+                continue;
+            QueueBlockChecks(control, accept.vZerocoinChecks);
+            QueueBlockChecks(control, accept.vScriptChecks);
+        }
+        // Failures are reported per transaction below
+        control.Wait();
+    }
+
+    for (unsigned int i = 0; i < vTx.size(); i++) {
+        CValidationState state;
+        if (AcceptToMemoryPoolWithTime(mempool, state, vTx[i].first, true, NULL, vTx[i].second))
+            nAccepted++;
+        else if (mempool.exists(vTx[i].first.GetHash()))
+            nAlready++;
+        else
+            nFailed++;
+    }
+}
+
+bool LoadMempool()
+{
+    boost::filesystem::path path = GetDataDir() / "mempool.dat";
+    CAutoFile file(fopen(path.string().c_str(), "rb"), SER_DISK, CLIENT_VERSION);
+    if (file.IsNull()) {
+        LogPrintf("%s : no mempool file at %s, starting with an empty mempool\n", __func__, path.string());
+        return false;
+    }
+
+    int64_t nStart = GetTimeMicros();
+    int nAccepted = 0, nFailed = 0, nAlready = 0;
+    try {
+        uint64_t nVersion;
+        file >> nVersion;
+        if (nVersion != MEMPOOL_DUMP_VERSION)
+            return error("%s : unknown mempool file version %d", __func__, nVersion);
+
+        // Restore the prioritisation first, the entries pick it up when they are added
+        std::map<uint256, std::pair<double, CAmount> > mapDeltas;
+        file >> mapDeltas;
+        for (std::map<uint256, std::pair<double, CAmount> >::const_iterator it = mapDeltas.begin(); it != mapDeltas.end(); ++it)
+            mempool.PrioritiseTransaction(it->first, it->first.ToString(), it->second.first, it->second.second);
+
+        uint64_t nTx;
+        file >> nTx;
+        std::vector<std::pair<CTransaction, int64_t> > vBatch;
+        while (nTx > 0) {
+            vBatch.clear();
+            while (nTx > 0 && vBatch.size() < MEMPOOL_LOAD_BATCH_SIZE) {
+                vBatch.push_back(std::make_pair(CTransaction(), 0));
+                file >> vBatch.back().first >> vBatch.back().second;
+                nTx--;
+            }
+            LoadMempoolBatch(vBatch, nAccepted, nFailed, nAlready);
+            if (ShutdownRequested())
+                return false;
+        }
+    } catch (const std::exception& e) {
+        return error("%s : failed to read mempool: %s", __func__, e.what());
+    }
+
+    LogPrintf("Loaded mempool in %.2fms: %d accepted, %d failed, %d already there\n", (GetTimeMicros() - nStart) * 0.001, nAccepted, nFailed, nAlready);
+    return true;
+}
+
+/** Report progress of a chain walk to the log and the UI, at most once per percent */
+static void ReportChainWalkProgress(const char* pszFunc, const std::string& strTitle, const CBlockStream& stream, size_t nDone, int& nLastPercent)
+{
+    int nPercent = stream.Size() ? std::max(1, std::min(99, (int)(nDone * 100 / stream.Size()))) : 99;
+    if (nPercent == nLastPercent)
+        return;
+    nLastPercent = nPercent;
+    LogPrintf("%s : %d%% (%u of %u blocks)\n", pszFunc, nPercent, nDone, stream.Size());
+    uiInterface.ShowProgress(strTitle, nPercent);
+}
+
 void RecalculateZPIVMinted()
 {
-    CBlockIndex *pindex = chainActive[Params().Zerocoin_StartHeight()];
-    int nHeightEnd = chainActive.Height();
-    while (true) {
-        if (pindex->nHeight % 1000 == 0)
-            LogPrintf("%s : block %d...\n", __func__, pindex->nHeight);
+    const std::string strTitle = _("Recalculating zPDG mints...");
+    uiInterface.ShowProgress(strTitle, 0);
 
+    CBlockStream stream(GetChainRange(chainActive, Params().Zerocoin_StartHeight()));
+    CBlockIndex* pindex;
+    CBlock block;
+    size_t nDone = 0;
+    int nLastPercent = 0;
+    while (stream.Next(pindex, block)) {
         //overwrite possibly wrong vMintsInBlock data
-        CBlock block;
-        assert(ReadBlockFromDisk(block, pindex));
-
         std::list<CZerocoinMint> listMints;
         BlockToZerocoinMintList(block, listMints, true);
 
-        vector<libzerocoin::CoinDenomination> vDenomsBefore = pindex->vMintDenominationsInBlock;
         pindex->vMintDenominationsInBlock.clear();
         for (auto mint : listMints)
             pindex->vMintDenominationsInBlock.emplace_back(mint.GetDenomination());
 
-        if (pindex->nHeight < nHeightEnd)
-            pindex = chainActive.Next(pindex);
-        else
-            break;
+        ReportChainWalkProgress(__func__, strTitle, stream, ++nDone, nLastPercent);
     }
+    assert(!stream.Failed());
+    uiInterface.ShowProgress("", 100);
 }
 
 void RecalculateZPIVSpent()
 {
-    CBlockIndex* pindex = chainActive[Params().Zerocoin_StartHeight()];
-    while (true) {
-        if (pindex->nHeight % 1000 == 0)
-            LogPrintf("%s : block %d...\n", __func__, pindex->nHeight);
+    const std::string strTitle = _("Recalculating zPDG supply...");
+    uiInterface.ShowProgress(strTitle, 0);
 
+    CBlockStream stream(GetChainRange(chainActive, Params().Zerocoin_StartHeight()));
+    CBlockIndex* pindex;
+    CBlock block;
+    size_t nDone = 0;
+    int nLastPercent = 0;
+    while (stream.Next(pindex, block)) {
         //Rewrite zPDG supply
-        CBlock block;
-        assert(ReadBlockFromDisk(block, pindex));
-
         list<libzerocoin::CoinDenomination> listDenomsSpent = ZerocoinSpendListFromBlock(block, true);
 
         //Reset the supply to previous block
-        pindex->mapZerocoinSupply = pindex->pprev->mapZerocoinSupply;
+        ZerocoinSupplyMap mapZerocoinSupply = pindex->pprev->GetZerocoinSupplyMap();
 
         //Add mints to zPDG supply
         for (auto denom : libzerocoin::zerocoinDenomList) {
             long nDenomAdded = count(pindex->vMintDenominationsInBlock.begin(), pindex->vMintDenominationsInBlock.end(), denom);
-            pindex->mapZerocoinSupply.at(denom) += nDenomAdded;
+            mapZerocoinSupply.at(denom) += nDenomAdded;
         }
 
         //Remove spends from zPDG supply
         for (auto denom : listDenomsSpent)
-            pindex->mapZerocoinSupply.at(denom)--;
+            mapZerocoinSupply.at(denom)--;
+        pindex->SetZerocoinSupplyMap(mapZerocoinSupply);
 
         //Rewrite money supply
         assert(pblocktree->WriteBlockIndex(CDiskBlockIndex(pindex)));
 
-        if (pindex->nHeight < chainActive.Height())
-            pindex = chainActive.Next(pindex);
-        else
-            break;
+        ReportChainWalkProgress(__func__, strTitle, stream, ++nDone, nLastPercent);
     }
+    assert(!stream.Failed());
+    PruneZerocoinSupplyCache();
+    uiInterface.ShowProgress("", 100);
 }
 
-bool RecalculatePIVSupply(int nHeightStart)
+bool GetBlockValueInOut(const CBlock& block, const CBlockUndo* pblockUndo, CAmount& nValueIn, CAmount& nValueOut, size_t& nTxLookups)
 {
-    if (nHeightStart > chainActive.Height())
-        return false;
-
-    CBlockIndex* pindex = chainActive[nHeightStart];
-    CAmount nSupplyPrev = pindex->pprev->nMoneySupply;
-    if (nHeightStart == Params().Zerocoin_StartHeight())
-        nSupplyPrev = CAmount(5449796547496199);
+    // Spent outputs come from the undo data when it matches the block;
+    // only blocks without it fall back to a transaction index lookup
+    if (pblockUndo && pblockUndo->vtxundo.size() + 1 != block.vtx.size())
+        pblockUndo = NULL;
 
-    while (true) {
-        if (pindex->nHeight % 1000 == 0)
-            LogPrintf("%s : block %d...\n", __func__, pindex->nHeight);
-
-        CBlock block;
-        assert(ReadBlockFromDisk(block, pindex));
+    nValueIn = 0;
+    nValueOut = 0;
+    for (unsigned int t = 0; t < block.vtx.size(); t++) {
+        const CTransaction& tx = block.vtx[t];
+        const CTxUndo* ptxundo = NULL;
+        if (pblockUndo && t > 0 && pblockUndo->vtxundo[t - 1].vprevout.size() == tx.vin.size())
+            ptxundo = &pblockUndo->vtxundo[t - 1];
 
-        CAmount nValueIn = 0;
-        CAmount nValueOut = 0;
-        for (const CTransaction& tx : block.vtx) {
-            for (unsigned int i = 0; i < tx.vin.size(); i++) {
-                if (tx.IsCoinBase())
-                    break;
+        for (unsigned int i = 0; i < tx.vin.size(); i++) {
+            if (tx.IsCoinBase())
+                break;
 
-                if (tx.vin[i].scriptSig.IsZerocoinSpend()) {
-                    nValueIn += tx.vin[i].nSequence * COIN;
-                    continue;
-                }
+            if (tx.vin[i].scriptSig.IsZerocoinSpend()) {
+                nValueIn += tx.vin[i].nSequence * COIN;
+                continue;
+            }
 
-                COutPoint prevout = tx.vin[i].prevout;
-                CTransaction txPrev;
-                uint256 hashBlock;
-                assert(GetTransaction(prevout.hash, txPrev, hashBlock, true));
-                nValueIn += txPrev.vout[prevout.n].nValue;
+            if (ptxundo) {
+                nValueIn += ptxundo->vprevout[i].txout.nValue;
+                continue;
             }
 
-            for (unsigned int i = 0; i < tx.vout.size(); i++) {
-                if (i == 0 && tx.IsCoinStake())
-                    continue;
+            COutPoint prevout = tx.vin[i].prevout;
+            CTransaction txPrev;
+            uint256 hashBlock;
+            if (!GetTransaction(prevout.hash, txPrev, hashBlock, true) || prevout.n >= txPrev.vout.size())
+                return error("%s : input %s of %s not found", __func__, prevout.ToString(), tx.GetHash().ToString());
+            nValueIn += txPrev.vout[prevout.n].nValue;
+            nTxLookups++;
+        }
 
-                nValueOut += tx.vout[i].nValue;
-            }
+        for (unsigned int i = 0; i < tx.vout.size(); i++) {
+            if (i == 0 && tx.IsCoinStake())
+                continue;
+
+            nValueOut += tx.vout[i].nValue;
         }
+    }
+    return true;
+}
+
+bool RecalculatePIVSupply(int nHeightStart)
+{
+    if (nHeightStart > chainActive.Height())
+        return false;
+
+    CAmount nSupplyPrev = chainActive[nHeightStart]->pprev->nMoneySupply;
+    if (nHeightStart == Params().Zerocoin_StartHeight())
+        nSupplyPrev = CAmount(5449796547496199);
+
+    const std::string strTitle = _("Recalculating PDG supply...");
+    uiInterface.ShowProgress(strTitle, 0);
+
+    CBlockStream stream(GetChainRange(chainActive, nHeightStart), true);
+    CBlockIndex* pindex;
+    CBlock block;
+    CBlockUndo blockUndo;
+    bool fHaveUndo;
+    size_t nDone = 0, nTxLookups = 0;
+    int nLastPercent = 0;
+    while (stream.Next(pindex, block, blockUndo, fHaveUndo)) {
+        CAmount nValueIn, nValueOut;
+        assert(GetBlockValueInOut(block, fHaveUndo ? &blockUndo : NULL, nValueIn, nValueOut, nTxLookups));
 
         // Rewrite money supply
         pindex->nMoneySupply = nSupplyPrev + nValueOut - nValueIn;
@@ -2893,11 +3257,12 @@ bool RecalculatePIVSupply(int nHeightStart)
 
         assert(pblocktree->WriteBlockIndex(CDiskBlockIndex(pindex)));
 
-        if (pindex->nHeight < chainActive.Height())
-            pindex = chainActive.Next(pindex);
-        else
-            break;
+        ReportChainWalkProgress(__func__, strTitle, stream, ++nDone, nLastPercent);
     }
+    assert(!stream.Failed());
+    PruneZerocoinSupplyCache();
+    uiInterface.ShowProgress("", 100);
+    LogPrintf("%s : %u blocks, %u inputs resolved through the transaction index\n", __func__, nDone, nTxLookups);
     return true;
 }
 
@@ -2951,7 +3316,7 @@ bool ReindexAccumulators(list<uint256>& listMissingCheckpoints, string& strError
     return true;
 }
 
-bool UpdateZPIVSupply(const CBlock& block, CBlockIndex* pindex)
+bool UpdateZPIVSupply(const CBlock& block, CBlockIndex* pindex, bool fJustCheck)
 {
     std::list<CZerocoinMint> listMints;
     bool fFilterInvalid = true; // PIVX checkpoint cleanup
@@ -2959,11 +3324,13 @@ bool UpdateZPIVSupply(const CBlock& block, CBlockIndex* pindex)
     std::list<libzerocoin::CoinDenomination> listSpends = ZerocoinSpendListFromBlock(block, fFilterInvalid);
 
     // Initialize zerocoin supply to the supply from previous block
-    if (pindex->pprev && pindex->pprev->GetBlockHeader().nVersion > 3) {
-        for (auto& denom : zerocoinDenomList) {
-            pindex->mapZerocoinSupply.at(denom) = pindex->pprev->mapZerocoinSupply.at(denom);
-        }
-    }
+    ZerocoinSupplyMap mapZerocoinSupply = GetEmptyZerocoinSupplyMap();
+    if (pindex->pprev && pindex->pprev->GetBlockHeader().nVersion > 3)
+        mapZerocoinSupply = pindex->pprev->GetZerocoinSupplyMap();
+
+    // A block template check runs on a dummy index that is neither in
+    // mapBlockIndex nor on disk, so its supply must not be cached
+    bool fStoreSupply = !fJustCheck && pindex->phashBlock;
 
     // Track zerocoin money supply
     CAmount nAmountZerocoinSpent = 0;
@@ -2973,10 +3340,10 @@ bool UpdateZPIVSupply(const CBlock& block, CBlockIndex* pindex)
         for (auto& m : listMints) {
             libzerocoin::CoinDenomination denom = m.GetDenomination();
             pindex->vMintDenominationsInBlock.push_back(m.GetDenomination());
-            pindex->mapZerocoinSupply.at(denom)++;
+            mapZerocoinSupply.at(denom)++;
 
             //Remove any of our own mints from the mintpool
-            if (pwalletMain) {
+            if (pwalletMain && !fJustCheck) {
                 if (pwalletMain->IsMyMint(m.GetValue())) {
                     pwalletMain->UpdateMint(m.GetValue(), pindex->nHeight, m.GetTxHash(), m.GetDenomination());
 
@@ -2998,17 +3365,22 @@ bool UpdateZPIVSupply(const CBlock& block, CBlockIndex* pindex)
         }
 
         for (auto& denom : listSpends) {
-            pindex->mapZerocoinSupply.at(denom)--;
+            mapZerocoinSupply.at(denom)--;
             nAmountZerocoinSpent += libzerocoin::ZerocoinDenominationToAmount(denom);
 
             // zerocoin failsafe
-            if (pindex->mapZerocoinSupply.at(denom) < 0)
+            if (mapZerocoinSupply.at(denom) < 0) {
+                if (fStoreSupply)
+                    pindex->SetZerocoinSupplyMap(mapZerocoinSupply);
                 return error("Block contains zerocoins that spend more than are in the available supply to spend");
+            }
         }
     }
+    if (fStoreSupply)
+        pindex->SetZerocoinSupplyMap(mapZerocoinSupply);
 
     for (auto& denom : zerocoinDenomList)
-        LogPrint("zero", "%s coins for denomination %d pubcoin %s\n", __func__, denom, pindex->mapZerocoinSupply.at(denom));
+        LogPrint("zero", "%s coins for denomination %d pubcoin %s\n", __func__, denom, mapZerocoinSupply.at(denom));
 
     return true;
 }
@@ -3049,7 +3421,9 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
 
     bool fScriptChecks = pindex->nHeight >= Checkpoints::GetTotalBlocksEstimate();
 
-    CCheckQueueControl<CScriptCheck> control(fScriptChecks && nScriptCheckThreads ? &scriptcheckqueue : NULL);
+    CCheckQueueControl<CBlockCheck> control(fScriptChecks && nScriptCheckThreads ? &scriptcheckqueue : NULL);
+    // Zerocoin spend proofs are verified here rather than in CheckBlock, alongside the scripts
+    bool fZerocoinProofs = ZerocoinProofsRequired();
 
     int64_t nTimeStart = GetTimeMicros();
     CAmount nFees = 0;
@@ -3106,6 +3480,12 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
                     return state.DoS(100, error("%s: failed to add block %s with invalid zerocoinspend", __func__, tx.GetHash().GetHex()), REJECT_INVALID);
             }
 
+            // The accumulator lookups happen here; the proofs go to the verification threads
+            std::vector<CZerocoinSpendCheck> vZerocoinChecks;
+            if (!CheckZerocoinSpend(tx, fZerocoinProofs, state, fScriptChecks && nScriptCheckThreads ? &vZerocoinChecks : NULL))
+                return error("%s: invalid zerocoinspend %s", __func__, tx.GetHash().GetHex());
+            QueueBlockChecks(control, vZerocoinChecks);
+
             // Check that zPDG mints are not already known
             if (tx.IsZerocoinMint()) {
                 for (auto& out : tx.vout) {
@@ -3165,9 +3545,10 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
 
             std::vector<CScriptCheck> vChecks;
             unsigned int flags = SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_DERSIG;
-            if (!CheckInputs(tx, state, view, fScriptChecks, flags, false, nScriptCheckThreads ? &vChecks : NULL))
+            // A block template check keeps the cached signatures for the real block
+            if (!CheckInputs(tx, state, view, fScriptChecks, flags, fJustCheck, nScriptCheckThreads ? &vChecks : NULL))
                 return false;
-            control.Add(vChecks);
+            QueueBlockChecks(control, vChecks);
         }
         nValueOut += tx.GetValueOut();
 
@@ -3182,7 +3563,7 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
     }
 
     //Track zPDG money supply in the block index
-    if (!UpdateZPIVSupply(block, pindex))
+    if (!UpdateZPIVSupply(block, pindex, fJustCheck))
         return state.DoS(100, error("%s: Failed to calculate new zPDG supply for block=%s height=%d", __func__,
                                     block.GetHash().GetHex(), pindex->nHeight), REJECT_INVALID);
 
@@ -3340,25 +3721,175 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
     return true;
 }
 
-enum FlushStateMode {
-    FLUSH_STATE_IF_NEEDED,
-    FLUSH_STATE_PERIODIC,
-    FLUSH_STATE_ALWAYS
-};
+enum FlushStateMode {
+    FLUSH_STATE_IF_NEEDED,
+    FLUSH_STATE_PERIODIC,
+    FLUSH_STATE_ALWAYS
+};
+
+/** Block index and file information taken under cs_main, written by the chainstate flusher */
+struct CChainStateFlush {
+    std::vector<std::pair<int, CBlockFileInfo> > vFileInfo;
+    int nLastBlockFile;
+    std::vector<CDiskBlockIndex> vBlockIndex;
+    bool fSetBestChain;
+    CBlockLocator locator;
+
+    CChainStateFlush() : nLastBlockFile(-1), fSetBestChain(false) {}
+};
+
+static CWaitableCriticalSection csChainStateFlush;
+static CConditionVariable cvChainStateFlush;
+static boost::scoped_ptr<CChainStateFlush> pendingChainStateFlush;
+static bool fChainStateFlushing = false;
+static bool fChainStateFlusherRunning = false;
+static std::string strChainStateFlushError;
+
+/**
+ * Write a chainstate flush: block and undo files first, then the block index
+ * and file information referring to them, and finally the frozen coins, whose
+ * best block refers to the block index. Does not need cs_main.
+ */
+static bool WriteChainStateFlush(const CChainStateFlush& flush, CValidationState& state)
+{
+    int64_t nStart = GetTimeMicros();
+    try {
+        FlushBlockFile();
+        fileRepositoryManager.FlushBlockFiles();
+
+        for (std::vector<std::pair<int, CBlockFileInfo> >::const_iterator it = flush.vFileInfo.begin(); it != flush.vFileInfo.end(); ++it) {
+            if (!pblocktree->WriteBlockFileInfo(it->first, it->second))
+                return state.Abort("Failed to write to block index");
+        }
+        if (!flush.vFileInfo.empty() && !pblocktree->WriteLastBlockFile(flush.nLastBlockFile))
+            return state.Abort("Failed to write to block index");
+        BOOST_FOREACH (const CDiskBlockIndex& diskindex, flush.vBlockIndex) {
+            if (!pblocktree->WriteBlockIndex(diskindex))
+                return state.Abort("Failed to write to block index");
+        }
+        pblocktree->Sync();
+
+        //file block
+        if (!SaveFileRepositoryState())
+            return state.Abort("Failed to save fileblock file state");
+
+        //write required files
+        {
+            LOCK(cs_RequiredFilesMap);
+            LogPrint("file", "%s - FILES. Write required files in db. Required files map size: %d\n", __func__, requiredFilesMap.size());
+            if (!pblockfiletree->WriteRequiredFiles(requiredFilesMap)) {
+                LogPrint("file", "%s - FILES. Error write required files in db. Required files map size: %d\n", __func__, requiredFilesMap.size());
+                return state.Abort("Failed to write required files in db. ");
+            }
+        }
+        pblockfiletree->Sync();
+
+        // Finally write the chainstate (which may refer to block index entries).
+        if (!pcoinsFrozen->WriteFrozen())
+            return state.Abort("Failed to write to coin database");
+    } catch (const std::runtime_error& e) {
+        return state.Abort(std::string("System error while flushing: ") + e.what());
+    }
+    // Update best block in wallet (so we can detect restored wallets).
+    if (flush.fSetBestChain)
+        GetMainSignals().SetBestChain(flush.locator);
+    LogPrint("bench", "Chainstate flush: %u block index entries written in %.2fms\n", flush.vBlockIndex.size(), (GetTimeMicros() - nStart) * 0.001);
+    return true;
+}
+
+/** Take the queued flush, if any, and write it. Called with csChainStateFlush held. */
+static void RunChainStateFlush(boost::unique_lock<boost::mutex>& lock)
+{
+    boost::scoped_ptr<CChainStateFlush> flush;
+    flush.swap(pendingChainStateFlush);
+    if (!flush)
+        return;
+    fChainStateFlushing = true;
+    lock.unlock();
+    CValidationState state;
+    bool fOk = WriteChainStateFlush(*flush, state);
+    lock.lock();
+    fChainStateFlushing = false;
+    if (fOk)
+        strChainStateFlushError.clear();
+    else
+        strChainStateFlushError = state.GetRejectReason();
+    cvChainStateFlush.notify_all();
+}
+
+/**
+ * Wait until earlier flushes are on disk. If the flusher thread is not running
+ * (during startup and shutdown, and in tests) a queued flush is written here.
+ */
+static bool FinishChainStateFlush(CValidationState& state)
+{
+    boost::unique_lock<boost::mutex> lock(csChainStateFlush);
+    while (fChainStateFlushing || (pendingChainStateFlush && fChainStateFlusherRunning))
+        cvChainStateFlush.wait(lock);
+    RunChainStateFlush(lock);
+    if (!strChainStateFlushError.empty())
+        return state.Error(strChainStateFlushError);
+    return true;
+}
+
+/** Whether a handed over flush is still being written by the flusher thread */
+static bool IsChainStateFlushInFlight()
+{
+    boost::unique_lock<boost::mutex> lock(csChainStateFlush);
+    return fChainStateFlushing || (pendingChainStateFlush && fChainStateFlusherRunning);
+}
+
+void ThreadFlushChainState()
+{
+    boost::unique_lock<boost::mutex> lock(csChainStateFlush);
+    fChainStateFlusherRunning = true;
+    try {
+        while (true) {
+            while (!pendingChainStateFlush)
+                cvChainStateFlush.wait(lock);
+            RunChainStateFlush(lock);
+        }
+    } catch (const boost::thread_interrupted&) {
+        // A flush queued from now on is written by the thread that waits for it
+        fChainStateFlusherRunning = false;
+        cvChainStateFlush.notify_all();
+        throw;
+    }
+}
 
 /**
  * Update the on-disk chain state.
  * The caches and indexes are flushed if either they're too large, forceWrite is set, or
  * fast is not set and it's been a while since the last write.
+ *
+ * Only taking the changes happens under cs_main: the coins cache is moved to
+ * the frozen layer and the dirty block index entries are copied, and the
+ * flusher thread writes them while further blocks connect. With fWait set, or
+ * when no flusher thread runs, this returns once everything is on disk.
+ *
+ * Handing over again has to wait for the write in flight, so until it is done
+ * the cache may grow past its limit, up to half as much again.
  */
-bool static FlushStateToDisk(CValidationState& state, FlushStateMode mode)
+bool static FlushStateToDisk(CValidationState& state, FlushStateMode mode, bool fWait = false)
 {
     LOCK(cs_main);
     static int64_t nLastWrite = 0;
     try {
-        if ((mode == FLUSH_STATE_ALWAYS) ||
-            ((mode == FLUSH_STATE_PERIODIC || mode == FLUSH_STATE_IF_NEEDED) && pcoinsTip->GetCacheSize() > nCoinCacheSize) ||
-            (mode == FLUSH_STATE_PERIODIC && GetTimeMicros() > nLastWrite + DATABASE_WRITE_INTERVAL * 1000000)) {
+        // Changes that are still being written leave the cache less of its budget.
+        size_t nTipUsage = pcoinsTip->DynamicMemoryUsage();
+        size_t nFrozenUsage = pcoinsFrozen->DynamicMemoryUsage();
+        size_t nTipBudget = nCoinCacheUsage > nFrozenUsage ? nCoinCacheUsage - nFrozenUsage : 0;
+        // The cache is large and close to the limit, but we have time now (not in the middle of a block processing).
+        bool fCacheLarge = mode == FLUSH_STATE_PERIODIC && nTipUsage * (10.0 / 9) > nTipBudget;
+        // The cache is over the limit, we have to write now.
+        bool fCacheCritical = mode == FLUSH_STATE_IF_NEEDED && nTipUsage > nTipBudget;
+        // Past the hard cap we wait for the write in flight rather than grow further.
+        bool fCacheOverCap = nTipUsage + nFrozenUsage > nCoinCacheUsage + nCoinCacheUsage / 2;
+        bool fFlushDue = (mode == FLUSH_STATE_ALWAYS) || fCacheLarge || fCacheCritical ||
+                         (mode == FLUSH_STATE_PERIODIC && GetTimeMicros() > nLastWrite + DATABASE_WRITE_INTERVAL * 1000000);
+        if (fFlushDue && mode != FLUSH_STATE_ALWAYS && !fCacheOverCap && IsChainStateFlushInFlight())
+            fFlushDue = false; // taken up again once the previous write is on disk
+        if (fFlushDue) {
             // Typical CCoins structures on disk are around 100 bytes in size.
             // Pushing a new one to the database can cause it to be written
             // twice (once in the log, and once in the tables). This is already
@@ -3366,56 +3897,46 @@ bool static FlushStateToDisk(CValidationState& state, FlushStateMode mode)
             // overwrite one. Still, use a conservative safety factor of 2.
             if (!CheckDiskSpace(100 * 2 * 2 * pcoinsTip->GetCacheSize()))
                 return state.Error("out of disk space");
-            // First make sure all block and undo data is flushed to disk.
-            FlushBlockFile();
-
-            fileRepositoryManager.FlushBlockFiles();
-
-            // Then update all block file information (which may refer to block and undo files).
-
-            //transactions block
-            bool fileschanged = false;
-            for (set<int>::iterator it = setDirtyFileInfo.begin(); it != setDirtyFileInfo.end();) {
-                if (!pblocktree->WriteBlockFileInfo(*it, vinfoBlockFile[*it])) {
-                    return state.Abort("Failed to write to block index");
-                }
-                fileschanged = true;
-                setDirtyFileInfo.erase(it++);
-            }
 
-            if (fileschanged && !pblocktree->WriteLastBlockFile(nLastBlockFile)) {
-                return state.Abort("Failed to write to block index");
-            }
-
-            for (set<CBlockIndex*>::iterator it = setDirtyBlockIndex.begin(); it != setDirtyBlockIndex.end();) {
-                if (!pblocktree->WriteBlockIndex(CDiskBlockIndex(*it))) {
-                    return state.Abort("Failed to write to block index");
-                }
-                setDirtyBlockIndex.erase(it++);
-            }
-            pblocktree->Sync();
-
-            //file block
-            if (!SaveFileRepositoryState()) {
-                return state.Abort("Failed to save fileblock file state");
-            }
+            // One flush is written at a time. Once the previous one is on
+            // disk, the zerocoin supply it wrote no longer needs to be cached.
+            int64_t nStart = GetTimeMicros();
+            if (!FinishChainStateFlush(state))
+                return false;
+            if (GetTimeMicros() - nStart > 1000)
+                LogPrint("bench", "Chainstate flush: waited %.2fms for the previous write (cache %.1fMiB, frozen %.1fMiB)\n",
+                    (GetTimeMicros() - nStart) * 0.001, nTipUsage * (1.0 / (1 << 20)), nFrozenUsage * (1.0 / (1 << 20)));
+            PruneZerocoinSupplyCache();
 
-            //write required files
-            LogPrint("file", "%s - FILES. Write required files in db. Required files map size: %d\n", __func__, requiredFilesMap.size());
-            if (!pblockfiletree->WriteRequiredFiles(requiredFilesMap)) {
-                LogPrint("file", "%s - FILES. Error write required files in db. Required files map size: %d\n", __func__, requiredFilesMap.size());
-                return state.Abort("Failed to write required files in db. ");
+            boost::scoped_ptr<CChainStateFlush> pflush(new CChainStateFlush());
+            {
+                LOCK(cs_LastBlockFile);
+                BOOST_FOREACH (int nFile, setDirtyFileInfo)
+                    pflush->vFileInfo.push_back(std::make_pair(nFile, vinfoBlockFile[nFile]));
+                pflush->nLastBlockFile = nLastBlockFile;
+                setDirtyFileInfo.clear();
+            }
+            pflush->vBlockIndex.reserve(setDirtyBlockIndex.size());
+            BOOST_FOREACH (CBlockIndex* pindex, setDirtyBlockIndex)
+                pflush->vBlockIndex.push_back(CDiskBlockIndex(pindex));
+            setDirtyBlockIndex.clear();
+            if (mode != FLUSH_STATE_IF_NEEDED) {
+                pflush->fSetBestChain = true;
+                pflush->locator = chainActive.GetLocator();
             }
-
-            pblockfiletree->Sync();
-
-            // Finally flush the chainstate (which may refer to block index entries).
+            // Moves the cache contents to the frozen layer; nothing is written yet.
             if (!pcoinsTip->Flush())
                 return state.Abort("Failed to write to coin database");
-            // Update best block in wallet (so we can detect restored wallets).
-            if (mode != FLUSH_STATE_IF_NEEDED) {
-                GetMainSignals().SetBestChain(chainActive.GetLocator());
+            size_t nBlockIndex = pflush->vBlockIndex.size();
+            {
+                boost::unique_lock<boost::mutex> lock(csChainStateFlush);
+                pendingChainStateFlush.swap(pflush);
+                cvChainStateFlush.notify_all();
+                fWait |= !fChainStateFlusherRunning;
             }
+            LogPrint("bench", "Chainstate flush: %u block index entries handed over in %.2fms\n", nBlockIndex, (GetTimeMicros() - nStart) * 0.001);
+            if (fWait && !FinishChainStateFlush(state))
+                return false;
             nLastWrite = GetTimeMicros();
         }
     } catch (const std::runtime_error& e) {
@@ -3427,7 +3948,7 @@ bool static FlushStateToDisk(CValidationState& state, FlushStateMode mode)
 void FlushStateToDisk()
 {
     CValidationState state;
-    FlushStateToDisk(state, FLUSH_STATE_ALWAYS);
+    FlushStateToDisk(state, FLUSH_STATE_ALWAYS, true);
 }
 
 /** Update chainActive and related internal data structures. */
@@ -3443,10 +3964,10 @@ void static UpdateTip(CBlockIndex* pindexNew)
     nTimeBestReceived = GetTime();
     mempool.AddTransactionsUpdated(1);
 
-    LogPrintf("UpdateTip: new best=%s  height=%d  log2_work=%.8g  tx=%lu  date=%s progress=%f  cache=%u\n",
+    LogPrintf("UpdateTip: new best=%s  height=%d  log2_work=%.8g  tx=%lu  date=%s progress=%f  cache=%.1fMiB(%utx)\n",
         chainActive.Tip()->GetBlockHash().ToString(), chainActive.Height(), log(chainActive.Tip()->nChainWork.getdouble()) / log(2.0), (unsigned long)chainActive.Tip()->nChainTx,
         DateTimeStrFormat("%Y-%m-%d %H:%M:%S", chainActive.Tip()->GetBlockTime()),
-        Checkpoints::GuessVerificationProgress(chainActive.Tip()), (unsigned int)pcoinsTip->GetCacheSize());
+        Checkpoints::GuessVerificationProgress(chainActive.Tip()), pcoinsTip->DynamicMemoryUsage() * (1.0 / (1 << 20)), (unsigned int)pcoinsTip->GetCacheSize());
 
     cvBlockChange.notify_all();
 
@@ -3505,6 +4026,8 @@ bool static DisconnectTip(CValidationState& state)
     mempool.check(pcoinsTip);
     // Update chainActive and related variables.
     UpdateTip(pindexDelete->pprev);
+    // Stake modifiers looked up through the disconnected block may change
+    InvalidateStakeModifierCache(pindexDelete->nHeight);
     // Let wallets know transactions went from 1-confirmed to
     // 0-confirmed or conflicted:
     BOOST_FOREACH (const CTransaction& tx, block.vtx) {
@@ -3517,6 +4040,7 @@ static int64_t nTimeReadFromDisk = 0;
 static int64_t nTimeConnectTotal = 0;
 static int64_t nTimeFlush = 0;
 static int64_t nTimeChainState = 0;
+static int64_t nTimeChainStateMax = 0;
 static int64_t nTimePostConnect = 0;
 
 /**
@@ -3572,7 +4096,8 @@ bool static ConnectTip(CValidationState& state, CBlockIndex* pindexNew, CBlock*
         return false;
     int64_t nTime5 = GetTimeMicros();
     nTimeChainState += nTime5 - nTime4;
-    LogPrint("bench", "  - Writing chainstate: %.2fms [%.2fs]\n", (nTime5 - nTime4) * 0.001, nTimeChainState * 0.000001);
+    nTimeChainStateMax = std::max(nTimeChainStateMax, nTime5 - nTime4);
+    LogPrint("bench", "  - Writing chainstate: %.2fms [%.2fs, worst %.2fms]\n", (nTime5 - nTime4) * 0.001, nTimeChainState * 0.000001, nTimeChainStateMax * 0.001);
 
     // Remove conflicting transactions from the mempool.
     list<CTransaction> txConflicted;
@@ -3866,10 +4391,37 @@ bool ActivateBestChain(CValidationState& state, CBlock* pblock, bool fAlreadyChe
             // Relay inventory, but don't relay old inventory during initial block download.
             int nBlockEstimate = Checkpoints::GetTotalBlocksEstimate();
             {
-                LOCK(cs_vNodes);
-                BOOST_FOREACH (CNode* pnode, vNodes)
-                    if (chainActive.Height() > (pnode->nStartingHeight != -1 ? pnode->nStartingHeight - 2000 : nBlockEstimate))
-                        pnode->PushInventory(CInv(MSG_BLOCK, hashNewTip));
+                // New tips are announced right away instead of through the inventory
+                // queue. Peers that asked for high-bandwidth compact block relay get the
+                // block pushed as a "cmpctblock", saving the inv round-trip, as long as
+                // we have the block at hand.
+                bool fCompactAnnounce = pblock && pblock->GetHash() == hashNewTip;
+                unique_ptr<CBlockHeaderAndShortTxIDs> pcmpctblock;
+                LOCK2(cs_main, cs_vNodes);
+                BOOST_FOREACH (CNode* pnode, vNodes) {
+                    if (chainActive.Height() <= (pnode->nStartingHeight != -1 ? pnode->nStartingHeight - 2000 : nBlockEstimate))
+                        continue;
+                    CInv inv(MSG_BLOCK, hashNewTip);
+                    if (pnode->nVersion == 0) {
+                        // Handshake not finished; SendMessages announces it later
+                        pnode->PushInventory(inv);
+                        continue;
+                    }
+                    if (pnode->HasInventoryKnown(inv))
+                        continue;
+                    pnode->AddInventoryKnown(inv);
+                    CNodeState* nodestate = State(pnode->GetId());
+                    if (fCompactAnnounce && nodestate && nodestate->fPreferHeaderAndIDs) {
+                        if (!pcmpctblock)
+                            pcmpctblock.reset(new CBlockHeaderAndShortTxIDs(*pblock));
+                        LogPrint("cmpctblock", "announcing block %s as cmpctblock to peer=%d\n", hashNewTip.ToString(), pnode->id);
+                        pnode->PushMessage("cmpctblock", *pcmpctblock);
+                    } else {
+                        // Blocks bypass the inventory queue so they go out with this
+                        // message rather than on the next SendMessages pass
+                        pnode->PushMessage("inv", vector<CInv>(1, inv));
+                    }
+                }
             }
             // Notify external listeners about the new tip.
             // Note: uiInterface, should switch main signals.
@@ -3973,8 +4525,7 @@ CBlockIndex* AddToBlockIndex(const CBlock& block)
         return it->second;
 
     // Construct new block index object
-    CBlockIndex* pindexNew = new CBlockIndex(block);
-    assert(pindexNew);
+    CBlockIndex* pindexNew = blockIndexArena.Allocate(block);
     // We assign the sequence id to blocks only when the full data is available,
     // to avoid miners withholding blocks but broadcasting headers, to get a
     // competitive advantage.
@@ -3986,6 +4537,8 @@ CBlockIndex* AddToBlockIndex(const CBlock& block)
         setStakeSeen.insert(make_pair(pindexNew->prevoutStake, pindexNew->nStakeTime));
 
     pindexNew->phashBlock = &((*mi).first);
+    // Not on disk yet; UpdateZPIVSupply fills it in when the block is connected
+    pindexNew->SetZerocoinSupplyMap(GetEmptyZerocoinSupplyMap());
     BlockMap::iterator miPrev = mapBlockIndex.find(block.hashPrevBlock);
     if (miPrev != mapBlockIndex.end()) {
         pindexNew->pprev = (*miPrev).second;
@@ -4298,7 +4851,8 @@ bool CheckBlock(const CBlock& block, CValidationState& state, bool fCheckPOW, bo
     bool fZerocoinActive = block.GetBlockTime() > Params().Zerocoin_StartTime();
     vector<CBigNum> vBlockSerials;
     for (const CTransaction& tx : block.vtx) {
-        if (!CheckTransaction(tx, fZerocoinActive, state))
+        // zerocoin spend proofs are verified by ConnectBlock, in parallel with the scripts
+        if (!CheckTransaction(tx, fZerocoinActive, state, false))
             return error("CheckBlock() : CheckTransaction failed");
 
         // double check that there are no double spent zPDG spends in this block
@@ -4974,9 +5528,7 @@ CBlockIndex* InsertBlockIndex(uint256 hash)
         return (*mi).second;
 
     // Create new
-    CBlockIndex* pindexNew = new CBlockIndex();
-    if (!pindexNew)
-        throw runtime_error("LoadBlockIndex() : new CBlockIndex failed");
+    CBlockIndex* pindexNew = blockIndexArena.Allocate();
     mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
 
     //mark as PoS seen
@@ -4990,8 +5542,10 @@ CBlockIndex* InsertBlockIndex(uint256 hash)
 
 bool static LoadBlockIndexDB(string& strError)
 {
+    int64_t nStart = GetTimeMillis();
     if (!pblocktree->LoadBlockIndexGuts())
         return false;
+    int64_t nGuts = GetTimeMillis();
 
     boost::this_thread::interruption_point();
 
@@ -5027,6 +5581,11 @@ bool static LoadBlockIndexDB(string& strError)
         if (pindex->IsValid(BLOCK_VALID_TREE) && (pindexBestHeader == NULL || CBlockIndexWorkComparator()(pindexBestHeader, pindex)))
             pindexBestHeader = pindex;
     }
+    LogPrintf("%s: block index loaded in %dms (read %dms, chain work %dms)\n", __func__,
+        GetTimeMillis() - nStart, nGuts - nStart, GetTimeMillis() - nGuts);
+
+    LogPrintf("%s: %u block index entries use %.1f MiB (%u bytes each)\n", __func__,
+        blockIndexArena.Size(), blockIndexArena.MemoryUsage() / 1048576.0, sizeof(CBlockIndex));
 
     // Load block file info
     pblocktree->ReadLastBlockFile(nLastBlockFile);
@@ -5122,29 +5681,28 @@ bool CVerifyDB::VerifyDB(CCoinsView* coinsview, int nCheckLevel, int nCheckDepth
     CBlockIndex* pindexFailure = NULL;
     int nGoodTransactions = 0;
     CValidationState state;
-    for (CBlockIndex* pindex = chainActive.Tip(); pindex && pindex->pprev; pindex = pindex->pprev) {
+
+    // Blocks and undo data are read ahead on background threads, newest first
+    std::vector<CBlockIndex*> vCheck;
+    for (CBlockIndex* pindex = chainActive.Tip(); pindex && pindex->pprev && pindex->nHeight >= chainActive.Height() - nCheckDepth; pindex = pindex->pprev)
+        vCheck.push_back(pindex);
+    CBlockStream stream(vCheck, nCheckLevel >= 2);
+    CBlockIndex* pindex;
+    CBlock block;
+    CBlockUndo undo;
+    bool fHaveUndo;
+    while (stream.Next(pindex, block, undo, fHaveUndo)) {
         boost::this_thread::interruption_point();
         uiInterface.ShowProgress(_("Verifying blocks..."), std::max(1, std::min(99, (int)(((double)(chainActive.Height() - pindex->nHeight)) / (double)nCheckDepth * (nCheckLevel >= 4 ? 50 : 100)))));
-        if (pindex->nHeight < chainActive.Height() - nCheckDepth)
-            break;
-        CBlock block;
-        // check level 0: read from disk
-        if (!ReadBlockFromDisk(block, pindex))
-            return error("VerifyDB() : *** ReadBlockFromDisk failed at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString());
+        // check level 0: read from disk (done by the stream)
         // check level 1: verify block validity
         if (nCheckLevel >= 1 && !CheckBlock(block, state))
             return error("VerifyDB() : *** found bad block at %d, hash=%s\n", pindex->nHeight, pindex->GetBlockHash().ToString());
         // check level 2: verify undo validity
-        if (nCheckLevel >= 2 && pindex) {
-            CBlockUndo undo;
-            CDiskBlockPos pos = pindex->GetUndoPos();
-            if (!pos.IsNull()) {
-                if (!undo.ReadFromDisk(pos, pindex->pprev->GetBlockHash()))
-                    return error("VerifyDB() : *** found bad undo data at %d, hash=%s\n", pindex->nHeight, pindex->GetBlockHash().ToString());
-            }
-        }
+        if (nCheckLevel >= 2 && !fHaveUndo && !pindex->GetUndoPos().IsNull())
+            return error("VerifyDB() : *** found bad undo data at %d, hash=%s\n", pindex->nHeight, pindex->GetBlockHash().ToString());
         // check level 3: check for inconsistencies during memory-only disconnect of tip blocks
-        if (nCheckLevel >= 3 && pindex == pindexState && (coins.GetCacheSize() + pcoinsTip->GetCacheSize()) <= nCoinCacheSize) {
+        if (nCheckLevel >= 3 && pindex == pindexState && (coins.DynamicMemoryUsage() + pcoinsTip->DynamicMemoryUsage()) <= nCoinCacheUsage) {
             bool fClean = true;
             if (!DisconnectBlock(block, state, pindex, coins, &fClean))
                 return error("VerifyDB() : *** irrecoverable inconsistency in block data at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString());
@@ -5158,22 +5716,22 @@ bool CVerifyDB::VerifyDB(CCoinsView* coinsview, int nCheckLevel, int nCheckDepth
         if (ShutdownRequested())
             return true;
     }
+    if (stream.Failed())
+        return error("VerifyDB() : *** ReadBlockFromDisk failed at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString());
     if (pindexFailure)
         return error("VerifyDB() : *** coin database inconsistencies found (last %i blocks, %i good transactions before that)\n", chainActive.Height() - pindexFailure->nHeight + 1, nGoodTransactions);
 
     // check level 4: try reconnecting blocks
     if (nCheckLevel >= 4) {
-        CBlockIndex* pindex = pindexState;
-        while (pindex != chainActive.Tip()) {
+        CBlockStream streamReconnect(GetChainRange(chainActive, pindexState->nHeight + 1));
+        while (streamReconnect.Next(pindex, block)) {
             boost::this_thread::interruption_point();
             uiInterface.ShowProgress(_("Verifying blocks..."), std::max(1, std::min(99, 100 - (int)(((double)(chainActive.Height() - pindex->nHeight)) / (double)nCheckDepth * 50))));
-            pindex = chainActive.Next(pindex);
-            CBlock block;
-            if (!ReadBlockFromDisk(block, pindex))
-                return error("VerifyDB() : *** ReadBlockFromDisk failed at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString());
             if (!ConnectBlock(block, state, pindex, coins, false))
                 return error("VerifyDB() : *** found unconnectable block at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString());
         }
+        if (streamReconnect.Failed())
+            return error("VerifyDB() : *** ReadBlockFromDisk failed at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString());
     }
 
     LogPrintf("No coin database inconsistencies in last %i blocks (%i transactions)\n", chainActive.Height() - pindexState->nHeight, nGoodTransactions);
@@ -5183,6 +5741,11 @@ bool CVerifyDB::VerifyDB(CCoinsView* coinsview, int nCheckLevel, int nCheckDepth
 
 void UnloadBlockIndex()
 {
+    {
+        LOCK(cs_zerocoinSupply);
+        mapZerocoinSupplyCache.clear();
+    }
+    InvalidateStakeModifierCache(0);
     mapBlockIndex.clear();
     setBlockIndexCandidates.clear();
     chainActive.SetTip(NULL);
@@ -5246,7 +5809,7 @@ bool InitBlockIndex()
             if (!ActivateBestChain(state, &block))
                 return error("LoadBlockIndex() : genesis block cannot be activated");
             // Force a chainstate write so that when we VerifyDB in a moment, it doesnt check stale data
-            return FlushStateToDisk(state, FLUSH_STATE_ALWAYS);
+            return FlushStateToDisk(state, FLUSH_STATE_ALWAYS, true);
         } catch (std::runtime_error& e) {
             return error("LoadBlockIndex() : failed to initialize block database: %s", e.what());
         }
@@ -5556,13 +6119,35 @@ string GetWarnings(string strFor)
 //
 
 
+/** A relayed transaction waiting for the -txverifythreads */
+struct CTxVerifyJob {
+    CTransaction tx;
+    CNode* pfrom; //!< referenced until the job is done
+    std::string strCommand;
+    bool ignoreFees;
+    bool fZerocoinActive;
+};
+
+int nTxVerifyThreads = 0;
+static boost::mutex csTxVerify;
+static boost::condition_variable cvTxVerify;
+static std::deque<CTxVerifyJob> queueTxVerify;
+//! Transactions queued or being verified, so a burst from several peers is checked once
+static std::set<uint256> setTxVerifyPending;
+
+static bool IsTxVerifyPending(const uint256& hash)
+{
+    boost::unique_lock<boost::mutex> lock(csTxVerify);
+    return setTxVerifyPending.count(hash);
+}
+
 bool static AlreadyHave(const CInv& inv)
 {
     switch (inv.type) {
     case MSG_TX: {
         bool txInMap = false;
         txInMap = mempool.exists(inv.hash);
-        return txInMap || mapOrphanTransactions.count(inv.hash) ||
+        return txInMap || orphanpool.Exists(inv.hash) || IsTxVerifyPending(inv.hash) ||
                pcoinsTip->HaveCoins(inv.hash);
     }
     case MSG_DSTX:
@@ -5647,7 +6232,7 @@ void static ProcessGetData(CNode* pfrom)
             boost::this_thread::interruption_point();
             it++;
 
-            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK) {
+            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK || inv.type == MSG_CMPCT_BLOCK) {
                 bool send = false;
                 BlockMap::iterator mi = mapBlockIndex.find(inv.hash);
                 if (mi != mapBlockIndex.end()) {
@@ -5672,7 +6257,14 @@ void static ProcessGetData(CNode* pfrom)
                         assert(!"cannot load block from disk");
                     if (inv.type == MSG_BLOCK)
                         pfrom->PushMessage("block", block);
-                    else // MSG_FILTERED_BLOCK)
+                    else if (inv.type == MSG_CMPCT_BLOCK) {
+                        // Compact blocks only pay off near the tip, where the peer's
+                        // mempool is likely to hold the transactions.
+                        if (chainActive.Height() - mi->second->nHeight <= MAX_CMPCTBLOCK_DEPTH)
+                            pfrom->PushMessage("cmpctblock", CBlockHeaderAndShortTxIDs(block));
+                        else
+                            pfrom->PushMessage("block", block);
+                    } else // MSG_FILTERED_BLOCK)
                     {
                         LOCK(pfrom->cs_filter);
                         if (pfrom->pfilter) {
@@ -5686,7 +6278,7 @@ void static ProcessGetData(CNode* pfrom)
                             // however we MUST always provide at least what the remote peer needs
                             typedef std::pair<unsigned int, uint256> PairType;
                             BOOST_FOREACH (PairType& pair, merkleBlock.vMatchedTxn)
-                                if (!pfrom->setInventoryKnown.count(CInv(MSG_TX, pair.second)))
+                                if (!pfrom->HasInventoryKnown(CInv(MSG_TX, pair.second)))
                                     pfrom->PushMessage("tx", block.vtx[pair.first]);
                         }
                         // else
@@ -5862,6 +6454,253 @@ void static ProcessGetData(CNode* pfrom)
 }
 
 bool fRequestedSporksIDB = false;
+/**
+ * Header checks for a compact block, run before any work goes into rebuilding
+ * it: what AcceptBlockHeader checks, plus the PoW/PoS period of its height.
+ * The proof of work is only checked for blocks without a prefilled coinstake;
+ * a stake kernel can only be checked once the full block is in.
+ */
+static bool CheckCompactBlockHeader(const CBlockHeaderAndShortTxIDs& cmpctblock, CValidationState& state, CBlockIndex* pindexPrev)
+{
+    AssertLockHeld(cs_main);
+    const bool fProofOfStake = cmpctblock.IsProofOfStake();
+    if (!CheckBlockHeader(cmpctblock.header, state, !fProofOfStake))
+        return false;
+
+    if (pindexPrev->nStatus & BLOCK_FAILED_MASK)
+        return state.DoS(100, error("%s : prev block %s is invalid", __func__, pindexPrev->GetBlockHash().ToString()),
+                         REJECT_INVALID, "bad-prevblk");
+
+    const int nHeight = pindexPrev->nHeight + 1;
+    if (nHeight <= Params().LAST_POW_BLOCK() && fProofOfStake)
+        return state.DoS(100, error("%s : PoS period not active", __func__), REJECT_INVALID, "PoS-early");
+    if (nHeight > Params().LAST_POW_BLOCK() && !fProofOfStake)
+        return state.DoS(100, error("%s : PoW period ended", __func__), REJECT_INVALID, "PoW-ended");
+
+    return ContextualCheckBlockHeader(cmpctblock.header, state, pindexPrev);
+}
+
+/** Hand a block received from a peer (in full or reconstructed from a compact block) to validation */
+void static ProcessReceivedBlock(CNode* pfrom, CBlock& block, const string& strCommand)
+{
+    CInv inv(MSG_BLOCK, block.GetHash());
+    pfrom->AddInventoryKnown(inv);
+    {
+        // Whatever route the block took, we no longer wait for its transactions
+        LOCK(cs_main);
+        CNodeState* nodestate = State(pfrom->GetId());
+        if (nodestate)
+            nodestate->mapPartialBlocks.erase(inv.hash);
+    }
+
+    CValidationState state;
+    if (!mapBlockIndex.count(block.GetHash())) {
+        ProcessNewBlock(state, pfrom, &block);
+        int nDoS;
+        if(state.IsInvalid(nDoS)) {
+            pfrom->PushMessage("reject", strCommand, state.GetRejectCode(),
+                               state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), inv.hash);
+            if(nDoS > 0) {
+                TRY_LOCK(cs_main, lockMain);
+                if(lockMain) Misbehaving(pfrom->GetId(), nDoS);
+            }
+        }
+        //disconnect this node if its old protocol version
+        pfrom->DisconnectOldProtocol(ActiveProtocol(), strCommand);
+    } else {
+        LogPrint("net", "%s : Already processed block %s, skipping ProcessNewBlock()\n", __func__, block.GetHash().GetHex());
+    }
+}
+
+/**
+ * Relay an accepted transaction and the orphans it unblocks, keep it as an
+ * orphan if inputs are missing, or tell the peer why it was rejected.
+ */
+static void ProcessTxAcceptResult(CNode* pfrom, const std::string& strCommand, const CTransaction& tx, bool fAccepted, bool fMissingInputs, CValidationState& state)
+{
+    AssertLockHeld(cs_main);
+    vector<CTransaction> vWorkQueue;
+    CInv inv(MSG_TX, tx.GetHash());
+
+    if (fAccepted && !tx.IsZerocoinSpend()) {
+        mempool.check(pcoinsTip);
+        RelayTransaction(tx);
+        vWorkQueue.push_back(tx);
+
+        LogPrint("mempool", "AcceptToMemoryPool: peer=%d %s : accepted %s (poolsz %u)\n",
+                 pfrom->id, pfrom->cleanSubVer,
+                 tx.GetHash().ToString(),
+                 mempool.mapTx.size());
+
+        // Recursively process any orphan transactions that depended on this one
+        set<NodeId> setMisbehaving;
+        for(unsigned int i = 0; i < vWorkQueue.size(); i++) {
+            vector<uint256> vChildren;
+            orphanpool.GetChildren(vWorkQueue[i], vChildren);
+            BOOST_FOREACH (const uint256& orphanHash, vChildren) {
+                const COrphanPool::COrphanTx* porphan = orphanpool.Get(orphanHash);
+                if (!porphan)
+                    continue;
+                const CTransaction orphanTx = porphan->tx;
+                NodeId fromPeer = porphan->fromPeer;
+                bool fMissingInputs2 = false;
+                // Use a dummy CValidationState so someone can't setup nodes to counter-DoS based on orphan
+                // resolution (that is, feeding people an invalid transaction based on LegitTxX in order to get
+                // anyone relaying LegitTxX banned)
+                CValidationState stateDummy;
+
+
+                if(setMisbehaving.count(fromPeer))
+                    continue;
+                if(AcceptToMemoryPool(mempool, stateDummy, orphanTx, true, &fMissingInputs2)) {
+                    LogPrint("mempool", "   accepted orphan tx %s\n", orphanHash.ToString());
+                    RelayTransaction(orphanTx);
+                    vWorkQueue.push_back(orphanTx);
+                    orphanpool.Erase(orphanHash);
+                } else if(!fMissingInputs2) {
+                    int nDos = 0;
+                    if(stateDummy.IsInvalid(nDos) && nDos > 0) {
+                        // Punish peer that gave us an invalid orphan tx
+                        Misbehaving(fromPeer, nDos, __FILE__, __LINE__);
+                        setMisbehaving.insert(fromPeer);
+                        LogPrint("mempool", "   invalid orphan tx %s\n", orphanHash.ToString());
+                    }
+                    // Has inputs but not accepted to mempool
+                    // Probably non-standard or insufficient fee/priority
+                    LogPrint("mempool", "   removed orphan tx %s\n", orphanHash.ToString());
+                    orphanpool.Erase(orphanHash);
+                }
+                mempool.check(pcoinsTip);
+            }
+        }
+    } else if (fAccepted) {
+        //Presstab: ZCoin has a bunch of code commented out here. Is this something that should have more going on?
+        //Also there is nothing that handles fMissingZerocoinInputs. Does there need to be?
+        RelayTransaction(tx);
+        LogPrint("mempool", "AcceptToMemoryPool: Zerocoinspend peer=%d %s : accepted %s (poolsz %u)\n",
+                 pfrom->id, pfrom->cleanSubVer,
+                 tx.GetHash().ToString(),
+                 mempool.mapTx.size());
+    } else if (fMissingInputs && !tx.IsZerocoinSpend()) {
+        orphanpool.Add(tx, pfrom->GetId());
+
+        // DoS prevention: do not allow the orphan pool to grow unbounded
+        unsigned int nMaxOrphanTx = (unsigned int)std::max((int64_t)0, GetArg("-maxorphantx", DEFAULT_MAX_ORPHAN_TRANSACTIONS));
+        size_t nMaxOrphanBytes = (size_t)std::max((int64_t)0, GetArg("-maxorphansize", DEFAULT_MAX_ORPHAN_SIZE)) * 1000;
+        unsigned int nEvicted = orphanpool.Limit(nMaxOrphanTx, nMaxOrphanBytes);
+        if (nEvicted > 0)
+            LogPrint("mempool", "mapOrphan overflow, removed %u tx\n", nEvicted);
+    } else if (pfrom->fWhitelisted) {
+        // Always relay transactions received from whitelisted peers, even
+        // if they are already in the mempool (allowing the node to function
+        // as a gateway for nodes hidden behind it).
+
+        RelayTransaction(tx);
+    }
+
+    if (strCommand == "dstx") {
+        CInv inv(MSG_DSTX, tx.GetHash());
+        RelayInv(inv);
+    }
+
+    int nDoS = 0;
+    if (state.IsInvalid(nDoS)) {
+        LogPrint("mempool", "%s from peer=%d %s was not accepted into the memory pool: %s\n", tx.GetHash().ToString(),
+            pfrom->id, pfrom->cleanSubVer,
+            state.GetRejectReason());
+        pfrom->PushMessage("reject", strCommand, state.GetRejectCode(),
+            state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), inv.hash);
+        if (nDoS > 0)
+            Misbehaving(pfrom->GetId(), nDoS, __FILE__, __LINE__);
+    }
+}
+
+/**
+ * Hand a relayed transaction to the verification threads. Returns false if it
+ * is to be accepted right away: no threads run or the queue is full.
+ */
+static bool QueueTxVerify(CNode* pfrom, const std::string& strCommand, const CTransaction& tx, bool ignoreFees)
+{
+    AssertLockHeld(cs_main);
+    if (nTxVerifyThreads == 0)
+        return false;
+
+    boost::unique_lock<boost::mutex> lock(csTxVerify);
+    if (setTxVerifyPending.count(tx.GetHash()))
+        return true;
+    if (queueTxVerify.size() >= MAX_TXVERIFY_QUEUE)
+        return false;
+
+    CTxVerifyJob job;
+    job.tx = tx;
+    job.pfrom = pfrom->AddRef();
+    job.strCommand = strCommand;
+    job.ignoreFees = ignoreFees;
+    job.fZerocoinActive = chainActive.Height() >= Params().Zerocoin_StartHeight();
+    queueTxVerify.push_back(job);
+    setTxVerifyPending.insert(tx.GetHash());
+    cvTxVerify.notify_one();
+    return true;
+}
+
+/**
+ * AcceptToMemoryPool for a queued transaction, with cs_main only held for
+ * the lookups and the insert. The script and proof checks of several
+ * transactions run at the same time this way.
+ */
+static void VerifyQueuedTx(const CTxVerifyJob& job)
+{
+    CValidationState state;
+    bool fMissingInputs = false;
+    CMempoolAccept accept(job.tx, true, false, job.ignoreFees);
+
+    // Context-free checks need no lock
+    bool fOk = CheckTransaction(job.tx, job.fZerocoinActive, state, false);
+    if (!fOk)
+        state.DoS(100, error("AcceptToMemoryPool: : CheckTransaction failed"), REJECT_INVALID, "bad-tx");
+    accept.fCheckedTx = true;
+    accept.fZerocoinActive = job.fZerocoinActive;
+
+    if (fOk) {
+        LOCK(cs_main);
+        fOk = PrepareMempoolAccept(mempool, state, accept, &fMissingInputs);
+    }
+    if (fOk)
+        fOk = VerifyMempoolAccept(state, accept);
+
+    LOCK(cs_main);
+    if (fOk)
+        fOk = FinishMempoolAccept(mempool, state, accept, &fMissingInputs);
+    ProcessTxAcceptResult(job.pfrom, job.strCommand, job.tx, fOk, fMissingInputs, state);
+}
+
+void ThreadTxVerify()
+{
+    RenameThread("pdg-txverify");
+    while (true) {
+        CTxVerifyJob job;
+        {
+            boost::unique_lock<boost::mutex> lock(csTxVerify);
+            while (queueTxVerify.empty())
+                cvTxVerify.wait(lock);
+            job = queueTxVerify.front();
+            queueTxVerify.pop_front();
+        }
+
+        try {
+            VerifyQueuedTx(job);
+        } catch (std::exception& e) {
+            PrintExceptionContinue(&e, "ThreadTxVerify()");
+        }
+
+        {
+            boost::unique_lock<boost::mutex> lock(csTxVerify);
+            setTxVerifyPending.erase(job.tx.GetHash());
+        }
+        job.pfrom->Release();
+    }
+}
+
 bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv, int64_t nTimeReceived)
 {
     RandAddSeedPerfmon();
@@ -6002,6 +6841,15 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
     else if (strCommand == "verack") {
         pfrom->SetRecvVersion(min(pfrom->nVersion, PROTOCOL_VERSION));
 
+        // Tell the peer we understand compact blocks. We ask our outbound peers to
+        // push new blocks to us directly (high-bandwidth mode), inbound peers only
+        // hear about them through invs.
+        if (pfrom->nVersion >= SHORT_IDS_BLOCKS_VERSION) {
+            bool fAnnounceUsingCMPCTBLOCK = !pfrom->fInbound;
+            uint64_t nCMPCTBLOCKVersion = 1;
+            pfrom->PushMessage("sendcmpct", fAnnounceUsingCMPCTBLOCK, nCMPCTBLOCKVersion);
+        }
+
         // Mark this node as currently connected, so we update its timestamp later.
         if (pfrom->fNetworkNode) {
             LOCK(cs_main);
@@ -6010,6 +6858,18 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
     }
 
 
+    else if (strCommand == "sendcmpct") {
+        bool fAnnounceUsingCMPCTBLOCK = false;
+        uint64_t nCMPCTBLOCKVersion = 0;
+        vRecv >> fAnnounceUsingCMPCTBLOCK >> nCMPCTBLOCKVersion;
+        if (nCMPCTBLOCKVersion == 1) {
+            LOCK(cs_main);
+            State(pfrom->GetId())->fProvidesHeaderAndIDs = true;
+            State(pfrom->GetId())->fPreferHeaderAndIDs = fAnnounceUsingCMPCTBLOCK;
+        }
+    }
+
+
     else if (strCommand == "addr") {
         vector<CAddress> vAddr;
         vRecv >> vAddr;
@@ -6104,8 +6964,14 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             if (inv.type == MSG_BLOCK) {
                 UpdateBlockAvailability(pfrom->GetId(), inv.hash);
                 if (!fAlreadyHave && !fImporting && !fReindex && !mapBlocksInFlight.count(inv.hash)) {
-                    // Add this to the list of blocks to request
-                    vToFetch.push_back(inv);
+                    // Add this to the list of blocks to request. Once we are synced, new
+                    // blocks are fetched as compact blocks from peers that support them.
+                    // Compact ones are tracked in flight so their answer counts as solicited.
+                    if (State(pfrom->GetId())->fProvidesHeaderAndIDs && !IsInitialBlockDownload()) {
+                        vToFetch.push_back(CInv(MSG_CMPCT_BLOCK, inv.hash));
+                        MarkBlockAsInFlight(pfrom->GetId(), inv.hash);
+                    } else
+                        vToFetch.push_back(inv);
                     LogPrint("net", "getblocks (%d) %s to peer=%d\n", pindexBestHeader->nHeight, inv.hash.ToString(), pfrom->id);
                 }
             }
@@ -6430,8 +7296,6 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
 
 
     else if (strCommand == "tx" || strCommand == "dstx") {
-        vector<uint256> vWorkQueue;
-        vector<uint256> vEraseQueue;
         CTransaction tx;
 
         //masternode signed transaction
@@ -6485,105 +7349,16 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
 
         LOCK(cs_main);
 
-        bool fMissingInputs = false;
-        bool fMissingZerocoinInputs = false;
-        CValidationState state;
-
         mapAlreadyAskedFor.erase(inv);
 
-        if (!tx.IsZerocoinSpend() && AcceptToMemoryPool(mempool, state, tx, true, &fMissingInputs, false, ignoreFees)) {
-            mempool.check(pcoinsTip);
-            RelayTransaction(tx);
-            vWorkQueue.push_back(inv.hash);
-
-            LogPrint("mempool", "AcceptToMemoryPool: peer=%d %s : accepted %s (poolsz %u)\n",
-                     pfrom->id, pfrom->cleanSubVer,
-                     tx.GetHash().ToString(),
-                     mempool.mapTx.size());
-
-            // Recursively process any orphan transactions that depended on this one
-            set<NodeId> setMisbehaving;
-            for(unsigned int i = 0; i < vWorkQueue.size(); i++) {
-                map<uint256, set<uint256> >::iterator itByPrev = mapOrphanTransactionsByPrev.find(vWorkQueue[i]);
-                if(itByPrev == mapOrphanTransactionsByPrev.end())
-                    continue;
-                for(set<uint256>::iterator mi = itByPrev->second.begin();
-                    mi != itByPrev->second.end();
-                    ++mi) {
-                    const uint256 &orphanHash = *mi;
-                    const CTransaction &orphanTx = mapOrphanTransactions[orphanHash].tx;
-                    NodeId fromPeer = mapOrphanTransactions[orphanHash].fromPeer;
-                    bool fMissingInputs2 = false;
-                    // Use a dummy CValidationState so someone can't setup nodes to counter-DoS based on orphan
-                    // resolution (that is, feeding people an invalid transaction based on LegitTxX in order to get
-                    // anyone relaying LegitTxX banned)
-                    CValidationState stateDummy;
-
-
-                    if(setMisbehaving.count(fromPeer))
-                        continue;
-                    if(AcceptToMemoryPool(mempool, stateDummy, orphanTx, true, &fMissingInputs2)) {
-                        LogPrint("mempool", "   accepted orphan tx %s\n", orphanHash.ToString());
-                        RelayTransaction(orphanTx);
-                        vWorkQueue.push_back(orphanHash);
-                        vEraseQueue.push_back(orphanHash);
-                    } else if(!fMissingInputs2) {
-                        int nDos = 0;
-                        if(stateDummy.IsInvalid(nDos) && nDos > 0) {
-                            // Punish peer that gave us an invalid orphan tx
-                            Misbehaving(fromPeer, nDos, __FILE__, __LINE__);
-                            setMisbehaving.insert(fromPeer);
-                            LogPrint("mempool", "   invalid orphan tx %s\n", orphanHash.ToString());
-                        }
-                        // Has inputs but not accepted to mempool
-                        // Probably non-standard or insufficient fee/priority
-                        LogPrint("mempool", "   removed orphan tx %s\n", orphanHash.ToString());
-                        vEraseQueue.push_back(orphanHash);
-                    }
-                    mempool.check(pcoinsTip);
-                }
-            }
+        // The verification threads check it while this thread moves on to the next message
+        if (QueueTxVerify(pfrom, strCommand, tx, ignoreFees))
+            return true;
 
-            BOOST_FOREACH (uint256 hash, vEraseQueue)EraseOrphanTx(hash);
-        } else if (tx.IsZerocoinSpend() && AcceptToMemoryPool(mempool, state, tx, true, &fMissingZerocoinInputs, false, ignoreFees)) {
-            //Presstab: ZCoin has a bunch of code commented out here. Is this something that should have more going on?
-            //Also there is nothing that handles fMissingZerocoinInputs. Does there need to be?
-            RelayTransaction(tx);
-            LogPrint("mempool", "AcceptToMemoryPool: Zerocoinspend peer=%d %s : accepted %s (poolsz %u)\n",
-                     pfrom->id, pfrom->cleanSubVer,
-                     tx.GetHash().ToString(),
-                     mempool.mapTx.size());
-        } else if (fMissingInputs) {
-            AddOrphanTx(tx, pfrom->GetId());
-
-            // DoS prevention: do not allow mapOrphanTransactions to grow unbounded
-            unsigned int nMaxOrphanTx = (unsigned int)std::max((int64_t)0, GetArg("-maxorphantx", DEFAULT_MAX_ORPHAN_TRANSACTIONS));
-            unsigned int nEvicted = LimitOrphanTxSize(nMaxOrphanTx);
-            if (nEvicted > 0)
-                LogPrint("mempool", "mapOrphan overflow, removed %u tx\n", nEvicted);
-        } else if (pfrom->fWhitelisted) {
-            // Always relay transactions received from whitelisted peers, even
-            // if they are already in the mempool (allowing the node to function
-            // as a gateway for nodes hidden behind it).
-
-            RelayTransaction(tx);
-        }
-
-        if (strCommand == "dstx") {
-            CInv inv(MSG_DSTX, tx.GetHash());
-            RelayInv(inv);
-        }
-
-        int nDoS = 0;
-        if (state.IsInvalid(nDoS)) {
-            LogPrint("mempool", "%s from peer=%d %s was not accepted into the memory pool: %s\n", tx.GetHash().ToString(),
-                pfrom->id, pfrom->cleanSubVer,
-                state.GetRejectReason());
-            pfrom->PushMessage("reject", strCommand, state.GetRejectCode(),
-                state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), inv.hash);
-            if (nDoS > 0)
-                Misbehaving(pfrom->GetId(), nDoS, __FILE__, __LINE__);
-        }
+        bool fMissingInputs = false;
+        CValidationState state;
+        bool fAccepted = AcceptToMemoryPool(mempool, state, tx, true, &fMissingInputs, false, ignoreFees);
+        ProcessTxAcceptResult(pfrom, strCommand, tx, fAccepted, fMissingInputs, state);
     }
 
 
@@ -6750,26 +7525,164 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                 pfrom->vBlockRequested.push_back(hashBlock);
             }
         } else {
-            pfrom->AddInventoryKnown(inv);
+            ProcessReceivedBlock(pfrom, block, strCommand);
+        }
+    }
+
+
+    else if (strCommand == "cmpctblock" && !fImporting && !fReindex) {
+        CBlockHeaderAndShortTxIDs cmpctblock;
+        vRecv >> cmpctblock;
+        uint256 hashBlock = cmpctblock.header.GetHash();
+        LogPrint("cmpctblock", "received cmpctblock %s peer=%d\n", hashBlock.ToString(), pfrom->id);
+
+        PartiallyDownloadedBlock partialBlock(&mempool);
+        {
+            LOCK(cs_main);
+            if (mapBlockIndex.count(hashBlock)) {
+                pfrom->AddInventoryKnown(CInv(MSG_BLOCK, hashBlock));
+                return true;
+            }
+
+            // We only take compact blocks we asked for: ones we requested with a
+            // getdata, or pushed by the outbound peers we put in high-bandwidth mode.
+            CNodeState* nodestate = State(pfrom->GetId());
+            map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator itInFlight = mapBlocksInFlight.find(hashBlock);
+            bool fRequested = itInFlight != mapBlocksInFlight.end() && itInFlight->second.first == pfrom->GetId();
+            if (!fRequested && (pfrom->fInbound || !nodestate->fProvidesHeaderAndIDs)) {
+                LogPrint("cmpctblock", "ignoring unsolicited cmpctblock %s peer=%d\n", hashBlock.ToString(), pfrom->id);
+                return true;
+            }
 
+            // Without the parent we cannot do anything useful with the short ids;
+            // fetch the full block and let the "block" handler sort out the chain.
+            BlockMap::iterator miPrev = mapBlockIndex.find(cmpctblock.header.hashPrevBlock);
+            if (miPrev == mapBlockIndex.end()) {
+                pfrom->PushMessage("getdata", vector<CInv>(1, CInv(MSG_BLOCK, hashBlock)));
+                return true;
+            }
+
+            // Spend nothing on reconstruction before the header holds up
             CValidationState state;
-            if (!mapBlockIndex.count(block.GetHash())) {
-                ProcessNewBlock(state, pfrom, &block);
+            if (!CheckCompactBlockHeader(cmpctblock, state, miPrev->second)) {
                 int nDoS;
-                if(state.IsInvalid(nDoS)) {
+                if (state.IsInvalid(nDoS)) {
                     pfrom->PushMessage("reject", strCommand, state.GetRejectCode(),
-                                       state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), inv.hash);
-                    if(nDoS > 0) {
-                        TRY_LOCK(cs_main, lockMain);
-                        if(lockMain) Misbehaving(pfrom->GetId(), nDoS);
-                    }
+                                       state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), hashBlock);
+                    if (nDoS > 0)
+                        Misbehaving(pfrom->GetId(), nDoS, __FILE__, __LINE__);
                 }
-                //disconnect this node if its old protocol version
-                pfrom->DisconnectOldProtocol(ActiveProtocol(), strCommand);
-            } else {
-                LogPrint("net", "%s : Already processed block %s, skipping ProcessNewBlock()\n", __func__, block.GetHash().GetHex());
+                if (fRequested)
+                    MarkBlockAsReceived(hashBlock);
+                return error("Peer %d sent us a compact block %s with an invalid header\n", pfrom->id, hashBlock.ToString());
+            }
+
+            if (!fRequested && mapBlocksInFlight.count(hashBlock)) {
+                // Already downloading it from someone else
+                return true;
+            }
+            if (nodestate->mapPartialBlocks.size() >= MAX_CMPCTBLOCKS_INFLIGHT_PER_PEER) {
+                MarkBlockAsInFlight(pfrom->GetId(), hashBlock);
+                pfrom->PushMessage("getdata", vector<CInv>(1, CInv(MSG_BLOCK, hashBlock)));
+                return true;
+            }
+            MarkBlockAsInFlight(pfrom->GetId(), hashBlock);
+
+            ReadStatus status = partialBlock.InitData(cmpctblock);
+            if (status == READ_STATUS_INVALID) {
+                MarkBlockAsReceived(hashBlock);
+                Misbehaving(pfrom->GetId(), 100, __FILE__, __LINE__);
+                return error("Peer %d sent us invalid compact block %s\n", pfrom->id, hashBlock.ToString());
+            } else if (status == READ_STATUS_FAILED) {
+                // Duplicate short ids or similar: fall back to the full block
+                pfrom->PushMessage("getdata", vector<CInv>(1, CInv(MSG_BLOCK, hashBlock)));
+                return true;
+            }
+
+            BlockTransactionsRequest req;
+            for (size_t i = 0; i < cmpctblock.BlockTxCount(); i++) {
+                if (!partialBlock.IsTxAvailable(i))
+                    req.indexes.push_back(i);
+            }
+            if (!req.indexes.empty()) {
+                req.blockhash = hashBlock;
+                nodestate->mapPartialBlocks.insert(make_pair(hashBlock, partialBlock));
+                pfrom->PushMessage("getblocktxn", req);
+                return true;
+            }
+        }
+
+        // Every transaction was prefilled or found in our mempool
+        CBlock block;
+        ReadStatus status = partialBlock.FillBlock(block, vector<CTransaction>());
+        if (status != READ_STATUS_OK) {
+            pfrom->PushMessage("getdata", vector<CInv>(1, CInv(MSG_BLOCK, hashBlock)));
+            return true;
+        }
+        ProcessReceivedBlock(pfrom, block, strCommand);
+    }
+
+
+    else if (strCommand == "getblocktxn") {
+        BlockTransactionsRequest req;
+        vRecv >> req;
+
+        LOCK(cs_main);
+        BlockMap::iterator mi = mapBlockIndex.find(req.blockhash);
+        if (mi == mapBlockIndex.end() || !(mi->second->nStatus & BLOCK_HAVE_DATA) || !chainActive.Contains(mi->second)) {
+            LogPrint("net", "Peer %d sent us a getblocktxn for a block we don't have\n", pfrom->id);
+            return true;
+        }
+
+        CBlock block;
+        if (!ReadBlockFromDisk(block, mi->second))
+            assert(!"cannot load block from disk");
+
+        // Old blocks are not worth the extra round-trip; just send them whole
+        if (chainActive.Height() - mi->second->nHeight > MAX_BLOCKTXN_DEPTH) {
+            pfrom->PushMessage("block", block);
+            return true;
+        }
+
+        BlockTransactions resp(req);
+        for (size_t i = 0; i < req.indexes.size(); i++) {
+            if (req.indexes[i] >= block.vtx.size()) {
+                Misbehaving(pfrom->GetId(), 100, __FILE__, __LINE__);
+                return error("Peer %d sent us a getblocktxn with out-of-bounds tx indices", pfrom->id);
+            }
+            resp.txn[i] = block.vtx[req.indexes[i]];
+        }
+        pfrom->PushMessage("blocktxn", resp);
+    }
+
+
+    else if (strCommand == "blocktxn" && !fImporting && !fReindex) {
+        BlockTransactions resp;
+        vRecv >> resp;
+
+        CBlock block;
+        {
+            LOCK(cs_main);
+            CNodeState* nodestate = State(pfrom->GetId());
+            map<uint256, PartiallyDownloadedBlock>::iterator it = nodestate->mapPartialBlocks.find(resp.blockhash);
+            if (it == nodestate->mapPartialBlocks.end()) {
+                LogPrint("net", "Peer %d sent us block transactions for block we weren't expecting\n", pfrom->id);
+                return true;
+            }
+
+            ReadStatus status = it->second.FillBlock(block, resp.txn);
+            nodestate->mapPartialBlocks.erase(it);
+            if (status == READ_STATUS_INVALID) {
+                MarkBlockAsReceived(resp.blockhash);
+                Misbehaving(pfrom->GetId(), 100, __FILE__, __LINE__);
+                return error("Peer %d sent us invalid compact block/non-matching block transactions\n", pfrom->id);
+            } else if (status == READ_STATUS_FAILED) {
+                // Might have collided, fall back to getdata now :(
+                pfrom->PushMessage("getdata", vector<CInv>(1, CInv(MSG_BLOCK, resp.blockhash)));
+                return true;
             }
         }
+        ProcessReceivedBlock(pfrom, block, strCommand);
     }
 
 
@@ -7255,48 +8168,43 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         //
         // Message: inventory
         //
+        // Everything but transactions is announced as soon as it is queued.
+        // Transactions are held back and announced in one batch per peer at
+        // Poisson-distributed intervals, which hides where they entered the
+        // network and keeps the number of inv messages low. Whitelisted peers
+        // get transactions right away.
+        int64_t nNow = GetTimeMicros();
+        bool fSendTxInv = pto->fWhitelisted || pto->nNextInvSend < nNow;
+        if (fSendTxInv && !pto->fWhitelisted)
+            pto->nNextInvSend = PoissonNextSend(nNow, pto->fInbound ? INVENTORY_BROADCAST_INTERVAL : INVENTORY_BROADCAST_INTERVAL >> 1);
         vector<CInv> vInv;
         vector<CInv> vInvWait;
         {
             LOCK(pto->cs_inventory);
             vInv.reserve(pto->vInventoryToSend.size());
-            vInvWait.reserve(pto->vInventoryToSend.size());
             BOOST_FOREACH (const CInv& inv, pto->vInventoryToSend) {
-                if (pto->setInventoryKnown.count(inv))
+                uint256 hashKnown = CNode::InventoryKnownKey(inv);
+                if (pto->filterInventoryKnown.contains(hashKnown))
                     continue;
 
-                // trickle out tx inv to protect privacy
-                if (inv.type == MSG_TX && !fSendTrickle) {
-                    // 1/4 of tx invs blast to all immediately
-                    static uint256 hashSalt;
-                    if (hashSalt == 0)
-                        hashSalt = GetRandHash();
-                    uint256 hashRand = inv.hash ^ hashSalt;
-                    hashRand = Hash(BEGIN(hashRand), END(hashRand));
-                    bool fTrickleWait = ((hashRand & 3) != 0);
-
-                    if (fTrickleWait) {
-                        vInvWait.push_back(inv);
-                        continue;
-                    }
+                if (inv.type == MSG_TX && !fSendTxInv) {
+                    vInvWait.push_back(inv);
+                    continue;
                 }
 
-                // returns true if wasn't already contained in the set
-                if (pto->setInventoryKnown.insert(inv).second) {
-                    vInv.push_back(inv);
-                    if (vInv.size() >= 1000) {
-                        pto->PushMessage("inv", vInv);
-                        vInv.clear();
-                    }
+                pto->filterInventoryKnown.insert(hashKnown);
+                vInv.push_back(inv);
+                if (vInv.size() >= 1000) {
+                    pto->PushMessage("inv", vInv);
+                    vInv.clear();
                 }
             }
-            pto->vInventoryToSend = vInvWait;
+            pto->vInventoryToSend.swap(vInvWait);
         }
         if (!vInv.empty())
             pto->PushMessage("inv", vInv);
 
         // Detect whether we're stalling
-        int64_t nNow = GetTimeMicros();
         if (!pto->fDisconnect && state.nStallingSince && state.nStallingSince < nNow - 1000000 * BLOCK_STALLING_TIMEOUT) {
             // Stalling only triggers when the block download window cannot move. During normal steady state,
             // the download window should be much larger than the to-be-downloaded set of blocks, so disconnection
@@ -8065,8 +8973,7 @@ public:
         mapBlockIndex.clear();
 
         // orphan transactions
-        mapOrphanTransactions.clear();
-        mapOrphanTransactionsByPrev.clear();
+        orphanpool.Clear();
     }
 } instance_of_cmaincleanup;
 
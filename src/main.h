@@ -41,23 +41,27 @@
 #include <string>
 #include <utility>
 #include <vector>
+#include <memory>
 #include <mutex>
 //#include <shared_mutex>
 #include <boost/thread/shared_mutex.hpp>
 #include <algorithm>
 
+#include "libzerocoin/Accumulator.h"
 #include "libzerocoin/CoinSpend.h"
 
 #include <boost/unordered_map.hpp>
 
 class CBlockIndex;
 class CBlockTreeDB;
+class CBlockUndo;
 class CBlockFileTreeDB;
 class CZerocoinDB;
 class CSporkDB;
 class CBloomFilter;
 class CInv;
 class CScriptCheck;
+class CZerocoinSpendCheck;
 class CValidationInterface;
 class CValidationState;
 class CWalletTx;
@@ -85,6 +89,24 @@ static const unsigned int MAX_TX_SIGOPS_CURRENT = MAX_BLOCK_SIGOPS_CURRENT / 5;
 static const unsigned int MAX_TX_SIGOPS_LEGACY = MAX_BLOCK_SIGOPS_LEGACY / 5;
 /** Default for -maxorphantx, maximum number of orphan transactions kept in memory */
 static const unsigned int DEFAULT_MAX_ORPHAN_TRANSACTIONS = 100;
+/** Default for -maxorphansize, maximum kilobytes of orphan transactions kept in memory */
+static const unsigned int DEFAULT_MAX_ORPHAN_SIZE = 250;
+/** Default for -maxmempool, maximum megabytes of mempool memory usage */
+static const unsigned int DEFAULT_MAX_MEMPOOL_SIZE = 300;
+/** Default for -limitancestorcount, max number of in-mempool ancestors */
+static const unsigned int DEFAULT_ANCESTOR_LIMIT = 25;
+/** Default for -limitancestorsize, maximum kilobytes of tx + all in-mempool ancestors */
+static const unsigned int DEFAULT_ANCESTOR_SIZE_LIMIT = 101;
+/** Default for -limitdescendantcount, max number of in-mempool descendants */
+static const unsigned int DEFAULT_DESCENDANT_LIMIT = 25;
+/** Default for -limitdescendantsize, maximum kilobytes of in-mempool descendants */
+static const unsigned int DEFAULT_DESCENDANT_SIZE_LIMIT = 101;
+/** Default for -persistmempool, saving the mempool on shutdown and loading it on startup */
+static const bool DEFAULT_PERSIST_MEMPOOL = true;
+/** Seconds between mempool.dat writes while running */
+static const int64_t MEMPOOL_DUMP_INTERVAL = 15 * 60;
+/** Saved transactions whose signatures are checked together when mempool.dat is loaded */
+static const unsigned int MEMPOOL_LOAD_BATCH_SIZE = 1000;
 /** The maximum size of a blk?????.dat file (since 0.8) */
 static const unsigned int MAX_BLOCKFILE_SIZE = 0x8000000; // 128 MiB
 /** The pre-allocation chunk size for blk?????.dat files (since 0.8) */
@@ -108,10 +130,16 @@ static const unsigned int LOCKTIME_THRESHOLD = 500000000; // Tue Nov  5 00:53:20
 static const int MAX_SCRIPTCHECK_THREADS = 16;
 /** -par default (number of script-checking threads, 0 = auto) */
 static const int DEFAULT_SCRIPTCHECK_THREADS = 0;
+/** -txverifythreads default (threads validating relayed transactions, 0 = on the message handler thread) */
+static const int DEFAULT_TXVERIFY_THREADS = 2;
+/** Maximum number of relayed transactions waiting for the -txverifythreads */
+static const unsigned int MAX_TXVERIFY_QUEUE = 1000;
 /** Number of blocks that can be requested at any given time from a single peer. */
 static const int MAX_BLOCKS_IN_TRANSIT_PER_PEER = 16;
 /** Timeout in seconds during which a peer must stall block download progress before being disconnected. */
 static const unsigned int BLOCK_STALLING_TIMEOUT = 2;
+/** Average delay between batched transaction invs to inbound peers in seconds; outbound peers get half of it. */
+static const unsigned int INVENTORY_BROADCAST_INTERVAL = 5;
 
 //region file
 /** Number of files that can be requested at any given time from a single peer. */
@@ -326,6 +354,7 @@ extern CCriticalSection cs_main;
 extern CTxMemPool mempool;
 typedef boost::unordered_map<uint256, CBlockIndex*, BlockHasher> BlockMap;
 extern BlockMap mapBlockIndex;
+extern CBlockIndexArena blockIndexArena;
 
 
 extern uint64_t nLastBlockTx;
@@ -337,10 +366,12 @@ extern CConditionVariable cvBlockChange;
 extern bool fImporting;
 extern bool fReindex;
 extern int nScriptCheckThreads;
+extern int nTxVerifyThreads;
 extern bool fTxIndex;
 extern bool fIsBareMultisigStd;
 extern bool fCheckBlockIndex;
-extern unsigned int nCoinCacheSize;
+/** Heap memory the in-memory UTXO cache may use before it is flushed, in bytes */
+extern size_t nCoinCacheUsage;
 extern CFeeRate minRelayTxFee;
 extern CFileFeeRate minFileFee;
 extern bool fAlerts;
@@ -469,6 +500,14 @@ bool SendHasFileRequest(CNode* pto, const uint256& fileTxHash);
 
 /** Run an instance of the script checking thread */
 void ThreadScriptCheck();
+/** Run an instance of the relayed transaction validation thread */
+void ThreadTxVerify();
+/** Write the mempool with its arrival times and prioritisation to mempool.dat */
+bool DumpMempool();
+/** Add the transactions saved in mempool.dat back to the mempool */
+bool LoadMempool();
+/** Write chainstate flushes in the background, outside cs_main */
+void ThreadFlushChainState();
 
 // ***TODO*** probably not the right place for these 2
 /** Check whether a block hash satisfies the proof-of-work requirement specified by nBits */
@@ -617,9 +656,9 @@ bool CheckInputs(const CTransaction& tx, CValidationState& state, const CCoinsVi
 void UpdateCoins(const CTransaction& tx, CValidationState& state, CCoinsViewCache& inputs, CTxUndo& txundo, int nHeight);
 
 /** Context-independent validity checks */
-bool CheckTransaction(const CTransaction& tx, bool fZerocoinActive, CValidationState& state);
+bool CheckTransaction(const CTransaction& tx, bool fZerocoinActive, CValidationState& state, bool fVerifyZerocoinProofs = true);
 bool CheckZerocoinMint(const uint256& txHash, const CTxOut& txout, CValidationState& state, bool fCheckOnly = false);
-bool CheckZerocoinSpend(const CTransaction& tx, bool fVerifySignature, CValidationState& state);
+bool CheckZerocoinSpend(const CTransaction& tx, bool fVerifySignature, CValidationState& state, std::vector<CZerocoinSpendCheck>* pvChecks = NULL);
 bool ContextualCheckZerocoinSpend(const CTransaction& tx, const libzerocoin::CoinSpend& spend, CBlockIndex* pindex);
 libzerocoin::CoinSpend TxInToZerocoinSpend(const CTxIn& txin);
 bool TxOutToPublicCoin(const CTxOut txout, libzerocoin::PublicCoin& pubCoin, CValidationState& state);
@@ -645,6 +684,12 @@ bool IsFileExistByTx(const uint256& fileTxHash);
 bool ValidOutPoint(const COutPoint out, int nHeight);
 void RecalculateZPIVSpent();
 void RecalculateZPIVMinted();
+/**
+ * Sum the value a block spends and creates, as counted in the money supply.
+ * Spent outputs are taken from pblockUndo when it is given and matches the
+ * block, otherwise they are looked up in the transaction index.
+ */
+bool GetBlockValueInOut(const CBlock& block, const CBlockUndo* pblockUndo, CAmount& nValueIn, CAmount& nValueOut, size_t& nTxLookups);
 bool RecalculatePIVSupply(int nHeightStart);
 bool ReindexAccumulators(list<uint256>& listMissingCheckpoints, string& strError);
 
@@ -720,6 +765,121 @@ public:
     ScriptError GetScriptError() const { return error; }
 };
 
+/**
+ * Closure representing the verification of one zerocoin spend proof against
+ * the accumulator it was made for. The accumulator is looked up on the
+ * calling thread; only the proof itself is checked here.
+ */
+class CZerocoinSpendCheck
+{
+private:
+    // shared so that the queue can move empty checks around cheaply
+    std::shared_ptr<const libzerocoin::CoinSpend> pspend;
+    std::shared_ptr<const libzerocoin::Accumulator> paccumulator;
+    uint256 txid;
+    uint256 hashProof; // key in the verified spend cache
+
+public:
+    CZerocoinSpendCheck() {}
+    CZerocoinSpendCheck(const libzerocoin::CoinSpend& spendIn, const libzerocoin::Accumulator& accumulatorIn, const uint256& txidIn, const uint256& hashProofIn) : pspend(std::make_shared<const libzerocoin::CoinSpend>(spendIn)),
+                                                                                                                                                                    paccumulator(std::make_shared<const libzerocoin::Accumulator>(accumulatorIn)),
+                                                                                                                                                                    txid(txidIn), hashProof(hashProofIn) {}
+
+    bool operator()();
+
+    void swap(CZerocoinSpendCheck& check)
+    {
+        pspend.swap(check.pspend);
+        paccumulator.swap(check.paccumulator);
+        std::swap(txid, check.txid);
+        std::swap(hashProof, check.hashProof);
+    }
+};
+
+/** One job for the -par verification threads: a script or a zerocoin spend proof */
+class CBlockCheck
+{
+private:
+    CScriptCheck script;
+    CZerocoinSpendCheck zerocoin;
+    bool fZerocoin;
+
+public:
+    CBlockCheck() : fZerocoin(false) {}
+    explicit CBlockCheck(CScriptCheck& check) : fZerocoin(false) { script.swap(check); }
+    explicit CBlockCheck(CZerocoinSpendCheck& check) : fZerocoin(true) { zerocoin.swap(check); }
+
+    bool operator()() { return fZerocoin ? zerocoin() : script(); }
+
+    void swap(CBlockCheck& check)
+    {
+        script.swap(check.script);
+        zerocoin.swap(check.zerocoin);
+        std::swap(fZerocoin, check.fZerocoin);
+    }
+};
+
+/**
+ * A transaction on its way into the mempool. Prepare looks up its inputs and
+ * does the contextual checks under cs_main, leaving the signature and zerocoin
+ * proof checks in here; Verify runs those without holding any lock, and Finish
+ * takes cs_main again to insert the transaction.
+ */
+struct CMempoolAccept {
+    const CTransaction tx;
+    bool fLimitFree;
+    bool fRejectInsaneFee;
+    bool ignoreFees;
+
+    //! Set when the context-free CheckTransaction already ran, and with which zerocoin setting
+    bool fCheckedTx;
+    bool fZerocoinActive;
+
+    //! The inputs, copied out of the coins cache and the mempool
+    CCoinsView dummy;
+    CCoinsViewCache view;
+
+    //! What the lookups were made against; Finish prepares again after a new tip and rechecks after a pool change
+    uint256 hashBestBlock;
+    unsigned int nTransactionsUpdated;
+
+    CAmount nFees;
+    double dPriority;
+    int nHeight;
+    bool fRateLimit; //!< counts against -limitfreerelay
+    bool fBypassRateLimit; //!< already counted when it first arrived, like the transactions in mempool.dat
+    bool fObfuscation;
+    int64_t nAcceptTime; //!< arrival time for the entry, 0 for now
+
+    std::vector<CScriptCheck> vScriptChecks;
+    std::vector<CScriptCheck> vMandatoryChecks;
+    std::vector<CZerocoinSpendCheck> vZerocoinChecks;
+
+    CMempoolAccept(const CTransaction& txIn, bool fLimitFreeIn, bool fRejectInsaneFeeIn, bool ignoreFeesIn) : tx(txIn), fLimitFree(fLimitFreeIn), fRejectInsaneFee(fRejectInsaneFeeIn), ignoreFees(ignoreFeesIn),
+                                                                                                              fCheckedTx(false), fZerocoinActive(false), view(&dummy), nTransactionsUpdated(0),
+                                                                                                              nFees(0), dPriority(0), nHeight(0), fRateLimit(false), fBypassRateLimit(false), fObfuscation(false), nAcceptTime(0) {}
+};
+
+/**
+ * First phase of AcceptToMemoryPool: everything that needs the chain or the
+ * mempool. Script and zerocoin proof checks are only collected.
+ */
+bool PrepareMempoolAccept(CTxMemPool& pool, CValidationState& state, CMempoolAccept& accept, bool* pfMissingInputs);
+/**
+ * Second phase of AcceptToMemoryPool: the signature and zerocoin proof
+ * checks. This touches nothing but the transaction, its inputs and the
+ * thread-safe verification caches, so it runs without cs_main.
+ */
+bool VerifyMempoolAccept(CValidationState& state, CMempoolAccept& accept);
+/**
+ * Last phase of AcceptToMemoryPool: insert the transaction. If a block came
+ * in since it was prepared, it is prepared and verified again; the
+ * signatures and proofs are in the caches by then, so that is cheap. If only
+ * the mempool changed, just the inputs, conflicts, fees and package limits
+ * are checked again.
+ */
+bool FinishMempoolAccept(CTxMemPool& pool, CValidationState& state, CMempoolAccept& accept, bool* pfMissingInputs);
+
 /** Functions for disk access for blocks */
 bool WriteBlockToDisk(CBlock& block, CDiskBlockPos& pos);
 bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos);
@@ -849,6 +1009,9 @@ extern CChain chainActive;
 /** Global variable that points to the active CCoinsView (protected by cs_main) */
 extern CCoinsViewCache* pcoinsTip;
 
+/** Changes flushed from pcoinsTip that the chainstate flusher is writing to the database */
+extern CCoinsViewFrozen* pcoinsFrozen;
+
 /** Global variable that points to the active block tree (protected by cs_main) */
 extern CBlockTreeDB* pblocktree;
 
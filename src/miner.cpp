@@ -31,7 +31,6 @@
 
 
 #include <boost/thread.hpp>
-#include <boost/tuple/tuple.hpp>
 
 using namespace std;
 
@@ -40,54 +39,520 @@ using namespace std;
 // PDGMiner
 //
 
+uint64_t nLastBlockTx = 0;
+uint64_t nLastBlockSize = 0;
+int64_t nLastCoinStakeSearchInterval = 0;
+
 //
 // Unconfirmed transactions in the memory pool often depend on other
-// transactions in the memory pool. When we select transactions from the
-// pool, we select by highest priority or fee rate, so we might consider
-// transactions that depend on transactions that aren't yet in the block.
-// The COrphan class keeps track of these 'temporary orphans' while
-// CreateBlock is figuring out which transactions to include.
+// transactions in the memory pool. The mempool keeps the fee and size of
+// every transaction's in-pool ancestors, and sorts them by that ancestor
+// fee rate, so the block is filled by walking that index and adding each
+// transaction together with the ancestors it needs. Once a package is in
+// the block only its descendants have to be rescored.
 //
-class COrphan
-{
-public:
-    const CTransaction* ptx;
-    set<uint256> setDependsOn;
-    CFeeRate feeRate;
-    double dPriority;
+struct CompareTxIterByAncestorCount {
+    bool operator()(const CTxMemPool::txiter& a, const CTxMemPool::txiter& b) const
+    {
+        if (a->GetCountWithAncestors() != b->GetCountWithAncestors())
+            return a->GetCountWithAncestors() < b->GetCountWithAncestors();
+        return CTxMemPool::CompareIteratorByHash()(a, b);
+    }
+};
 
-    COrphan(const CTransaction* ptxIn) : ptx(ptxIn), feeRate(0), dPriority(0)
+struct update_for_parent_inclusion {
+    update_for_parent_inclusion(CTxMemPool::txiter it) : iter(it) {}
+
+    void operator()(CTxMemPoolModifiedEntry& e)
     {
+        e.nSizeWithAncestors -= iter->GetTxSize();
+        e.nModFeesWithAncestors -= iter->GetModifiedFee();
     }
+
+private:
+    CTxMemPool::txiter iter;
 };
 
-uint64_t nLastBlockTx = 0;
-uint64_t nLastBlockSize = 0;
-int64_t nLastCoinStakeSearchInterval = 0;
+CTxPackageSelector::CTxPackageSelector(const CTxMemPool& poolIn) : pool(poolIn), fCurrentModified(false)
+{
+    mi = pool.mapTx.get<ancestor_score>().begin();
+    iterCurrent = pool.mapTx.end();
+}
 
-// We want to sort transactions by priority and fee rate, so:
-typedef boost::tuple<double, CFeeRate, const CTransaction*> TxPriority;
-class TxPriorityCompare
+bool CTxPackageSelector::Next(uint64_t nMaxSize, std::vector<CTxMemPool::txiter>& vPackage, uint64_t& nPackageSize, CAmount& nPackageFees)
 {
-    bool byFee;
+    static const int64_t MAX_CONSECUTIVE_FAILURES = 1000;
+    int64_t nConsecutiveFailed = 0;
+
+    vPackage.clear();
+    while (mi != pool.mapTx.get<ancestor_score>().end() || !mapModifiedTx.empty()) {
+        // Skip entries that are already in the block, failed, or whose
+        // score changed and which are therefore found in mapModifiedTx
+        if (mi != pool.mapTx.get<ancestor_score>().end()) {
+            CTxMemPool::txiter it = pool.mapTx.project<0>(mi);
+            if (setInBlock.count(it) || setFailed.count(it) || mapModifiedTx.count(it)) {
+                ++mi;
+                continue;
+            }
+        }
+
+        // Take the better of the next unmodified entry and the best modified one
+        indexed_modified_transaction_set::index<ancestor_score>::type::iterator modit = mapModifiedTx.get<ancestor_score>().begin();
+        if (mi == pool.mapTx.get<ancestor_score>().end()) {
+            iterCurrent = modit->iter;
+            fCurrentModified = true;
+        } else {
+            iterCurrent = pool.mapTx.project<0>(mi);
+            fCurrentModified = modit != mapModifiedTx.get<ancestor_score>().end() &&
+                               CompareTxMemPoolEntryByAncestorFee()(*modit, CTxMemPoolModifiedEntry(iterCurrent));
+            if (fCurrentModified)
+                iterCurrent = modit->iter;
+            else
+                ++mi;
+        }
+
+        if (fCurrentModified) {
+            nPackageSize = modit->nSizeWithAncestors;
+            nPackageFees = modit->nModFeesWithAncestors;
+        } else {
+            nPackageSize = iterCurrent->GetSizeWithAncestors();
+            nPackageFees = iterCurrent->GetModFeesWithAncestors();
+        }
 
-public:
-    TxPriorityCompare(bool _byFee) : byFee(_byFee) {}
+        if (nPackageSize >= nMaxSize) {
+            Skip();
+            // Give up once the block is nearly full and nothing fits anymore
+            if (++nConsecutiveFailed > MAX_CONSECUTIVE_FAILURES && nMaxSize < 4000)
+                return false;
+            continue;
+        }
+
+        CTxMemPool::setEntries setAncestors;
+        pool.CalculateMemPoolAncestors(iterCurrent, setAncestors);
+        bool fFailedAncestor = false;
+        BOOST_FOREACH (CTxMemPool::txiter it, setAncestors) {
+            if (setFailed.count(it)) {
+                fFailedAncestor = true;
+                break;
+            }
+            if (!setInBlock.count(it))
+                vPackage.push_back(it);
+        }
+        if (fFailedAncestor) {
+            vPackage.clear();
+            Skip();
+            continue;
+        }
+        vPackage.push_back(iterCurrent);
 
-    bool operator()(const TxPriority& a, const TxPriority& b)
+        // An ancestor always has fewer ancestors than its descendants, so
+        // this puts parents before children
+        std::sort(vPackage.begin(), vPackage.end(), CompareTxIterByAncestorCount());
+        return true;
+    }
+    return false;
+}
+
+void CTxPackageSelector::Added(const std::vector<CTxMemPool::txiter>& vPackage)
+{
+    BOOST_FOREACH (CTxMemPool::txiter it, vPackage) {
+        setInBlock.insert(it);
+        mapModifiedTx.erase(it);
+    }
+
+    // Descendants left behind no longer pay for these ancestors
+    BOOST_FOREACH (CTxMemPool::txiter it, vPackage) {
+        CTxMemPool::setEntries setDescendants;
+        pool.CalculateDescendants(it, setDescendants);
+        BOOST_FOREACH (CTxMemPool::txiter itDescendant, setDescendants) {
+            if (setInBlock.count(itDescendant))
+                continue;
+            indexed_modified_transaction_set::iterator mit = mapModifiedTx.find(itDescendant);
+            if (mit == mapModifiedTx.end())
+                mit = mapModifiedTx.insert(CTxMemPoolModifiedEntry(itDescendant)).first;
+            mapModifiedTx.modify(mit, update_for_parent_inclusion(it));
+        }
+    }
+    iterCurrent = pool.mapTx.end();
+}
+
+void CTxPackageSelector::Skip(CTxMemPool::txiter itFailed)
+{
+    setFailed.insert(itFailed);
+    Skip();
+}
+
+void CTxPackageSelector::Skip()
+{
+    if (iterCurrent == pool.mapTx.end())
+        return;
+    if (fCurrentModified)
+        mapModifiedTx.erase(iterCurrent);
+    setFailed.insert(iterCurrent);
+    iterCurrent = pool.mapTx.end();
+}
+
+/** Mempool transactions picked for a block, and what they add up to */
+struct CBlockAssembly {
+    vector<CTransaction> vtx;
+    vector<CAmount> vTxFees;
+    vector<int64_t> vTxSigOps;
+    uint64_t nBlockSize;
+    unsigned int nBlockSigOps;
+    CAmount nFees;
+    vector<CBigNum> vBlockSerials;
+    bool fPrintPriority;
+
+    CBlockAssembly()
     {
-        if (byFee) {
-            if (a.get<1>() == b.get<1>())
-                return a.get<0>() < b.get<0>();
-            return a.get<1>() < b.get<1>();
+        // Room for the coinbase and coinstake
+        nBlockSize = 1000;
+        nBlockSigOps = 100;
+        nFees = 0;
+        fPrintPriority = false;
+    }
+};
+
+static void AppendToBlock(CBlockAssembly& block, CTxMemPool::txiter it, CAmount nTxFees, int64_t nTxSigOps, int nHeight)
+{
+    const CTransaction& tx = it->GetTx();
+    block.vtx.push_back(tx);
+    block.vTxFees.push_back(nTxFees);
+    block.vTxSigOps.push_back(nTxSigOps);
+    block.nBlockSize += it->GetTxSize();
+    block.nBlockSigOps += nTxSigOps;
+    block.nFees += nTxFees;
+
+    if (block.fPrintPriority) {
+        LogPrintf("priority %.1f fee %s txid %s\n",
+            it->GetPriority(nHeight), CFeeRate(it->GetModifiedFee(), it->GetTxSize()).ToString(), tx.GetHash().ToString());
+    }
+}
+
+/**
+ * Check every transaction of a package against the block so far and add
+ * them all, or none. On failure itFailed is the offending transaction.
+ */
+static bool AddPackageToBlock(CBlockAssembly& block, CCoinsViewCache& view, int nHeight, const std::vector<CTxMemPool::txiter>& vPackage, CTxMemPool::txiter& itFailed)
+{
+    const unsigned int nMaxBlockSigOps = MAX_BLOCK_SIGOPS_CURRENT;
+
+    // Cheap checks first
+    unsigned int nPackageSigOps = 0;
+    BOOST_FOREACH (CTxMemPool::txiter it, vPackage) {
+        const CTransaction& tx = it->GetTx();
+        itFailed = it;
+        if (tx.IsCoinBase() || tx.IsCoinStake() || !IsFinalTx(tx, nHeight))
+            return false;
+        if (GetAdjustedTime() > GetSporkValue(SPORK_16_ZEROCOIN_MAINTENANCE_MODE) && tx.ContainsZerocoins())
+            return false;
+        nPackageSigOps += GetLegacySigOpCount(tx);
+        if (block.nBlockSigOps + nPackageSigOps >= nMaxBlockSigOps)
+            return false;
+    }
+
+    CCoinsViewCache viewPackage(&view);
+    vector<CBigNum> vPackageSerials;
+    vector<CAmount> vTxFees;
+    vector<int64_t> vTxSigOps;
+    nPackageSigOps = 0;
+    BOOST_FOREACH (CTxMemPool::txiter it, vPackage) {
+        const CTransaction& tx = it->GetTx();
+        itFailed = it;
+
+        if (!viewPackage.HaveInputs(tx))
+            return false;
+
+        if (!tx.IsZerocoinSpend()) {
+            //Check for invalid/fraudulent inputs. They shouldn't make it through mempool, but check anyways.
+            BOOST_FOREACH (const CTxIn& txin, tx.vin) {
+                if (invalid_out::ContainsOutPoint(txin.prevout)) {
+                    LogPrintf("%s : found invalid input %s in tx %s", __func__, txin.prevout.ToString(), tx.GetHash().ToString());
+                    return false;
+                }
+            }
         } else {
-            if (a.get<0>() == b.get<0>())
-                return a.get<1>() < b.get<1>();
-            return a.get<0>() < b.get<0>();
+            // double check that there are no double spent zPDG spends in this block or tx
+            int nHeightTx = 0;
+            if (IsTransactionInChain(tx.GetHash(), nHeightTx))
+                return false;
+
+            for (const CTxIn& txIn : tx.vin) {
+                if (txIn.scriptSig.IsZerocoinSpend()) {
+                    libzerocoin::CoinSpend spend = TxInToZerocoinSpend(txIn);
+                    bool fUseV1Params = libzerocoin::ExtractVersionFromSerial(spend.getCoinSerialNumber()) < libzerocoin::PrivateCoin::PUBKEY_VERSION;
+                    if (!spend.HasValidSerial(Params().Zerocoin_Params(fUseV1Params)))
+                        return false;
+                    //This zPDG serial has already been included in the block, do not add this tx.
+                    if (count(block.vBlockSerials.begin(), block.vBlockSerials.end(), spend.getCoinSerialNumber()))
+                        return false;
+                    if (count(vPackageSerials.begin(), vPackageSerials.end(), spend.getCoinSerialNumber()))
+                        return false;
+                    vPackageSerials.emplace_back(spend.getCoinSerialNumber());
+                }
+            }
         }
+
+        CAmount nTxFees = viewPackage.GetValueIn(tx) - tx.GetValueOut();
+
+        unsigned int nTxSigOps = GetLegacySigOpCount(tx) + GetP2SHSigOpCount(tx, viewPackage);
+        nPackageSigOps += nTxSigOps;
+        if (block.nBlockSigOps + nPackageSigOps >= nMaxBlockSigOps)
+            return false;
+
+        // Note that flags: we don't want to set mempool/IsStandard()
+        // policy here, but we still have to ensure that the block we
+        // create only contains transactions that are valid in new blocks.
+        CValidationState state;
+        if (!CheckInputs(tx, state, viewPackage, true, MANDATORY_SCRIPT_VERIFY_FLAGS, true))
+            return false;
+
+        CTxUndo txundo;
+        UpdateCoins(tx, state, viewPackage, txundo, nHeight);
+        vTxFees.push_back(nTxFees);
+        vTxSigOps.push_back(nTxSigOps);
+    }
+    viewPackage.Flush();
+
+    for (unsigned int i = 0; i < vPackage.size(); i++)
+        AppendToBlock(block, vPackage[i], vTxFees[i], vTxSigOps[i], nHeight);
+    block.vBlockSerials.insert(block.vBlockSerials.end(), vPackageSerials.begin(), vPackageSerials.end());
+    return true;
+}
+
+// We want to sort transactions by priority, so:
+typedef std::pair<double, CTxMemPool::txiter> TxPriority;
+struct TxPriorityCompare {
+    bool operator()(const TxPriority& a, const TxPriority& b) const
+    {
+        if (a.first == b.first)
+            return CTxMemPool::CompareIteratorByHash()(b.second, a.second);
+        return a.first < b.first;
     }
 };
 
+/** Block size limits from the -blockmaxsize, -blockprioritysize and -blockminsize options */
+static void GetBlockSizeLimits(unsigned int& nBlockMaxSize, unsigned int& nBlockPrioritySize, unsigned int& nBlockMinSize)
+{
+    // Largest block you're willing to create:
+    nBlockMaxSize = GetArg("-blockmaxsize", DEFAULT_BLOCK_MAX_SIZE);
+    // Limit to betweeen 1K and MAX_BLOCK_SIZE-1K for sanity:
+    unsigned int nBlockMaxSizeNetwork = MAX_BLOCK_SIZE_CURRENT;
+    nBlockMaxSize = std::max((unsigned int)1000, std::min((nBlockMaxSizeNetwork - 1000), nBlockMaxSize));
+
+    // How much of the block should be dedicated to high-priority transactions,
+    // included regardless of the fees they pay
+    nBlockPrioritySize = GetArg("-blockprioritysize", DEFAULT_BLOCK_PRIORITY_SIZE);
+    nBlockPrioritySize = std::min(nBlockMaxSize, nBlockPrioritySize);
+
+    // Minimum block size you want to create; block will be filled with free transactions
+    // until there are no more or the block reaches this size:
+    nBlockMinSize = GetArg("-blockminsize", DEFAULT_BLOCK_MIN_SIZE);
+    nBlockMinSize = std::min(nBlockMaxSize, nBlockMinSize);
+}
+
+static void AddPriorityTransactions(CBlockAssembly& block, CCoinsViewCache& view, int nHeight, CTxPackageSelector& selector, unsigned int nBlockMaxSize, unsigned int nBlockPrioritySize)
+{
+    std::vector<CTxMemPool::txiter> vPackage;
+    CTxMemPool::txiter itFailed;
+
+    // First fill the priority area with high-priority transactions that
+    // do not depend on other mempool transactions, regardless of their
+    // fees. zPDG spends are always first in line. The priority of each
+    // entry is cached by the mempool, so no coins are looked up here.
+    if (nBlockPrioritySize > 0) {
+        vector<TxPriority> vecPriority;
+        vecPriority.reserve(mempool.mapTx.size());
+        for (CTxMemPool::txiter mi = mempool.mapTx.begin(); mi != mempool.mapTx.end(); ++mi) {
+            if (mi->GetCountWithAncestors() > 1)
+                continue;
+            const CTransaction& tx = mi->GetTx();
+            uint256 txid = tx.GetHash();
+            double dPriority = mi->GetPriority(nHeight);
+            if (tx.IsZerocoinSpend()) {
+                //Give a high priority to zerocoinspends to get into the next block
+                //Priority = (age^6+100000)*amount - gives higher priority to zpivs that have been in mempool long
+                //and higher priority to zpivs that are large in value
+                int64_t nTimeSeen = GetAdjustedTime();
+                double nConfs = 100000;
+
+                auto it = mapZerocoinspends.find(txid);
+                if (it != mapZerocoinspends.end()) {
+                    nTimeSeen = it->second;
+                } else {
+                    //for some reason not in map, add it
+                    mapZerocoinspends[txid] = nTimeSeen;
+                }
+
+                double nTimePriority = std::pow(GetAdjustedTime() - nTimeSeen, 6);
+
+                // zPDG spends can have very large priority, use non-overflowing safe functions
+                dPriority = double_safe_multiplication(double_safe_addition(0, (nTimePriority * nConfs)), tx.GetZerocoinSpent());
+                dPriority = tx.ComputePriority(dPriority, mi->GetTxSize());
+            }
+            double dPriorityDelta = 0;
+            CAmount nFeeDelta = 0;
+            mempool.ApplyDeltas(txid, dPriorityDelta, nFeeDelta);
+            vecPriority.push_back(TxPriority(dPriority + dPriorityDelta, mi));
+        }
+
+        TxPriorityCompare comparer;
+        std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
+        while (!vecPriority.empty()) {
+            double dPriority = vecPriority.front().first;
+            CTxMemPool::txiter iter = vecPriority.front().second;
+            std::pop_heap(vecPriority.begin(), vecPriority.end(), comparer);
+            vecPriority.pop_back();
+
+            // The rest is ordered by fee rate once past the priority size
+            // or out of high-priority transactions
+            if (!iter->GetTx().IsZerocoinSpend() &&
+                (block.nBlockSize + iter->GetTxSize() >= nBlockPrioritySize || !AllowFree(dPriority)))
+                break;
+            if (block.nBlockSize + iter->GetTxSize() >= nBlockMaxSize)
+                continue;
+
+            vPackage.assign(1, iter);
+            if (AddPackageToBlock(block, view, nHeight, vPackage, itFailed))
+                selector.Added(vPackage);
+            else
+                selector.Skip(itFailed);
+        }
+    }
+}
+
+static void AddFeeTransactions(CBlockAssembly& block, CCoinsViewCache& view, int nHeight, CTxPackageSelector& selector, unsigned int nBlockMaxSize, unsigned int nBlockMinSize)
+{
+    std::vector<CTxMemPool::txiter> vPackage;
+    CTxMemPool::txiter itFailed;
+
+    // Then take packages by ancestor fee rate
+    uint64_t nPackageSize;
+    CAmount nPackageFees;
+    while (selector.Next(nBlockMaxSize - block.nBlockSize, vPackage, nPackageSize, nPackageFees)) {
+        // Skip free transactions if we're past the minimum block size:
+        if (!vPackage.back()->GetTx().IsZerocoinSpend() && nPackageFees < ::minRelayTxFee.GetFee(nPackageSize) &&
+            block.nBlockSize + nPackageSize >= nBlockMinSize) {
+            selector.Skip();
+            continue;
+        }
+
+        if (!AddPackageToBlock(block, view, nHeight, vPackage, itFailed)) {
+            selector.Skip(itFailed);
+            continue;
+        }
+        selector.Added(vPackage);
+    }
+}
+
+/**
+ * Carry over the transactions of an earlier template for the same tip that
+ * are still in the mempool. Their inputs, scripts, fees and sigops were
+ * checked when they were picked, so they are only applied to the view.
+ */
+static void KeepTemplateTransactions(CBlockAssembly& block, const CBlockAssembly& prev, CCoinsViewCache& view, int nHeight, CTxPackageSelector& selector)
+{
+    std::vector<CTxMemPool::txiter> vKept;
+    for (unsigned int i = 0; i < prev.vtx.size(); i++) {
+        const CTransaction& tx = prev.vtx[i];
+        // Anything that spends a transaction that left has left with it
+        CTxMemPool::txiter it = mempool.mapTx.find(tx.GetHash());
+        if (it == mempool.mapTx.end())
+            continue;
+
+        CValidationState state;
+        CTxUndo txundo;
+        UpdateCoins(tx, state, view, txundo, nHeight);
+        AppendToBlock(block, it, prev.vTxFees[i], prev.vTxSigOps[i], nHeight);
+        if (tx.IsZerocoinSpend()) {
+            for (const CTxIn& txIn : tx.vin) {
+                if (txIn.scriptSig.IsZerocoinSpend())
+                    block.vBlockSerials.emplace_back(TxInToZerocoinSpend(txIn).getCoinSerialNumber());
+            }
+        }
+        vKept.push_back(it);
+    }
+    selector.Added(vKept);
+}
+
+//! Pick the mempool transactions again at least this often (in seconds), for time locks that expired
+static const int64_t TEMPLATE_CACHE_MAX_AGE = 60;
+
+/**
+ * The mempool part of the last block template. It is reused as long as the
+ * tip and the mempool stay the same, and patched when only the mempool
+ * changed, so a staker that finds a kernel only has to add its coinstake and
+ * sign. Guarded by cs_main and mempool.cs.
+ */
+struct CTemplateCache {
+    uint256 hashPrevBlock;
+    int nHeight;
+    unsigned int nTransactionsUpdated;
+    unsigned int nBlockMaxSize;
+    bool fZerocoinMaintenance;
+    int64_t nTimeUpdated;
+    CBlockAssembly block;
+
+    CTemplateCache()
+    {
+        nHeight = -1;
+        nTransactionsUpdated = 0;
+        nBlockMaxSize = 0;
+        fZerocoinMaintenance = false;
+        nTimeUpdated = 0;
+    }
+};
+static CTemplateCache templateCache;
+
+/** Bring the cached template up to date with the tip and the mempool */
+static const CBlockAssembly& GetTemplateTransactions()
+{
+    AssertLockHeld(cs_main);
+    AssertLockHeld(mempool.cs);
+
+    unsigned int nBlockMaxSize, nBlockPrioritySize, nBlockMinSize;
+    GetBlockSizeLimits(nBlockMaxSize, nBlockPrioritySize, nBlockMinSize);
+
+    CBlockIndex* pindexPrev = chainActive.Tip();
+    const int nHeight = pindexPrev->nHeight + 1;
+    const unsigned int nTransactionsUpdated = mempool.GetTransactionsUpdated();
+    const bool fZerocoinMaintenance = GetAdjustedTime() > GetSporkValue(SPORK_16_ZEROCOIN_MAINTENANCE_MODE);
+    const int64_t nNow = GetTime();
+
+    bool fSameTip = templateCache.hashPrevBlock == pindexPrev->GetBlockHash() && templateCache.nHeight == nHeight &&
+                    templateCache.nBlockMaxSize == nBlockMaxSize && templateCache.fZerocoinMaintenance == fZerocoinMaintenance;
+    if (fSameTip && templateCache.nTransactionsUpdated == nTransactionsUpdated && nNow - templateCache.nTimeUpdated < TEMPLATE_CACHE_MAX_AGE)
+        return templateCache.block;
+
+    CCoinsViewCache view(pcoinsTip);
+    CTxPackageSelector selector(mempool);
+    CBlockAssembly block;
+    block.fPrintPriority = GetBoolArg("-printpriority", false);
+    if (fSameTip) {
+        // Keep what is still there and fill the room left by fee rate
+        KeepTemplateTransactions(block, templateCache.block, view, nHeight, selector);
+    } else {
+        AddPriorityTransactions(block, view, nHeight, selector, nBlockMaxSize, nBlockPrioritySize);
+    }
+    AddFeeTransactions(block, view, nHeight, selector, nBlockMaxSize, nBlockMinSize);
+
+    templateCache.hashPrevBlock = pindexPrev->GetBlockHash();
+    templateCache.nHeight = nHeight;
+    templateCache.nTransactionsUpdated = nTransactionsUpdated;
+    templateCache.nBlockMaxSize = nBlockMaxSize;
+    templateCache.fZerocoinMaintenance = fZerocoinMaintenance;
+    templateCache.nTimeUpdated = nNow;
+    templateCache.block = block;
+    return templateCache.block;
+}
+
+void UpdateTemplateCache()
+{
+    LOCK2(cs_main, mempool.cs);
+    if (chainActive.Tip())
+        GetTemplateTransactions();
+}
+
 void UpdateTime(CBlockHeader* pblock, const CBlockIndex* pindexPrev)
 {
     pblock->nTime = std::max(pindexPrev->GetMedianTimePast() + 1, GetAdjustedTime());
@@ -157,22 +622,6 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn, CWallet* pwallet,
             return NULL;
     }
 
-    // Largest block you're willing to create:
-    unsigned int nBlockMaxSize = GetArg("-blockmaxsize", DEFAULT_BLOCK_MAX_SIZE);
-    // Limit to betweeen 1K and MAX_BLOCK_SIZE-1K for sanity:
-    unsigned int nBlockMaxSizeNetwork = MAX_BLOCK_SIZE_CURRENT;
-    nBlockMaxSize = std::max((unsigned int)1000, std::min((nBlockMaxSizeNetwork - 1000), nBlockMaxSize));
-
-    // How much of the block should be dedicated to high-priority transactions,
-    // included regardless of the fees they pay
-    unsigned int nBlockPrioritySize = GetArg("-blockprioritysize", DEFAULT_BLOCK_PRIORITY_SIZE);
-    nBlockPrioritySize = std::min(nBlockMaxSize, nBlockPrioritySize);
-
-    // Minimum block size you want to create; block will be filled with free transactions
-    // until there are no more or the block reaches this size:
-    unsigned int nBlockMinSize = GetArg("-blockminsize", DEFAULT_BLOCK_MIN_SIZE);
-    nBlockMinSize = std::min(nBlockMaxSize, nBlockMinSize);
-
     // Collect memory pool transactions into the block
     CAmount nFees = 0;
 
@@ -181,248 +630,15 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn, CWallet* pwallet,
 
         CBlockIndex* pindexPrev = chainActive.Tip();
         const int nHeight = pindexPrev->nHeight + 1;
-        CCoinsViewCache view(pcoinsTip);
-
-        // Priority order to process transactions
-        list<COrphan> vOrphan; // list memory doesn't move
-        map<uint256, vector<COrphan*> > mapDependers;
-        bool fPrintPriority = GetBoolArg("-printpriority", false);
-
-        // This vector will be sorted into a priority queue:
-        vector<TxPriority> vecPriority;
-        vecPriority.reserve(mempool.mapTx.size());
-        for (map<uint256, CTxMemPoolEntry>::iterator mi = mempool.mapTx.begin();
-             mi != mempool.mapTx.end(); ++mi) {
-            const CTransaction& tx = mi->second.GetTx();
-
-            if (tx.IsCoinBase() || tx.IsCoinStake() || !IsFinalTx(tx, nHeight)){
-                continue;
-            }
-            if(GetAdjustedTime() > GetSporkValue(SPORK_16_ZEROCOIN_MAINTENANCE_MODE) && tx.ContainsZerocoins()){
-                continue;
-            }
-
-            COrphan* porphan = NULL;
-            double dPriority = 0;
-            CAmount nTotalIn = 0;
-            bool fMissingInputs = false;
-            uint256 txid = tx.GetHash();
-            for (const CTxIn& txin : tx.vin) {
-                //zerocoinspend has special vin
-                if (tx.IsZerocoinSpend()) {
-                    nTotalIn = tx.GetZerocoinSpent();
-
-                    //Give a high priority to zerocoinspends to get into the next block
-                    //Priority = (age^6+100000)*amount - gives higher priority to zpivs that have been in mempool long
-                    //and higher priority to zpivs that are large in value
-                    int64_t nTimeSeen = GetAdjustedTime();
-                    double nConfs = 100000;
-
-                    auto it = mapZerocoinspends.find(txid);
-                    if (it != mapZerocoinspends.end()) {
-                        nTimeSeen = it->second;
-                    } else {
-                        //for some reason not in map, add it
-                        mapZerocoinspends[txid] = nTimeSeen;
-                    }
-
-                    double nTimePriority = std::pow(GetAdjustedTime() - nTimeSeen, 6);
-
-                    // zPDG spends can have very large priority, use non-overflowing safe functions
-                    dPriority = double_safe_addition(dPriority, (nTimePriority * nConfs));
-                    dPriority = double_safe_multiplication(dPriority, nTotalIn);
-
-                    continue;
-                }
-
-                // Read prev transaction
-                if (!view.HaveCoins(txin.prevout.hash)) {
-                    // This should never happen; all transactions in the memory
-                    // pool should connect to either transactions in the chain
-                    // or other transactions in the memory pool.
-                    if (!mempool.mapTx.count(txin.prevout.hash)) {
-                        LogPrintf("ERROR: mempool transaction missing input\n");
-                        if (fDebug) assert("mempool transaction missing input" == 0);
-                        fMissingInputs = true;
-                        if (porphan)
-                            vOrphan.pop_back();
-                        break;
-                    }
-
-                    // Has to wait for dependencies
-                    if (!porphan) {
-                        // Use list for automatic deletion
-                        vOrphan.push_back(COrphan(&tx));
-                        porphan = &vOrphan.back();
-                    }
-                    mapDependers[txin.prevout.hash].push_back(porphan);
-                    porphan->setDependsOn.insert(txin.prevout.hash);
-                    nTotalIn += mempool.mapTx[txin.prevout.hash].GetTx().vout[txin.prevout.n].nValue;
-                    continue;
-                }
-
-                //Check for invalid/fraudulent inputs. They shouldn't make it through mempool, but check anyways.
-                if (invalid_out::ContainsOutPoint(txin.prevout)) {
-                    LogPrintf("%s : found invalid input %s in tx %s", __func__, txin.prevout.ToString(), tx.GetHash().ToString());
-                    fMissingInputs = true;
-                    break;
-                }
-
-                const CCoins* coins = view.AccessCoins(txin.prevout.hash);
-                assert(coins);
-
-                CAmount nValueIn = coins->vout[txin.prevout.n].nValue;
-                nTotalIn += nValueIn;
-
-                int nConf = nHeight - coins->nHeight;
-
-                // zPDG spends can have very large priority, use non-overflowing safe functions
-                dPriority = double_safe_addition(dPriority, ((double)nValueIn * nConf));
-
-            }
-            if (fMissingInputs) continue;
-
-            // Priority is sum(valuein * age) / modified_txsize
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-            dPriority = tx.ComputePriority(dPriority, nTxSize);
-
-            uint256 hash = tx.GetHash();
-            mempool.ApplyDeltas(hash, dPriority, nTotalIn);
-
-            CFeeRate feeRate(nTotalIn - tx.GetValueOut(), nTxSize);
-
-            if (porphan) {
-                porphan->dPriority = dPriority;
-                porphan->feeRate = feeRate;
-            } else
-                vecPriority.push_back(TxPriority(dPriority, feeRate, &mi->second.GetTx()));
-        }
-
-        // Collect transactions into block
-        uint64_t nBlockSize = 1000;
-        uint64_t nBlockTx = 0;
-        int nBlockSigOps = 100;
-        bool fSortedByFee = (nBlockPrioritySize <= 0);
-
-        TxPriorityCompare comparer(fSortedByFee);
-        std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
-
-        vector<CBigNum> vBlockSerials;
-        vector<CBigNum> vTxSerials;
-        while (!vecPriority.empty()) {
-            // Take highest priority transaction off the priority queue:
-            double dPriority = vecPriority.front().get<0>();
-            CFeeRate feeRate = vecPriority.front().get<1>();
-            const CTransaction& tx = *(vecPriority.front().get<2>());
-
-            std::pop_heap(vecPriority.begin(), vecPriority.end(), comparer);
-            vecPriority.pop_back();
-
-            // Size limits
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-            if (nBlockSize + nTxSize >= nBlockMaxSize)
-                continue;
-
-            // Legacy limits on sigOps:
-            unsigned int nMaxBlockSigOps = MAX_BLOCK_SIGOPS_CURRENT;
-            unsigned int nTxSigOps = GetLegacySigOpCount(tx);
-            if (nBlockSigOps + nTxSigOps >= nMaxBlockSigOps)
-                continue;
-
-            // Skip free transactions if we're past the minimum block size:
-            const uint256& hash = tx.GetHash();
-            double dPriorityDelta = 0;
-            CAmount nFeeDelta = 0;
-            mempool.ApplyDeltas(hash, dPriorityDelta, nFeeDelta);
-            if (!tx.IsZerocoinSpend() && fSortedByFee && (dPriorityDelta <= 0) && (nFeeDelta <= 0) && (feeRate < ::minRelayTxFee) && (nBlockSize + nTxSize >= nBlockMinSize))
-                continue;
-
-            // Prioritise by fee once past the priority size or we run out of high-priority
-            // transactions:
-            if (!fSortedByFee &&
-                ((nBlockSize + nTxSize >= nBlockPrioritySize) || !AllowFree(dPriority))) {
-                fSortedByFee = true;
-                comparer = TxPriorityCompare(fSortedByFee);
-                std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
-            }
-
-            if (!view.HaveInputs(tx))
-                continue;
-
-            // double check that there are no double spent zPDG spends in this block or tx
-            if (tx.IsZerocoinSpend()) {
-                int nHeightTx = 0;
-                if (IsTransactionInChain(tx.GetHash(), nHeightTx))
-                    continue;
-
-                bool fDoubleSerial = false;
-                for (const CTxIn& txIn : tx.vin) {
-                    if (txIn.scriptSig.IsZerocoinSpend()) {
-                        libzerocoin::CoinSpend spend = TxInToZerocoinSpend(txIn);
-                        bool fUseV1Params = libzerocoin::ExtractVersionFromSerial(spend.getCoinSerialNumber()) < libzerocoin::PrivateCoin::PUBKEY_VERSION;
-                        if (!spend.HasValidSerial(Params().Zerocoin_Params(fUseV1Params)))
-                            fDoubleSerial = true;
-                        if (count(vBlockSerials.begin(), vBlockSerials.end(), spend.getCoinSerialNumber()))
-                            fDoubleSerial = true;
-                        if (count(vTxSerials.begin(), vTxSerials.end(), spend.getCoinSerialNumber()))
-                            fDoubleSerial = true;
-                        if (fDoubleSerial)
-                            break;
-                        vTxSerials.emplace_back(spend.getCoinSerialNumber());
-                    }
-                }
-                //This zPDG serial has already been included in the block, do not add this tx.
-                if (fDoubleSerial)
-                    continue;
-            }
 
-            CAmount nTxFees = view.GetValueIn(tx) - tx.GetValueOut();
+        const CBlockAssembly& block = GetTemplateTransactions();
+        pblock->vtx.insert(pblock->vtx.end(), block.vtx.begin(), block.vtx.end());
+        pblocktemplate->vTxFees.insert(pblocktemplate->vTxFees.end(), block.vTxFees.begin(), block.vTxFees.end());
+        pblocktemplate->vTxSigOps.insert(pblocktemplate->vTxSigOps.end(), block.vTxSigOps.begin(), block.vTxSigOps.end());
 
-            nTxSigOps += GetP2SHSigOpCount(tx, view);
-            if (nBlockSigOps + nTxSigOps >= nMaxBlockSigOps)
-                continue;
-
-            // Note that flags: we don't want to set mempool/IsStandard()
-            // policy here, but we still have to ensure that the block we
-            // create only contains transactions that are valid in new blocks.
-
-            CValidationState state;
-            if (!CheckInputs(tx, state, view, true, MANDATORY_SCRIPT_VERIFY_FLAGS, true))
-                continue;
-
-            CTxUndo txundo;
-            UpdateCoins(tx, state, view, txundo, nHeight);
-
-            // Added
-            pblock->vtx.push_back(tx);
-            pblocktemplate->vTxFees.push_back(nTxFees);
-            pblocktemplate->vTxSigOps.push_back(nTxSigOps);
-            nBlockSize += nTxSize;
-            ++nBlockTx;
-            nBlockSigOps += nTxSigOps;
-            nFees += nTxFees;
-
-            for (const CBigNum& bnSerial : vTxSerials)
-                vBlockSerials.emplace_back(bnSerial);
-
-            if (fPrintPriority) {
-                LogPrintf("priority %.1f fee %s txid %s\n",
-                    dPriority, feeRate.ToString(), tx.GetHash().ToString());
-            }
-
-            // Add transactions that depend on this one to the priority queue
-            if (mapDependers.count(hash)) {
-                BOOST_FOREACH (COrphan* porphan, mapDependers[hash]) {
-                    if (!porphan->setDependsOn.empty()) {
-                        porphan->setDependsOn.erase(hash);
-                        if (porphan->setDependsOn.empty()) {
-                            vecPriority.push_back(TxPriority(porphan->dPriority, porphan->feeRate, porphan->ptx));
-                            std::push_heap(vecPriority.begin(), vecPriority.end(), comparer);
-                        }
-                    }
-                }
-            }
-        }
+        uint64_t nBlockSize = block.nBlockSize;
+        uint64_t nBlockTx = block.vtx.size();
+        nFees = block.nFees;
 
         if (!fProofOfStake) {
             //Masternode and general budget payments
@@ -633,6 +849,11 @@ void BitcoinMiner(CWallet* pwallet, bool fProofOfStake)
         if (!pindexPrev)
             continue;
 
+        // Have the transactions ready before searching for a kernel, so
+        // a stake that is found goes out with as little delay as possible
+        if (fProofOfStake)
+            UpdateTemplateCache();
+
         unique_ptr<CBlockTemplate> pblocktemplate(CreateNewBlockWithKey(reservekey, pwallet, fProofOfStake));
         if (!pblocktemplate.get())
             continue;
@@ -7,7 +7,13 @@
 #ifndef BITCOIN_MINER_H
 #define BITCOIN_MINER_H
 
+#include "txmempool.h"
+
 #include <stdint.h>
+#include <vector>
+
+#include <boost/multi_index/ordered_index.hpp>
+#include <boost/multi_index_container.hpp>
 
 class CBlock;
 class CBlockHeader;
@@ -18,11 +24,90 @@ class CWallet;
 
 struct CBlockTemplate;
 
+/** A mempool entry whose ancestor totals are reduced by ancestors already in the block */
+struct CTxMemPoolModifiedEntry {
+    explicit CTxMemPoolModifiedEntry(CTxMemPool::txiter entry)
+    {
+        iter = entry;
+        nSizeWithAncestors = entry->GetSizeWithAncestors();
+        nModFeesWithAncestors = entry->GetModFeesWithAncestors();
+    }
+
+    const CTransaction& GetTx() const { return iter->GetTx(); }
+    CAmount GetModifiedFee() const { return iter->GetModifiedFee(); }
+    size_t GetTxSize() const { return iter->GetTxSize(); }
+    uint64_t GetSizeWithAncestors() const { return nSizeWithAncestors; }
+    CAmount GetModFeesWithAncestors() const { return nModFeesWithAncestors; }
+
+    CTxMemPool::txiter iter;
+    uint64_t nSizeWithAncestors;
+    CAmount nModFeesWithAncestors;
+};
+
+struct modifiedentry_iter {
+    typedef CTxMemPool::txiter result_type;
+    result_type operator()(const CTxMemPoolModifiedEntry& entry) const
+    {
+        return entry.iter;
+    }
+};
+
+typedef boost::multi_index_container<
+    CTxMemPoolModifiedEntry,
+    boost::multi_index::indexed_by<
+        boost::multi_index::ordered_unique<
+            modifiedentry_iter,
+            CTxMemPool::CompareIteratorByHash>,
+        // sorted by modified ancestor fee rate, best first
+        boost::multi_index::ordered_non_unique<
+            boost::multi_index::tag<ancestor_score>,
+            boost::multi_index::identity<CTxMemPoolModifiedEntry>,
+            CompareTxMemPoolEntryByAncestorFee> > >
+    indexed_modified_transaction_set;
+
+/**
+ * Hands out mempool transactions for a block template as packages: a
+ * transaction together with the ancestors that are not yet in the block,
+ * parents first, best ancestor fee rate first. The mempool keeps the ancestor
+ * totals up to date, so only the descendants of what was actually added have
+ * to be rescored. The pool's cs must be held while the selector is in use.
+ */
+class CTxPackageSelector
+{
+private:
+    const CTxMemPool& pool;
+    CTxMemPool::setEntries setInBlock;
+    CTxMemPool::setEntries setFailed;
+    indexed_modified_transaction_set mapModifiedTx;
+    CTxMemPool::indexed_transaction_set::index<ancestor_score>::type::const_iterator mi;
+    CTxMemPool::txiter iterCurrent;
+    bool fCurrentModified;
+
+public:
+    explicit CTxPackageSelector(const CTxMemPool& poolIn);
+
+    /**
+     * Select the best remaining package smaller than nMaxSize bytes. Returns
+     * false once the pool is exhausted, or when the block is nearly full and
+     * nothing has fit for a while.
+     */
+    bool Next(uint64_t nMaxSize, std::vector<CTxMemPool::txiter>& vPackage, uint64_t& nPackageSize, CAmount& nPackageFees);
+    /** The package was put into the block (it does not need to come from Next) */
+    void Added(const std::vector<CTxMemPool::txiter>& vPackage);
+    /** The last package from Next() was not used. Packages containing itFailed are not offered again. */
+    void Skip(CTxMemPool::txiter itFailed);
+    void Skip();
+
+    bool IsInBlock(CTxMemPool::txiter it) const { return setInBlock.count(it) != 0; }
+};
+
 /** Run the miner threads */
 void GenerateBitcoins(bool fGenerate, CWallet* pwallet, int nThreads);
 /** Generate a new block, without valid proof-of-work */
 CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn, CWallet* pwallet, bool fProofOfStake);
 CBlockTemplate* CreateNewBlockWithKey(CReserveKey& reservekey, CWallet* pwallet, bool fProofOfStake);
+/** Pick the mempool transactions for the next block now, if the tip or the mempool changed since the last template */
+void UpdateTemplateCache();
 /** Modify the extranonce in a block */
 void IncrementExtraNonce(CBlock* pblock, CBlockIndex* pindexPrev, unsigned int& nExtraNonce);
 /** Check mined block */
@@ -21,6 +21,8 @@
 #include "ui_interface.h"
 #include "wallet.h"
 
+#include <math.h>
+
 #ifdef WIN32
 #include <string.h>
 #else
@@ -73,6 +75,10 @@ using namespace std;
 namespace
 {
 const int MAX_OUTBOUND_CONNECTIONS = 16;
+/** Number of outbound connection attempts that may be in progress at the same time */
+const int MAX_PARALLEL_CONNECTS = 4;
+/** Delay between starting the parallel dialers, so attempts are staggered rather than simultaneous */
+const int PARALLEL_CONNECT_STAGGER_MS = 250;
 
 struct ListenSocket {
     SOCKET socket;
@@ -118,6 +124,11 @@ NodeId nLastNodeId = 0;
 CCriticalSection cs_nLastNodeId;
 
 static CSemaphore* semOutbound = NULL;
+
+/** Network groups an outbound connection is currently being attempted to */
+static set<vector<unsigned char> > setDialingGroups;
+static CCriticalSection cs_setDialingGroups;
+static int64_t nOutboundFullTime = 0;
 boost::condition_variable messageHandlerCondition;
 
 // Signals for message handling
@@ -763,6 +774,48 @@ bool CNode::ReceiveMsgBytes(const char* pch, unsigned int nBytes)
     return true;
 }
 
+uint64_t CNetMessage::nTotalBufferedBytes = 0;
+CCriticalSection CNetMessage::cs_totalBufferedBytes;
+
+CNetMessage::CNetMessage(const CNetMessage& other) : in_data(other.in_data), hdrbuf(other.hdrbuf), hdr(other.hdr), nHdrPos(other.nHdrPos),
+                                                     vRecv(other.vRecv), nDataPos(other.nDataPos), nTime(other.nTime), nBufferedBytes(0)
+{
+    Account(other.nBufferedBytes);
+}
+
+CNetMessage& CNetMessage::operator=(const CNetMessage& other)
+{
+    in_data = other.in_data;
+    hdrbuf = other.hdrbuf;
+    hdr = other.hdr;
+    nHdrPos = other.nHdrPos;
+    vRecv = other.vRecv;
+    nDataPos = other.nDataPos;
+    nTime = other.nTime;
+    Account(other.nBufferedBytes);
+    return *this;
+}
+
+CNetMessage::~CNetMessage()
+{
+    Account(0);
+}
+
+void CNetMessage::Account(uint64_t nNewBufferedBytes)
+{
+    if (nNewBufferedBytes == nBufferedBytes)
+        return;
+    LOCK(cs_totalBufferedBytes);
+    nTotalBufferedBytes = nTotalBufferedBytes - nBufferedBytes + nNewBufferedBytes;
+    nBufferedBytes = nNewBufferedBytes;
+}
+
+uint64_t CNetMessage::GetTotalBufferedBytes()
+{
+    LOCK(cs_totalBufferedBytes);
+    return nTotalBufferedBytes;
+}
+
 int CNetMessage::readHeader(const char* pch, unsigned int nBytes)
 {
     // copy data to temporary parsing buffer
@@ -801,6 +854,7 @@ int CNetMessage::readData(const char* pch, unsigned int nBytes)
     if (vRecv.size() < nDataPos + nCopy) {
         // Allocate up to 256 KiB ahead, but never more than the total message size.
         vRecv.resize(std::min(hdr.nMessageSize, nDataPos + nCopy + 256 * 1024));
+        Account(hdrbuf.size() + vRecv.size());
     }
 
     memcpy(&vRecv[nDataPos], pch, nCopy);
@@ -811,12 +865,82 @@ int CNetMessage::readData(const char* pch, unsigned int nBytes)
 
 
 // requires LOCK(cs_vSend)
-void SocketSendData(CNode* pnode)
+SendPriority GetSendPriority(const char* pszCommand)
+{
+    // Small, latency sensitive messages and everything needed to propagate a block
+    static const char* const ppszCritical[] = {
+        "version", "verack", "ping", "pong", "reject", "alert",
+        "inv", "getdata", "notfound", "getblocks", "getheaders", "headers",
+        "block", "merkleblock", "sendcmpct", "cmpctblock", "getblocktxn", "blocktxn"};
+    // Masternode, budget, spork and obfuscation traffic
+    static const char* const ppszMasternode[] = {
+        "mnb", "mnp", "mnw", "mnget", "mnvs", "dseg", "dsee", "dseep", "ssc",
+        "spork", "getsporks", "mprop", "mvote", "fbs", "fbvote",
+        "dsa", "dsc", "dsf", "dsi", "dsq", "dsr", "dss", "dssu"};
+    static const char* const ppszBulk[] = {"file"};
+
+    for (unsigned int i = 0; i < ARRAYLEN(ppszCritical); i++)
+        if (strcmp(pszCommand, ppszCritical[i]) == 0)
+            return SEND_PRIORITY_CRITICAL;
+    for (unsigned int i = 0; i < ARRAYLEN(ppszMasternode); i++)
+        if (strcmp(pszCommand, ppszMasternode[i]) == 0)
+            return SEND_PRIORITY_MASTERNODE;
+    for (unsigned int i = 0; i < ARRAYLEN(ppszBulk); i++)
+        if (strcmp(pszCommand, ppszBulk[i]) == 0)
+            return SEND_PRIORITY_BULK;
+    return SEND_PRIORITY_RELAY;
+}
+
+unsigned int GetSendQueueWeight(SendPriority priority)
+{
+    switch (priority) {
+    case SEND_PRIORITY_RELAY:
+        return 4;
+    case SEND_PRIORITY_MASTERNODE:
+        return 2;
+    case SEND_PRIORITY_BULK:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+int CNode::SelectSendQueue()
 {
-    std::deque<CSerializeData>::iterator it = pnode->vSendMsg.begin();
+    assert(nSendSize > 0);
 
-    while (it != pnode->vSendMsg.end()) {
-        const CSerializeData& data = *it;
+    // Messages cannot be interleaved on the wire
+    if (nSendQueueInFlight >= 0)
+        return nSendQueueInFlight;
+
+    if (!vSendMsg[SEND_PRIORITY_CRITICAL].empty()) {
+        nSendQueueInFlight = SEND_PRIORITY_CRITICAL;
+        return nSendQueueInFlight;
+    }
+
+    // Deficit round robin: each visit tops a queue up by its quantum, and a
+    // queue may start its next message once it has saved up enough credit.
+    while (true) {
+        std::deque<CSerializeData>& queue = vSendMsg[nSendQueueNext];
+        if (queue.empty()) {
+            nSendDeficit[nSendQueueNext] = 0;
+        } else if (nSendDeficit[nSendQueueNext] >= (int64_t)queue.front().size()) {
+            nSendDeficit[nSendQueueNext] -= queue.front().size();
+            nSendQueueInFlight = nSendQueueNext;
+            return nSendQueueInFlight;
+        }
+
+        nSendQueueNext = nSendQueueNext + 1 < SEND_PRIORITY_MAX ? nSendQueueNext + 1 : SEND_PRIORITY_CRITICAL + 1;
+        if (!vSendMsg[nSendQueueNext].empty())
+            nSendDeficit[nSendQueueNext] += (int64_t)GetSendQueueWeight((SendPriority)nSendQueueNext) * SEND_QUEUE_QUANTUM;
+    }
+}
+
+void SocketSendData(CNode* pnode)
+{
+    while (pnode->nSendSize > 0) {
+        std::deque<CSerializeData>& queue = pnode->vSendMsg[pnode->SelectSendQueue()];
+        const CSerializeData& data = queue.front();
         assert(data.size() > pnode->nSendOffset);
         int nBytes = send(pnode->hSocket, &data[pnode->nSendOffset], data.size() - pnode->nSendOffset, MSG_NOSIGNAL | MSG_DONTWAIT);
         if (nBytes > 0) {
@@ -827,7 +951,8 @@ void SocketSendData(CNode* pnode)
             if (pnode->nSendOffset == data.size()) {
                 pnode->nSendOffset = 0;
                 pnode->nSendSize -= data.size();
-                it++;
+                pnode->nSendQueueInFlight = -1;
+                queue.pop_front();
             } else {
                 // could not send full message; stop sending more
                 break;
@@ -846,11 +971,8 @@ void SocketSendData(CNode* pnode)
         }
     }
 
-    if (it == pnode->vSendMsg.end()) {
+    if (pnode->nSendSize == 0)
         assert(pnode->nSendOffset == 0);
-        assert(pnode->nSendSize == 0);
-    }
-    pnode->vSendMsg.erase(pnode->vSendMsg.begin(), it);
 }
 
 static list<CNode*> vNodesDisconnected;
@@ -858,6 +980,7 @@ static list<CNode*> vNodesDisconnected;
 void ThreadSocketHandler()
 {
     unsigned int nPrevNodeCount = 0;
+    bool fRecvBudgetExhaustedPrev = false;
     while (true) {
         //
         // Disconnect nodes
@@ -942,8 +1065,21 @@ void ThreadSocketHandler()
             have_fds = true;
         }
 
+        // Once the receive buffers of all peers together exceed the global budget,
+        // stop reading from peers that already have a complete message waiting for
+        // the message handler, or that hold more than their share of the budget.
+        // Every peer may still buffer one maximum-size message, so a partially
+        // received message can always be completed.
+        uint64_t nRecvBudget = ReceiveMemoryBudget();
+        bool fRecvBudgetExhausted = CNetMessage::GetTotalBufferedBytes() >= nRecvBudget;
+        if (fRecvBudgetExhausted != fRecvBudgetExhaustedPrev) {
+            LogPrint("net", "receive memory budget of %u bytes %s\n", nRecvBudget, fRecvBudgetExhausted ? "exhausted, throttling reads" : "available again");
+            fRecvBudgetExhaustedPrev = fRecvBudgetExhausted;
+        }
+
         {
             LOCK(cs_vNodes);
+            uint64_t nRecvFairShare = max((uint64_t)MAX_PROTOCOL_MESSAGE_LENGTH + 24, nRecvBudget / max((uint64_t)1, (uint64_t)vNodes.size()));
             BOOST_FOREACH (CNode* pnode, vNodes) {
                 if (pnode->hSocket == INVALID_SOCKET)
                     continue;
@@ -968,7 +1104,7 @@ void ThreadSocketHandler()
                 // * We process a message in the buffer (message handler thread).
                 {
                     TRY_LOCK(pnode->cs_vSend, lockSend);
-                    if (lockSend && !pnode->vSendMsg.empty()) {
+                    if (lockSend && pnode->nSendSize > 0) {
                         FD_SET(pnode->hSocket, &fdsetSend);
                         continue;
                     }
@@ -976,8 +1112,13 @@ void ThreadSocketHandler()
                 {
                     TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
                     if (lockRecv && (pnode->vRecvMsg.empty() || !pnode->vRecvMsg.front().complete() ||
-                                        pnode->GetTotalRecvSize() <= ReceiveFloodSize()))
+                                        pnode->GetTotalRecvSize() <= ReceiveFloodSize())) {
+                        if (fRecvBudgetExhausted && !pnode->fWhitelisted &&
+                            ((!pnode->vRecvMsg.empty() && pnode->vRecvMsg.front().complete()) ||
+                                pnode->GetTotalRecvSize() > nRecvFairShare))
+                            continue;
                         FD_SET(pnode->hSocket, &fdsetRecv);
+                    }
                 }
             }
         }
@@ -1245,6 +1386,24 @@ void MapPort(bool)
 #endif
 
 
+static void ResolveDNSSeed(const CDNSSeedData& seed, int* pnFound, CCriticalSection& cs_found)
+{
+    vector<CNetAddr> vIPs;
+    vector<CAddress> vAdd;
+    if (LookupHost(seed.host.c_str(), vIPs)) {
+        BOOST_FOREACH (CNetAddr& ip, vIPs) {
+            int nOneDay = 24 * 3600;
+            CAddress addr = CAddress(CService(ip, Params().GetDefaultPort()));
+            addr.nTime = GetTime() - 3 * nOneDay - GetRand(4 * nOneDay); // use a random age between 3 and 7 days old
+            vAdd.push_back(addr);
+        }
+    }
+    addrman.Add(vAdd, CNetAddr(seed.name, true));
+
+    LOCK(cs_found);
+    *pnFound += vAdd.size();
+}
+
 void ThreadDNSAddressSeed()
 {
     // goal: only query DNS seeds if address need is acute
@@ -1261,29 +1420,28 @@ void ThreadDNSAddressSeed()
 
     const vector<CDNSSeedData>& vSeeds = Params().DNSSeeds();
     int found = 0;
+    int64_t nStart = GetTimeMillis();
 
     LogPrintf("Loading addresses from DNS seeds (could take a while)\n");
 
+    // Resolve all seeds at once: a slow or dead seed no longer holds up the others
+    boost::thread_group resolvers;
+    CCriticalSection cs_found;
     BOOST_FOREACH (const CDNSSeedData& seed, vSeeds) {
-        if (HaveNameProxy()) {
+        if (HaveNameProxy())
             AddOneShot(seed.host);
-        } else {
-            vector<CNetAddr> vIPs;
-            vector<CAddress> vAdd;
-            if (LookupHost(seed.host.c_str(), vIPs)) {
-                BOOST_FOREACH (CNetAddr& ip, vIPs) {
-                    int nOneDay = 24 * 3600;
-                    CAddress addr = CAddress(CService(ip, Params().GetDefaultPort()));
-                    addr.nTime = GetTime() - 3 * nOneDay - GetRand(4 * nOneDay); // use a random age between 3 and 7 days old
-                    vAdd.push_back(addr);
-                    found++;
-                }
-            }
-            addrman.Add(vAdd, CNetAddr(seed.name, true));
-        }
+        else
+            resolvers.create_thread(boost::bind(&ResolveDNSSeed, boost::cref(seed), &found, boost::ref(cs_found)));
+    }
+    try {
+        resolvers.join_all();
+    } catch (const boost::thread_interrupted&) {
+        // the lookups cannot be cancelled; wait for them before leaving
+        resolvers.join_all();
+        throw;
     }
 
-    LogPrintf("%d addresses found from DNS seeds\n", found);
+    LogPrintf("%d addresses found from DNS seeds  %dms\n", found, GetTimeMillis() - nStart);
 }
 
 
@@ -1342,10 +1500,12 @@ void static ProcessOneShot()
     }
 }
 
-void ThreadOpenConnections()
+void ThreadOpenConnections(int nDialer)
 {
     // Connect to specific addresses
     if (mapArgs.count("-connect") && mapMultiArgs["-connect"].size() > 0) {
+        if (nDialer != 0)
+            return;
         for (int64_t nLoop = 0;; nLoop++) {
             ProcessOneShot();
             BOOST_FOREACH (string strAddr, mapMultiArgs["-connect"]) {
@@ -1359,10 +1519,16 @@ void ThreadOpenConnections()
         }
     }
 
+    // Several dialers run this loop side by side, each blocking in its own
+    // connect, so a handful of unreachable addresses cannot keep the outbound
+    // slots empty for long after startup.
+    MilliSleep(nDialer * PARALLEL_CONNECT_STAGGER_MS);
+
     // Initiate network connections
     int64_t nStart = GetTime();
     while (true) {
-        ProcessOneShot();
+        if (nDialer == 0)
+            ProcessOneShot();
 
         MilliSleep(500);
 
@@ -1370,7 +1536,7 @@ void ThreadOpenConnections()
         boost::this_thread::interruption_point();
 
         // Add seed nodes if DNS seeds are all down (an infrastructure attack?).
-        if (addrman.size() == 0 && (GetTime() - nStart > 60)) {
+        if (nDialer == 0 && addrman.size() == 0 && (GetTime() - nStart > 60)) {
             static bool done = false;
             if (!done) {
                 LogPrintf("Adding fixed seed nodes as DNS doesn't seem to be available.\n");
@@ -1384,7 +1550,8 @@ void ThreadOpenConnections()
         //
         CAddress addrConnect;
 
-        // Only connect out to one peer per network group (/16 for IPv4).
+        // Only connect out to one peer per network group (/16 for IPv4), counting
+        // the groups other dialers are connecting to right now.
         // Do this here so we don't have to critsect vNodes inside mapAddresses critsect.
         int nOutbound = 0;
         set<vector<unsigned char> > setConnected;
@@ -1397,6 +1564,10 @@ void ThreadOpenConnections()
                 }
             }
         }
+        {
+            LOCK(cs_setDialingGroups);
+            setConnected.insert(setDialingGroups.begin(), setDialingGroups.end());
+        }
 
         int64_t nANow = GetAdjustedTime();
 
@@ -1430,8 +1601,33 @@ void ThreadOpenConnections()
             break;
         }
 
-        if (addrConnect.IsValid())
-            OpenNetworkConnection(addrConnect, &grant);
+        if (!addrConnect.IsValid())
+            continue;
+
+        vector<unsigned char> vchGroup = addrConnect.GetGroup();
+        {
+            LOCK(cs_setDialingGroups);
+            if (!setDialingGroups.insert(vchGroup).second)
+                continue; // another dialer got there first
+        }
+        bool fConnected = OpenNetworkConnection(addrConnect, &grant);
+        {
+            LOCK(cs_setDialingGroups);
+            setDialingGroups.erase(vchGroup);
+        }
+
+        // Report how long it took to fill the outbound slots for the first time
+        if (fConnected && nOutbound + 1 >= min(MAX_OUTBOUND_CONNECTIONS, nMaxConnections)) {
+            LOCK2(cs_vNodes, cs_setDialingGroups);
+            nOutbound = 0;
+            BOOST_FOREACH (CNode* pnode, vNodes)
+                if (!pnode->fInbound)
+                    nOutbound++;
+            if (nOutboundFullTime == 0 && nOutbound >= min(MAX_OUTBOUND_CONNECTIONS, nMaxConnections)) {
+                nOutboundFullTime = GetTime();
+                LogPrintf("All %d outbound connection slots filled %ds after startup\n", nOutbound, nOutboundFullTime - nStart);
+            }
+        }
     }
 }
 
@@ -1895,7 +2091,10 @@ void StartNode(boost::thread_group& threadGroup, CScheduler& scheduler)
     threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "addcon", &ThreadOpenAddedConnections));
 
     // Initiate outbound connections
-    threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "opencon", &ThreadOpenConnections));
+    int nDialers = min(MAX_PARALLEL_CONNECTS, min(MAX_OUTBOUND_CONNECTIONS, nMaxConnections));
+    for (int i = 0; i < max(nDialers, 1); i++)
+        threadGroup.create_thread(boost::bind(&TraceThread<boost::function<void()> >, "opencon",
+                                              boost::function<void()>(boost::bind(&ThreadOpenConnections, i))));
 
     // Process messages
     threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "msghand", &ThreadMessageHandler));
@@ -2190,8 +2389,15 @@ bool CAddrDB::Read(CAddrMan& addr)
 
 unsigned int ReceiveFloodSize() { return 1000 * GetArg("-maxreceivebuffer", 25 * 1000); }
 unsigned int SendBufferSize() { return 1000 * GetArg("-maxsendbuffer", 11 * 1000); }
+int64_t PoissonNextSend(int64_t nNow, int average_interval_seconds)
+{
+    return nNow + (int64_t)(log1p(GetRand(1ULL << 48) * -0.0000000000000035527136788 /* -1/2^48 */) * average_interval_seconds * -1000000.0 + 0.5);
+}
 
-CNode::CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn, bool fInboundIn) : ssSend(SER_NETWORK, INIT_PROTO_VERSION), setAddrKnown(5000)
+uint64_t ReceiveMemoryBudget() { return (uint64_t)1000000 * GetArg("-maxreceivememory", DEFAULT_MAX_RECEIVE_MEMORY); }
+
+CNode::CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn, bool fInboundIn) : ssSend(SER_NETWORK, INIT_PROTO_VERSION), setAddrKnown(5000),
+                                                                                          filterInventoryKnown(INVENTORY_KNOWN_FILTER_ELEMENTS, 0.000001)
 {
     nServices = 0;
     hSocket = hSocketIn;
@@ -2216,11 +2422,16 @@ CNode::CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn, bool fIn
     nRefCount = 0;
     nSendSize = 0;
     nSendOffset = 0;
+    nSendPriority = SEND_PRIORITY_RELAY;
+    nSendQueueInFlight = -1;
+    nSendQueueNext = SEND_PRIORITY_CRITICAL + 1;
+    for (int i = 0; i < SEND_PRIORITY_MAX; i++)
+        nSendDeficit[i] = 0;
     hashContinue = 0;
     nStartingHeight = -1;
     fGetAddr = false;
     fRelayTxes = false;
-    setInventoryKnown.max_size(SendBufferSize() / 2000); // TODO: PDG3 check if actual size
+    nNextInvSend = 0;
     pfilter = new CBloomFilter();
     nPingNonceSent = 0;
     nPingUsecStart = 0;
@@ -2290,6 +2501,7 @@ void CNode::BeginMessage(const char* pszCommand) EXCLUSIVE_LOCK_FUNCTION(cs_vSen
     ENTER_CRITICAL_SECTION(cs_vSend);
     assert(ssSend.size() == 0);
     ssSend << CMessageHeader(pszCommand, 0);
+    nSendPriority = GetSendPriority(pszCommand);
     LogPrint("net", "sending: %s ", SanitizeString(pszCommand));
 }
 
@@ -2333,12 +2545,15 @@ void CNode::EndMessage() UNLOCK_FUNCTION(cs_vSend)
 
     LogPrint("net", "(%d bytes) peer=%d\n", nSize, id);
 
-    std::deque<CSerializeData>::iterator it = vSendMsg.insert(vSendMsg.end(), CSerializeData());
+    // If write queue empty, attempt "optimistic write"
+    bool fOptimisticWrite = nSendSize == 0;
+
+    std::deque<CSerializeData>& queue = vSendMsg[nSendPriority];
+    std::deque<CSerializeData>::iterator it = queue.insert(queue.end(), CSerializeData());
     ssSend.GetAndClear(*it);
     nSendSize += (*it).size();
 
-    // If write queue empty, attempt "optimistic write"
-    if (it == vSendMsg.begin())
+    if (fOptimisticWrite)
         SocketSendData(this);
 
     LEAVE_CRITICAL_SECTION(cs_vSend);
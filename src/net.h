@@ -61,9 +61,38 @@ static const bool DEFAULT_UPNP = false;
 #endif
 /** The maximum number of entries in mapAskFor */
 static const size_t MAPASKFOR_MAX_SZ = MAX_INV_SZ;
+/** Number of inventory items remembered per peer to avoid announcing them twice */
+static const unsigned int INVENTORY_KNOWN_FILTER_ELEMENTS = 20000;
+/** Default for -maxreceivememory, the receive buffer budget shared by all peers, in megabytes */
+static const unsigned int DEFAULT_MAX_RECEIVE_MEMORY = 256;
+/** Bytes a weight-1 send queue may write per round when the non-critical queues compete */
+static const unsigned int SEND_QUEUE_QUANTUM = 32 * 1024;
+
+/**
+ * Outbound traffic classes. Each peer keeps one send queue per class:
+ * critical messages (handshake, pings, block announcements and blocks) are
+ * always written first, the rest share the socket by weight so that a large
+ * file transfer cannot hold back relay or masternode traffic.
+ */
+enum SendPriority {
+    SEND_PRIORITY_CRITICAL = 0,
+    SEND_PRIORITY_RELAY,
+    SEND_PRIORITY_MASTERNODE,
+    SEND_PRIORITY_BULK,
+
+    SEND_PRIORITY_MAX
+};
+
+/** The send queue a message with the given command is placed in */
+SendPriority GetSendPriority(const char* pszCommand);
+/** Relative share of the socket a non-critical queue gets */
+unsigned int GetSendQueueWeight(SendPriority priority);
 
 unsigned int ReceiveFloodSize();
 unsigned int SendBufferSize();
+uint64_t ReceiveMemoryBudget();
+/** Return a timestamp in the future (in microseconds) for exponentially distributed events. */
+int64_t PoissonNextSend(int64_t nNow, int average_interval_seconds);
 
 void AddOneShot(std::string strDest);
 bool RecvLine(SOCKET hSocket, std::string& strLine);
@@ -214,8 +243,14 @@ public:
         nHdrPos = 0;
         nDataPos = 0;
         nTime = 0;
+        nBufferedBytes = 0;
+        Account(hdrbuf.size());
     }
 
+    CNetMessage(const CNetMessage& other);
+    CNetMessage& operator=(const CNetMessage& other);
+    ~CNetMessage();
+
     bool complete() const
     {
         if (!in_data)
@@ -231,6 +266,20 @@ public:
 
     int readHeader(const char* pch, unsigned int nBytes);
     int readData(const char* pch, unsigned int nBytes);
+
+    //! Bytes held by this message's buffers
+    uint64_t GetBufferedBytes() const { return nBufferedBytes; }
+    //! Bytes held by the buffers of all received messages of all peers
+    static uint64_t GetTotalBufferedBytes();
+
+private:
+    //! What this message has added to nTotalBufferedBytes
+    uint64_t nBufferedBytes;
+
+    static CCriticalSection cs_totalBufferedBytes;
+    static uint64_t nTotalBufferedBytes;
+
+    void Account(uint64_t nNewBufferedBytes);
 };
 
 
@@ -305,9 +354,13 @@ public:
     SOCKET hSocket;
     CDataStream ssSend;
     size_t nSendSize;   // total size of all vSendMsg entries
-    size_t nSendOffset; // offset inside the first vSendMsg already sent
+    size_t nSendOffset; // offset inside the vSendMsg entry currently being sent
     uint64_t nSendBytes;
-    std::deque<CSerializeData> vSendMsg;
+    std::deque<CSerializeData> vSendMsg[SEND_PRIORITY_MAX];
+    SendPriority nSendPriority; // queue of the message being built in ssSend
+    int nSendQueueInFlight;     // queue whose front entry is being sent, or -1
+    int nSendQueueNext;         // round robin position among the non-critical queues
+    int64_t nSendDeficit[SEND_PRIORITY_MAX];
     CCriticalSection cs_vSend;
 
     std::deque<CInv> vRecvGetData;
@@ -381,9 +434,11 @@ public:
     std::set<uint256> setKnown;
 
     // inventory based relay
-    mruset<CInv> setInventoryKnown;
+    CRollingBloomFilter filterInventoryKnown;
     std::vector<CInv> vInventoryToSend;
     CCriticalSection cs_inventory;
+    //! Time (in usec) of the next batched transaction inv to this peer
+    int64_t nNextInvSend;
     std::multimap<int64_t, CInv> mapAskFor;
     std::vector<uint256> vBlockRequested;
     std::vector<uint256> vFileRequested;
@@ -475,19 +530,31 @@ public:
     }
 
 
+    //! Key under which an inventory item is remembered in filterInventoryKnown
+    static uint256 InventoryKnownKey(const CInv& inv)
+    {
+        return inv.hash ^ uint256(inv.type);
+    }
+
     void AddInventoryKnown(const CInv& inv)
     {
         {
             LOCK(cs_inventory);
-            setInventoryKnown.insert(inv);
+            filterInventoryKnown.insert(InventoryKnownKey(inv));
         }
     }
 
+    bool HasInventoryKnown(const CInv& inv)
+    {
+        LOCK(cs_inventory);
+        return filterInventoryKnown.contains(InventoryKnownKey(inv));
+    }
+
     void PushInventory(const CInv& inv)
     {
         {
             LOCK(cs_inventory);
-            if (!setInventoryKnown.count(inv))
+            if (!filterInventoryKnown.contains(InventoryKnownKey(inv)))
                 vInventoryToSend.push_back(inv);
         }
     }
@@ -503,6 +570,14 @@ public:
     // TODO: Document the precondition of this function.  Is cs_vSend locked?
     void EndMessage() UNLOCK_FUNCTION(cs_vSend);
 
+    /**
+     * Pick the send queue whose front entry goes on the wire next. A message
+     * that has been started is always finished first; otherwise critical
+     * traffic wins and the other queues are served by deficit round robin.
+     * Requires cs_vSend and nSendSize > 0.
+     */
+    int SelectSendQueue();
+
     void PushVersion();
 
 
@@ -0,0 +1,189 @@
+// Copyright (c) 2018-2019 The PDG developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "orphanpool.h"
+
+#include "random.h"
+#include "util.h"
+#include "utiltime.h"
+#include "version.h"
+
+#include <algorithm>
+
+#include <boost/foreach.hpp>
+
+bool COrphanPool::Add(const CTransaction& tx, NodeId peer)
+{
+    uint256 hash = tx.GetHash();
+    if (mapOrphans.count(hash))
+        return false;
+
+    // Ignore big transactions, to avoid a
+    // send-big-orphans memory exhaustion attack. If a peer has a legitimate
+    // large transaction with a missing parent then we assume
+    // it will rebroadcast it later, after the parent transaction(s)
+    // have been mined or received.
+    unsigned int sz = tx.GetSerializeSize(SER_NETWORK, CTransaction::CURRENT_VERSION);
+    if (sz > MAX_ORPHAN_TX_SIZE) {
+        LogPrint("mempool", "ignoring large orphan tx (size: %u, hash: %s)\n", sz, hash.ToString());
+        return false;
+    }
+
+    OrphanIter it = mapOrphans.insert(std::make_pair(hash, COrphanTx())).first;
+    COrphanTx& orphan = it->second;
+    orphan.tx = tx;
+    orphan.fromPeer = peer;
+    orphan.nTimeExpire = GetTime() + ORPHAN_TX_EXPIRE_TIME;
+    orphan.nSize = sz;
+    orphan.nPos = vOrphans.size();
+    vOrphans.push_back(it);
+
+    BOOST_FOREACH (const CTxIn& txin, tx.vin)
+        mapByPrev[txin.prevout].insert(it);
+    CPeerOrphans& peerOrphans = mapByPeer[peer];
+    peerOrphans.setOrphans.insert(it);
+    peerOrphans.nSize += sz;
+    nTotalSize += sz;
+
+    LogPrint("mempool", "stored orphan tx %s (mapsz %u outsz %u)\n", hash.ToString(),
+        mapOrphans.size(), mapByPrev.size());
+    return true;
+}
+
+void COrphanPool::Erase(OrphanIter it)
+{
+    const COrphanTx& orphan = it->second;
+    BOOST_FOREACH (const CTxIn& txin, orphan.tx.vin) {
+        std::map<COutPoint, OrphanSet>::iterator itPrev = mapByPrev.find(txin.prevout);
+        if (itPrev == mapByPrev.end())
+            continue;
+        itPrev->second.erase(it);
+        if (itPrev->second.empty())
+            mapByPrev.erase(itPrev);
+    }
+
+    std::map<NodeId, CPeerOrphans>::iterator itPeer = mapByPeer.find(orphan.fromPeer);
+    assert(itPeer != mapByPeer.end());
+    itPeer->second.setOrphans.erase(it);
+    itPeer->second.nSize -= orphan.nSize;
+    if (itPeer->second.setOrphans.empty())
+        mapByPeer.erase(itPeer);
+
+    // Fill the hole in vOrphans with the last entry
+    size_t nPos = orphan.nPos;
+    vOrphans[nPos] = vOrphans.back();
+    vOrphans[nPos]->second.nPos = nPos;
+    vOrphans.pop_back();
+
+    nTotalSize -= orphan.nSize;
+    mapOrphans.erase(it);
+}
+
+bool COrphanPool::Erase(const uint256& hash)
+{
+    OrphanIter it = mapOrphans.find(hash);
+    if (it == mapOrphans.end())
+        return false;
+    Erase(it);
+    return true;
+}
+
+unsigned int COrphanPool::EraseForPeer(NodeId peer)
+{
+    std::map<NodeId, CPeerOrphans>::iterator itPeer = mapByPeer.find(peer);
+    if (itPeer == mapByPeer.end())
+        return 0;
+    // Erasing the last one removes the peer's entry
+    std::vector<OrphanIter> vErase(itPeer->second.setOrphans.begin(), itPeer->second.setOrphans.end());
+    BOOST_FOREACH (OrphanIter it, vErase)
+        Erase(it);
+    LogPrint("mempool", "Erased %d orphan tx from peer %d\n", vErase.size(), peer);
+    return vErase.size();
+}
+
+unsigned int COrphanPool::EraseExpired(int64_t nNow)
+{
+    std::vector<OrphanIter> vErase;
+    BOOST_FOREACH (OrphanIter it, vOrphans) {
+        if (it->second.nTimeExpire <= nNow)
+            vErase.push_back(it);
+    }
+    BOOST_FOREACH (OrphanIter it, vErase)
+        Erase(it);
+    if (!vErase.empty())
+        LogPrint("mempool", "Erased %d expired orphan tx\n", vErase.size());
+    return vErase.size();
+}
+
+unsigned int COrphanPool::Limit(unsigned int nMaxOrphans, size_t nMaxBytes)
+{
+    unsigned int nEvicted = 0;
+    int64_t nNow = GetTime();
+    if (nNextSweep <= nNow) {
+        nEvicted += EraseExpired(nNow);
+        nNextSweep = nNow + ORPHAN_TX_EXPIRE_INTERVAL;
+    }
+
+    // A peer over its share makes room from its own oldest orphans
+    size_t nPeerMaxOrphans = std::max(nMaxOrphans / ORPHAN_PEER_SHARE, 1u);
+    size_t nPeerMaxBytes = std::max(nMaxBytes / ORPHAN_PEER_SHARE, (size_t)MAX_ORPHAN_TX_SIZE);
+    std::map<NodeId, CPeerOrphans>::iterator itPeer = mapByPeer.begin();
+    while (itPeer != mapByPeer.end()) {
+        CPeerOrphans& peerOrphans = (itPeer++)->second;
+        while (peerOrphans.setOrphans.size() > nPeerMaxOrphans || peerOrphans.nSize > nPeerMaxBytes) {
+            OrphanIter itOldest = *peerOrphans.setOrphans.begin();
+            BOOST_FOREACH (OrphanIter it, peerOrphans.setOrphans) {
+                if (it->second.nTimeExpire < itOldest->second.nTimeExpire)
+                    itOldest = it;
+            }
+            bool fLast = peerOrphans.setOrphans.size() == 1;
+            Erase(itOldest);
+            ++nEvicted;
+            if (fLast)
+                break;
+        }
+    }
+
+    while (!vOrphans.empty() && (vOrphans.size() > nMaxOrphans || nTotalSize > nMaxBytes)) {
+        // Evict a random orphan:
+        Erase(vOrphans[GetRand(vOrphans.size())]);
+        ++nEvicted;
+    }
+    return nEvicted;
+}
+
+void COrphanPool::Clear()
+{
+    mapOrphans.clear();
+    mapByPrev.clear();
+    mapByPeer.clear();
+    vOrphans.clear();
+    nTotalSize = 0;
+}
+
+const COrphanPool::COrphanTx* COrphanPool::Get(const uint256& hash) const
+{
+    OrphanMap::const_iterator it = mapOrphans.find(hash);
+    return it == mapOrphans.end() ? NULL : &it->second;
+}
+
+void COrphanPool::GetChildren(const CTransaction& tx, std::vector<uint256>& vChildren) const
+{
+    std::set<uint256> setChildren;
+    uint256 hash = tx.GetHash();
+    for (unsigned int i = 0; i < tx.vout.size(); i++) {
+        std::map<COutPoint, OrphanSet>::const_iterator itPrev = mapByPrev.find(COutPoint(hash, i));
+        if (itPrev == mapByPrev.end())
+            continue;
+        BOOST_FOREACH (const OrphanIter& it, itPrev->second)
+            setChildren.insert(it->first);
+    }
+    vChildren.assign(setChildren.begin(), setChildren.end());
+}
+
+size_t COrphanPool::PeerCount(NodeId peer) const
+{
+    std::map<NodeId, CPeerOrphans>::const_iterator itPeer = mapByPeer.find(peer);
+    return itPeer == mapByPeer.end() ? 0 : itPeer->second.setOrphans.size();
+}
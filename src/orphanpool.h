@@ -0,0 +1,104 @@
+// Copyright (c) 2018-2019 The PDG developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef PDG_ORPHANPOOL_H
+#define PDG_ORPHANPOOL_H
+
+#include "net.h"
+#include "primitives/transaction.h"
+#include "uint256.h"
+
+#include <map>
+#include <set>
+#include <vector>
+
+/** Orphans bigger than this are not kept, the peer is expected to send them again later */
+static const unsigned int MAX_ORPHAN_TX_SIZE = 5000;
+/** Seconds an orphan is kept waiting for its parents */
+static const int64_t ORPHAN_TX_EXPIRE_TIME = 20 * 60;
+/** Minimum seconds between two sweeps for expired orphans */
+static const int64_t ORPHAN_TX_EXPIRE_INTERVAL = 5 * 60;
+/** A single peer's orphans may take up at most 1/ORPHAN_PEER_SHARE of the pool */
+static const unsigned int ORPHAN_PEER_SHARE = 4;
+
+/**
+ * Transactions whose inputs are not known yet, kept until a parent arrives.
+ *
+ * Orphans are indexed by the outpoints they spend, so a transaction finds
+ * the orphans waiting for it with one lookup per output. The pool is bounded
+ * in count and in bytes; a peer that goes over its share loses its own oldest
+ * orphans first, anything beyond that is evicted at random. Orphans expire
+ * after ORPHAN_TX_EXPIRE_TIME and are dropped when their peer disconnects.
+ *
+ * Not thread safe, main.cpp guards its instance with cs_main.
+ */
+class COrphanPool
+{
+public:
+    struct COrphanTx {
+        CTransaction tx;
+        NodeId fromPeer;
+        int64_t nTimeExpire;
+        unsigned int nSize;
+        size_t nPos; //!< index in vOrphans
+    };
+
+private:
+    typedef std::map<uint256, COrphanTx> OrphanMap;
+    typedef OrphanMap::iterator OrphanIter;
+
+    struct CompareOrphanIter {
+        bool operator()(const OrphanIter& a, const OrphanIter& b) const
+        {
+            return a->first < b->first;
+        }
+    };
+    typedef std::set<OrphanIter, CompareOrphanIter> OrphanSet;
+
+    struct CPeerOrphans {
+        OrphanSet setOrphans;
+        size_t nSize;
+        CPeerOrphans() : nSize(0) {}
+    };
+
+    OrphanMap mapOrphans;
+    //! Orphans by the outpoints they spend
+    std::map<COutPoint, OrphanSet> mapByPrev;
+    std::map<NodeId, CPeerOrphans> mapByPeer;
+    //! All orphans, to pick one at random in constant time
+    std::vector<OrphanIter> vOrphans;
+    size_t nTotalSize;
+    int64_t nNextSweep;
+
+    void Erase(OrphanIter it);
+    unsigned int EraseExpired(int64_t nNow);
+
+public:
+    COrphanPool() : nTotalSize(0), nNextSweep(0) {}
+
+    /** Keep tx until its parents arrive. Returns false if it is known already or too big */
+    bool Add(const CTransaction& tx, NodeId peer);
+    bool Erase(const uint256& hash);
+    /** Drop all orphans a peer sent us, returning how many */
+    unsigned int EraseForPeer(NodeId peer);
+    /**
+     * Drop expired orphans, then evict until every peer is within its share
+     * and the pool holds at most nMaxOrphans transactions and nMaxBytes bytes.
+     * Returns the number of orphans removed.
+     */
+    unsigned int Limit(unsigned int nMaxOrphans, size_t nMaxBytes);
+    void Clear();
+
+    bool Exists(const uint256& hash) const { return mapOrphans.count(hash); }
+    const COrphanTx* Get(const uint256& hash) const;
+    /** The hashes of the orphans spending outputs of tx */
+    void GetChildren(const CTransaction& tx, std::vector<uint256>& vChildren) const;
+
+    size_t Size() const { return mapOrphans.size(); }
+    size_t TotalSize() const { return nTotalSize; }
+    size_t PeerCount(NodeId peer) const;
+    size_t PrevCount() const { return mapByPrev.size(); }
+};
+
+#endif // PDG_ORPHANPOOL_H
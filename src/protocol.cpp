@@ -33,7 +33,12 @@ static const char* ppszTypeName[] =
         "mn quorum",
         "mn announce",
         "mn ping",
-        "dstx"};
+        "dstx",
+        "has file request",
+        "has file",
+        "file request",
+        "file",
+        "cmpct block"};
 
 CMessageHeader::CMessageHeader()
 {
@@ -176,7 +176,10 @@ enum {
     MSG_HAS_FILE_REQUEST,
     MSG_HAS_FILE,
     MSG_FILE_REQUEST,
-    MSG_FILE
+    MSG_FILE,
+    // MSG_CMPCT_BLOCK is only requested in getdata and answered with a "cmpctblock";
+    // it never appears in invs.
+    MSG_CMPCT_BLOCK
 };
 
 #endif // BITCOIN_PROTOCOL_H
@@ -118,8 +118,9 @@ UniValue blockToJSON(const CBlock& block, const CBlockIndex* blockindex, bool tx
     result.push_back(Pair("moneysupply",ValueFromAmount(blockindex->nMoneySupply)));
 
     UniValue zpivObj(UniValue::VOBJ);
+    ZerocoinSupplyMap mapZerocoinSupply = blockindex->GetZerocoinSupplyMap();
     for (auto denom : libzerocoin::zerocoinDenomList) {
-        zpivObj.push_back(Pair(to_string(denom), ValueFromAmount(blockindex->mapZerocoinSupply.at(denom) * (denom*COIN))));
+        zpivObj.push_back(Pair(to_string(denom), ValueFromAmount(mapZerocoinSupply.at(denom) * (denom*COIN))));
     }
     zpivObj.push_back(Pair("total", ValueFromAmount(blockindex->GetZerocoinSupply())));
     result.push_back(Pair("zPDGsupply", zpivObj));
@@ -184,9 +185,8 @@ UniValue mempoolToJSON(bool fVerbose = false)
     if (fVerbose) {
         LOCK(mempool.cs);
         UniValue o(UniValue::VOBJ);
-        BOOST_FOREACH (const PAIRTYPE(uint256, CTxMemPoolEntry) & entry, mempool.mapTx) {
-            const uint256& hash = entry.first;
-            const CTxMemPoolEntry& e = entry.second;
+        BOOST_FOREACH (const CTxMemPoolEntry& e, mempool.mapTx) {
+            const uint256& hash = e.GetTx().GetHash();
             UniValue info(UniValue::VOBJ);
             info.push_back(Pair("size", (int)e.GetTxSize()));
             info.push_back(Pair("fee", ValueFromAmount(e.GetFee())));
@@ -588,7 +588,12 @@ UniValue getblockchaininfo(const UniValue& params, bool fHelp)
             "  \"bestblockhash\": \"...\", (string) the hash of the currently best block\n"
             "  \"difficulty\": xxxxxx,     (numeric) the current difficulty\n"
             "  \"verificationprogress\": xxxx, (numeric) estimate of verification progress [0..1]\n"
-            "  \"chainwork\": \"xxxx\"     (string) total amount of work in active chain, in hexadecimal\n"
+            "  \"chainwork\": \"xxxx\",    (string) total amount of work in active chain, in hexadecimal\n"
+            "  \"coinscache\": {         (object) the in-memory UTXO cache\n"
+            "     \"transactions\": xxxx, (numeric) number of transactions with cached outputs\n"
+            "     \"usage\": xxxx,        (numeric) heap memory used by the cache, in bytes\n"
+            "     \"limit\": xxxx         (numeric) usage at which the cache is flushed to disk, in bytes (set by -dbcache)\n"
+            "  }\n"
             "}\n"
 
             "\nExamples:\n" +
@@ -604,6 +609,12 @@ UniValue getblockchaininfo(const UniValue& params, bool fHelp)
     obj.push_back(Pair("difficulty", (double)GetDifficulty()));
     obj.push_back(Pair("verificationprogress", Checkpoints::GuessVerificationProgress(chainActive.Tip())));
     obj.push_back(Pair("chainwork", chainActive.Tip()->nChainWork.GetHex()));
+
+    UniValue coinscache(UniValue::VOBJ);
+    coinscache.push_back(Pair("transactions", (uint64_t)pcoinsTip->GetCacheSize()));
+    coinscache.push_back(Pair("usage", (uint64_t)pcoinsTip->DynamicMemoryUsage()));
+    coinscache.push_back(Pair("limit", (uint64_t)nCoinCacheUsage));
+    obj.push_back(Pair("coinscache", coinscache));
     return obj;
 }
 
@@ -794,12 +805,41 @@ UniValue getfeeinfo(const UniValue& params, bool fHelp)
     return ret;
 }
 
+static std::string TxTypeToString(int32_t type)
+{
+    switch (type) {
+    case TX_PAYMENT:
+        return "payment";
+    case TX_FILE_PAYMENT_REQUEST:
+        return "file_payment_request";
+    case TX_FILE_PAYMENT_CONFIRM:
+        return "file_payment_confirm";
+    case TX_FILE_TRANSFER:
+        return "file_transfer";
+    }
+    return strprintf("type_%d", type);
+}
+
 UniValue mempoolInfoToJSON()
 {
     UniValue ret(UniValue::VOBJ);
     ret.push_back(Pair("size", (int64_t) mempool.size()));
     ret.push_back(Pair("bytes", (int64_t) mempool.GetTotalTxSize()));
-    //ret.push_back(Pair("usage", (int64_t) mempool.DynamicMemoryUsage()));
+    ret.push_back(Pair("usage", (int64_t) mempool.DynamicMemoryUsage()));
+    size_t maxmempool = GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000;
+    ret.push_back(Pair("maxmempool", (int64_t) maxmempool));
+    ret.push_back(Pair("mempoolminfee", ValueFromAmount(mempool.GetMinFee(maxmempool).GetFeePerK())));
+
+    UniValue types(UniValue::VOBJ);
+    std::map<int32_t, TxMempoolTypeStats> mapTypeStats = mempool.GetTypeStats();
+    for (std::map<int32_t, TxMempoolTypeStats>::const_iterator it = mapTypeStats.begin(); it != mapTypeStats.end(); ++it) {
+        UniValue type(UniValue::VOBJ);
+        type.push_back(Pair("size", (int64_t) it->second.nCount));
+        type.push_back(Pair("bytes", (int64_t) it->second.nBytes));
+        type.push_back(Pair("usage", (int64_t) it->second.nUsage));
+        types.push_back(Pair(TxTypeToString(it->first), type));
+    }
+    ret.push_back(Pair("types", types));
 
     return ret;
 }
@@ -815,6 +855,16 @@ UniValue getmempoolinfo(const UniValue& params, bool fHelp)
             "{\n"
             "  \"size\": xxxxx                (numeric) Current tx count\n"
             "  \"bytes\": xxxxx               (numeric) Sum of all tx sizes\n"
+            "  \"usage\": xxxxx               (numeric) Total memory usage for the mempool\n"
+            "  \"maxmempool\": xxxxx          (numeric) Maximum memory usage for the mempool\n"
+            "  \"mempoolminfee\": xxxxx       (numeric) Minimum fee per kB for a transaction to be accepted\n"
+            "  \"types\": {                   (json object) Totals per transaction type that is in the mempool\n"
+            "    \"type\": {                  (json object) payment, file_payment_request, file_payment_confirm or file_transfer\n"
+            "      \"size\": xxxxx            (numeric) Number of transactions\n"
+            "      \"bytes\": xxxxx           (numeric) Sum of their sizes\n"
+            "      \"usage\": xxxxx           (numeric) Memory held by them, not counting index overhead\n"
+            "    }, ...\n"
+            "  }\n"
             "}\n"
 
             "\nExamples:\n" +
@@ -146,6 +146,8 @@ UniValue importprivkey(const UniValue& params, bool fHelp)
 
         if (fRescan) {
             pwalletMain->ScanForWalletTransactions(chainActive.Genesis(), true);
+        } else {
+            pwalletMain->RebuildStakeableCoins();
         }
     }
 
@@ -217,6 +219,8 @@ UniValue importaddress(const UniValue& params, bool fHelp)
         if (fRescan) {
             pwalletMain->ScanForWalletTransactions(chainActive.Genesis(), true);
             pwalletMain->ReacceptWalletTransactions();
+        } else {
+            pwalletMain->RebuildStakeableCoins();
         }
     }
 
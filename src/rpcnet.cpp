@@ -412,6 +412,8 @@ UniValue getnetworkinfo(const UniValue& params, bool fHelp)
             "  ,...\n"
             "  ],\n"
             "  \"relayfee\": x.xxxxxxxx,                (numeric) minimum relay fee for non-free transactions in pdg/kb\n"
+            "  \"recvbufferbytes\": xxxxx,              (numeric) bytes currently held in receive buffers of all peers\n"
+            "  \"recvbufferlimit\": xxxxx,              (numeric) receive buffer budget shared by all peers (-maxreceivememory)\n"
             "  \"localaddresses\": [                    (array) list of local addresses\n"
             "  {\n"
             "    \"address\": \"xxxx\",                 (string) network address\n"
@@ -437,6 +439,8 @@ UniValue getnetworkinfo(const UniValue& params, bool fHelp)
     obj.push_back(Pair("connections", (int)vNodes.size()));
     obj.push_back(Pair("networks", GetNetworksInfo()));
     obj.push_back(Pair("relayfee", ValueFromAmount(::minRelayTxFee.GetFeePerK())));
+    obj.push_back(Pair("recvbufferbytes", CNetMessage::GetTotalBufferedBytes()));
+    obj.push_back(Pair("recvbufferlimit", ReceiveMemoryBudget()));
     UniValue localAddresses(UniValue::VARR);
     {
         LOCK(cs_mapLocalHost);
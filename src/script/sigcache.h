@@ -10,6 +10,13 @@
 
 #include <vector>
 
+// DoS prevention: limit cache size to 32MiB (over 1000000 entries on 64-bit
+// systems). The cuckoo cache allocates its table up front, so this is also the
+// actual memory usage.
+static const unsigned int DEFAULT_MAX_SIG_CACHE_SIZE = 32;
+// Maximum sig cache size allowed, in MiB
+static const int64_t MAX_MAX_SIG_CACHE_SIZE = 16384;
+
 class CPubKey;
 
 class CachingTransactionSignatureChecker : public TransactionSignatureChecker
@@ -23,4 +30,6 @@ public:
     bool VerifySignature(const std::vector<unsigned char>& vchSig, const CPubKey& vchPubKey, const uint256& sighash) const;
 };
 
+void InitSignatureCache();
+
 #endif // BITCOIN_SCRIPT_SIGCACHE_H
@@ -11,11 +11,13 @@
 #include "keystore.h"
 #include "main.h"
 #include "net.h"
+#include "orphanpool.h"
 #include "pow.h"
 #include "script/sign.h"
 #include "serialize.h"
 #include "util.h"
 
+#include <algorithm>
 #include <stdint.h>
 
 #include <boost/assign/list_of.hpp> // for 'map_list_of()'
@@ -23,17 +25,6 @@
 #include <boost/foreach.hpp>
 #include <boost/test/unit_test.hpp>
 
-// Tests this internal-to-main.cpp method:
-extern bool AddOrphanTx(const CTransaction& tx, NodeId peer);
-extern void EraseOrphansFor(NodeId peer);
-extern unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans);
-struct COrphanTx {
-    CTransaction tx;
-    NodeId fromPeer;
-};
-extern std::map<uint256, COrphanTx> mapOrphanTransactions;
-extern std::map<uint256, std::set<uint256> > mapOrphanTransactionsByPrev;
-
 CService ip(uint32_t i)
 {
     struct in_addr s;
@@ -106,13 +97,12 @@ BOOST_AUTO_TEST_CASE(DoS_bantime)
     BOOST_CHECK(!CNode::IsBanned(addr));
 }
 
-CTransaction RandomOrphan()
+CTransaction RandomOrphan(const COrphanPool& pool, const std::vector<uint256>& vHashes)
 {
-    std::map<uint256, COrphanTx>::iterator it;
-    it = mapOrphanTransactions.lower_bound(GetRandHash());
-    if (it == mapOrphanTransactions.end())
-        it = mapOrphanTransactions.begin();
-    return it->second.tx;
+    const COrphanPool::COrphanTx* porphan = NULL;
+    while (!porphan)
+        porphan = pool.Get(vHashes[GetRand(vHashes.size())]);
+    return porphan->tx;
 }
 
 BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
@@ -121,6 +111,8 @@ BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
     key.MakeNewKey(true);
     CBasicKeyStore keystore;
     keystore.AddKey(key);
+    COrphanPool pool;
+    std::vector<uint256> vHashes;
 
     // 50 orphan transactions:
     for (int i = 0; i < 50; i++)
@@ -134,13 +126,14 @@ BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
         tx.vout[0].nValue = 1*CENT;
         tx.vout[0].scriptPubKey = GetScriptForDestination(key.GetPubKey().GetID());
 
-        AddOrphanTx(tx, i);
+        BOOST_CHECK(pool.Add(tx, i));
+        vHashes.push_back(tx.GetHash());
     }
 
     // ... and 50 that depend on other orphans:
     for (int i = 0; i < 50; i++)
     {
-        CTransaction txPrev = RandomOrphan();
+        CTransaction txPrev = RandomOrphan(pool, vHashes);
 
         CMutableTransaction tx;
         tx.vin.resize(1);
@@ -151,13 +144,18 @@ BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
         tx.vout[0].scriptPubKey = GetScriptForDestination(key.GetPubKey().GetID());
         SignSignature(keystore, txPrev, tx, 0);
 
-        AddOrphanTx(tx, i);
+        pool.Add(tx, i);
+
+        // The parent finds it by its outputs
+        std::vector<uint256> vChildren;
+        pool.GetChildren(txPrev, vChildren);
+        BOOST_CHECK(std::find(vChildren.begin(), vChildren.end(), tx.GetHash()) != vChildren.end());
     }
 
     // This really-big orphan should be ignored:
     for (int i = 0; i < 10; i++)
     {
-        CTransaction txPrev = RandomOrphan();
+        CTransaction txPrev = RandomOrphan(pool, vHashes);
 
         CMutableTransaction tx;
         tx.vout.resize(1);
@@ -175,25 +173,98 @@ BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
         for (unsigned int j = 1; j < tx.vin.size(); j++)
             tx.vin[j].scriptSig = tx.vin[0].scriptSig;
 
-        BOOST_CHECK(!AddOrphanTx(tx, i));
+        BOOST_CHECK(!pool.Add(tx, i));
     }
 
-    // Test EraseOrphansFor:
+    // Test EraseForPeer:
     for (NodeId i = 0; i < 3; i++)
     {
-        size_t sizeBefore = mapOrphanTransactions.size();
-        EraseOrphansFor(i);
-        BOOST_CHECK(mapOrphanTransactions.size() < sizeBefore);
+        size_t sizeBefore = pool.Size();
+        pool.EraseForPeer(i);
+        BOOST_CHECK(pool.Size() < sizeBefore);
+        BOOST_CHECK_EQUAL(pool.PeerCount(i), 0U);
+    }
+
+    // Test Limit():
+    pool.Limit(40, 1000000);
+    BOOST_CHECK(pool.Size() <= 40);
+    pool.Limit(10, 1000000);
+    BOOST_CHECK(pool.Size() <= 10);
+    pool.Limit(100, 0);
+    BOOST_CHECK_EQUAL(pool.Size(), 0U);
+    BOOST_CHECK_EQUAL(pool.TotalSize(), 0U);
+    BOOST_CHECK_EQUAL(pool.PrevCount(), 0U);
+}
+
+static CTransaction SimpleOrphan(unsigned int nOutputs)
+{
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout = COutPoint(GetRandHash(), 0);
+    tx.vin[0].scriptSig << OP_1;
+    tx.vout.resize(nOutputs);
+    for (unsigned int i = 0; i < nOutputs; i++) {
+        tx.vout[i].nValue = 1*CENT;
+        tx.vout[i].scriptPubKey = CScript() << OP_TRUE;
+    }
+    return tx;
+}
+
+BOOST_AUTO_TEST_CASE(DoS_orphanpool_limits)
+{
+    int64_t nStartTime = GetTime();
+    SetMockTime(nStartTime);
+    COrphanPool pool;
+
+    // A peer flooding the pool only displaces its own oldest orphans
+    std::vector<uint256> vFlood;
+    for (int i = 0; i < 40; i++) {
+        CTransaction tx = SimpleOrphan(1);
+        pool.Add(tx, 1);
+        vFlood.push_back(tx.GetHash());
+        SetMockTime(nStartTime + i + 1);
     }
+    CTransaction txOther = SimpleOrphan(1);
+    pool.Add(txOther, 2);
+    pool.Limit(40, 1000000);
+    BOOST_CHECK_EQUAL(pool.PeerCount(1), 40U / ORPHAN_PEER_SHARE);
+    BOOST_CHECK(pool.Exists(txOther.GetHash()));
+    BOOST_CHECK(!pool.Exists(vFlood.front()));
+    BOOST_CHECK(pool.Exists(vFlood.back()));
+
+    // The byte cap holds as well as the count
+    size_t nTxSize = pool.Get(txOther.GetHash())->nSize;
+    pool.Limit(40, 3 * nTxSize);
+    BOOST_CHECK(pool.TotalSize() <= 3 * nTxSize);
+    BOOST_CHECK(pool.Size() <= 3);
+
+    // Two outputs of one parent spent by the same orphan give one child
+    CTransaction txParent = SimpleOrphan(2);
+    CMutableTransaction txChild;
+    txChild.vin.resize(2);
+    txChild.vin[0].prevout = COutPoint(txParent.GetHash(), 0);
+    txChild.vin[1].prevout = COutPoint(txParent.GetHash(), 1);
+    txChild.vout.resize(1);
+    txChild.vout[0].scriptPubKey = CScript() << OP_TRUE;
+    BOOST_CHECK(pool.Add(txChild, 3));
+    BOOST_CHECK(!pool.Add(txChild, 3));
+    std::vector<uint256> vChildren;
+    pool.GetChildren(txParent, vChildren);
+    BOOST_CHECK_EQUAL(vChildren.size(), 1U);
+    BOOST_CHECK(vChildren[0] == txChild.GetHash());
+    BOOST_CHECK(pool.Erase(txChild.GetHash()));
+    pool.GetChildren(txParent, vChildren);
+    BOOST_CHECK(vChildren.empty());
+
+    // Orphans expire
+    pool.Add(SimpleOrphan(1), 4);
+    BOOST_CHECK(pool.Size() > 0);
+    SetMockTime(nStartTime + 100 + ORPHAN_TX_EXPIRE_TIME);
+    pool.Limit(40, 1000000);
+    BOOST_CHECK_EQUAL(pool.Size(), 0U);
+    BOOST_CHECK_EQUAL(pool.TotalSize(), 0U);
 
-    // Test LimitOrphanTxSize() function:
-    LimitOrphanTxSize(40);
-    BOOST_CHECK(mapOrphanTransactions.size() <= 40);
-    LimitOrphanTxSize(10);
-    BOOST_CHECK(mapOrphanTransactions.size() <= 10);
-    LimitOrphanTxSize(0);
-    BOOST_CHECK(mapOrphanTransactions.empty());
-    BOOST_CHECK(mapOrphanTransactionsByPrev.empty());
+    SetMockTime(0);
 }
 
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,138 @@
+// Copyright (c) 2018-2019 The PDG developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+// Benchmarks for the per-database LevelDB profiles. Run with
+//   test_pdg --run_test=benchmark_leveldb --log_level=message
+// to see the measurements.
+
+#include "leveldbwrapper.h"
+#include "random.h"
+#include "uint256.h"
+#include "util.h"
+#include "utiltime.h"
+
+#include <string>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(benchmark_leveldb)
+
+BOOST_AUTO_TEST_CASE(dbprofile_parse)
+{
+    CLevelDBProfile profile;
+    std::string strError;
+    BOOST_CHECK(ParseLevelDBProfile("compression=1,blocksize=32,maxopenfiles=128,bloombits=12,cache=40,writebuffer=30,mincache=16", profile, strError));
+    BOOST_CHECK(profile.fCompression);
+    BOOST_CHECK_EQUAL(profile.nBlockSize, 32U << 10);
+    BOOST_CHECK_EQUAL(profile.nMaxOpenFiles, 128);
+    BOOST_CHECK_EQUAL(profile.nBloomBits, 12);
+    BOOST_CHECK_EQUAL(profile.nCachePercent, 40);
+    BOOST_CHECK_EQUAL(profile.nWriteBufferPercent, 30);
+    BOOST_CHECK_EQUAL(profile.nMinCacheSize, 16U << 20);
+
+    BOOST_CHECK(!ParseLevelDBProfile("cache=60,writebuffer=25", profile, strError));
+    BOOST_CHECK(!ParseLevelDBProfile("blocksize", profile, strError));
+    BOOST_CHECK(!ParseLevelDBProfile("speed=11", profile, strError));
+
+    mapMultiArgs["-dbprofile"].push_back("zerocoin:bloombits=20");
+    BOOST_CHECK_EQUAL(GetLevelDBProfile("zerocoin").nBloomBits, 20);
+    BOOST_CHECK_EQUAL(GetLevelDBProfile("chainstate").nBloomBits, CLevelDBProfile().nBloomBits);
+    BOOST_CHECK(CheckLevelDBProfileArgs(strError));
+    mapMultiArgs["-dbprofile"].push_back("mempool:cache=10");
+    BOOST_CHECK(!CheckLevelDBProfileArgs(strError));
+    mapMultiArgs.erase("-dbprofile");
+}
+
+static uint64_t DirectorySize(const boost::filesystem::path& path)
+{
+    uint64_t nSize = 0;
+    for (boost::filesystem::directory_iterator it(path); it != boost::filesystem::directory_iterator(); ++it)
+        if (boost::filesystem::is_regular_file(it->status()))
+            nSize += boost::filesystem::file_size(it->path());
+    return nSize;
+}
+
+/** A record that compresses like real index data: a fixed layout with some random fields */
+static std::vector<unsigned char> MakeRecord(size_t nSize)
+{
+    std::vector<unsigned char> vch(nSize, 0);
+    uint256 hash = GetRandHash();
+    for (size_t i = 0; i < nSize; i++)
+        vch[i] = (i % 64 < 32) ? hash.begin()[i % 32] : (unsigned char)(i % 7);
+    return vch;
+}
+
+struct BenchResult {
+    int64_t nWriteMicros;
+    int64_t nReadMicros;
+    uint64_t nDiskBytes;
+};
+
+/**
+ * Write nRecords records in batches like the node flushes them, then read
+ * them back: point lookups of existing and absent keys when fScan is false,
+ * one ordered sweep when it is true.
+ */
+static BenchResult RunWorkload(const std::string& strProfile, int nRecords, size_t nRecordSize, bool fScan)
+{
+    boost::filesystem::path path = GetDataDir() / ("bench_leveldb_" + strProfile);
+    BenchResult result;
+    std::vector<uint256> vKeys;
+    {
+        CLevelDBWrapper db(path, 1 << 20, false, true, strProfile);
+        int64_t nStart = GetTimeMicros();
+        for (int i = 0; i < nRecords; i += 1000) {
+            CLevelDBBatch batch;
+            for (int j = i; j < std::min(nRecords, i + 1000); j++) {
+                vKeys.push_back(fScan ? uint256(j) : GetRandHash());
+                batch.Write(std::make_pair('r', vKeys.back()), MakeRecord(nRecordSize));
+            }
+            db.WriteBatch(batch, true);
+        }
+        result.nWriteMicros = GetTimeMicros() - nStart;
+
+        nStart = GetTimeMicros();
+        if (fScan) {
+            boost::scoped_ptr<leveldb::Iterator> pcursor(db.NewIterator());
+            int nFound = 0;
+            for (pcursor->SeekToFirst(); pcursor->Valid(); pcursor->Next())
+                nFound++;
+            BOOST_CHECK_EQUAL(nFound, nRecords);
+        } else {
+            std::vector<unsigned char> vch;
+            for (int i = 0; i < nRecords; i++) {
+                BOOST_CHECK(db.Read(std::make_pair('r', vKeys[GetRand(vKeys.size())]), vch));
+                BOOST_CHECK(!db.Exists(std::make_pair('r', GetRandHash())));
+            }
+        }
+        result.nReadMicros = GetTimeMicros() - nStart;
+    }
+    result.nDiskBytes = DirectorySize(path);
+    boost::filesystem::remove_all(path);
+    return result;
+}
+
+static void Compare(const std::string& strWorkload, const std::string& strProfile, int nRecords, size_t nRecordSize, bool fScan)
+{
+    BenchResult legacy = RunWorkload("legacy", nRecords, nRecordSize, fScan);
+    BenchResult tuned = RunWorkload(strProfile, nRecords, nRecordSize, fScan);
+    BOOST_TEST_MESSAGE(strWorkload << ": legacy write " << legacy.nWriteMicros / 1000 << " ms, read " << legacy.nReadMicros / 1000
+                       << " ms, " << legacy.nDiskBytes / 1024 << " KiB; " << strProfile << " write " << tuned.nWriteMicros / 1000
+                       << " ms, read " << tuned.nReadMicros / 1000 << " ms, " << tuned.nDiskBytes / 1024 << " KiB");
+}
+
+BOOST_AUTO_TEST_CASE(dbprofile_workloads)
+{
+    // Block index during sync: sequential appends, one sweep at startup
+    Compare("block index sync", "blockindex", 50000, 160, true);
+    // File index: larger records, scanned
+    Compare("file index", "fileindex", 20000, 600, true);
+    // Zerocoin serial checks: mostly lookups of keys that are not there
+    Compare("zerocoin lookups", "zerocoin", 20000, 80, false);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,171 @@
+// Copyright (c) 2018-2019 The PDG developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+// Benchmarks for block template transaction selection. Run with
+//   test_pdg --run_test=benchmark_mempool --log_level=message
+// to see the measurements.
+
+#include "main.h"
+#include "miner.h"
+#include "random.h"
+#include "txmempool.h"
+#include "utiltime.h"
+
+#include <algorithm>
+#include <list>
+#include <map>
+#include <set>
+#include <vector>
+
+#include <boost/foreach.hpp>
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(benchmark_mempool)
+
+static const uint64_t BENCH_BLOCK_SIZE = 1000000;
+
+/** Fill a pool with nTxs transactions, about a quarter of them spending an earlier one */
+static void FillPool(CTxMemPool& pool, int nTxs, int64_t& nAddTime)
+{
+    std::vector<uint256> vHashes;
+    std::set<COutPoint> setSpent;
+    vHashes.reserve(nTxs);
+
+    nAddTime = 0;
+    for (int i = 0; i < nTxs; i++) {
+        CMutableTransaction tx;
+        tx.vin.resize(1);
+        tx.vin[0].scriptSig = CScript() << OP_11;
+        tx.vin[0].prevout = COutPoint(GetRandHash(), 0);
+        if (!vHashes.empty() && GetRand(4) == 0) {
+            COutPoint prevout(vHashes[GetRand(vHashes.size())], GetRand(2));
+            if (setSpent.insert(prevout).second)
+                tx.vin[0].prevout = prevout;
+        }
+        tx.vout.resize(2);
+        for (int j = 0; j < 2; j++) {
+            tx.vout[j].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+            tx.vout[j].nValue = COIN;
+        }
+        uint256 hash = tx.GetHash();
+        CTxMemPoolEntry entry(tx, 1000 + GetRand(100000), 0, 0.0, 1);
+
+        int64_t nStart = GetTimeMicros();
+        pool.addUnchecked(hash, entry);
+        nAddTime += GetTimeMicros() - nStart;
+        vHashes.push_back(hash);
+    }
+}
+
+/**
+ * The selection CreateNewBlock did before the mempool kept ancestor totals:
+ * score every entry, park the ones with parents in the pool until those are
+ * taken, and pop the rest from a heap. Coins lookups are left out, so this is
+ * a lower bound on the old cost.
+ */
+static uint64_t SelectLegacy(const CTxMemPool& pool, std::vector<uint256>& vSelected)
+{
+    typedef std::pair<CFeeRate, const CTxMemPoolEntry*> TxFeeRate;
+    std::vector<TxFeeRate> vecPriority;
+    std::map<uint256, std::vector<const CTxMemPoolEntry*> > mapDependers;
+    std::map<const CTxMemPoolEntry*, int> mapWaiting;
+
+    BOOST_FOREACH (const CTxMemPoolEntry& entry, pool.mapTx) {
+        const CTransaction& tx = entry.GetTx();
+        int nWaiting = 0;
+        BOOST_FOREACH (const CTxIn& txin, tx.vin) {
+            if (pool.mapTx.count(txin.prevout.hash)) {
+                mapDependers[txin.prevout.hash].push_back(&entry);
+                nWaiting++;
+            }
+        }
+        if (nWaiting)
+            mapWaiting[&entry] = nWaiting;
+        else
+            vecPriority.push_back(TxFeeRate(CFeeRate(entry.GetFee(), entry.GetTxSize()), &entry));
+    }
+
+    std::make_heap(vecPriority.begin(), vecPriority.end());
+    uint64_t nBlockSize = 1000;
+    while (!vecPriority.empty()) {
+        const CTxMemPoolEntry* pentry = vecPriority.front().second;
+        std::pop_heap(vecPriority.begin(), vecPriority.end());
+        vecPriority.pop_back();
+        if (nBlockSize + pentry->GetTxSize() >= BENCH_BLOCK_SIZE)
+            continue;
+        nBlockSize += pentry->GetTxSize();
+        vSelected.push_back(pentry->GetTx().GetHash());
+
+        std::map<uint256, std::vector<const CTxMemPoolEntry*> >::iterator it = mapDependers.find(pentry->GetTx().GetHash());
+        if (it == mapDependers.end())
+            continue;
+        BOOST_FOREACH (const CTxMemPoolEntry* pchild, it->second) {
+            if (--mapWaiting[pchild] == 0) {
+                vecPriority.push_back(TxFeeRate(CFeeRate(pchild->GetFee(), pchild->GetTxSize()), pchild));
+                std::push_heap(vecPriority.begin(), vecPriority.end());
+            }
+        }
+    }
+    return nBlockSize;
+}
+
+static uint64_t SelectPackages(const CTxMemPool& pool, std::vector<uint256>& vSelected)
+{
+    CTxPackageSelector selector(pool);
+    std::vector<CTxMemPool::txiter> vPackage;
+    uint64_t nPackageSize;
+    CAmount nPackageFees;
+    uint64_t nBlockSize = 1000;
+    while (selector.Next(BENCH_BLOCK_SIZE - nBlockSize, vPackage, nPackageSize, nPackageFees)) {
+        BOOST_FOREACH (CTxMemPool::txiter it, vPackage) {
+            nBlockSize += it->GetTxSize();
+            vSelected.push_back(it->GetTx().GetHash());
+        }
+        selector.Added(vPackage);
+    }
+    return nBlockSize;
+}
+
+BOOST_AUTO_TEST_CASE(template_selection)
+{
+    const int vSizes[] = {1000, 10000, 100000};
+    BOOST_FOREACH (int nTxs, vSizes) {
+        CTxMemPool pool(CFeeRate(0));
+        int64_t nAddTime;
+        FillPool(pool, nTxs, nAddTime);
+        LOCK(pool.cs);
+
+        std::vector<uint256> vLegacy;
+        int64_t nStart = GetTimeMicros();
+        uint64_t nLegacySize = SelectLegacy(pool, vLegacy);
+        int64_t nLegacyTime = GetTimeMicros() - nStart;
+
+        std::vector<uint256> vPackages;
+        nStart = GetTimeMicros();
+        uint64_t nPackagesSize = SelectPackages(pool, vPackages);
+        int64_t nPackagesTime = GetTimeMicros() - nStart;
+
+        BOOST_TEST_MESSAGE(nTxs << " mempool txs: insert with ancestor tracking " << nAddTime / 1000 << " ms ("
+                           << (double)nAddTime / nTxs << " us/tx), legacy selection " << nLegacyTime / 1000
+                           << " ms for " << vLegacy.size() << " txs, package selection " << nPackagesTime / 1000
+                           << " ms for " << vPackages.size() << " txs");
+
+        // Both fill the block as far as they can, and never put a child before its parent
+        BOOST_CHECK(nPackagesSize <= BENCH_BLOCK_SIZE);
+        BOOST_CHECK(nLegacySize <= BENCH_BLOCK_SIZE);
+        std::set<uint256> setSelected;
+        BOOST_FOREACH (const uint256& hash, vPackages) {
+            const CTransaction& tx = pool.mapTx.find(hash)->GetTx();
+            BOOST_FOREACH (const CTxIn& txin, tx.vin) {
+                if (pool.mapTx.count(txin.prevout.hash))
+                    BOOST_CHECK(setSelected.count(txin.prevout.hash));
+            }
+            BOOST_CHECK(setSelected.insert(hash).second);
+        }
+        if (nPackagesSize < BENCH_BLOCK_SIZE / 2)
+            BOOST_CHECK_EQUAL(vPackages.size(), pool.mapTx.size());
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,116 @@
+// Copyright (c) 2018-2019 The PDG developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+// Benchmarks for Quark, the proof of work hash of version 1 to 3 block
+// headers. Run with
+//   test_pdg --run_test=benchmark_quark --log_level=message
+// to see the measurements.
+
+#include "crypto/quark.h"
+#include "crypto/sph_blake.h"
+#include "crypto/sph_bmw.h"
+#include "crypto/sph_skein.h"
+#include "primitives/block.h"
+#include "utiltime.h"
+
+#include <algorithm>
+#include <string.h>
+
+#include <boost/foreach.hpp>
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(benchmark_quark)
+
+static const int BENCH_HASHES = 20000;
+
+typedef void (*Hash512Fn)(unsigned char* out, const unsigned char* in);
+
+/** The rounds that only have the sph implementation */
+#define SPH_HASH512_64(name)                                                \
+    static void Sph##name##512(unsigned char* out, const unsigned char* in) \
+    {                                                                       \
+        sph_##name##512_context ctx;                                        \
+        sph_##name##512_init(&ctx);                                         \
+        sph_##name##512(&ctx, in, 64);                                      \
+        sph_##name##512_close(&ctx, out);                                   \
+    }
+
+SPH_HASH512_64(blake)
+SPH_HASH512_64(bmw)
+SPH_HASH512_64(skein)
+
+struct CBenchHash {
+    const char* name;
+    Hash512Fn fn;
+};
+
+/** Hash buf into itself BENCH_HASHES times, returning the microseconds it took */
+static int64_t TimeHash512(Hash512Fn fn, unsigned char* buf)
+{
+    int64_t nStart = GetTimeMicros();
+    for (int i = 0; i < BENCH_HASHES; i++)
+        fn(buf, buf);
+    return GetTimeMicros() - nStart;
+}
+
+/** Hash BENCH_HASHES headers differing in their nonce, returning the microseconds it took */
+static int64_t TimeHeaders(uint256& hashLast)
+{
+    CBlockHeader header;
+    header.nVersion = 1;
+    header.hashPrevBlock = uint256("0000041e482b9b9691d98eefb48473405c0b8ec31b76df3797c74a78680ef818");
+    header.hashMerkleRoot = uint256("1b2ef6e2f28be914103a277377ae7729dcd125dfeb8bf97bd5964ba72b6dc39b");
+    header.nTime = 1454124731;
+    header.nBits = 0x1e0ffff0;
+
+    int64_t nStart = GetTimeMicros();
+    for (int i = 0; i < BENCH_HASHES; i++) {
+        header.nNonce = i;
+        hashLast = header.GetHash();
+    }
+    return GetTimeMicros() - nStart;
+}
+
+BOOST_AUTO_TEST_CASE(quark_algorithms)
+{
+    const CBenchHash vHashes[] = {
+        {"blake", Sphblake512},
+        {"bmw", Sphbmw512},
+        {"groestl", Groestl512_64},
+        {"jh", JH512_64},
+        {"keccak", Keccak512_64},
+        {"skein", Sphskein512}};
+
+    BOOST_TEST_MESSAGE("Quark implementations: " << QuarkAutoDetect());
+    BOOST_FOREACH (const CBenchHash& hash, vHashes) {
+        unsigned char bufGeneric[64] = {};
+        unsigned char bufDetected[64] = {};
+        QuarkUseGeneric();
+        int64_t nGeneric = TimeHash512(hash.fn, bufGeneric);
+        QuarkAutoDetect();
+        int64_t nDetected = TimeHash512(hash.fn, bufDetected);
+
+        BOOST_TEST_MESSAGE(hash.name << "-512 of 64 bytes: " << nGeneric * 1000 / BENCH_HASHES << " ns portable, "
+                           << nDetected * 1000 / BENCH_HASHES << " ns detected ("
+                           << (double)nGeneric / std::max(nDetected, (int64_t)1) << "x)");
+        BOOST_CHECK(memcmp(bufGeneric, bufDetected, sizeof(bufGeneric)) == 0);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(quark_headers)
+{
+    uint256 hashGeneric, hashDetected;
+    QuarkUseGeneric();
+    int64_t nGeneric = TimeHeaders(hashGeneric);
+    QuarkAutoDetect();
+    int64_t nDetected = TimeHeaders(hashDetected);
+
+    BOOST_TEST_MESSAGE(BENCH_HASHES << " Quark headers: " << nGeneric / 1000 << " ms portable ("
+                       << BENCH_HASHES * 1000000LL / std::max(nGeneric, (int64_t)1) << " headers/s), "
+                       << nDetected / 1000 << " ms detected ("
+                       << BENCH_HASHES * 1000000LL / std::max(nDetected, (int64_t)1) << " headers/s)");
+    BOOST_CHECK(hashGeneric == hashDetected);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
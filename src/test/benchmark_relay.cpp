@@ -0,0 +1,118 @@
+// Copyright (c) 2018-2019 The PDG developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+// Benchmarks for the peer announcement path. Run with
+//   test_pdg --run_test=benchmark_relay --log_level=message
+// to see the measurements.
+
+#include "bloom.h"
+#include "main.h"
+#include "mruset.h"
+#include "net.h"
+#include "protocol.h"
+#include "random.h"
+#include "utiltime.h"
+
+#include <algorithm>
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(benchmark_relay)
+
+/** Approximate heap footprint of one mruset entry: a std::set node plus its deque slot */
+static size_t MruSetBytesPerEntry()
+{
+    // red-black tree node: color + 3 pointers, followed by the value
+    return 4 * sizeof(void*) + sizeof(CInv) + sizeof(CInv);
+}
+
+BOOST_AUTO_TEST_CASE(known_inventory_memory_per_peer)
+{
+    const unsigned int nOldCapacity = SendBufferSize() / 2000;
+    size_t nMruSetBytes = nOldCapacity * MruSetBytesPerEntry();
+
+    CRollingBloomFilter filter(INVENTORY_KNOWN_FILTER_ELEMENTS, 0.000001);
+    size_t nFilterBytes = filter.GetMemoryUsage();
+
+    BOOST_TEST_MESSAGE("known inventory per peer: mruset " << nOldCapacity << " entries ~" << nMruSetBytes / 1024
+                       << " KiB when full, rolling bloom " << INVENTORY_KNOWN_FILTER_ELEMENTS << " entries "
+                       << nFilterBytes / 1024 << " KiB fixed");
+
+    // The filter remembers more items in less memory, and does not grow
+    BOOST_CHECK(INVENTORY_KNOWN_FILTER_ELEMENTS > nOldCapacity);
+    BOOST_CHECK(nFilterBytes < nMruSetBytes);
+}
+
+BOOST_AUTO_TEST_CASE(known_inventory_throughput)
+{
+    static const int ITEMS = 100000;
+    std::vector<CInv> vInv;
+    vInv.reserve(ITEMS);
+    for (int i = 0; i < ITEMS; i++)
+        vInv.push_back(CInv(MSG_TX, GetRandHash()));
+
+    mruset<CInv> setKnown(SendBufferSize() / 2000);
+    int64_t nStart = GetTimeMicros();
+    for (int i = 0; i < ITEMS; i++) {
+        if (!setKnown.count(vInv[i]))
+            setKnown.insert(vInv[i]);
+    }
+    int64_t nMruSetTime = GetTimeMicros() - nStart;
+
+    CRollingBloomFilter filter(INVENTORY_KNOWN_FILTER_ELEMENTS, 0.000001);
+    nStart = GetTimeMicros();
+    for (int i = 0; i < ITEMS; i++) {
+        uint256 hashKnown = CNode::InventoryKnownKey(vInv[i]);
+        if (!filter.contains(hashKnown))
+            filter.insert(hashKnown);
+    }
+    int64_t nFilterTime = GetTimeMicros() - nStart;
+
+    BOOST_TEST_MESSAGE("known inventory check+insert of " << ITEMS << " items: mruset " << nMruSetTime / 1000
+                       << " ms, rolling bloom " << nFilterTime / 1000 << " ms");
+
+    // The most recent items are always remembered
+    for (int i = ITEMS - INVENTORY_KNOWN_FILTER_ELEMENTS / 2; i < ITEMS; i++)
+        BOOST_CHECK(filter.contains(CNode::InventoryKnownKey(vInv[i])));
+}
+
+BOOST_AUTO_TEST_CASE(announce_latency)
+{
+    // Simulate transactions arriving at random moments over ten minutes and
+    // measure how long each waits for the next batched inv to a peer.
+    static const int TXS = 20000;
+    static const int64_t nPeriod = 600 * 1000000LL;
+
+    for (int fInbound = 0; fInbound < 2; fInbound++) {
+        int nInterval = fInbound ? INVENTORY_BROADCAST_INTERVAL : INVENTORY_BROADCAST_INTERVAL >> 1;
+
+        std::vector<int64_t> vSends;
+        int64_t nNext = PoissonNextSend(0, nInterval);
+        while (nNext < nPeriod + 60 * 1000000LL) {
+            vSends.push_back(nNext);
+            nNext = PoissonNextSend(nNext, nInterval);
+        }
+
+        int64_t nTotalDelay = 0;
+        for (int i = 0; i < TXS; i++) {
+            int64_t nArrival = GetRand(nPeriod);
+            std::vector<int64_t>::iterator it = std::upper_bound(vSends.begin(), vSends.end(), nArrival);
+            BOOST_REQUIRE(it != vSends.end());
+            nTotalDelay += *it - nArrival;
+        }
+        double dMeanDelay = (double)nTotalDelay / TXS / 1000000.0;
+        double dTxPerInv = (double)TXS / vSends.size();
+
+        BOOST_TEST_MESSAGE((fInbound ? "inbound" : "outbound") << " peer: mean tx announce delay " << dMeanDelay
+                           << " s (interval " << nInterval << " s), " << vSends.size() << " invs, "
+                           << dTxPerInv << " tx per inv");
+
+        // Exponential waiting times are memoryless: the mean delay is the interval
+        BOOST_CHECK(dMeanDelay > nInterval * 0.75);
+        BOOST_CHECK(dMeanDelay < nInterval * 1.25);
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,111 @@
+// Copyright (c) 2018-2019 The PDG developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+// Benchmarks for the staking kernel search. Run with
+//   test_pdg --run_test=benchmark_staking --log_level=message
+// to see the measurements.
+
+#include "hash.h"
+#include "kernel.h"
+#include "random.h"
+#include "streams.h"
+#include "utiltime.h"
+
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
+
+BOOST_AUTO_TEST_SUITE(benchmark_staking)
+
+/** The kernel hash as CheckStake computed it before midstates were used */
+static uint256 LegacyKernelHash(uint64_t nStakeModifier, unsigned int nTimeBlockFrom, const CDataStream& ssUniqueID, unsigned int nTimeTx)
+{
+    CDataStream ss(SER_GETHASH, 0);
+    ss << nStakeModifier << nTimeBlockFrom << ssUniqueID << nTimeTx;
+    return Hash(ss.begin(), ss.end());
+}
+
+static CDataStream RandomUniqueness()
+{
+    CDataStream ss(SER_GETHASH, 0);
+    ss << GetRandHash() << (uint32_t)GetRand(100);
+    return ss;
+}
+
+BOOST_AUTO_TEST_CASE(stake_kernel_midstate)
+{
+    uint256 bnTargetPerCoinDay;
+    bnTargetPerCoinDay.SetCompact(0x1e0fffff);
+    for (int i = 0; i < 100; i++) {
+        uint64_t nStakeModifier = GetRand(std::numeric_limits<uint64_t>::max());
+        unsigned int nTimeBlockFrom = 1500000000 + GetRand(100000000);
+        CDataStream ssUniqueID = RandomUniqueness();
+        CAmount nValueIn = GetRand(100000) * COIN;
+        CStakeKernel kernel(nStakeModifier, nTimeBlockFrom, ssUniqueID, nValueIn, bnTargetPerCoinDay);
+        for (unsigned int nTimeTx = nTimeBlockFrom; nTimeTx < nTimeBlockFrom + 10; nTimeTx++) {
+            uint256 hashLegacy = LegacyKernelHash(nStakeModifier, nTimeBlockFrom, ssUniqueID, nTimeTx);
+            uint256 hashProofOfStake;
+            BOOST_CHECK_EQUAL(kernel.Check(nTimeTx, hashProofOfStake), stakeTargetHit(hashLegacy, nValueIn, bnTargetPerCoinDay));
+            BOOST_CHECK(hashProofOfStake == hashLegacy);
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(stake_kernel_search_order)
+{
+    // An unreachable target everywhere but on two inputs; the first one wins
+    std::vector<CStakeKernel> vKernels;
+    for (int i = 0; i < 1000; i++)
+        vKernels.push_back(CStakeKernel(GetRand(1000000), 1500000000, RandomUniqueness(), 1, 0));
+    uint256 bnAny = ~uint256(0) / 1000;
+    vKernels[700] = CStakeKernel(1, 1500000000, RandomUniqueness(), 100000, bnAny);
+    vKernels[900] = CStakeKernel(2, 1500000000, RandomUniqueness(), 100000, bnAny);
+
+    unsigned int nTimeFound = 0;
+    uint256 hashProofOfStake;
+    BOOST_CHECK_EQUAL(SearchStakeKernels(vKernels, 0, 1600000000, nTimeFound, hashProofOfStake, 4), 700);
+    BOOST_CHECK_EQUAL(nTimeFound, 1600000000 + STAKE_HASH_DRIFT);
+    BOOST_CHECK(hashProofOfStake == vKernels[700].GetHash(nTimeFound));
+    BOOST_CHECK_EQUAL(SearchStakeKernels(vKernels, 701, 1600000000, nTimeFound, hashProofOfStake, 4), 900);
+    BOOST_CHECK_EQUAL(SearchStakeKernels(vKernels, 901, 1600000000, nTimeFound, hashProofOfStake, 4), -1);
+}
+
+BOOST_AUTO_TEST_CASE(stake_kernel_tries_per_second)
+{
+    static const int INPUTS = 4000;
+    std::vector<uint64_t> vModifiers;
+    std::vector<CDataStream> vUniqueness;
+    std::vector<CStakeKernel> vKernels;
+    for (int i = 0; i < INPUTS; i++) {
+        vModifiers.push_back(GetRand(std::numeric_limits<uint64_t>::max()));
+        vUniqueness.push_back(RandomUniqueness());
+        // A zero target never hits, so every input is tried in full
+        vKernels.push_back(CStakeKernel(vModifiers[i], 1500000000, vUniqueness[i], COIN, 0));
+    }
+    double dTries = (double)INPUTS * STAKE_HASH_DRIFT;
+
+    int64_t nStart = GetTimeMicros();
+    for (int i = 0; i < INPUTS; i++) {
+        for (int j = 0; j < STAKE_HASH_DRIFT; j++)
+            LegacyKernelHash(vModifiers[i], 1500000000, vUniqueness[i], 1600000000 + j);
+    }
+    int64_t nLegacyTime = GetTimeMicros() - nStart;
+
+    unsigned int nTimeFound;
+    uint256 hashProofOfStake;
+    std::vector<int> vThreads;
+    vThreads.push_back(1);
+    vThreads.push_back(DEFAULT_STAKE_THREADS);
+    for (size_t n = 0; n < vThreads.size(); n++) {
+        nStart = GetTimeMicros();
+        BOOST_CHECK_EQUAL(SearchStakeKernels(vKernels, 0, 1600000000, nTimeFound, hashProofOfStake, vThreads[n]), -1);
+        int64_t nSearchTime = GetTimeMicros() - nStart;
+        BOOST_TEST_MESSAGE("kernel search over " << INPUTS << " inputs: legacy " << (int64_t)(dTries * 1000000 / std::max(nLegacyTime, (int64_t)1))
+                           << " tries/s, midstate with " << (vThreads[n] ? vThreads[n] : (int)boost::thread::hardware_concurrency())
+                           << " thread(s) " << (int64_t)(dTries * 1000000 / std::max(nSearchTime, (int64_t)1)) << " tries/s");
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
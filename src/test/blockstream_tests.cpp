@@ -0,0 +1,141 @@
+// Copyright (c) 2018-2019 The PDG developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockstream.h"
+#include "main.h"
+#include "undo.h"
+
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(blockstream_tests)
+
+BOOST_AUTO_TEST_CASE(blockstream_order)
+{
+    LOCK(cs_main);
+    CBlockIndex* pindexGenesis = chainActive.Genesis();
+    BOOST_REQUIRE(pindexGenesis);
+    BOOST_CHECK_EQUAL(GetChainRange(chainActive, 0).size(), (size_t)chainActive.Height() + 1);
+
+    // More entries than the read-ahead window, so the readers have to wait for the consumer
+    std::vector<CBlockIndex*> vIndex(MAX_BLOCK_STREAM_THREADS * BLOCK_STREAM_WINDOW_PER_THREAD * 3, pindexGenesis);
+    CBlockStream stream(vIndex, false, 2);
+    CBlockIndex* pindex;
+    CBlock block;
+    size_t nRead = 0;
+    while (stream.Next(pindex, block)) {
+        BOOST_CHECK(pindex == pindexGenesis);
+        BOOST_CHECK(block.GetHash() == pindexGenesis->GetBlockHash());
+        nRead++;
+    }
+    BOOST_CHECK(!stream.Failed());
+    BOOST_CHECK_EQUAL(nRead, vIndex.size());
+    BOOST_CHECK_EQUAL(stream.Position(), vIndex.size());
+}
+
+BOOST_AUTO_TEST_CASE(blockstream_unreadable_block)
+{
+    LOCK(cs_main);
+    CBlockIndex indexMissing;
+    std::vector<CBlockIndex*> vIndex;
+    vIndex.push_back(chainActive.Genesis());
+    vIndex.push_back(&indexMissing);
+    vIndex.push_back(chainActive.Genesis());
+
+    CBlockStream stream(vIndex);
+    CBlockIndex* pindex;
+    CBlock block;
+    BOOST_CHECK(stream.Next(pindex, block));
+    BOOST_CHECK(!stream.Next(pindex, block));
+    BOOST_CHECK(stream.Failed());
+    BOOST_CHECK(pindex == &indexMissing);
+    BOOST_CHECK(!stream.Next(pindex, block));
+}
+
+BOOST_AUTO_TEST_CASE(blockstream_empty)
+{
+    CBlockStream stream((std::vector<CBlockIndex*>()));
+    CBlockIndex* pindex;
+    CBlock block;
+    BOOST_CHECK(!stream.Next(pindex, block));
+    BOOST_CHECK(!stream.Failed());
+}
+
+BOOST_AUTO_TEST_CASE(blockstream_undo)
+{
+    LOCK(cs_main);
+    // The genesis block has no undo data, which Next() reports instead of failing
+    CBlockStream stream(GetChainRange(chainActive, 0, 0), true);
+    CBlockIndex* pindex;
+    CBlock block;
+    CBlockUndo undo;
+    bool fHaveUndo = true;
+    BOOST_CHECK(stream.Next(pindex, block, undo, fHaveUndo));
+    BOOST_CHECK(pindex == chainActive.Genesis());
+    BOOST_CHECK(!fHaveUndo);
+    BOOST_CHECK(!stream.Next(pindex, block, undo, fHaveUndo));
+    BOOST_CHECK(!stream.Failed());
+}
+
+BOOST_AUTO_TEST_CASE(block_value_in_out)
+{
+    CBlock block;
+    CBlockUndo undo;
+
+    CMutableTransaction coinbase;
+    coinbase.vin.resize(1);
+    coinbase.vin[0].prevout.SetNull();
+    coinbase.vout.resize(1);
+    coinbase.vout[0].nValue = 0;
+    block.vtx.push_back(coinbase);
+
+    // The coinstake marker output is not counted, its stake input is
+    CMutableTransaction coinstake;
+    coinstake.vin.resize(1);
+    coinstake.vin[0].prevout = COutPoint(GetRandHash(), 0);
+    coinstake.vout.resize(2);
+    coinstake.vout[0].SetEmpty();
+    coinstake.vout[1].nValue = 110 * COIN;
+    block.vtx.push_back(coinstake);
+    undo.vtxundo.push_back(CTxUndo());
+    undo.vtxundo.back().vprevout.push_back(CTxInUndo(CTxOut(100 * COIN, CScript())));
+
+    CMutableTransaction tx;
+    tx.vin.resize(2);
+    tx.vin[0].prevout = COutPoint(GetRandHash(), 0);
+    tx.vin[1].prevout = COutPoint(GetRandHash(), 1);
+    tx.vout.resize(1);
+    tx.vout[0].nValue = 29 * COIN;
+    block.vtx.push_back(tx);
+    undo.vtxundo.push_back(CTxUndo());
+    undo.vtxundo.back().vprevout.push_back(CTxInUndo(CTxOut(20 * COIN, CScript())));
+    undo.vtxundo.back().vprevout.push_back(CTxInUndo(CTxOut(10 * COIN, CScript())));
+
+    // A zerocoin spend redeems its denomination, undo data or not
+    CMutableTransaction zcspend;
+    zcspend.vin.resize(1);
+    zcspend.vin[0].scriptSig = CScript() << OP_ZEROCOINSPEND;
+    zcspend.vin[0].nSequence = 5;
+    zcspend.vout.resize(1);
+    zcspend.vout[0].nValue = 5 * COIN;
+    block.vtx.push_back(zcspend);
+    undo.vtxundo.push_back(CTxUndo());
+
+    CAmount nValueIn, nValueOut;
+    size_t nTxLookups = 0;
+    BOOST_CHECK(GetBlockValueInOut(block, &undo, nValueIn, nValueOut, nTxLookups));
+    BOOST_CHECK_EQUAL(nValueIn, 135 * COIN);
+    BOOST_CHECK_EQUAL(nValueOut, 144 * COIN);
+    BOOST_CHECK_EQUAL(nTxLookups, 0U);
+
+    // Undo data that does not match the block is ignored; these inputs are
+    // in no transaction index, so the lookup fails
+    undo.vtxundo.pop_back();
+    BOOST_CHECK(!GetBlockValueInOut(block, &undo, nValueIn, nValueOut, nTxLookups));
+    BOOST_CHECK(!GetBlockValueInOut(block, NULL, nValueIn, nValueOut, nTxLookups));
+    BOOST_CHECK_EQUAL(nTxLookups, 0U);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
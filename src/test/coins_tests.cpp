@@ -3,6 +3,7 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "coins.h"
+#include "memusage.h"
 #include "random.h"
 #include "uint256.h"
 
@@ -58,6 +59,22 @@ public:
 
     bool GetStats(CCoinsStats& stats) const { return false; }
 };
+
+class CCoinsViewCacheTest : public CCoinsViewCache
+{
+public:
+    CCoinsViewCacheTest(CCoinsView* base) : CCoinsViewCache(base) {}
+
+    void SelfTest() const
+    {
+        // Manually recompute the dynamic usage of the whole data, and compare it.
+        size_t ret = memusage::DynamicUsage(cacheCoins);
+        for (CCoinsMap::iterator it = cacheCoins.begin(); it != cacheCoins.end(); it++) {
+            ret += it->second.coins.DynamicMemoryUsage();
+        }
+        BOOST_CHECK_EQUAL(DynamicMemoryUsage(), ret);
+    }
+};
 }
 
 BOOST_AUTO_TEST_SUITE(coins_tests)
@@ -89,8 +106,8 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
 
     // The cache stack.
     CCoinsViewTest base; // A CCoinsViewTest at the bottom.
-    std::vector<CCoinsViewCache*> stack; // A stack of CCoinsViewCaches on top.
-    stack.push_back(new CCoinsViewCache(&base)); // Start with one cache.
+    std::vector<CCoinsViewCacheTest*> stack; // A stack of CCoinsViewCaches on top.
+    stack.push_back(new CCoinsViewCacheTest(&base)); // Start with one cache.
 
     // Use a limited set of random transaction ids, so we do test overwriting entries.
     std::vector<uint256> txids;
@@ -115,6 +132,7 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
                 coins.nVersion = insecure_rand();
                 coins.vout.resize(1);
                 coins.vout[0].nValue = insecure_rand();
+                coins.vout[0].scriptPubKey.assign(insecure_rand() & 0x3F, 0);
                 *entry = coins;
             } else {
                 coins.Clear();
@@ -135,6 +153,9 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
                     missed_an_entry = true;
                 }
             }
+            BOOST_FOREACH (const CCoinsViewCacheTest* test, stack) {
+                test->SelfTest();
+            }
         }
 
         if (insecure_rand() % 100 == 0) {
@@ -151,7 +172,7 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
                 } else {
                     removed_all_caches = true;
                 }
-                stack.push_back(new CCoinsViewCache(tip));
+                stack.push_back(new CCoinsViewCacheTest(tip));
                 if (stack.size() == 4) {
                     reached_4_caches = true;
                 }
@@ -175,4 +196,49 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
     BOOST_CHECK(missed_an_entry);
 }
 
+BOOST_AUTO_TEST_CASE(coins_frozen_layer_test)
+{
+    CCoinsViewTest base;
+    CCoinsViewFrozen frozen(&base);
+    CCoinsViewCacheTest cache(&frozen);
+
+    uint256 txidA = GetRandHash(), txidB = GetRandHash();
+    CCoins coins;
+    coins.nVersion = 1;
+    coins.vout.resize(1);
+    coins.vout[0].nValue = 50;
+    *cache.ModifyCoins(txidA) = coins;
+    *cache.ModifyCoins(txidB) = coins;
+    uint256 hashFirst = GetRandHash();
+    cache.SetBestBlock(hashFirst);
+
+    // Flushing only freezes the changes; reads see them before they are written
+    BOOST_CHECK(cache.Flush());
+    BOOST_CHECK(frozen.HasPending());
+    BOOST_CHECK(frozen.DynamicMemoryUsage() > 0);
+    BOOST_CHECK(!base.HaveCoins(txidA));
+    BOOST_CHECK(cache.HaveCoins(txidA));
+    BOOST_CHECK(cache.GetBestBlock() == hashFirst);
+
+    // Changes frozen on top of unwritten ones replace them
+    cache.ModifyCoins(txidA)->vout[0].nValue = 60;
+    cache.ModifyCoins(txidB)->Clear();
+    uint256 hashSecond = GetRandHash();
+    cache.SetBestBlock(hashSecond);
+    BOOST_CHECK(cache.Flush());
+    BOOST_CHECK(frozen.GetBestBlock() == hashSecond);
+    BOOST_CHECK(!frozen.HaveCoins(txidB));
+
+    BOOST_CHECK(frozen.WriteFrozen());
+    BOOST_CHECK(!frozen.HasPending());
+    BOOST_CHECK(base.GetBestBlock() == hashSecond);
+    BOOST_CHECK(base.GetCoins(txidA, coins));
+    BOOST_CHECK_EQUAL(coins.vout[0].nValue, 60);
+    BOOST_CHECK(!base.GetCoins(txidB, coins) || coins.IsPruned());
+    BOOST_CHECK(cache.AccessCoins(txidA)->vout[0].nValue == 60);
+
+    // Nothing left to write
+    BOOST_CHECK(frozen.WriteFrozen());
+}
+
 BOOST_AUTO_TEST_SUITE_END()
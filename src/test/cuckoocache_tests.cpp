@@ -0,0 +1,83 @@
+// Copyright (c) 2018-2019 The PDG developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "cuckoocache.h"
+#include "random.h"
+#include "uint256.h"
+
+#include <string.h>
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(cuckoocache_tests)
+
+/** Random keys are already uniform, so each hash is just a slice of the key */
+struct RandomHasher {
+    template <uint8_t hash_select>
+    uint32_t operator()(const uint256& key) const
+    {
+        uint32_t u;
+        memcpy(&u, key.begin() + 4 * hash_select, 4);
+        return u;
+    }
+};
+
+typedef CuckooCache::cache<uint256, RandomHasher> TestCache;
+
+BOOST_AUTO_TEST_CASE(cuckoocache_no_false_positives)
+{
+    TestCache cc;
+    cc.setup(1 << 12);
+    for (int i = 0; i < 10000; i++)
+        BOOST_CHECK(!cc.contains(GetRandHash(), false));
+}
+
+BOOST_AUTO_TEST_CASE(cuckoocache_hit_rate)
+{
+    TestCache cc;
+    size_t nElems = cc.setup_bytes(1 << 20);
+    BOOST_CHECK_EQUAL(nElems, (1 << 20) / sizeof(uint256));
+
+    // Fill to half capacity; nearly everything should still be found
+    std::vector<uint256> vKeys;
+    for (size_t i = 0; i < nElems / 2; i++) {
+        vKeys.push_back(GetRandHash());
+        cc.insert(vKeys.back());
+    }
+    size_t nHits = 0;
+    for (size_t i = 0; i < vKeys.size(); i++)
+        if (cc.contains(vKeys[i], false))
+            nHits++;
+    BOOST_CHECK(nHits * 100 >= vKeys.size() * 99);
+}
+
+BOOST_AUTO_TEST_CASE(cuckoocache_erase)
+{
+    TestCache cc;
+    cc.setup(1 << 10);
+    std::vector<uint256> vKeys;
+    for (int i = 0; i < 256; i++) {
+        vKeys.push_back(GetRandHash());
+        cc.insert(vKeys.back());
+    }
+
+    // Erased entries still answer until their slot is reused...
+    for (size_t i = 0; i < vKeys.size(); i++)
+        BOOST_CHECK(cc.contains(vKeys[i], true));
+
+    // ...and new inserts reclaim those slots before evicting anything live
+    std::vector<uint256> vFresh;
+    for (int i = 0; i < 512; i++) {
+        vFresh.push_back(GetRandHash());
+        cc.insert(vFresh.back());
+    }
+    size_t nHits = 0;
+    for (size_t i = 0; i < vFresh.size(); i++)
+        if (cc.contains(vFresh[i], false))
+            nHits++;
+    BOOST_CHECK(nHits * 100 >= vFresh.size() * 95);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
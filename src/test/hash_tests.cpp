@@ -3,8 +3,10 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "hash.h"
+#include "random.h"
 #include "utilstrencodings.h"
 
+#include <string.h>
 #include <vector>
 
 #include <boost/test/unit_test.hpp>
@@ -46,4 +48,62 @@ BOOST_AUTO_TEST_CASE(murmurhash3)
 #undef T
 }
 
+BOOST_AUTO_TEST_CASE(siphash)
+{
+    CSipHasher hasher(0x0706050403020100ULL, 0x0F0E0D0C0B0A0908ULL);
+    BOOST_CHECK_EQUAL(hasher.Finalize(),  0x726fdb47dd0e0e31ull);
+    static const unsigned char t0[1] = {0};
+    hasher.Write(t0, 1);
+    BOOST_CHECK_EQUAL(hasher.Finalize(),  0x74f839c593dc67fdull);
+    static const unsigned char t1[7] = {1,2,3,4,5,6,7};
+    hasher.Write(t1, 7);
+    BOOST_CHECK_EQUAL(hasher.Finalize(),  0x93f5f5799a932462ull);
+    hasher.Write(0x0F0E0D0C0B0A0908ULL);
+    BOOST_CHECK_EQUAL(hasher.Finalize(),  0x3f2acc7f57c29bdbull);
+    static const unsigned char t2[2] = {16,17};
+    hasher.Write(t2, 2);
+    BOOST_CHECK_EQUAL(hasher.Finalize(),  0x4bc1b3f0968dd39cull);
+    static const unsigned char t3[9] = {18,19,20,21,22,23,24,25,26};
+    hasher.Write(t3, 9);
+    BOOST_CHECK_EQUAL(hasher.Finalize(),  0x2f2e6163076bcfadull);
+    static const unsigned char t4[5] = {27,28,29,30,31};
+    hasher.Write(t4, 5);
+    BOOST_CHECK_EQUAL(hasher.Finalize(),  0x7127512f72f27cceull);
+    hasher.Write(0x2726252423222120ULL);
+    BOOST_CHECK_EQUAL(hasher.Finalize(),  0x0e3ea96b5304a7d0ull);
+    hasher.Write(0x2F2E2D2C2B2A2928ULL);
+    BOOST_CHECK_EQUAL(hasher.Finalize(),  0xe612a3cb9ecba951ull);
+
+    BOOST_CHECK_EQUAL(SipHashUint256(0x0706050403020100ULL, 0x0F0E0D0C0B0A0908ULL, uint256("1f1e1d1c1b1a191817161514131211100f0e0d0c0b0a09080706050403020100")), 0x7127512f72f27cceull);
+}
+
+BOOST_AUTO_TEST_CASE(quark)
+{
+    // The PIVX genesis header, the first block of the Quark chain PDG descends from
+    vector<unsigned char> vHeader = ParseHex("01000000000000000000000000000000000000000000000000000000000000000000000"
+                                             "09bc36d2ba74b96d57bf98bebdf25d1dc2977ae7773273a1014e98bf2e2f62e1bbb2eac"
+                                             "56f0ff0f1edfa62400");
+    const uint256 hashGenesis("0000041e482b9b9691d98eefb48473405c0b8ec31b76df3797c74a78680ef818");
+
+    QuarkUseGeneric();
+    BOOST_CHECK(HashQuark(vHeader.begin(), vHeader.end()) == hashGenesis);
+    QuarkAutoDetect();
+    BOOST_CHECK(HashQuark(vHeader.begin(), vHeader.end()) == hashGenesis);
+
+    // The detected Groestl, JH and Keccak agree with sph
+    for (int i = 0; i < 100; i++) {
+        unsigned char in[64], outGeneric[3][64], outDetected[3][64];
+        GetRandBytes(in, sizeof(in));
+        QuarkUseGeneric();
+        Groestl512_64(outGeneric[0], in);
+        JH512_64(outGeneric[1], in);
+        Keccak512_64(outGeneric[2], in);
+        QuarkAutoDetect();
+        Groestl512_64(outDetected[0], in);
+        JH512_64(outDetected[1], in);
+        Keccak512_64(outDetected[2], in);
+        BOOST_CHECK(memcmp(outGeneric, outDetected, sizeof(outGeneric)) == 0);
+    }
+}
+
 BOOST_AUTO_TEST_SUITE_END()
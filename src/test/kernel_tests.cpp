@@ -0,0 +1,66 @@
+// Copyright (c) 2018-2019 The PDG developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "kernel.h"
+#include "main.h"
+#include "random.h"
+
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(kernel_tests)
+
+BOOST_AUTO_TEST_CASE(stake_modifier_cache)
+{
+    LOCK(cs_main);
+    CBlockIndex* pindexGenesis = chainActive.Tip();
+
+    // A chain of blocks one minute apart, each generating a modifier
+    std::vector<uint256> vHashes(200);
+    std::vector<CBlockIndex> vBlocks(vHashes.size());
+    for (size_t i = 0; i < vBlocks.size(); i++) {
+        vHashes[i] = GetRandHash();
+        vBlocks[i].phashBlock = &vHashes[i];
+        vBlocks[i].pprev = i ? &vBlocks[i - 1] : pindexGenesis;
+        vBlocks[i].nHeight = vBlocks[i].pprev->nHeight + 1;
+        vBlocks[i].nTime = pindexGenesis->nTime + 60 * (i + 1);
+        vBlocks[i].SetStakeModifier(i, true);
+        mapBlockIndex[vHashes[i]] = &vBlocks[i];
+    }
+    chainActive.SetTip(&vBlocks.back());
+
+    uint64_t nStakeModifier = 0, nCached = 0;
+    int nHeight = 0;
+    int64_t nTime = 0;
+    BOOST_CHECK(GetKernelStakeModifier(vHashes[10], nStakeModifier, nHeight, nTime, false));
+    BOOST_CHECK(nStakeModifier > 10);
+    BOOST_CHECK_EQUAL(vBlocks[nStakeModifier].nHeight, nHeight);
+
+    // Later lookups come from the cache and do not see the changed chain
+    for (size_t i = 0; i < vBlocks.size(); i++)
+        vBlocks[i].nStakeModifier += 1000;
+    BOOST_CHECK(GetKernelStakeModifier(vHashes[10], nCached, nHeight, nTime, false));
+    BOOST_CHECK_EQUAL(nCached, nStakeModifier);
+
+    // Disconnecting a block after the lookup's range keeps it...
+    InvalidateStakeModifierCache(vBlocks[nStakeModifier + 1].nHeight);
+    BOOST_CHECK(GetKernelStakeModifier(vHashes[10], nCached, nHeight, nTime, false));
+    BOOST_CHECK_EQUAL(nCached, nStakeModifier);
+
+    // ...disconnecting one inside it does not
+    InvalidateStakeModifierCache(vBlocks[nStakeModifier].nHeight);
+    BOOST_CHECK(GetKernelStakeModifier(vHashes[10], nCached, nHeight, nTime, false));
+    BOOST_CHECK_EQUAL(nCached, nStakeModifier + 1000);
+
+    // Too close to the tip: nothing to find, and nothing cached
+    BOOST_CHECK(!GetKernelStakeModifier(vHashes[vHashes.size() - 2], nCached, nHeight, nTime, false));
+
+    chainActive.SetTip(pindexGenesis);
+    for (size_t i = 0; i < vHashes.size(); i++)
+        mapBlockIndex.erase(vHashes[i]);
+    InvalidateStakeModifierCache(0);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
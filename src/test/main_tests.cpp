@@ -5,9 +5,16 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "primitives/transaction.h"
+#include "keystore.h"
 #include "main.h"
+#include "miner.h"
+#include "random.h"
+#include "script/sign.h"
+#include "txdb.h"
 
+#include <boost/scoped_ptr.hpp>
 #include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
 
 BOOST_AUTO_TEST_SUITE(main_tests)
 
@@ -48,4 +55,232 @@ BOOST_AUTO_TEST_CASE(subsidy_limit_test)
     BOOST_CHECK(nSum == 4109975100000000ULL);
 }
 
+BOOST_AUTO_TEST_CASE(block_index_arena)
+{
+    size_t nBefore = blockIndexArena.Size();
+    std::vector<CBlockIndex*> vIndex;
+    for (int i = 0; i < 5000; i++) {
+        vIndex.push_back(blockIndexArena.Allocate());
+        BOOST_CHECK(vIndex.back()->pprev == NULL);
+        BOOST_CHECK_EQUAL(vIndex.back()->nHeight, 0);
+        vIndex.back()->nHeight = i;
+    }
+    BOOST_CHECK_EQUAL(blockIndexArena.Size(), nBefore + 5000);
+    BOOST_CHECK(blockIndexArena.MemoryUsage() >= blockIndexArena.Size() * sizeof(CBlockIndex));
+
+    // Entries do not overlap
+    for (int i = 0; i < 5000; i++)
+        BOOST_CHECK_EQUAL(vIndex[i]->nHeight, i);
+
+    // A freed slot is handed out again, reset
+    size_t nMemory = blockIndexArena.MemoryUsage();
+    CBlockIndex* pindexFreed = vIndex.back();
+    blockIndexArena.Free(pindexFreed);
+    BOOST_CHECK_EQUAL(blockIndexArena.Size(), nBefore + 4999);
+    CBlockIndex* pindexReused = blockIndexArena.Allocate();
+    BOOST_CHECK(pindexReused == pindexFreed);
+    BOOST_CHECK_EQUAL(pindexReused->nHeight, 0);
+    BOOST_CHECK_EQUAL(blockIndexArena.Size(), nBefore + 5000);
+    BOOST_CHECK_EQUAL(blockIndexArena.MemoryUsage(), nMemory);
+}
+
+BOOST_AUTO_TEST_CASE(block_index_zerocoin_supply)
+{
+    CBlockIndex* pindex = blockIndexArena.Allocate();
+    pindex->SetZerocoinSupplyMap(GetEmptyZerocoinSupplyMap());
+    BOOST_CHECK_EQUAL(pindex->GetZerocoinSupply(), 0);
+
+    ZerocoinSupplyMap mapSupply = GetEmptyZerocoinSupplyMap();
+    mapSupply.at(libzerocoin::CoinDenomination::ZQ_ONE) = 3;
+    mapSupply.at(libzerocoin::CoinDenomination::ZQ_FIVE) = 2;
+    pindex->SetZerocoinSupplyMap(mapSupply);
+    BOOST_CHECK(pindex->GetZerocoinSupplyMap() == mapSupply);
+    BOOST_CHECK_EQUAL(pindex->GetZerocoinSupply(), 13 * COIN);
+
+    // The disk format still carries the supply
+    CDiskBlockIndex diskindex(pindex);
+    BOOST_CHECK(diskindex.mapZerocoinSupply == mapSupply);
+
+    // Entries not in the cache read their supply back from the block tree
+    diskindex.nVersion = 4;
+    diskindex.nNonce = GetRand(std::numeric_limits<uint32_t>::max());
+    BOOST_REQUIRE(pblocktree->WriteBlockIndex(diskindex));
+    uint256 hash = diskindex.GetBlockHash();
+    CBlockIndex* pindexLoaded = blockIndexArena.Allocate();
+    pindexLoaded->phashBlock = &hash;
+    BOOST_CHECK(pindexLoaded->GetZerocoinSupplyMap() == mapSupply);
+    BOOST_CHECK_EQUAL(pindexLoaded->GetZerocoinSupply(), 13 * COIN);
+}
+
+BOOST_AUTO_TEST_CASE(block_template_validity)
+{
+    LOCK(cs_main);
+    CBlockIndex* pindexTip = chainActive.Tip();
+    ZerocoinSupplyMap mapSupplyTip = pindexTip->GetZerocoinSupplyMap();
+
+    // CreateNewBlock checks the template on a dummy index for the next height
+    CScript scriptPubKey = CScript() << OP_TRUE;
+    boost::scoped_ptr<CBlockTemplate> pblocktemplate(CreateNewBlock(scriptPubKey, NULL, false));
+    BOOST_REQUIRE(pblocktemplate);
+
+    // Checking it again works and leaves the tip and its supply alone
+    CValidationState state;
+    BOOST_CHECK(TestBlockValidity(state, pblocktemplate->block, pindexTip, false, false));
+    BOOST_CHECK(state.IsValid());
+    BOOST_CHECK(chainActive.Tip() == pindexTip);
+    BOOST_CHECK(pindexTip->GetZerocoinSupplyMap() == mapSupplyTip);
+}
+
+/** A confirmed transaction with nOutputs of 10 COIN to scriptFund, only in the coins cache */
+static uint256 AddFund(const CScript& scriptFund, unsigned int nOutputs)
+{
+    uint256 hashFund = GetRandHash();
+    CCoinsModifier coins = pcoinsTip->ModifyCoins(hashFund);
+    coins->fCoinBase = false;
+    coins->nVersion = 1;
+    coins->nHeight = chainActive.Height();
+    coins->vout.assign(nOutputs, CTxOut(10 * COIN, scriptFund));
+    return hashFund;
+}
+
+/** A signed spend of one output of hashFund, paying 1 COIN of its 10 in fees */
+static CTransaction SpendFund(const CKeyStore& keystore, const CScript& scriptFund, const uint256& hashFund, unsigned int n, const CScript& scriptTo)
+{
+    CMutableTransaction tx;
+    tx.vin.push_back(CTxIn(COutPoint(hashFund, n)));
+    tx.vout.push_back(CTxOut(9 * COIN, scriptTo));
+    BOOST_CHECK(SignSignature(keystore, scriptFund, tx, 0));
+    return tx;
+}
+
+BOOST_AUTO_TEST_CASE(mempool_accept_phases)
+{
+    LOCK(cs_main);
+    CBasicKeyStore keystore;
+    CKey key;
+    key.MakeNewKey(true);
+    keystore.AddKey(key);
+    CScript scriptFund = GetScriptForDestination(key.GetPubKey().GetID());
+    CScript scriptTo = CScript() << OP_11 << OP_EQUAL;
+
+    uint256 hashFund = AddFund(scriptFund, 3);
+    CTransaction tx1 = SpendFund(keystore, scriptFund, hashFund, 0, scriptTo);
+    CTransaction tx2 = SpendFund(keystore, scriptFund, hashFund, 0, CScript() << OP_12 << OP_EQUAL);
+    CTransaction tx3 = SpendFund(keystore, scriptFund, hashFund, 1, scriptTo);
+    CMutableTransaction txBadSig(SpendFund(keystore, scriptFund, hashFund, 2, scriptTo));
+    txBadSig.vin[0].scriptSig = CScript() << std::vector<unsigned char>(72, 1) << ToByteVector(key.GetPubKey());
+
+    // Prepare only collects the script checks, Verify runs them
+    CValidationState state;
+    CMempoolAccept acceptBad(txBadSig, false, false, false);
+    BOOST_CHECK(PrepareMempoolAccept(mempool, state, acceptBad, NULL));
+    BOOST_CHECK_EQUAL(acceptBad.vScriptChecks.size(), 1);
+    BOOST_CHECK_EQUAL(acceptBad.nFees, 1 * COIN);
+    BOOST_CHECK(!VerifyMempoolAccept(state, acceptBad));
+    BOOST_CHECK(state.GetRejectReason().find("mandatory-script-verify-flag-failed") == 0);
+
+    // A double spend verified concurrently: the first one finished wins
+    CMempoolAccept accept1(tx1, false, false, false);
+    CMempoolAccept accept2(tx2, false, false, false);
+    CMempoolAccept accept3(tx3, false, false, false);
+    CValidationState state1, state2, state3;
+    BOOST_CHECK(PrepareMempoolAccept(mempool, state1, accept1, NULL));
+    BOOST_CHECK(PrepareMempoolAccept(mempool, state2, accept2, NULL));
+    BOOST_CHECK(PrepareMempoolAccept(mempool, state3, accept3, NULL));
+    bool fVerified1 = false, fVerified2 = false;
+    boost::thread thread1([&]() { fVerified1 = VerifyMempoolAccept(state1, accept1); });
+    boost::thread thread2([&]() { fVerified2 = VerifyMempoolAccept(state2, accept2); });
+    thread1.join();
+    thread2.join();
+    BOOST_CHECK(fVerified1 && fVerified2);
+    BOOST_CHECK(VerifyMempoolAccept(state3, accept3));
+
+    BOOST_CHECK(FinishMempoolAccept(mempool, state1, accept1, NULL));
+    BOOST_CHECK(mempool.exists(tx1.GetHash()));
+    BOOST_CHECK(!FinishMempoolAccept(mempool, state2, accept2, NULL));
+    BOOST_CHECK(!mempool.exists(tx2.GetHash()));
+
+    // An unrelated transaction is only rechecked against the changed pool
+    BOOST_CHECK(accept3.nTransactionsUpdated != mempool.GetTransactionsUpdated());
+    BOOST_CHECK(FinishMempoolAccept(mempool, state3, accept3, NULL));
+    BOOST_CHECK(mempool.exists(tx3.GetHash()));
+    BOOST_CHECK_EQUAL(accept3.nTransactionsUpdated + 1, mempool.GetTransactionsUpdated());
+
+    // After a new tip everything is checked again, the signatures included
+    CMempoolAccept acceptStale(txBadSig, false, false, false);
+    CValidationState stateStale;
+    BOOST_CHECK(PrepareMempoolAccept(mempool, stateStale, acceptStale, NULL));
+    acceptStale.hashBestBlock = uint256();
+    BOOST_CHECK(!FinishMempoolAccept(mempool, stateStale, acceptStale, NULL));
+    BOOST_CHECK(stateStale.GetRejectReason().find("mandatory-script-verify-flag-failed") == 0);
+    BOOST_CHECK(!mempool.exists(txBadSig.GetHash()));
+
+    mempool.clear();
+    pcoinsTip->ModifyCoins(hashFund)->Clear();
+}
+
+BOOST_AUTO_TEST_CASE(mempool_dump_load)
+{
+    LOCK(cs_main);
+    CBasicKeyStore keystore;
+    CKey key;
+    key.MakeNewKey(true);
+    keystore.AddKey(key);
+    CScript scriptFund = GetScriptForDestination(key.GetPubKey().GetID());
+    uint256 hashFund = AddFund(scriptFund, 2);
+
+    // A parent and its child, and a transaction whose input is gone by the time the pool is loaded
+    CMutableTransaction txParent(SpendFund(keystore, scriptFund, hashFund, 0, scriptFund));
+    CMutableTransaction txChild;
+    txChild.vin.push_back(CTxIn(COutPoint(txParent.GetHash(), 0)));
+    txChild.vout.push_back(CTxOut(8 * COIN, scriptFund));
+    BOOST_CHECK(SignSignature(keystore, txParent, txChild, 0));
+    CTransaction txGone = SpendFund(keystore, scriptFund, hashFund, 1, scriptFund);
+    uint256 hashParent = txParent.GetHash(), hashChild = txChild.GetHash(), hashUnknown = GetRandHash();
+
+    CValidationState state;
+    SetMockTime(1000);
+    BOOST_CHECK(AcceptToMemoryPool(mempool, state, txParent, true, NULL));
+    SetMockTime(2000);
+    BOOST_CHECK(AcceptToMemoryPool(mempool, state, txChild, true, NULL));
+    BOOST_CHECK(AcceptToMemoryPool(mempool, state, txGone, true, NULL));
+    SetMockTime(0);
+    mempool.PrioritiseTransaction(hashChild, hashChild.ToString(), 0, 5000);
+    mempool.PrioritiseTransaction(hashUnknown, hashUnknown.ToString(), 1.5, 0);
+    BOOST_CHECK(DumpMempool());
+
+    mempool.clear();
+    mempool.ClearPrioritisation(hashChild);
+    mempool.ClearPrioritisation(hashUnknown);
+    pcoinsTip->ModifyCoins(hashFund)->Spend(1);
+
+    BOOST_CHECK(LoadMempool());
+    BOOST_CHECK_EQUAL(mempool.size(), 2);
+    BOOST_CHECK(!mempool.exists(txGone.GetHash()));
+    {
+        LOCK(mempool.cs);
+        CTxMemPool::txiter itParent = mempool.mapTx.find(hashParent);
+        CTxMemPool::txiter itChild = mempool.mapTx.find(hashChild);
+        BOOST_REQUIRE(itParent != mempool.mapTx.end() && itChild != mempool.mapTx.end());
+        BOOST_CHECK_EQUAL(itParent->GetTime(), 1000);
+        BOOST_CHECK_EQUAL(itChild->GetTime(), 2000);
+        BOOST_CHECK_EQUAL(itChild->GetModifiedFee(), 1 * COIN + 5000);
+        BOOST_CHECK_EQUAL(itChild->GetCountWithAncestors(), 2);
+        BOOST_CHECK_EQUAL(mempool.mapDeltas[hashUnknown].first, 1.5);
+    }
+
+    // A file from another version is left alone
+    mempool.clear();
+    {
+        CAutoFile file(fopen((GetDataDir() / "mempool.dat").string().c_str(), "wb"), SER_DISK, CLIENT_VERSION);
+        file << (uint64_t)2 << std::map<uint256, std::pair<double, CAmount> >() << (uint64_t)1 << CTransaction(txParent) << (int64_t)1000;
+    }
+    BOOST_CHECK(!LoadMempool());
+    BOOST_CHECK_EQUAL(mempool.size(), 0);
+
+    mempool.ClearPrioritisation(hashChild);
+    mempool.ClearPrioritisation(hashUnknown);
+    pcoinsTip->ModifyCoins(hashFund)->Clear();
+}
+
 BOOST_AUTO_TEST_SUITE_END()
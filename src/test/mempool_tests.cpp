@@ -3,11 +3,14 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "main.h"
+#include "random.h"
 #include "txmempool.h"
 #include "util.h"
+#include "utiltime.h"
 
 #include <boost/test/unit_test.hpp>
 #include <list>
+#include <math.h>
 
 BOOST_AUTO_TEST_SUITE(mempool_tests)
 
@@ -99,4 +102,249 @@ BOOST_AUTO_TEST_CASE(MempoolRemoveTest)
     removed.clear();
 }
 
+static CMutableTransaction MakeSpend(const uint256& hashPrev, CAmount nValue)
+{
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].scriptSig = CScript() << OP_11;
+    tx.vin[0].prevout.hash = hashPrev;
+    tx.vin[0].prevout.n = 0;
+    tx.vout.resize(1);
+    tx.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    tx.vout[0].nValue = nValue;
+    return tx;
+}
+
+BOOST_AUTO_TEST_CASE(MempoolAncestorIndexingTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+
+    // A <- B <- C chain, and an unrelated D
+    CMutableTransaction txA = MakeSpend(GetRandHash(), 10 * COIN);
+    CMutableTransaction txB = MakeSpend(txA.GetHash(), 9 * COIN);
+    CMutableTransaction txC = MakeSpend(txB.GetHash(), 8 * COIN);
+    CMutableTransaction txD = MakeSpend(GetRandHash(), 7 * COIN);
+    uint256 hashA = txA.GetHash(), hashB = txB.GetHash(), hashC = txC.GetHash(), hashD = txD.GetHash();
+    pool.addUnchecked(hashA, CTxMemPoolEntry(txA, 10000, 0, 0.0, 1));
+    pool.addUnchecked(hashB, CTxMemPoolEntry(txB, 1000, 0, 0.0, 1));
+    pool.addUnchecked(hashC, CTxMemPoolEntry(txC, 50000, 0, 0.0, 1));
+    pool.addUnchecked(hashD, CTxMemPoolEntry(txD, 2000, 0, 0.0, 1));
+
+    uint64_t nTxSize = ::GetSerializeSize(CTransaction(txA), SER_NETWORK, PROTOCOL_VERSION);
+    CTxMemPool::txiter itC = pool.mapTx.find(hashC);
+    BOOST_CHECK_EQUAL(itC->GetCountWithAncestors(), 3);
+    BOOST_CHECK_EQUAL(itC->GetSizeWithAncestors(), 3 * nTxSize);
+    BOOST_CHECK_EQUAL(itC->GetModFeesWithAncestors(), 61000);
+    BOOST_CHECK_EQUAL(pool.mapTx.find(hashB)->GetModFeesWithAncestors(), 11000);
+
+    // C pays for its ancestors; B is scored by its own low fee rate
+    std::vector<uint256> vOrder;
+    BOOST_FOREACH (const CTxMemPoolEntry& entry, pool.mapTx.get<ancestor_score>())
+        vOrder.push_back(entry.GetTx().GetHash());
+    BOOST_REQUIRE_EQUAL(vOrder.size(), 4);
+    BOOST_CHECK(vOrder[0] == hashC);
+    BOOST_CHECK(vOrder[1] == hashA);
+    BOOST_CHECK(vOrder[2] == hashD);
+    BOOST_CHECK(vOrder[3] == hashB);
+
+    // Prioritisation reaches the descendants
+    pool.PrioritiseTransaction(hashA, hashA.ToString(), 0, 30000);
+    BOOST_CHECK_EQUAL(pool.mapTx.find(hashA)->GetModFeesWithAncestors(), 40000);
+    BOOST_CHECK_EQUAL(pool.mapTx.find(hashC)->GetModFeesWithAncestors(), 91000);
+
+    // A confirmed in a block leaves the others behind with fewer ancestors
+    std::list<CTransaction> removed;
+    pool.remove(txA, removed, false);
+    BOOST_CHECK_EQUAL(removed.size(), 1);
+    BOOST_CHECK_EQUAL(pool.mapTx.find(hashB)->GetCountWithAncestors(), 1);
+    BOOST_CHECK_EQUAL(pool.mapTx.find(hashC)->GetCountWithAncestors(), 2);
+    BOOST_CHECK_EQUAL(pool.mapTx.find(hashC)->GetModFeesWithAncestors(), 51000);
+
+    // ... and coming back after a reorg links it up again, prioritisation included
+    pool.addUnchecked(hashA, CTxMemPoolEntry(txA, 10000, 0, 0.0, 1));
+    BOOST_CHECK_EQUAL(pool.mapTx.find(hashC)->GetCountWithAncestors(), 3);
+    BOOST_CHECK_EQUAL(pool.mapTx.find(hashC)->GetModFeesWithAncestors(), 91000);
+    CTxMemPool::setEntries setAncestors;
+    pool.CalculateMemPoolAncestors(pool.mapTx.find(hashC), setAncestors);
+    BOOST_CHECK_EQUAL(setAncestors.size(), 2);
+
+    pool.remove(txA, removed, true);
+    BOOST_CHECK_EQUAL(pool.size(), 1);
+}
+
+BOOST_AUTO_TEST_CASE(MempoolSizeLimitTest)
+{
+    CTxMemPool pool(CFeeRate(1000));
+
+    // A pays well, B is a cheap parent whose child C pays for both, D is cheap on its own
+    CMutableTransaction txA = MakeSpend(GetRandHash(), 10 * COIN);
+    CMutableTransaction txB = MakeSpend(GetRandHash(), 9 * COIN);
+    CMutableTransaction txC = MakeSpend(txB.GetHash(), 8 * COIN);
+    CMutableTransaction txD = MakeSpend(GetRandHash(), 7 * COIN);
+    uint256 hashA = txA.GetHash(), hashB = txB.GetHash(), hashC = txC.GetHash(), hashD = txD.GetHash();
+    pool.addUnchecked(hashA, CTxMemPoolEntry(txA, 30000, 0, 0.0, 1));
+    pool.addUnchecked(hashB, CTxMemPoolEntry(txB, 100, 0, 0.0, 1));
+    pool.addUnchecked(hashC, CTxMemPoolEntry(txC, 20000, 0, 0.0, 1));
+    pool.addUnchecked(hashD, CTxMemPoolEntry(txD, 500, 0, 0.0, 1));
+
+    uint64_t nTxSize = ::GetSerializeSize(CTransaction(txA), SER_NETWORK, PROTOCOL_VERSION);
+    BOOST_CHECK_EQUAL(pool.mapTx.find(hashB)->GetCountWithDescendants(), 2);
+    BOOST_CHECK_EQUAL(pool.mapTx.find(hashB)->GetSizeWithDescendants(), 2 * nTxSize);
+    BOOST_CHECK_EQUAL(pool.mapTx.find(hashB)->GetModFeesWithDescendants(), 20100);
+    BOOST_CHECK_EQUAL(pool.mapTx.find(hashC)->GetCountWithDescendants(), 1);
+
+    // Prioritising the child shows up in the parent's descendant totals
+    pool.PrioritiseTransaction(hashC, hashC.ToString(), 0, 1000);
+    BOOST_CHECK_EQUAL(pool.mapTx.find(hashB)->GetModFeesWithDescendants(), 21100);
+    pool.PrioritiseTransaction(hashC, hashC.ToString(), 0, -1000);
+
+    // Every transaction of one type is accounted for
+    std::map<int32_t, TxMempoolTypeStats> mapTypeStats = pool.GetTypeStats();
+    BOOST_CHECK_EQUAL(mapTypeStats.size(), 1);
+    BOOST_CHECK_EQUAL(mapTypeStats[TX_PAYMENT].nCount, 4);
+    BOOST_CHECK_EQUAL(mapTypeStats[TX_PAYMENT].nBytes, 4 * nTxSize);
+    BOOST_CHECK(pool.DynamicMemoryUsage() > mapTypeStats[TX_PAYMENT].nUsage + 4 * sizeof(CTxMemPoolEntry));
+
+    // D goes first; B is kept as long as C pays for it
+    pool.TrimToSize(pool.DynamicMemoryUsage() - 1);
+    BOOST_CHECK_EQUAL(pool.size(), 3);
+    BOOST_CHECK(!pool.exists(hashD));
+    BOOST_CHECK_EQUAL(pool.GetMinFee(1).GetFeePerK(), CFeeRate(500, nTxSize).GetFeePerK() + 1000);
+
+    // ... then B leaves together with C
+    pool.TrimToSize(pool.DynamicMemoryUsage() - 1);
+    BOOST_CHECK_EQUAL(pool.size(), 1);
+    BOOST_CHECK(pool.exists(hashA));
+    CAmount nMinFee = CFeeRate(20100, 2 * nTxSize).GetFeePerK() + 1000;
+    BOOST_CHECK_EQUAL(pool.GetMinFee(1).GetFeePerK(), nMinFee);
+
+    // The minimum fee decays once a block came in, faster in an emptier pool
+    std::vector<CTransaction> vtx;
+    std::list<CTransaction> conflicts;
+    SetMockTime(42);
+    pool.removeForBlock(vtx, 1, conflicts);
+    SetMockTime(42 + CTxMemPool::ROLLING_FEE_HALFLIFE / 4);
+    BOOST_CHECK_EQUAL(pool.GetMinFee(1000000).GetFeePerK(), llround(nMinFee / 2.0));
+    SetMockTime(0);
+
+    // Zerocoin spends pay no fee but are not evicted for size
+    CMutableTransaction txZ = MakeSpend(uint256(0), 5 * COIN);
+    txZ.vin[0].scriptSig = CScript() << OP_ZEROCOINSPEND;
+    BOOST_CHECK(CTransaction(txZ).IsZerocoinSpend());
+    uint256 hashZ = txZ.GetHash();
+    pool.addUnchecked(hashZ, CTxMemPoolEntry(txZ, 0, 0, 0.0, 1));
+    pool.TrimToSize(pool.DynamicMemoryUsage() - 1);
+    BOOST_CHECK_EQUAL(pool.size(), 1);
+    BOOST_CHECK(pool.exists(hashZ));
+
+    // ... even when nothing else is left to make room
+    pool.TrimToSize(0);
+    BOOST_CHECK(pool.exists(hashZ));
+
+    // File transactions are charged for their metadata
+    CMutableTransaction txFile = MakeSpend(GetRandHash(), 6 * COIN);
+    txFile.type = TX_FILE_PAYMENT_CONFIRM;
+    txFile.meta = CPaymentConfirm(hashA, 3600, std::vector<char>(270, 'k'));
+    CTxMemPoolEntry entryFile(txFile, 10000, 0, 0.0, 1);
+    BOOST_CHECK(entryFile.DynamicMemoryUsage() > 270);
+    pool.addUnchecked(txFile.GetHash(), entryFile);
+    mapTypeStats = pool.GetTypeStats();
+    BOOST_CHECK_EQUAL(mapTypeStats.size(), 2);
+    BOOST_CHECK_EQUAL(mapTypeStats[TX_FILE_PAYMENT_CONFIRM].nCount, 1);
+    BOOST_CHECK_EQUAL(mapTypeStats[TX_FILE_PAYMENT_CONFIRM].nUsage, entryFile.DynamicMemoryUsage());
+
+    pool.clear();
+    BOOST_CHECK(pool.GetTypeStats().empty());
+}
+
+BOOST_AUTO_TEST_CASE(MempoolRemoveSubtreeTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+
+    // A <- P <- C, with another child Q of A and a grandchild G of P
+    CMutableTransaction txA = MakeSpend(GetRandHash(), 10 * COIN);
+    txA.vout.push_back(txA.vout[0]);
+    CMutableTransaction txP = MakeSpend(txA.GetHash(), 9 * COIN);
+    txP.vout.push_back(txP.vout[0]);
+    CMutableTransaction txC = MakeSpend(txP.GetHash(), 8 * COIN);
+    CMutableTransaction txG = MakeSpend(txC.GetHash(), 7 * COIN);
+    CMutableTransaction txQ = MakeSpend(txA.GetHash(), 6 * COIN);
+    txQ.vin[0].prevout.n = 1;
+    uint256 hashA = txA.GetHash(), hashQ = txQ.GetHash();
+    pool.addUnchecked(hashA, CTxMemPoolEntry(txA, 10000, 0, 0.0, 1));
+    pool.addUnchecked(txP.GetHash(), CTxMemPoolEntry(txP, 2000, 0, 0.0, 1));
+    pool.addUnchecked(txC.GetHash(), CTxMemPoolEntry(txC, 3000, 0, 0.0, 1));
+    pool.addUnchecked(txG.GetHash(), CTxMemPoolEntry(txG, 4000, 0, 0.0, 1));
+    pool.addUnchecked(hashQ, CTxMemPoolEntry(txQ, 5000, 0, 0.0, 1));
+    BOOST_CHECK_EQUAL(pool.mapTx.find(hashA)->GetCountWithDescendants(), 5);
+    BOOST_CHECK_EQUAL(pool.mapTx.find(hashA)->GetModFeesWithDescendants(), 24000);
+
+    // Evicting P takes its subtree and leaves A with only itself and Q
+    std::list<CTransaction> removed;
+    pool.remove(txP, removed, true);
+    BOOST_CHECK_EQUAL(removed.size(), 3);
+    BOOST_CHECK_EQUAL(pool.size(), 2);
+    CTxMemPool::txiter itA = pool.mapTx.find(hashA);
+    CTxMemPool::txiter itQ = pool.mapTx.find(hashQ);
+    BOOST_CHECK_EQUAL(itA->GetCountWithDescendants(), 2);
+    BOOST_CHECK_EQUAL(itA->GetSizeWithDescendants(), itA->GetTxSize() + itQ->GetTxSize());
+    BOOST_CHECK_EQUAL(itA->GetModFeesWithDescendants(), 15000);
+    BOOST_CHECK_EQUAL(itQ->GetCountWithAncestors(), 2);
+    BOOST_CHECK_EQUAL(pool.GetMemPoolChildren(itA).size(), 1);
+    BOOST_CHECK(pool.mapNextTx.count(txC.vin[0].prevout) == 0);
+    BOOST_CHECK(pool.mapNextTx.count(txG.vin[0].prevout) == 0);
+    BOOST_CHECK_EQUAL(pool.GetTotalTxSize(), itA->GetTxSize() + itQ->GetTxSize());
+
+    // Removing A alone leaves Q without ancestors
+    pool.remove(txA, removed, false);
+    itQ = pool.mapTx.find(hashQ);
+    BOOST_CHECK_EQUAL(pool.size(), 1);
+    BOOST_CHECK_EQUAL(itQ->GetCountWithAncestors(), 1);
+    BOOST_CHECK_EQUAL(itQ->GetModFeesWithAncestors(), 5000);
+    BOOST_CHECK(pool.GetMemPoolParents(itQ).empty());
+}
+
+BOOST_AUTO_TEST_CASE(MempoolPackageLimitTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+    std::string errString;
+
+    // A chain of 25, the first one with a spare output
+    std::vector<CMutableTransaction> vChain;
+    vChain.push_back(MakeSpend(GetRandHash(), 10 * COIN));
+    vChain[0].vout.push_back(vChain[0].vout[0]);
+    for (int i = 1; i < 25; i++)
+        vChain.push_back(MakeSpend(vChain.back().GetHash(), 10 * COIN - i * 1000));
+    uint64_t nTxSize = ::GetSerializeSize(CTransaction(vChain[1]), SER_NETWORK, PROTOCOL_VERSION);
+    BOOST_FOREACH (const CMutableTransaction& tx, vChain) {
+        BOOST_CHECK(pool.CheckPackageLimits(tx, nTxSize, 25, 101000, 25, 101000, errString));
+        pool.addUnchecked(tx.GetHash(), CTxMemPoolEntry(tx, 1000, 0, 0.0, 1));
+    }
+
+    // One more at the end has too many ancestors
+    CMutableTransaction txLong = MakeSpend(vChain.back().GetHash(), 9 * COIN);
+    BOOST_CHECK(!pool.CheckPackageLimits(txLong, nTxSize, 25, 101000, 25, 101000, errString));
+    BOOST_CHECK(errString.find("too many unconfirmed ancestors") == 0);
+    BOOST_CHECK(pool.CheckPackageLimits(txLong, nTxSize, 26, 101000, 26, 101000, errString));
+
+    // A second child of the first one has a single ancestor, which has too many descendants
+    CMutableTransaction txSibling = MakeSpend(vChain[0].GetHash(), 1 * COIN);
+    txSibling.vin[0].prevout.n = 1;
+    BOOST_CHECK(!pool.CheckPackageLimits(txSibling, nTxSize, 25, 101000, 25, 101000, errString));
+    BOOST_CHECK(errString.find("too many descendants for tx " + vChain[0].GetHash().ToString()) == 0);
+    BOOST_CHECK(pool.CheckPackageLimits(txSibling, nTxSize, 25, 101000, 26, 101000, errString));
+
+    // The size limits count the new transaction as well
+    uint64_t nChainSize = pool.mapTx.find(vChain.back().GetHash())->GetSizeWithAncestors();
+    BOOST_CHECK_EQUAL(pool.mapTx.find(vChain[0].GetHash())->GetSizeWithDescendants(), nChainSize);
+    BOOST_CHECK(!pool.CheckPackageLimits(txSibling, nTxSize, 25, 101000, 26, nChainSize + nTxSize - 1, errString));
+    BOOST_CHECK(errString.find("exceeds descendant size limit") == 0);
+    BOOST_CHECK(!pool.CheckPackageLimits(txLong, nTxSize, 26, nChainSize + nTxSize - 1, 26, 101000, errString));
+    BOOST_CHECK(errString.find("exceeds ancestor size limit") == 0);
+    BOOST_CHECK(pool.CheckPackageLimits(txLong, nTxSize, 26, nChainSize + nTxSize, 26, nChainSize + nTxSize, errString));
+
+    // Unrelated transactions are not limited
+    BOOST_CHECK(pool.CheckPackageLimits(MakeSpend(GetRandHash(), COIN), nTxSize, 1, nTxSize, 1, nTxSize, errString));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,132 @@
+// Copyright (c) 2018-2019 The PDG developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "net.h"
+#include "netbase.h"
+#include "serialize.h"
+#include "streams.h"
+#include "sync.h"
+#include "version.h"
+
+#include <deque>
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(net_tests)
+
+static std::vector<char> BuildMessage(const char* pszCommand, unsigned int nSize)
+{
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << CMessageHeader(pszCommand, nSize);
+    std::vector<char> vMsg(ss.begin(), ss.end());
+    vMsg.resize(vMsg.size() + nSize, 0x42);
+    return vMsg;
+}
+
+BOOST_AUTO_TEST_CASE(netmessage_receive_budget)
+{
+    uint64_t nBaseline = CNetMessage::GetTotalBufferedBytes();
+    std::vector<char> vMsg = BuildMessage("ping", 300 * 1024);
+
+    {
+        std::deque<CNetMessage> vRecvMsg;
+        vRecvMsg.push_back(CNetMessage(SER_NETWORK, PROTOCOL_VERSION));
+        CNetMessage& msg = vRecvMsg.back();
+        BOOST_CHECK_EQUAL(CNetMessage::GetTotalBufferedBytes(), nBaseline + msg.GetBufferedBytes());
+
+        const char* pch = &vMsg[0];
+        int nHeader = msg.readHeader(pch, vMsg.size());
+        BOOST_CHECK_EQUAL(nHeader, 24);
+        BOOST_CHECK(msg.in_data);
+
+        // Data is buffered at most 256 KiB ahead of what was received
+        BOOST_CHECK_EQUAL(msg.readData(pch + nHeader, 1000), 1000);
+        BOOST_CHECK_EQUAL(msg.GetBufferedBytes(), 24 + 1000 + 256 * 1024);
+        BOOST_CHECK_EQUAL(CNetMessage::GetTotalBufferedBytes(), nBaseline + msg.GetBufferedBytes());
+
+        BOOST_CHECK_EQUAL(msg.readData(pch + nHeader + 1000, vMsg.size() - nHeader - 1000), (int)vMsg.size() - nHeader - 1000);
+        BOOST_CHECK(msg.complete());
+        BOOST_CHECK_EQUAL(msg.GetBufferedBytes(), vMsg.size());
+
+        // Copies are accounted for separately
+        vRecvMsg.push_back(msg);
+        BOOST_CHECK_EQUAL(CNetMessage::GetTotalBufferedBytes(), nBaseline + 2 * vMsg.size());
+        vRecvMsg.pop_front();
+        BOOST_CHECK_EQUAL(CNetMessage::GetTotalBufferedBytes(), nBaseline + vMsg.size());
+    }
+
+    // Released once the messages are gone
+    BOOST_CHECK_EQUAL(CNetMessage::GetTotalBufferedBytes(), nBaseline);
+}
+
+BOOST_AUTO_TEST_CASE(send_priority_classes)
+{
+    BOOST_CHECK_EQUAL(GetSendPriority("block"), SEND_PRIORITY_CRITICAL);
+    BOOST_CHECK_EQUAL(GetSendPriority("cmpctblock"), SEND_PRIORITY_CRITICAL);
+    BOOST_CHECK_EQUAL(GetSendPriority("ping"), SEND_PRIORITY_CRITICAL);
+    BOOST_CHECK_EQUAL(GetSendPriority("tx"), SEND_PRIORITY_RELAY);
+    BOOST_CHECK_EQUAL(GetSendPriority("addr"), SEND_PRIORITY_RELAY);
+    BOOST_CHECK_EQUAL(GetSendPriority("mnb"), SEND_PRIORITY_MASTERNODE);
+    BOOST_CHECK_EQUAL(GetSendPriority("mvote"), SEND_PRIORITY_MASTERNODE);
+    BOOST_CHECK_EQUAL(GetSendPriority("file"), SEND_PRIORITY_BULK);
+}
+
+/** Queue a message of the given size without touching the socket */
+static void QueueMessage(CNode& node, SendPriority priority, size_t nSize)
+{
+    node.vSendMsg[priority].push_back(CSerializeData(nSize));
+    node.nSendSize += nSize;
+}
+
+/** Pretend the selected message went out and return its queue */
+static int SendNext(CNode& node)
+{
+    int nQueue = node.SelectSendQueue();
+    node.nSendSize -= node.vSendMsg[nQueue].front().size();
+    node.vSendMsg[nQueue].pop_front();
+    node.nSendQueueInFlight = -1;
+    return nQueue;
+}
+
+BOOST_AUTO_TEST_CASE(send_queue_selection)
+{
+    CNode node(INVALID_SOCKET, CAddress(CService("127.0.0.1", 0)), "", true);
+    LOCK(node.cs_vSend);
+
+    for (int i = 0; i < 4; i++)
+        QueueMessage(node, SEND_PRIORITY_BULK, 100 * 1024);
+    for (int i = 0; i < 8; i++)
+        QueueMessage(node, SEND_PRIORITY_RELAY, 1000);
+    QueueMessage(node, SEND_PRIORITY_CRITICAL, 200);
+
+    // Critical traffic goes first
+    BOOST_CHECK_EQUAL(SendNext(node), SEND_PRIORITY_CRITICAL);
+
+    // A started message is finished before anything else, even a new block
+    BOOST_CHECK_EQUAL(node.SelectSendQueue(), SEND_PRIORITY_RELAY);
+    QueueMessage(node, SEND_PRIORITY_CRITICAL, 200);
+    BOOST_CHECK_EQUAL(node.SelectSendQueue(), SEND_PRIORITY_RELAY);
+    node.nSendQueueInFlight = -1;
+    BOOST_CHECK_EQUAL(SendNext(node), SEND_PRIORITY_CRITICAL);
+
+    // Small relay messages are not stuck behind the file transfer, which
+    // still gets its share once it has saved up enough credit
+    int nRelaySent = 0, nBulkSent = 0;
+    while (node.nSendSize > 0) {
+        int nQueue = SendNext(node);
+        if (nQueue == SEND_PRIORITY_RELAY) {
+            nRelaySent++;
+        } else {
+            BOOST_CHECK_EQUAL(nQueue, SEND_PRIORITY_BULK);
+            nBulkSent++;
+        }
+        if (nBulkSent == 0)
+            BOOST_CHECK(nRelaySent > 0);
+    }
+    BOOST_CHECK_EQUAL(nRelaySent, 8);
+    BOOST_CHECK_EQUAL(nBulkSent, 4);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -5,8 +5,10 @@
 
 #define BOOST_TEST_MODULE Pdg Test Suite
 
+#include "crypto/quark.h"
 #include "main.h"
 #include "random.h"
+#include "script/sigcache.h"
 #include "txdb.h"
 #include "ui_interface.h"
 #include "util.h"
@@ -32,6 +34,7 @@ struct TestingSetup {
 
     TestingSetup() {
         SetupEnvironment();
+        QuarkAutoDetect();
         fPrintToDebugLog = false; // don't want to write to debug.log file
         fCheckBlockIndex = true;
         SelectParams(CBaseChainParams::UNITTEST);
@@ -44,8 +47,10 @@ struct TestingSetup {
         mapArgs["-datadir"] = pathTemp.string();
         pblocktree = new CBlockTreeDB(1 << 20, true);
         pcoinsdbview = new CCoinsViewDB(1 << 23, true);
-        pcoinsTip = new CCoinsViewCache(pcoinsdbview);
+        pcoinsFrozen = new CCoinsViewFrozen(pcoinsdbview);
+        pcoinsTip = new CCoinsViewCache(pcoinsFrozen);
         InitBlockIndex();
+        InitSignatureCache();
 #ifdef ENABLE_WALLET
         bool fFirstRun;
         pwalletMain = new CWallet("wallet.dat");
@@ -67,6 +72,7 @@ struct TestingSetup {
         pwalletMain = NULL;
 #endif
         delete pcoinsTip;
+        delete pcoinsFrozen;
         delete pcoinsdbview;
         delete pblocktree;
 #ifdef ENABLE_WALLET
@@ -0,0 +1,130 @@
+// Copyright (c) 2018-2019 The PDG developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "chainparams.h"
+#include "main.h"
+#include "pow.h"
+#include "txdb.h"
+
+#include <algorithm>
+#include <map>
+#include <vector>
+
+#include <boost/foreach.hpp>
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(txdb_tests)
+
+/** What the block index load must reproduce for one entry */
+struct CLoadedEntry {
+    uint256 hashPrev;
+    uint256 hashNext;
+    int nHeight;
+    unsigned int nStatus;
+    unsigned int nFlags;
+    uint256 nChainWork;
+
+    bool operator==(const CLoadedEntry& other) const
+    {
+        return hashPrev == other.hashPrev && hashNext == other.hashNext && nHeight == other.nHeight &&
+               nStatus == other.nStatus && nFlags == other.nFlags && nChainWork == other.nChainWork;
+    }
+};
+
+static bool CompareHeight(const CBlockIndex* a, const CBlockIndex* b)
+{
+    return a->nHeight < b->nHeight;
+}
+
+/** Load db into an empty mapBlockIndex on nThreads threads and summarize the result */
+static std::map<uint256, CLoadedEntry> LoadTestIndex(CBlockTreeDB& db, int nThreads)
+{
+    mapBlockIndex.clear();
+    setStakeSeen.clear();
+    BOOST_REQUIRE(db.LoadBlockIndexGuts(nThreads));
+
+    // Chain work the way LoadBlockIndexDB computes it, parents first
+    std::vector<CBlockIndex*> vSorted;
+    BOOST_FOREACH (const BlockMap::value_type& item, mapBlockIndex)
+        vSorted.push_back(item.second);
+    std::sort(vSorted.begin(), vSorted.end(), CompareHeight);
+    BOOST_FOREACH (CBlockIndex* pindex, vSorted)
+        pindex->nChainWork = (pindex->pprev ? pindex->pprev->nChainWork : 0) + GetBlockProof(*pindex);
+
+    std::map<uint256, CLoadedEntry> mapLoaded;
+    BOOST_FOREACH (const BlockMap::value_type& item, mapBlockIndex) {
+        const CBlockIndex* pindex = item.second;
+        BOOST_CHECK(pindex->GetBlockHash() == item.first);
+        CLoadedEntry& entry = mapLoaded[item.first];
+        entry.hashPrev = pindex->pprev ? pindex->pprev->GetBlockHash() : uint256(0);
+        entry.hashNext = pindex->pnext ? pindex->pnext->GetBlockHash() : uint256(0);
+        entry.nHeight = pindex->nHeight;
+        entry.nStatus = pindex->nStatus;
+        entry.nFlags = pindex->nFlags;
+        entry.nChainWork = pindex->nChainWork;
+    }
+    BOOST_CHECK_EQUAL(mapLoaded.size(), mapBlockIndex.size());
+    return mapLoaded;
+}
+
+BOOST_AUTO_TEST_CASE(load_block_index_threads)
+{
+    LOCK(cs_main);
+    CBlockTreeDB db(1 << 20, true);
+
+    // A main chain with a fork off its middle, alternating PoW and PoS
+    // entries, all above the last PoW height so no real work is needed
+    const int nHeightBase = Params().LAST_POW_BLOCK() + 1;
+    std::vector<CDiskBlockIndex> vEntries;
+    std::vector<uint256> vHashes;
+    for (int i = 0; i < 600; i++) {
+        bool fFork = i >= 500;
+        CDiskBlockIndex entry;
+        entry.nVersion = 4;
+        entry.nHeight = nHeightBase + (fFork ? i - 100 : i);
+        entry.hashPrev = i == 0 ? uint256(0) : vHashes[i == 500 ? 399 : i - 1];
+        entry.nTime = 1500000000 + i;
+        entry.nBits = 0x1e0ffff0;
+        entry.nNonce = i;
+        entry.nTx = 1;
+        entry.nStatus = fFork ? BLOCK_VALID_TREE : (BLOCK_VALID_SCRIPTS | BLOCK_HAVE_DATA);
+        entry.nFile = 0;
+        entry.nDataPos = 8 + i * 200;
+        if (i % 2) {
+            entry.SetProofOfStake();
+            entry.prevoutStake = COutPoint(GetRandHash(), i);
+            entry.nStakeTime = entry.nTime;
+        }
+        vEntries.push_back(entry);
+        vHashes.push_back(entry.GetBlockHash());
+    }
+    for (int i = 0; i < 499; i++)
+        vEntries[i].hashNext = vHashes[i + 1];
+    BOOST_FOREACH (const CDiskBlockIndex& entry, vEntries)
+        BOOST_REQUIRE(db.WriteBlockIndex(entry));
+
+    BlockMap mapSaved;
+    mapSaved.swap(mapBlockIndex);
+    std::set<std::pair<COutPoint, unsigned int> > setStakeSeenSaved;
+    setStakeSeenSaved.swap(setStakeSeen);
+
+    std::map<uint256, CLoadedEntry> mapSerial = LoadTestIndex(db, 1);
+    size_t nStakeSeen = setStakeSeen.size();
+    std::map<uint256, CLoadedEntry> mapParallel = LoadTestIndex(db, MAX_BLOCK_INDEX_LOAD_THREADS);
+
+    BOOST_CHECK_EQUAL(mapSerial.size(), vEntries.size());
+    BOOST_CHECK(mapSerial == mapParallel);
+    BOOST_CHECK_EQUAL(nStakeSeen, vEntries.size() / 2);
+    BOOST_CHECK_EQUAL(setStakeSeen.size(), nStakeSeen);
+
+    const CLoadedEntry& entryFork = mapParallel[vHashes[500]];
+    BOOST_CHECK(entryFork.hashPrev == vHashes[399]);
+    BOOST_CHECK_EQUAL(entryFork.nHeight, nHeightBase + 400);
+    BOOST_CHECK(mapParallel[vHashes[599]].nChainWork == mapParallel[vHashes[499]].nChainWork);
+
+    mapBlockIndex.swap(mapSaved);
+    setStakeSeen.swap(setStakeSeenSaved);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -4,6 +4,7 @@
 
 #include "wallet.h"
 
+#include <algorithm>
 #include <set>
 #include <stdint.h>
 #include <utility>
@@ -23,6 +24,8 @@ using namespace std;
 
 typedef set<pair<const CWalletTx*,unsigned int> > CoinSet;
 
+extern CWallet* pwalletMain;
+
 BOOST_AUTO_TEST_SUITE(wallet_tests)
 
 static CWallet wallet;
@@ -305,4 +308,61 @@ BOOST_AUTO_TEST_CASE(coin_selection_tests)
     empty_wallet();
 }
 
+BOOST_AUTO_TEST_CASE(stakeable_coin_index)
+{
+    LOCK(pwalletMain->cs_wallet);
+    size_t nStartCoins = pwalletMain->GetStakeableCoins()->size();
+
+    CKey key;
+    key.MakeNewKey(true);
+    BOOST_CHECK(pwalletMain->AddKeyPubKey(key, key.GetPubKey()));
+    CScript scriptMine = GetScriptForDestination(key.GetPubKey().GetID());
+    CKey keyOther;
+    keyOther.MakeNewKey(true);
+    CScript scriptOther = GetScriptForDestination(keyOther.GetPubKey().GetID());
+
+    // Only our own outputs are indexed
+    CMutableTransaction txFund;
+    txFund.vout.push_back(CTxOut(5 * COIN, scriptMine));
+    txFund.vout.push_back(CTxOut(3 * COIN, scriptMine));
+    txFund.vout.push_back(CTxOut(1 * COIN, scriptOther));
+    CWalletTx wtxFund(pwalletMain, txFund);
+    BOOST_CHECK(pwalletMain->AddToWallet(wtxFund));
+
+    // The snapshot is shared until the index changes
+    std::shared_ptr<const std::vector<COutPoint> > pCoins = pwalletMain->GetStakeableCoins();
+    BOOST_CHECK_EQUAL(pCoins->size(), nStartCoins + 2);
+    BOOST_CHECK(std::count(pCoins->begin(), pCoins->end(), COutPoint(wtxFund.GetHash(), 1)) == 1);
+    BOOST_CHECK(std::count(pCoins->begin(), pCoins->end(), COutPoint(wtxFund.GetHash(), 2)) == 0);
+    BOOST_CHECK(pwalletMain->GetStakeableCoins() == pCoins);
+
+    // A reloaded wallet reads its transactions before its keys and still indexes them
+    {
+        CWallet walletReloaded("wallet.dat");
+        bool fFirstRun;
+        BOOST_CHECK_EQUAL(walletReloaded.LoadWallet(fFirstRun), DB_LOAD_OK);
+        std::shared_ptr<const std::vector<COutPoint> > pReloaded = walletReloaded.GetStakeableCoins();
+        BOOST_CHECK_EQUAL(pReloaded->size(), nStartCoins + 2);
+        BOOST_CHECK(std::count(pReloaded->begin(), pReloaded->end(), COutPoint(wtxFund.GetHash(), 1)) == 1);
+    }
+
+    // Rebuilding the index in place gives the same coins
+    pwalletMain->RebuildStakeableCoins();
+    BOOST_CHECK(*pwalletMain->GetStakeableCoins() == *pCoins);
+
+    // Spending an output drops it without touching the handed out snapshot
+    CMutableTransaction txSpend;
+    txSpend.vin.push_back(CTxIn(COutPoint(wtxFund.GetHash(), 0)));
+    txSpend.vout.push_back(CTxOut(5 * COIN, scriptOther));
+    CWalletTx wtxSpend(pwalletMain, txSpend);
+    BOOST_CHECK(pwalletMain->AddToWallet(wtxSpend));
+    BOOST_CHECK_EQUAL(pwalletMain->GetStakeableCoins()->size(), nStartCoins + 1);
+    BOOST_CHECK_EQUAL(pCoins->size(), nStartCoins + 2);
+
+    // Erased transactions leave the index
+    pwalletMain->EraseFromWallet(wtxSpend.GetHash());
+    pwalletMain->EraseFromWallet(wtxFund.GetHash());
+    BOOST_CHECK_EQUAL(pwalletMain->GetStakeableCoins()->size(), nStartCoins);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
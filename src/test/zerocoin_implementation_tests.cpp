@@ -10,8 +10,11 @@
 #include "primitives/deterministicmint.h"
 #include "key.h"
 #include "accumulatorcheckpoints.h"
+#include "zpivspendcache.h"
 #include "libzerocoin/bignum.h"
+#include "checkqueue.h"
 #include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
 #include <iostream>
 #include <accumulators.h>
 #include "wallet.h"
@@ -515,4 +518,90 @@ BOOST_AUTO_TEST_CASE(deterministic_tests)
 }
 
 
+/** Mint a ZQ_ONE coin, accumulate it next to a few others and spend it */
+static CoinSpend CreateTestSpend(Accumulator& accumulator)
+{
+    PrivateCoin privateCoin(Params().Zerocoin_Params(false), CoinDenomination::ZQ_ONE);
+    PublicCoin pubCoin = privateCoin.getPublicCoin();
+    AccumulatorWitness witness(Params().Zerocoin_Params(false), accumulator, pubCoin);
+    for (int i = 0; i < 3; i++) {
+        PrivateCoin privTemp(Params().Zerocoin_Params(false), CoinDenomination::ZQ_ONE);
+        PublicCoin pubTemp = privTemp.getPublicCoin();
+        accumulator += pubTemp;
+        witness += pubTemp;
+    }
+    accumulator += pubCoin;
+
+    uint32_t nChecksum = GetChecksum(accumulator.getValue());
+    return CoinSpend(Params().Zerocoin_Params(false), Params().Zerocoin_Params(false), privateCoin, accumulator, nChecksum, witness, GetRandHash(), SpendType::SPEND);
+}
+
+BOOST_AUTO_TEST_CASE(zerocoinspend_checkqueue_test)
+{
+    Accumulator accumulator(Params().Zerocoin_Params(false), CoinDenomination::ZQ_ONE);
+    CoinSpend spend = CreateTestSpend(accumulator);
+    // The proof does not hold against an accumulator that lacks the coin
+    Accumulator accumulatorEmpty(Params().Zerocoin_Params(false), CoinDenomination::ZQ_ONE);
+
+    uint256 hashGood = GetZerocoinSpendCacheKey(spend, accumulator, false);
+    uint256 hashBad = GetZerocoinSpendCacheKey(spend, accumulatorEmpty, false);
+    BOOST_CHECK(!IsZerocoinSpendVerified(hashGood));
+    BOOST_CHECK(!IsZerocoinSpendVerified(hashBad));
+
+    CCheckQueue<CBlockCheck> queue(128);
+    boost::thread_group threadGroup;
+    for (int i = 0; i < 2; i++)
+        threadGroup.create_thread(boost::bind(&CCheckQueue<CBlockCheck>::Thread, &queue));
+
+    {
+        // One bad proof fails the whole batch, like a bad script does
+        CCheckQueueControl<CBlockCheck> control(&queue);
+        CZerocoinSpendCheck checkGood(spend, accumulator, GetRandHash(), hashGood);
+        CZerocoinSpendCheck checkBad(spend, accumulatorEmpty, GetRandHash(), hashBad);
+        std::vector<CBlockCheck> vChecks(2);
+        CBlockCheck(checkGood).swap(vChecks[0]);
+        CBlockCheck(checkBad).swap(vChecks[1]);
+        control.Add(vChecks);
+        BOOST_CHECK(!control.Wait());
+    }
+    BOOST_CHECK(!IsZerocoinSpendVerified(hashBad));
+
+    {
+        CCheckQueueControl<CBlockCheck> control(&queue);
+        CZerocoinSpendCheck checkGood(spend, accumulator, GetRandHash(), hashGood);
+        std::vector<CBlockCheck> vChecks(1);
+        CBlockCheck(checkGood).swap(vChecks[0]);
+        control.Add(vChecks);
+        BOOST_CHECK(control.Wait());
+    }
+    // A proof that verified on a worker is remembered for later checks
+    BOOST_CHECK(IsZerocoinSpendVerified(hashGood));
+
+    threadGroup.interrupt_all();
+    threadGroup.join_all();
+}
+
+BOOST_AUTO_TEST_CASE(zerocoinspend_cache_test)
+{
+    Accumulator accumulator(Params().Zerocoin_Params(false), CoinDenomination::ZQ_ONE);
+    CoinSpend spend = CreateTestSpend(accumulator);
+    Accumulator accumulatorOther(Params().Zerocoin_Params(false), CoinDenomination::ZQ_ONE);
+
+    uint256 hashProof = GetZerocoinSpendCacheKey(spend, accumulator, false);
+    BOOST_CHECK(!IsZerocoinSpendVerified(hashProof));
+    SetZerocoinSpendVerified(hashProof);
+    BOOST_CHECK(IsZerocoinSpendVerified(hashProof));
+
+    // The same spend relayed again hits the cache
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << spend;
+    CoinSpend spendRelayed(Params().Zerocoin_Params(false), Params().Zerocoin_Params(false), ss);
+    BOOST_CHECK(GetZerocoinSpendCacheKey(spendRelayed, accumulator, false) == hashProof);
+    BOOST_CHECK(IsZerocoinSpendVerified(GetZerocoinSpendCacheKey(spendRelayed, accumulator, false)));
+
+    // ...but not when checked against another accumulator or parameter set
+    BOOST_CHECK(!IsZerocoinSpendVerified(GetZerocoinSpendCacheKey(spend, accumulatorOther, false)));
+    BOOST_CHECK(!IsZerocoinSpendVerified(GetZerocoinSpendCacheKey(spend, accumulator, true)));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
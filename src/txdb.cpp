@@ -13,6 +13,8 @@
 
 #include <stdint.h>
 
+#include <boost/bind.hpp>
+#include <boost/scoped_ptr.hpp>
 #include <boost/thread.hpp>
 
 using namespace std;
@@ -31,7 +33,7 @@ void static BatchWriteHashBestChain(CLevelDBBatch& batch, const uint256& hash)
     batch.Write('B', hash);
 }
 
-CCoinsViewDB::CCoinsViewDB(size_t nCacheSize, bool fMemory, bool fWipe) : db(GetDataDir() / "chainstate", nCacheSize, fMemory, fWipe)
+CCoinsViewDB::CCoinsViewDB(size_t nCacheSize, bool fMemory, bool fWipe) : db(GetDataDir() / "chainstate", nCacheSize, fMemory, fWipe, "chainstate")
 {
 }
 
@@ -58,14 +60,13 @@ bool CCoinsViewDB::BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock)
     CLevelDBBatch batch;
     size_t count = 0;
     size_t changed = 0;
-    for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end();) {
+    // The map is left as is: a frozen layer keeps serving reads from it while this runs
+    for (CCoinsMap::const_iterator it = mapCoins.begin(); it != mapCoins.end(); ++it) {
         if (it->second.flags & CCoinsCacheEntry::DIRTY) {
             BatchWriteCoins(batch, it->first, it->second.coins);
             changed++;
         }
         count++;
-        CCoinsMap::iterator itOld = it++;
-        mapCoins.erase(itOld);
     }
     if (hashBlock != uint256(0))
         BatchWriteHashBestChain(batch, hashBlock);
@@ -74,7 +75,7 @@ bool CCoinsViewDB::BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock)
     return db.WriteBatch(batch);
 }
 
-CBlockFileTreeDB::CBlockFileTreeDB(size_t nCacheSize, bool fMemory, bool fWipe) : CLevelDBWrapper(GetDataDir() / "files" / "index", nCacheSize, fMemory, fWipe)
+CBlockFileTreeDB::CBlockFileTreeDB(size_t nCacheSize, bool fMemory, bool fWipe) : CLevelDBWrapper(GetDataDir() / "files" / "index", nCacheSize, fMemory, fWipe, "fileindex")
 {
 }
 
@@ -159,7 +160,7 @@ bool CBlockFileTreeDB::ReadCDBFileRepositoryState(CDBFileRepositoryState& fileRe
     return Read(string("dfs"), fileRepositoryState);
 }
 
-CBlockTreeDB::CBlockTreeDB(size_t nCacheSize, bool fMemory, bool fWipe) : CLevelDBWrapper(GetDataDir() / "blocks" / "index", nCacheSize, fMemory, fWipe)
+CBlockTreeDB::CBlockTreeDB(size_t nCacheSize, bool fMemory, bool fWipe) : CLevelDBWrapper(GetDataDir() / "blocks" / "index", nCacheSize, fMemory, fWipe, "blockindex")
 {
 }
 
@@ -168,6 +169,11 @@ bool CBlockTreeDB::WriteBlockIndex(const CDiskBlockIndex& blockindex)
     return Write(make_pair('b', blockindex.GetBlockHash()), blockindex);
 }
 
+bool CBlockTreeDB::ReadBlockIndex(const uint256& hash, CDiskBlockIndex& blockindex)
+{
+    return Read(make_pair('b', hash), blockindex);
+}
+
 bool CBlockTreeDB::WriteBlockFileInfo(int nFile, const CBlockFileInfo& info)
 {
     return Write(make_pair('f', nFile), info);
@@ -293,89 +299,182 @@ bool CBlockTreeDB::ReadInt(const std::string& name, int& nValue)
     return Read(std::make_pair('I', name), nValue);
 }
 
-bool CBlockTreeDB::LoadBlockIndexGuts()
+namespace
 {
-    boost::scoped_ptr<leveldb::Iterator> pcursor(NewIterator());
+/** A block index entry decoded by a loader thread, waiting to be linked into mapBlockIndex */
+struct CDecodedBlockIndex {
+    uint256 hash;
+    uint256 hashPrev;
+    uint256 hashNext;
+    CBlockIndex* pindex;
+};
 
-    CDataStream ssKeySet(SER_DISK, CLIENT_VERSION);
-    ssKeySet << make_pair('b', uint256(0));
-    pcursor->Seek(ssKeySet.str());
+/**
+ * Decode the 'b' records whose hash starts with a byte in [nBegin, nEnd).
+ * Runs on its own iterator, so several ranges can be read at once.
+ */
+void DecodeBlockIndexRange(CBlockTreeDB* pdb, unsigned int nBegin, unsigned int nEnd, std::vector<CDecodedBlockIndex>* pvDecoded, std::string* pstrError, const volatile bool* pfAbort)
+{
+    try {
+        boost::scoped_ptr<leveldb::Iterator> pcursor(pdb->NewIterator());
 
-    // Load mapBlockIndex
-    uint256 nPreviousCheckpoint;
-    while (pcursor->Valid()) {
-        boost::this_thread::interruption_point();
-        try {
+        uint256 hashStart = 0;
+        *hashStart.begin() = nBegin;
+        CDataStream ssKeySet(SER_DISK, CLIENT_VERSION);
+        ssKeySet << make_pair('b', hashStart);
+        pcursor->Seek(ssKeySet.str());
+
+        while (pcursor->Valid() && !*pfAbort) {
             leveldb::Slice slKey = pcursor->key();
             CDataStream ssKey(slKey.data(), slKey.data() + slKey.size(), SER_DISK, CLIENT_VERSION);
             char chType;
+            uint256 hashKey;
             ssKey >> chType;
-            if (chType == 'b') {
-                leveldb::Slice slValue = pcursor->value();
-                CDataStream ssValue(slValue.data(), slValue.data() + slValue.size(), SER_DISK, CLIENT_VERSION);
-                CDiskBlockIndex diskindex;
-                ssValue >> diskindex;
-
-                // Construct block index object
-                CBlockIndex* pindexNew = InsertBlockIndex(diskindex.GetBlockHash());
-                pindexNew->pprev = InsertBlockIndex(diskindex.hashPrev);
-                pindexNew->pnext = InsertBlockIndex(diskindex.hashNext);
-                pindexNew->nHeight = diskindex.nHeight;
-                pindexNew->nFile = diskindex.nFile;
-                pindexNew->nDataPos = diskindex.nDataPos;
-                pindexNew->nUndoPos = diskindex.nUndoPos;
-                pindexNew->nVersion = diskindex.nVersion;
-                pindexNew->hashMerkleRoot = diskindex.hashMerkleRoot;
-                pindexNew->nTime = diskindex.nTime;
-                pindexNew->nBits = diskindex.nBits;
-                pindexNew->nNonce = diskindex.nNonce;
-                pindexNew->nStatus = diskindex.nStatus;
-                pindexNew->nTx = diskindex.nTx;
-
-                //zerocoin
-                pindexNew->nAccumulatorCheckpoint = diskindex.nAccumulatorCheckpoint;
-                pindexNew->mapZerocoinSupply = diskindex.mapZerocoinSupply;
-                pindexNew->vMintDenominationsInBlock = diskindex.vMintDenominationsInBlock;
-
-                //Proof Of Stake
-                pindexNew->nMint = diskindex.nMint;
-                pindexNew->nMoneySupply = diskindex.nMoneySupply;
-                pindexNew->nFlags = diskindex.nFlags;
-                pindexNew->nStakeModifier = diskindex.nStakeModifier;
-                pindexNew->prevoutStake = diskindex.prevoutStake;
-                pindexNew->nStakeTime = diskindex.nStakeTime;
-                pindexNew->hashProofOfStake = diskindex.hashProofOfStake;
-
-                if (pindexNew->nHeight <= Params().LAST_POW_BLOCK()) {
-                    if (!CheckProofOfWork(pindexNew->GetBlockHash(), pindexNew->nBits))
-                        return error("LoadBlockIndex() : CheckProofOfWork failed: %s", pindexNew->ToString());
+            if (chType != 'b')
+                break;
+            ssKey >> hashKey;
+            if (*hashKey.begin() >= nEnd)
+                break;
+
+            leveldb::Slice slValue = pcursor->value();
+            CDataStream ssValue(slValue.data(), slValue.data() + slValue.size(), SER_DISK, CLIENT_VERSION);
+            CDiskBlockIndex diskindex;
+            ssValue >> diskindex;
+
+            // Construct block index object; it is linked into the tree later
+            CDecodedBlockIndex decoded;
+            decoded.hash = diskindex.GetBlockHash();
+            decoded.hashPrev = diskindex.hashPrev;
+            decoded.hashNext = diskindex.hashNext;
+            CBlockIndex* pindexNew = decoded.pindex = blockIndexArena.Allocate();
+            pvDecoded->push_back(decoded);
+
+            pindexNew->nHeight = diskindex.nHeight;
+            pindexNew->nFile = diskindex.nFile;
+            pindexNew->nDataPos = diskindex.nDataPos;
+            pindexNew->nUndoPos = diskindex.nUndoPos;
+            pindexNew->nVersion = diskindex.nVersion;
+            pindexNew->hashMerkleRoot = diskindex.hashMerkleRoot;
+            pindexNew->nTime = diskindex.nTime;
+            pindexNew->nBits = diskindex.nBits;
+            pindexNew->nNonce = diskindex.nNonce;
+            pindexNew->nStatus = diskindex.nStatus;
+            pindexNew->nTx = diskindex.nTx;
+
+            //zerocoin; the supply is left on disk until it is asked for
+            pindexNew->nAccumulatorCheckpoint = diskindex.nAccumulatorCheckpoint;
+            pindexNew->vMintDenominationsInBlock.swap(diskindex.vMintDenominationsInBlock);
+
+            //Proof Of Stake
+            pindexNew->nMint = diskindex.nMint;
+            pindexNew->nMoneySupply = diskindex.nMoneySupply;
+            pindexNew->nFlags = diskindex.nFlags;
+            pindexNew->nStakeModifier = diskindex.nStakeModifier;
+            pindexNew->prevoutStake = diskindex.prevoutStake;
+            pindexNew->nStakeTime = diskindex.nStakeTime;
+            pindexNew->hashProofOfStake = diskindex.hashProofOfStake;
+
+            if (pindexNew->nHeight <= Params().LAST_POW_BLOCK()) {
+                if (!CheckProofOfWork(decoded.hash, pindexNew->nBits)) {
+                    *pstrError = strprintf("CheckProofOfWork failed: %s", decoded.hash.ToString());
+                    return;
                 }
-                // ppcoin: build setStakeSeen
-                if (pindexNew->IsProofOfStake())
-                    setStakeSeen.insert(make_pair(pindexNew->prevoutStake, pindexNew->nStakeTime));
+            }
+
+            pcursor->Next();
+        }
+    } catch (std::exception& e) {
+        *pstrError = strprintf("Deserialize or I/O error - %s", e.what());
+    }
+}
+}
 
-                //populate accumulator checksum map in memory
-                if(pindexNew->nAccumulatorCheckpoint != 0 && pindexNew->nAccumulatorCheckpoint != nPreviousCheckpoint) {
-                    //Don't load any checkpoints that exist before v2 zpdg. The accumulator is invalid for v1 and not used.
-                    if (pindexNew->nHeight >= Params().Zerocoin_Block_V2_Start())
-                        LoadAccumulatorValuesFromDB(pindexNew->nAccumulatorCheckpoint);
+bool CBlockTreeDB::LoadBlockIndexGuts(int nThreads)
+{
+    int64_t nStart = GetTimeMicros();
 
-                    nPreviousCheckpoint = pindexNew->nAccumulatorCheckpoint;
-                }
+    // Block index keys are uniformly distributed hashes, so splitting on the
+    // first hash byte gives every thread a similar share of the records
+    if (nThreads <= 0)
+        nThreads = boost::thread::hardware_concurrency();
+    nThreads = std::max(1, std::min(nThreads, MAX_BLOCK_INDEX_LOAD_THREADS));
+    std::vector<std::vector<CDecodedBlockIndex> > vDecoded(nThreads);
+    std::vector<std::string> vError(nThreads);
+    volatile bool fAbort = false;
+    {
+        boost::thread_group threadGroup;
+        for (int i = 0; i < nThreads; i++)
+            threadGroup.create_thread(boost::bind(&DecodeBlockIndexRange, this, 256 * i / nThreads, 256 * (i + 1) / nThreads, &vDecoded[i], &vError[i], &fAbort));
+        try {
+            threadGroup.join_all();
+        } catch (const boost::thread_interrupted&) {
+            // Shutdown requested; let the loaders finish before their output goes away
+            fAbort = true;
+            boost::this_thread::disable_interruption di;
+            threadGroup.join_all();
+            throw;
+        }
+    }
+    int64_t nDecoded = GetTimeMicros();
+
+    bool fError = false;
+    size_t nEntries = 0;
+    for (int i = 0; i < nThreads; i++) {
+        if (!vError[i].empty()) {
+            error("%s : %s", __func__, vError[i]);
+            fError = true;
+        }
+        nEntries += vDecoded[i].size();
+    }
+    if (fError)
+        return false;
 
-                pcursor->Next();
-            } else {
-                break; // if shutdown requested or finished loading block index
+    // Load mapBlockIndex: register every entry first, then resolve the links,
+    // so that only genuinely missing parents become placeholder entries
+    mapBlockIndex.reserve(mapBlockIndex.size() + nEntries);
+    BOOST_FOREACH (std::vector<CDecodedBlockIndex>& vRange, vDecoded) {
+        BOOST_FOREACH (CDecodedBlockIndex& decoded, vRange) {
+            std::pair<BlockMap::iterator, bool> ret = mapBlockIndex.insert(make_pair(decoded.hash, decoded.pindex));
+            if (!ret.second) {
+                // Already known; take over the decoded fields and hand the slot back
+                *ret.first->second = *decoded.pindex;
+                blockIndexArena.Free(decoded.pindex);
+                decoded.pindex = ret.first->second;
             }
-        } catch (std::exception& e) {
-            return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+            decoded.pindex->phashBlock = &ret.first->first;
+        }
+    }
+
+    std::set<uint256> setCheckpoints;
+    BOOST_FOREACH (std::vector<CDecodedBlockIndex>& vRange, vDecoded) {
+        BOOST_FOREACH (const CDecodedBlockIndex& decoded, vRange) {
+            CBlockIndex* pindexNew = decoded.pindex;
+            pindexNew->pprev = InsertBlockIndex(decoded.hashPrev);
+            pindexNew->pnext = InsertBlockIndex(decoded.hashNext);
+
+            // ppcoin: build setStakeSeen
+            if (pindexNew->IsProofOfStake())
+                setStakeSeen.insert(make_pair(pindexNew->prevoutStake, pindexNew->nStakeTime));
+
+            //Don't load any checkpoints that exist before v2 zpdg. The accumulator is invalid for v1 and not used.
+            if (pindexNew->nAccumulatorCheckpoint != 0 && pindexNew->nHeight >= Params().Zerocoin_Block_V2_Start())
+                setCheckpoints.insert(pindexNew->nAccumulatorCheckpoint);
         }
     }
+    int64_t nLinked = GetTimeMicros();
+
+    //populate accumulator checksum map in memory
+    BOOST_FOREACH (const uint256& nCheckpoint, setCheckpoints)
+        LoadAccumulatorValuesFromDB(nCheckpoint);
+    int64_t nEnd = GetTimeMicros();
 
+    LogPrintf("%s: %u entries in %dms (decode %dms on %d threads, link %dms, %u accumulator checkpoints %dms)\n", __func__,
+        nEntries, (nEnd - nStart) / 1000, (nDecoded - nStart) / 1000, nThreads, (nLinked - nDecoded) / 1000,
+        setCheckpoints.size(), (nEnd - nLinked) / 1000);
     return true;
 }
 
-CZerocoinDB::CZerocoinDB(size_t nCacheSize, bool fMemory, bool fWipe) : CLevelDBWrapper(GetDataDir() / "zerocoin", nCacheSize, fMemory, fWipe)
+CZerocoinDB::CZerocoinDB(size_t nCacheSize, bool fMemory, bool fWipe) : CLevelDBWrapper(GetDataDir() / "zerocoin", nCacheSize, fMemory, fWipe, "zerocoin")
 {
 }
 
@@ -7,6 +7,7 @@
 #include "txmempool.h"
 
 #include "clientversion.h"
+#include "core_memusage.h"
 #include "main.h"
 #include "streams.h"
 #include "util.h"
@@ -17,16 +18,27 @@
 
 using namespace std;
 
-CTxMemPoolEntry::CTxMemPoolEntry() : nFee(0), nTxSize(0), nModSize(0), nTime(0), dPriority(0.0)
+CTxMemPoolEntry::CTxMemPoolEntry() : nFee(0), nTxSize(0), nModSize(0), nUsageSize(0), nTime(0), dPriority(0.0), nFeeDelta(0),
+                                     nCountWithAncestors(1), nSizeWithAncestors(0), nModFeesWithAncestors(0),
+                                     nCountWithDescendants(1), nSizeWithDescendants(0), nModFeesWithDescendants(0)
 {
     nHeight = MEMPOOL_HEIGHT;
 }
 
-CTxMemPoolEntry::CTxMemPoolEntry(const CTransaction& _tx, const CAmount& _nFee, int64_t _nTime, double _dPriority, unsigned int _nHeight) : tx(_tx), nFee(_nFee), nTime(_nTime), dPriority(_dPriority), nHeight(_nHeight)
+CTxMemPoolEntry::CTxMemPoolEntry(const CTransaction& _tx, const CAmount& _nFee, int64_t _nTime, double _dPriority, unsigned int _nHeight) : tx(_tx), nFee(_nFee), nTime(_nTime), dPriority(_dPriority), nHeight(_nHeight), nFeeDelta(0)
 {
     nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
 
     nModSize = tx.CalculateModifiedSize(nTxSize);
+    nUsageSize = RecursiveDynamicUsage(tx);
+
+    nCountWithAncestors = 1;
+    nSizeWithAncestors = nTxSize;
+    nModFeesWithAncestors = nFee;
+
+    nCountWithDescendants = 1;
+    nSizeWithDescendants = nTxSize;
+    nModFeesWithDescendants = nFee;
 }
 
 CTxMemPoolEntry::CTxMemPoolEntry(const CTxMemPoolEntry& other)
@@ -43,6 +55,31 @@ CTxMemPoolEntry::GetPriority(unsigned int currentHeight) const
     return dResult;
 }
 
+void CTxMemPoolEntry::UpdateAncestorState(int64_t nModifySize, CAmount nModifyFee, int64_t nModifyCount)
+{
+    nSizeWithAncestors += nModifySize;
+    assert(int64_t(nSizeWithAncestors) > 0);
+    nModFeesWithAncestors += nModifyFee;
+    nCountWithAncestors += nModifyCount;
+    assert(int64_t(nCountWithAncestors) > 0);
+}
+
+void CTxMemPoolEntry::UpdateDescendantState(int64_t nModifySize, CAmount nModifyFee, int64_t nModifyCount)
+{
+    nSizeWithDescendants += nModifySize;
+    assert(int64_t(nSizeWithDescendants) > 0);
+    nModFeesWithDescendants += nModifyFee;
+    nCountWithDescendants += nModifyCount;
+    assert(int64_t(nCountWithDescendants) > 0);
+}
+
+void CTxMemPoolEntry::UpdateFeeDelta(CAmount nNewFeeDelta)
+{
+    nModFeesWithAncestors += nNewFeeDelta - nFeeDelta;
+    nModFeesWithDescendants += nNewFeeDelta - nFeeDelta;
+    nFeeDelta = nNewFeeDelta;
+}
+
 /**
  * Keep track of fee/priority for transactions confirmed within N blocks
  */
@@ -356,7 +393,12 @@ public:
 
 
 CTxMemPool::CTxMemPool(const CFeeRate& _minRelayFee) : nTransactionsUpdated(0),
-                                                       minRelayFee(_minRelayFee)
+                                                       minRelayFee(_minRelayFee),
+                                                       totalTxSize(0),
+                                                       cachedInnerUsage(0),
+                                                       rollingMinimumFeeRate(0),
+                                                       lastRollingFeeUpdate(GetTime()),
+                                                       blockSinceLastRollingFeeBump(false)
 {
     // Sanity checks off by default for performance, because otherwise
     // accepting transactions becomes O(N^2) where N is the number
@@ -402,6 +444,159 @@ void CTxMemPool::AddTransactionsUpdated(unsigned int n)
 }
 
 
+void CTxMemPool::UpdateParent(txiter entry, txiter parent, bool fAdd)
+{
+    setEntries& parents = mapLinks[entry].parents;
+    if (fAdd && parents.insert(parent).second)
+        cachedInnerUsage += memusage::IncrementalDynamicUsage(parents);
+    else if (!fAdd && parents.erase(parent))
+        cachedInnerUsage -= memusage::IncrementalDynamicUsage(parents);
+}
+
+void CTxMemPool::UpdateChild(txiter entry, txiter child, bool fAdd)
+{
+    setEntries& children = mapLinks[entry].children;
+    if (fAdd && children.insert(child).second)
+        cachedInnerUsage += memusage::IncrementalDynamicUsage(children);
+    else if (!fAdd && children.erase(child))
+        cachedInnerUsage -= memusage::IncrementalDynamicUsage(children);
+}
+
+const CTxMemPool::setEntries& CTxMemPool::GetMemPoolParents(txiter entry) const
+{
+    assert(entry != mapTx.end());
+    txlinksMap::const_iterator it = mapLinks.find(entry);
+    assert(it != mapLinks.end());
+    return it->second.parents;
+}
+
+const CTxMemPool::setEntries& CTxMemPool::GetMemPoolChildren(txiter entry) const
+{
+    assert(entry != mapTx.end());
+    txlinksMap::const_iterator it = mapLinks.find(entry);
+    assert(it != mapLinks.end());
+    return it->second.children;
+}
+
+void CTxMemPool::CalculateMemPoolAncestors(txiter entry, setEntries& setAncestors) const
+{
+    std::vector<txiter> vStage(GetMemPoolParents(entry).begin(), GetMemPoolParents(entry).end());
+    while (!vStage.empty()) {
+        txiter it = vStage.back();
+        vStage.pop_back();
+        if (!setAncestors.insert(it).second)
+            continue;
+        const setEntries& setParents = GetMemPoolParents(it);
+        vStage.insert(vStage.end(), setParents.begin(), setParents.end());
+    }
+}
+
+void CTxMemPool::CalculateDescendants(txiter entry, setEntries& setDescendants) const
+{
+    std::vector<txiter> vStage(1, entry);
+    while (!vStage.empty()) {
+        txiter it = vStage.back();
+        vStage.pop_back();
+        if (!setDescendants.insert(it).second)
+            continue;
+        const setEntries& setChildren = GetMemPoolChildren(it);
+        vStage.insert(vStage.end(), setChildren.begin(), setChildren.end());
+    }
+}
+
+bool CTxMemPool::CheckPackageLimits(const CTransaction& tx, uint64_t nSize, uint64_t limitAncestorCount, uint64_t limitAncestorSize,
+                                    uint64_t limitDescendantCount, uint64_t limitDescendantSize, std::string& errString) const
+{
+    LOCK(cs);
+    std::vector<txiter> vStage;
+    if (!tx.IsZerocoinSpend()) {
+        BOOST_FOREACH (const CTxIn& txin, tx.vin) {
+            txiter itParent = mapTx.find(txin.prevout.hash);
+            if (itParent != mapTx.end())
+                vStage.push_back(itParent);
+        }
+    }
+
+    setEntries setAncestors;
+    uint64_t nSizeWithAncestors = nSize;
+    while (!vStage.empty()) {
+        txiter it = vStage.back();
+        vStage.pop_back();
+        if (!setAncestors.insert(it).second)
+            continue;
+
+        nSizeWithAncestors += it->GetTxSize();
+        if (setAncestors.size() + 1 > limitAncestorCount) {
+            errString = strprintf("too many unconfirmed ancestors [limit: %u]", limitAncestorCount);
+            return false;
+        }
+        if (nSizeWithAncestors > limitAncestorSize) {
+            errString = strprintf("exceeds ancestor size limit [limit: %u]", limitAncestorSize);
+            return false;
+        }
+        if (it->GetSizeWithDescendants() + nSize > limitDescendantSize) {
+            errString = strprintf("exceeds descendant size limit for tx %s [limit: %u]", it->GetTx().GetHash().ToString(), limitDescendantSize);
+            return false;
+        }
+        if (it->GetCountWithDescendants() + 1 > limitDescendantCount) {
+            errString = strprintf("too many descendants for tx %s [limit: %u]", it->GetTx().GetHash().ToString(), limitDescendantCount);
+            return false;
+        }
+
+        const setEntries& setParents = GetMemPoolParents(it);
+        vStage.insert(vStage.end(), setParents.begin(), setParents.end());
+    }
+    return true;
+}
+
+void CTxMemPool::UpdateEntryAncestorState(txiter entry)
+{
+    setEntries setAncestors;
+    CalculateMemPoolAncestors(entry, setAncestors);
+
+    int64_t nSize = entry->GetTxSize() - (int64_t)entry->GetSizeWithAncestors();
+    CAmount nFees = entry->GetModifiedFee() - entry->GetModFeesWithAncestors();
+    int64_t nCount = 1 - (int64_t)entry->GetCountWithAncestors();
+    BOOST_FOREACH (txiter it, setAncestors) {
+        nSize += it->GetTxSize();
+        nFees += it->GetModifiedFee();
+        nCount++;
+    }
+    mapTx.modify(entry, update_ancestor_state(nSize, nFees, nCount));
+}
+
+void CTxMemPool::UpdateEntryDescendantState(txiter entry)
+{
+    setEntries setDescendants;
+    CalculateDescendants(entry, setDescendants);
+
+    int64_t nSize = -(int64_t)entry->GetSizeWithDescendants();
+    CAmount nFees = -entry->GetModFeesWithDescendants();
+    int64_t nCount = -(int64_t)entry->GetCountWithDescendants();
+    BOOST_FOREACH (txiter it, setDescendants) {
+        nSize += it->GetTxSize();
+        nFees += it->GetModifiedFee();
+        nCount++;
+    }
+    mapTx.modify(entry, update_descendant_state(nSize, nFees, nCount));
+}
+
+void CTxMemPool::UpdateTypeStats(txiter entry, bool fAdd)
+{
+    TxMempoolTypeStats& stats = mapTypeStats[entry->GetTx().type];
+    if (fAdd) {
+        stats.nCount++;
+        stats.nBytes += entry->GetTxSize();
+        stats.nUsage += entry->DynamicMemoryUsage();
+    } else {
+        stats.nCount--;
+        stats.nBytes -= entry->GetTxSize();
+        stats.nUsage -= entry->DynamicMemoryUsage();
+        if (stats.nCount == 0)
+            mapTypeStats.erase(entry->GetTx().type);
+    }
+}
+
 bool CTxMemPool::addUnchecked(const uint256& hash, const CTxMemPoolEntry& entry)
 {
     // Add to memory pool without checking anything.
@@ -409,14 +604,68 @@ bool CTxMemPool::addUnchecked(const uint256& hash, const CTxMemPoolEntry& entry)
     // all the appropriate checks.
     LOCK(cs);
     {
-        mapTx[hash] = entry;
-        const CTransaction& tx = mapTx[hash].GetTx();
+        std::pair<txiter, bool> ret = mapTx.insert(entry);
+        if (!ret.second)
+            return true;
+        txiter newit = ret.first;
+        mapLinks.insert(make_pair(newit, TxLinks()));
+
+        // Prioritisation may have been set before the transaction arrived
+        std::map<uint256, std::pair<double, CAmount> >::const_iterator pos = mapDeltas.find(hash);
+        if (pos != mapDeltas.end() && pos->second.second != 0)
+            mapTx.modify(newit, update_fee_delta(pos->second.second));
+
+        const CTransaction& tx = newit->GetTx();
         if(!tx.IsZerocoinSpend()) {
-            for (unsigned int i = 0; i < tx.vin.size(); i++)
+            for (unsigned int i = 0; i < tx.vin.size(); i++) {
                 mapNextTx[tx.vin[i].prevout] = CInPoint(&tx, i);
+                txiter itParent = mapTx.find(tx.vin[i].prevout.hash);
+                if (itParent != mapTx.end()) {
+                    UpdateParent(newit, itParent, true);
+                    UpdateChild(itParent, newit, true);
+                }
+            }
+        }
+
+        // Transactions already in the pool may spend this one when it comes
+        // back from a disconnected block
+        bool fHasChildren = false;
+        for (unsigned int i = 0; i < tx.vout.size(); i++) {
+            std::map<COutPoint, CInPoint>::const_iterator it = mapNextTx.lower_bound(COutPoint(hash, i));
+            if (it == mapNextTx.end() || it->first.hash != hash)
+                break;
+            i = it->first.n;
+            txiter itChild = mapTx.find(it->second.ptx->GetHash());
+            if (itChild != mapTx.end()) {
+                UpdateParent(itChild, newit, true);
+                UpdateChild(newit, itChild, true);
+                fHasChildren = true;
+            }
+        }
+
+        UpdateEntryAncestorState(newit);
+        setEntries setAncestors;
+        CalculateMemPoolAncestors(newit, setAncestors);
+        if (fHasChildren) {
+            setEntries setDescendants;
+            CalculateDescendants(newit, setDescendants);
+            BOOST_FOREACH (txiter it, setDescendants) {
+                if (it != newit)
+                    UpdateEntryAncestorState(it);
+            }
+            // The ancestors may already count some of those descendants
+            UpdateEntryDescendantState(newit);
+            BOOST_FOREACH (txiter it, setAncestors)
+                UpdateEntryDescendantState(it);
+        } else {
+            BOOST_FOREACH (txiter it, setAncestors)
+                mapTx.modify(it, update_descendant_state(newit->GetTxSize(), newit->GetModifiedFee(), 1));
         }
+
         nTransactionsUpdated++;
         totalTxSize += entry.GetTxSize();
+        cachedInnerUsage += entry.DynamicMemoryUsage();
+        UpdateTypeStats(newit, true);
     }
     return true;
 }
@@ -425,44 +674,95 @@ bool CTxMemPool::addUnchecked(const uint256& hash, const CTxMemPoolEntry& entry)
 void CTxMemPool::remove(const CTransaction& origTx, std::list<CTransaction>& removed, bool fRecursive)
 {
     // Remove transaction from memory pool
-    {
-        LOCK(cs);
-        std::deque<uint256> txToRemove;
-        txToRemove.push_back(origTx.GetHash());
-        if (fRecursive && !mapTx.count(origTx.GetHash())) {
-            // If recursively removing but origTx isn't in the mempool
-            // be sure to remove any children that are in the pool. This can
-            // happen during chain re-orgs if origTx isn't re-accepted into
-            // the mempool for any reason.
-            for (unsigned int i = 0; i < origTx.vout.size(); i++) {
-                std::map<COutPoint, CInPoint>::iterator it = mapNextTx.find(COutPoint(origTx.GetHash(), i));
-                if (it == mapNextTx.end())
-                    continue;
-                txToRemove.push_back(it->second.ptx->GetHash());
-            }
-        }
-        while (!txToRemove.empty()) {
-            uint256 hash = txToRemove.front();
-            txToRemove.pop_front();
-            if (!mapTx.count(hash))
+    LOCK(cs);
+    setEntries setAllRemoves;
+    txiter origit = mapTx.find(origTx.GetHash());
+    if (origit != mapTx.end()) {
+        if (fRecursive)
+            CalculateDescendants(origit, setAllRemoves);
+        else
+            setAllRemoves.insert(origit);
+    } else if (fRecursive) {
+        // If recursively removing but origTx isn't in the mempool
+        // be sure to remove any children that are in the pool. This can
+        // happen during chain re-orgs if origTx isn't re-accepted into
+        // the mempool for any reason.
+        for (unsigned int i = 0; i < origTx.vout.size(); i++) {
+            std::map<COutPoint, CInPoint>::iterator it = mapNextTx.find(COutPoint(origTx.GetHash(), i));
+            if (it == mapNextTx.end())
                 continue;
-            const CTransaction& tx = mapTx[hash].GetTx();
-            if (fRecursive) {
-                for (unsigned int i = 0; i < tx.vout.size(); i++) {
-                    std::map<COutPoint, CInPoint>::iterator it = mapNextTx.find(COutPoint(hash, i));
-                    if (it == mapNextTx.end())
-                        continue;
-                    txToRemove.push_back(it->second.ptx->GetHash());
-                }
-            }
-            BOOST_FOREACH (const CTxIn& txin, tx.vin)
-                mapNextTx.erase(txin.prevout);
+            txiter nextit = mapTx.find(it->second.ptx->GetHash());
+            assert(nextit != mapTx.end());
+            CalculateDescendants(nextit, setAllRemoves);
+        }
+    }
+    RemoveStaged(setAllRemoves, removed);
+}
 
-            removed.push_back(tx);
-            totalTxSize -= mapTx[hash].GetTxSize();
-            mapTx.erase(hash);
-            nTransactionsUpdated++;
+void CTxMemPool::RemoveStaged(const setEntries& stage, std::list<CTransaction>& removed)
+{
+    // Add up what leaves the package of every entry that stays, so each of
+    // them is modified (and reindexed) once however much of it goes
+    struct CStateChange {
+        int64_t nSize;
+        CAmount nFees;
+        int64_t nCount;
+        CStateChange() : nSize(0), nFees(0), nCount(0) {}
+    };
+    typedef std::map<txiter, CStateChange, CompareIteratorByHash> mapStateChange;
+    mapStateChange mapDescendantChanges; //!< ancestors that stay, losing descendants
+    mapStateChange mapAncestorChanges;   //!< descendants that stay, losing ancestors
+    BOOST_FOREACH (txiter itRemove, stage) {
+        setEntries setRelatives;
+        CalculateMemPoolAncestors(itRemove, setRelatives);
+        BOOST_FOREACH (txiter it, setRelatives) {
+            if (stage.count(it))
+                continue;
+            CStateChange& change = mapDescendantChanges[it];
+            change.nSize -= itRemove->GetTxSize();
+            change.nFees -= itRemove->GetModifiedFee();
+            change.nCount--;
         }
+        setRelatives.clear();
+        CalculateDescendants(itRemove, setRelatives);
+        BOOST_FOREACH (txiter it, setRelatives) {
+            if (stage.count(it))
+                continue;
+            CStateChange& change = mapAncestorChanges[it];
+            change.nSize -= itRemove->GetTxSize();
+            change.nFees -= itRemove->GetModifiedFee();
+            change.nCount--;
+        }
+    }
+    for (mapStateChange::const_iterator it = mapDescendantChanges.begin(); it != mapDescendantChanges.end(); ++it)
+        mapTx.modify(it->first, update_descendant_state(it->second.nSize, it->second.nFees, it->second.nCount));
+    for (mapStateChange::const_iterator it = mapAncestorChanges.begin(); it != mapAncestorChanges.end(); ++it)
+        mapTx.modify(it->first, update_ancestor_state(it->second.nSize, it->second.nFees, it->second.nCount));
+
+    // Only then unlink and erase, links inside the stage go with it
+    BOOST_FOREACH (txiter itRemove, stage) {
+        BOOST_FOREACH (const CTxIn& txin, itRemove->GetTx().vin)
+            mapNextTx.erase(txin.prevout);
+        BOOST_FOREACH (txiter it, GetMemPoolParents(itRemove)) {
+            if (!stage.count(it))
+                UpdateChild(it, itRemove, false);
+        }
+        BOOST_FOREACH (txiter it, GetMemPoolChildren(itRemove)) {
+            if (!stage.count(it))
+                UpdateParent(it, itRemove, false);
+        }
+    }
+    BOOST_FOREACH (txiter itRemove, stage) {
+        txlinksMap::iterator itLinks = mapLinks.find(itRemove);
+        cachedInnerUsage -= memusage::DynamicUsage(itLinks->second.parents) + memusage::DynamicUsage(itLinks->second.children);
+        mapLinks.erase(itLinks);
+
+        removed.push_back(itRemove->GetTx());
+        totalTxSize -= itRemove->GetTxSize();
+        cachedInnerUsage -= itRemove->DynamicMemoryUsage();
+        UpdateTypeStats(itRemove, false);
+        mapTx.erase(itRemove);
+        nTransactionsUpdated++;
     }
 }
 
@@ -471,10 +771,10 @@ void CTxMemPool::removeCoinbaseSpends(const CCoinsViewCache* pcoins, unsigned in
     // Remove transactions spending a coinbase which are now immature
     LOCK(cs);
     list<CTransaction> transactionsToRemove;
-    for (std::map<uint256, CTxMemPoolEntry>::const_iterator it = mapTx.begin(); it != mapTx.end(); it++) {
-        const CTransaction& tx = it->second.GetTx();
+    for (txiter it = mapTx.begin(); it != mapTx.end(); it++) {
+        const CTransaction& tx = it->GetTx();
         BOOST_FOREACH (const CTxIn& txin, tx.vin) {
-            std::map<uint256, CTxMemPoolEntry>::const_iterator it2 = mapTx.find(txin.prevout.hash);
+            txiter it2 = mapTx.find(txin.prevout.hash);
             if (it2 != mapTx.end())
                 continue;
             const CCoins* coins = pcoins->AccessCoins(txin.prevout.hash);
@@ -515,9 +815,9 @@ void CTxMemPool::removeForBlock(const std::vector<CTransaction>& vtx, unsigned i
     LOCK(cs);
     std::vector<CTxMemPoolEntry> entries;
     BOOST_FOREACH (const CTransaction& tx, vtx) {
-        uint256 hash = tx.GetHash();
-        if (mapTx.count(hash))
-            entries.push_back(mapTx[hash]);
+        txiter it = mapTx.find(tx.GetHash());
+        if (it != mapTx.end())
+            entries.push_back(*it);
     }
     minerPolicyEstimator->seenBlock(entries, nBlockHeight, minRelayFee);
     BOOST_FOREACH (const CTransaction& tx, vtx) {
@@ -526,15 +826,23 @@ void CTxMemPool::removeForBlock(const std::vector<CTransaction>& vtx, unsigned i
         removeConflicts(tx, conflicts);
         ClearPrioritisation(tx.GetHash());
     }
+    lastRollingFeeUpdate = GetTime();
+    blockSinceLastRollingFeeBump = true;
 }
 
 
 void CTxMemPool::clear()
 {
     LOCK(cs);
+    mapLinks.clear();
     mapTx.clear();
     mapNextTx.clear();
     totalTxSize = 0;
+    cachedInnerUsage = 0;
+    mapTypeStats.clear();
+    lastRollingFeeUpdate = GetTime();
+    blockSinceLastRollingFeeBump = false;
+    rollingMinimumFeeRate = 0;
     ++nTransactionsUpdated;
 }
 
@@ -546,23 +854,34 @@ void CTxMemPool::check(const CCoinsViewCache* pcoins) const
     LogPrint("mempool", "Checking mempool with %u transactions and %u inputs\n", (unsigned int)mapTx.size(), (unsigned int)mapNextTx.size());
 
     uint64_t checkTotal = 0;
+    uint64_t innerUsage = 0;
+    std::map<int32_t, TxMempoolTypeStats> mapTypeCheck;
 
     CCoinsViewCache mempoolDuplicate(const_cast<CCoinsViewCache*>(pcoins));
 
     LOCK(cs);
     list<const CTxMemPoolEntry*> waitingOnDependants;
-    for (std::map<uint256, CTxMemPoolEntry>::const_iterator it = mapTx.begin(); it != mapTx.end(); it++) {
+    for (txiter it = mapTx.begin(); it != mapTx.end(); it++) {
         unsigned int i = 0;
-        checkTotal += it->second.GetTxSize();
-        const CTransaction& tx = it->second.GetTx();
+        checkTotal += it->GetTxSize();
+        innerUsage += it->DynamicMemoryUsage();
+        const CTransaction& tx = it->GetTx();
+        TxMempoolTypeStats& typeCheck = mapTypeCheck[tx.type];
+        typeCheck.nCount++;
+        typeCheck.nBytes += it->GetTxSize();
+        typeCheck.nUsage += it->DynamicMemoryUsage();
+        const TxLinks& links = mapLinks.find(it)->second;
+        innerUsage += memusage::DynamicUsage(links.parents) + memusage::DynamicUsage(links.children);
         bool fDependsWait = false;
+        setEntries setParentCheck;
         BOOST_FOREACH (const CTxIn& txin, tx.vin) {
             // Check that every mempool transaction's inputs refer to available coins, or other mempool tx's.
-            std::map<uint256, CTxMemPoolEntry>::const_iterator it2 = mapTx.find(txin.prevout.hash);
+            txiter it2 = mapTx.find(txin.prevout.hash);
             if (it2 != mapTx.end()) {
-                const CTransaction& tx2 = it2->second.GetTx();
+                const CTransaction& tx2 = it2->GetTx();
                 assert(tx2.vout.size() > txin.prevout.n && !tx2.vout[txin.prevout.n].IsNull());
                 fDependsWait = true;
+                setParentCheck.insert(it2);
             } else {
                 const CCoins* coins = pcoins->AccessCoins(txin.prevout.hash);
                 assert(coins && coins->IsAvailable(txin.prevout.n));
@@ -574,8 +893,36 @@ void CTxMemPool::check(const CCoinsViewCache* pcoins) const
             assert(it3->second.n == i);
             i++;
         }
+        assert(setParentCheck == GetMemPoolParents(it));
+
+        // Check the cached ancestor totals
+        setEntries setAncestors;
+        CalculateMemPoolAncestors(it, setAncestors);
+        uint64_t nSizeCheck = it->GetTxSize();
+        CAmount nFeesCheck = it->GetModifiedFee();
+        BOOST_FOREACH (txiter itAncestor, setAncestors) {
+            nSizeCheck += itAncestor->GetTxSize();
+            nFeesCheck += itAncestor->GetModifiedFee();
+        }
+        assert(it->GetCountWithAncestors() == setAncestors.size() + 1);
+        assert(it->GetSizeWithAncestors() == nSizeCheck);
+        assert(it->GetModFeesWithAncestors() == nFeesCheck);
+
+        // ... and descendant totals
+        setEntries setDescendants;
+        CalculateDescendants(it, setDescendants);
+        nSizeCheck = 0;
+        nFeesCheck = 0;
+        BOOST_FOREACH (txiter itDescendant, setDescendants) {
+            nSizeCheck += itDescendant->GetTxSize();
+            nFeesCheck += itDescendant->GetModifiedFee();
+        }
+        assert(it->GetCountWithDescendants() == setDescendants.size());
+        assert(it->GetSizeWithDescendants() == nSizeCheck);
+        assert(it->GetModFeesWithDescendants() == nFeesCheck);
+
         if (fDependsWait)
-            waitingOnDependants.push_back(&it->second);
+            waitingOnDependants.push_back(&(*it));
         else {
             CValidationState state;
             CTxUndo undo;
@@ -601,15 +948,23 @@ void CTxMemPool::check(const CCoinsViewCache* pcoins) const
     }
     for (std::map<COutPoint, CInPoint>::const_iterator it = mapNextTx.begin(); it != mapNextTx.end(); it++) {
         uint256 hash = it->second.ptx->GetHash();
-        map<uint256, CTxMemPoolEntry>::const_iterator it2 = mapTx.find(hash);
-        const CTransaction& tx = it2->second.GetTx();
+        txiter it2 = mapTx.find(hash);
         assert(it2 != mapTx.end());
+        const CTransaction& tx = it2->GetTx();
         assert(&tx == it->second.ptx);
         assert(tx.vin.size() > it->second.n);
         assert(it->first == it->second.ptx->vin[it->second.n].prevout);
     }
 
     assert(totalTxSize == checkTotal);
+    assert(innerUsage == cachedInnerUsage);
+    assert(mapTypeCheck.size() == mapTypeStats.size());
+    for (std::map<int32_t, TxMempoolTypeStats>::const_iterator it = mapTypeStats.begin(); it != mapTypeStats.end(); it++) {
+        const TxMempoolTypeStats& typeCheck = mapTypeCheck[it->first];
+        assert(typeCheck.nCount == it->second.nCount);
+        assert(typeCheck.nBytes == it->second.nBytes);
+        assert(typeCheck.nUsage == it->second.nUsage);
+    }
 }
 
 void CTxMemPool::queryHashes(vector<uint256>& vtxid)
@@ -618,8 +973,8 @@ void CTxMemPool::queryHashes(vector<uint256>& vtxid)
 
     LOCK(cs);
     vtxid.reserve(mapTx.size());
-    for (map<uint256, CTxMemPoolEntry>::iterator mi = mapTx.begin(); mi != mapTx.end(); ++mi)
-        vtxid.push_back((*mi).first);
+    for (txiter mi = mapTx.begin(); mi != mapTx.end(); ++mi)
+        vtxid.push_back(mi->GetTx().GetHash());
 }
 
 void CTxMemPool::getTransactions(std::set<uint256>& setTxid)
@@ -627,16 +982,16 @@ void CTxMemPool::getTransactions(std::set<uint256>& setTxid)
     setTxid.clear();
 
     LOCK(cs);
-    for (map<uint256, CTxMemPoolEntry>::iterator mi = mapTx.begin(); mi != mapTx.end(); ++mi)
-        setTxid.insert((*mi).first);
+    for (txiter mi = mapTx.begin(); mi != mapTx.end(); ++mi)
+        setTxid.insert(mi->GetTx().GetHash());
 }
 
 bool CTxMemPool::lookup(uint256 hash, CTransaction& result) const
 {
     LOCK(cs);
-    map<uint256, CTxMemPoolEntry>::const_iterator i = mapTx.find(hash);
+    txiter i = mapTx.find(hash);
     if (i == mapTx.end()) return false;
-    result = i->second.GetTx();
+    result = i->GetTx();
     return true;
 }
 
@@ -689,6 +1044,21 @@ void CTxMemPool::PrioritiseTransaction(const uint256 hash, const string strHash,
         std::pair<double, CAmount>& deltas = mapDeltas[hash];
         deltas.first += dPriorityDelta;
         deltas.second += nFeeDelta;
+        txiter it = mapTx.find(hash);
+        if (it != mapTx.end()) {
+            mapTx.modify(it, update_fee_delta(deltas.second));
+            // The transaction's ancestors carry its fee in their descendant totals
+            setEntries setAncestors;
+            CalculateMemPoolAncestors(it, setAncestors);
+            BOOST_FOREACH (txiter itAncestor, setAncestors)
+                mapTx.modify(itAncestor, update_descendant_state(0, nFeeDelta, 0));
+            // ... and its descendants in their ancestor totals
+            setEntries setDescendants;
+            CalculateDescendants(it, setDescendants);
+            setDescendants.erase(it);
+            BOOST_FOREACH (txiter itDescendant, setDescendants)
+                mapTx.modify(itDescendant, update_ancestor_state(0, nFeeDelta, 0));
+        }
     }
     LogPrintf("PrioritiseTransaction: %s priority += %f, fee += %d\n", strHash, dPriorityDelta, FormatMoney(nFeeDelta));
 }
@@ -710,6 +1080,85 @@ void CTxMemPool::ClearPrioritisation(const uint256 hash)
     mapDeltas.erase(hash);
 }
 
+size_t CTxMemPool::DynamicMemoryUsage() const
+{
+    LOCK(cs);
+    // Estimate the overhead of mapTx to be 9 pointers (three ordered indices) + an allocation, as no exact formula for boost::multi_index_contained is implemented.
+    return memusage::MallocUsage(sizeof(CTxMemPoolEntry) + 9 * sizeof(void*)) * mapTx.size() + memusage::DynamicUsage(mapNextTx) + memusage::DynamicUsage(mapDeltas) + memusage::DynamicUsage(mapLinks) + cachedInnerUsage;
+}
+
+std::map<int32_t, TxMempoolTypeStats> CTxMemPool::GetTypeStats() const
+{
+    LOCK(cs);
+    return mapTypeStats;
+}
+
+void CTxMemPool::trackPackageRemoved(const CFeeRate& rate)
+{
+    AssertLockHeld(cs);
+    if (rate.GetFeePerK() > rollingMinimumFeeRate) {
+        rollingMinimumFeeRate = rate.GetFeePerK();
+        blockSinceLastRollingFeeBump = false;
+    }
+}
+
+CFeeRate CTxMemPool::GetMinFee(size_t sizelimit) const
+{
+    LOCK(cs);
+    if (!blockSinceLastRollingFeeBump || rollingMinimumFeeRate == 0)
+        return CFeeRate(llround(rollingMinimumFeeRate));
+
+    int64_t time = GetTime();
+    if (time > lastRollingFeeUpdate + 10) {
+        double halflife = ROLLING_FEE_HALFLIFE;
+        if (DynamicMemoryUsage() < sizelimit / 4)
+            halflife /= 4;
+        else if (DynamicMemoryUsage() < sizelimit / 2)
+            halflife /= 2;
+
+        rollingMinimumFeeRate = rollingMinimumFeeRate / pow(2.0, (time - lastRollingFeeUpdate) / halflife);
+        lastRollingFeeUpdate = time;
+
+        if (rollingMinimumFeeRate < minRelayFee.GetFeePerK() / 2) {
+            rollingMinimumFeeRate = 0;
+            return CFeeRate(0);
+        }
+    }
+    return std::max(CFeeRate(llround(rollingMinimumFeeRate)), minRelayFee);
+}
+
+void CTxMemPool::TrimToSize(size_t sizelimit)
+{
+    LOCK(cs);
+
+    unsigned int nTxnRemoved = 0;
+    CFeeRate maxFeeRateRemoved(0);
+    while (!mapTx.empty() && DynamicMemoryUsage() > sizelimit) {
+        // Zerocoin spends pay no fee and would always go first; they have no
+        // parents in the pool, so evicting other packages never takes them along
+        indexed_transaction_set::index<descendant_score>::type::iterator it = mapTx.get<descendant_score>().begin();
+        while (it != mapTx.get<descendant_score>().end() && it->GetTx().IsZerocoinSpend())
+            ++it;
+        if (it == mapTx.get<descendant_score>().end())
+            break;
+
+        // Whatever replaces the evicted package has to pay the relay fee on
+        // top of it, so the pool does not churn on the same fee rate
+        CFeeRate removed(it->GetModFeesWithDescendants(), it->GetSizeWithDescendants());
+        removed = CFeeRate(removed.GetFeePerK() + minRelayFee.GetFeePerK());
+        trackPackageRemoved(removed);
+        maxFeeRateRemoved = std::max(maxFeeRateRemoved, removed);
+
+        CTransaction tx = it->GetTx();
+        std::list<CTransaction> removedTxs;
+        remove(tx, removedTxs, true);
+        nTxnRemoved += removedTxs.size();
+    }
+
+    if (maxFeeRateRemoved > CFeeRate(0))
+        LogPrint("mempool", "Removed %u txn, rolling minimum fee bumped to %s\n", nTxnRemoved, maxFeeRateRemoved.ToString());
+}
+
 
 CCoinsViewMemPool::CCoinsViewMemPool(CCoinsView* baseIn, CTxMemPool& mempoolIn) : CCoinsViewBacked(baseIn), mempool(mempoolIn) {}
 
@@ -8,12 +8,17 @@
 #define BITCOIN_TXMEMPOOL_H
 
 #include <list>
+#include <set>
 
 #include "amount.h"
 #include "coins.h"
 #include "primitives/transaction.h"
 #include "sync.h"
 
+#include <boost/multi_index/identity.hpp>
+#include <boost/multi_index/ordered_index.hpp>
+#include <boost/multi_index_container.hpp>
+
 class CAutoFile;
 
 inline double AllowFreeThreshold()
@@ -34,6 +39,12 @@ static const unsigned int MEMPOOL_HEIGHT = 0x7FFFFFFF;
 
 /**
  * CTxMemPool stores these:
+ *
+ * Besides the transaction itself, every entry keeps the totals of its
+ * in-mempool ancestors and descendants (including itself). They are kept up
+ * to date as transactions enter and leave the pool, so the miner can order
+ * packages by ancestor fee rate and the pool can evict by descendant fee
+ * rate without walking the dependency graph.
  */
 class CTxMemPoolEntry
 {
@@ -42,9 +53,19 @@ private:
     CAmount nFee;         //! Cached to avoid expensive parent-transaction lookups
     size_t nTxSize;       //! ... and avoid recomputing tx size
     size_t nModSize;      //! ... and modified size for priority
+    size_t nUsageSize;    //! ... and memory held by the transaction
     int64_t nTime;        //! Local time when entering the mempool
     double dPriority;     //! Priority when entering the mempool
     unsigned int nHeight; //! Chain height when entering the mempool
+    CAmount nFeeDelta;    //! Fee adjustment from prioritisetransaction
+
+    uint64_t nCountWithAncestors;  //! Number of in-mempool ancestors, including this one
+    uint64_t nSizeWithAncestors;   //! ... their total size
+    CAmount nModFeesWithAncestors; //! ... and their total modified fees
+
+    uint64_t nCountWithDescendants;  //! Number of in-mempool descendants, including this one
+    uint64_t nSizeWithDescendants;   //! ... their total size
+    CAmount nModFeesWithDescendants; //! ... and their total modified fees
 
 public:
     CTxMemPoolEntry(const CTransaction& _tx, const CAmount& _nFee, int64_t _nTime, double _dPriority, unsigned int _nHeight);
@@ -55,8 +76,163 @@ public:
     double GetPriority(unsigned int currentHeight) const;
     CAmount GetFee() const { return nFee; }
     size_t GetTxSize() const { return nTxSize; }
+    size_t DynamicMemoryUsage() const { return nUsageSize; }
     int64_t GetTime() const { return nTime; }
     unsigned int GetHeight() const { return nHeight; }
+    CAmount GetModifiedFee() const { return nFee + nFeeDelta; }
+
+    uint64_t GetCountWithAncestors() const { return nCountWithAncestors; }
+    uint64_t GetSizeWithAncestors() const { return nSizeWithAncestors; }
+    CAmount GetModFeesWithAncestors() const { return nModFeesWithAncestors; }
+
+    uint64_t GetCountWithDescendants() const { return nCountWithDescendants; }
+    uint64_t GetSizeWithDescendants() const { return nSizeWithDescendants; }
+    CAmount GetModFeesWithDescendants() const { return nModFeesWithDescendants; }
+
+    /** Adjust the ancestor totals when an ancestor enters, leaves or is reprioritised */
+    void UpdateAncestorState(int64_t nModifySize, CAmount nModifyFee, int64_t nModifyCount);
+    /** Adjust the descendant totals when a descendant enters, leaves or is reprioritised */
+    void UpdateDescendantState(int64_t nModifySize, CAmount nModifyFee, int64_t nModifyCount);
+    void UpdateFeeDelta(CAmount nNewFeeDelta);
+};
+
+struct update_ancestor_state {
+    update_ancestor_state(int64_t _nModifySize, CAmount _nModifyFee, int64_t _nModifyCount) : nModifySize(_nModifySize), nModifyFee(_nModifyFee), nModifyCount(_nModifyCount) {}
+
+    void operator()(CTxMemPoolEntry& e) { e.UpdateAncestorState(nModifySize, nModifyFee, nModifyCount); }
+
+private:
+    int64_t nModifySize;
+    CAmount nModifyFee;
+    int64_t nModifyCount;
+};
+
+struct update_descendant_state {
+    update_descendant_state(int64_t _nModifySize, CAmount _nModifyFee, int64_t _nModifyCount) : nModifySize(_nModifySize), nModifyFee(_nModifyFee), nModifyCount(_nModifyCount) {}
+
+    void operator()(CTxMemPoolEntry& e) { e.UpdateDescendantState(nModifySize, nModifyFee, nModifyCount); }
+
+private:
+    int64_t nModifySize;
+    CAmount nModifyFee;
+    int64_t nModifyCount;
+};
+
+struct update_fee_delta {
+    update_fee_delta(CAmount _nFeeDelta) : nFeeDelta(_nFeeDelta) {}
+
+    void operator()(CTxMemPoolEntry& e) { e.UpdateFeeDelta(nFeeDelta); }
+
+private:
+    CAmount nFeeDelta;
+};
+
+/** Extract the txid of an entry, the primary key of the mempool */
+struct mempoolentry_txid {
+    typedef uint256 result_type;
+    result_type operator()(const CTxMemPoolEntry& entry) const
+    {
+        return entry.GetTx().GetHash();
+    }
+};
+
+/**
+ * Sort by the lower of the ancestor fee rate and the transaction's own fee
+ * rate, highest first. Using the minimum keeps a cheap child from riding on
+ * a well paying parent it is not needed for. Works for anything exposing the
+ * CTxMemPoolEntry ancestor accessors.
+ */
+class CompareTxMemPoolEntryByAncestorFee
+{
+public:
+    template <typename T>
+    bool operator()(const T& a, const T& b) const
+    {
+        double a_mod_fee, a_size, b_mod_fee, b_size;
+        GetModFeeAndSize(a, a_mod_fee, a_size);
+        GetModFeeAndSize(b, b_mod_fee, b_size);
+
+        // Avoid division by rewriting (a/b > c/d) as (a*d > c*b).
+        double f1 = a_mod_fee * b_size;
+        double f2 = a_size * b_mod_fee;
+
+        if (f1 == f2)
+            return a.GetTx().GetHash() < b.GetTx().GetHash();
+        return f1 > f2;
+    }
+
+    template <typename T>
+    void GetModFeeAndSize(const T& a, double& mod_fee, double& size) const
+    {
+        double f1 = (double)a.GetModifiedFee() * a.GetSizeWithAncestors();
+        double f2 = (double)a.GetModFeesWithAncestors() * a.GetTxSize();
+
+        if (f1 > f2) {
+            mod_fee = a.GetModFeesWithAncestors();
+            size = a.GetSizeWithAncestors();
+        } else {
+            mod_fee = a.GetModifiedFee();
+            size = a.GetTxSize();
+        }
+    }
+};
+
+/**
+ * Sort by the higher of the descendant fee rate and the transaction's own fee
+ * rate, lowest first. The first entry is the cheapest one to evict: removing
+ * it takes its descendants along, and a parent whose children pay for it is
+ * kept as long as they do.
+ */
+class CompareTxMemPoolEntryByDescendantScore
+{
+public:
+    bool operator()(const CTxMemPoolEntry& a, const CTxMemPoolEntry& b) const
+    {
+        double a_mod_fee, a_size, b_mod_fee, b_size;
+        GetModFeeAndSize(a, a_mod_fee, a_size);
+        GetModFeeAndSize(b, b_mod_fee, b_size);
+
+        // Avoid division by rewriting (a/b < c/d) as (a*d < c*b).
+        double f1 = a_mod_fee * b_size;
+        double f2 = a_size * b_mod_fee;
+
+        // Of equal fee rates, the newest goes first
+        if (f1 == f2) {
+            if (a.GetTime() != b.GetTime())
+                return a.GetTime() > b.GetTime();
+            return a.GetTx().GetHash() < b.GetTx().GetHash();
+        }
+        return f1 < f2;
+    }
+
+    void GetModFeeAndSize(const CTxMemPoolEntry& a, double& mod_fee, double& size) const
+    {
+        double f1 = (double)a.GetModifiedFee() * a.GetSizeWithDescendants();
+        double f2 = (double)a.GetModFeesWithDescendants() * a.GetTxSize();
+
+        if (f2 > f1) {
+            mod_fee = a.GetModFeesWithDescendants();
+            size = a.GetSizeWithDescendants();
+        } else {
+            mod_fee = a.GetModifiedFee();
+            size = a.GetTxSize();
+        }
+    }
+};
+
+// Multi_index tag names
+struct ancestor_score {
+};
+struct descendant_score {
+};
+
+/** Number, serialized size and memory usage of the mempool transactions of one type */
+struct TxMempoolTypeStats {
+    uint64_t nCount;
+    uint64_t nBytes;
+    uint64_t nUsage;
+
+    TxMempoolTypeStats() : nCount(0), nBytes(0), nUsage(0) {}
 };
 
 class CMinerPolicyEstimator;
@@ -101,10 +277,71 @@ private:
 
     CFeeRate minRelayFee; //! Passed to constructor to avoid dependency on main
     uint64_t totalTxSize; //! sum of all mempool tx' byte sizes
+    uint64_t cachedInnerUsage; //! sum of dynamic memory usage of all the map elements (NOT the maps themselves)
+    std::map<int32_t, TxMempoolTypeStats> mapTypeStats; //! totals per transaction type
+
+    //! Fee rate below which transactions are not accepted since the pool was last trimmed
+    mutable double rollingMinimumFeeRate;
+    mutable int64_t lastRollingFeeUpdate;
+    mutable bool blockSinceLastRollingFeeBump;
+
+    void trackPackageRemoved(const CFeeRate& rate);
 
 public:
+    typedef boost::multi_index_container<
+        CTxMemPoolEntry,
+        boost::multi_index::indexed_by<
+            // sorted by txid
+            boost::multi_index::ordered_unique<mempoolentry_txid>,
+            // sorted by ancestor package fee rate, best first
+            boost::multi_index::ordered_non_unique<
+                boost::multi_index::tag<ancestor_score>,
+                boost::multi_index::identity<CTxMemPoolEntry>,
+                CompareTxMemPoolEntryByAncestorFee>,
+            // sorted by descendant fee rate, cheapest to evict first
+            boost::multi_index::ordered_non_unique<
+                boost::multi_index::tag<descendant_score>,
+                boost::multi_index::identity<CTxMemPoolEntry>,
+                CompareTxMemPoolEntryByDescendantScore> > >
+        indexed_transaction_set;
+
     mutable CCriticalSection cs;
-    std::map<uint256, CTxMemPoolEntry> mapTx;
+    indexed_transaction_set mapTx;
+
+    typedef indexed_transaction_set::nth_index<0>::type::const_iterator txiter;
+    struct CompareIteratorByHash {
+        bool operator()(const txiter& a, const txiter& b) const
+        {
+            return a->GetTx().GetHash() < b->GetTx().GetHash();
+        }
+    };
+    typedef std::set<txiter, CompareIteratorByHash> setEntries;
+
+private:
+    /** In-mempool parents and children of every entry */
+    struct TxLinks {
+        setEntries parents;
+        setEntries children;
+    };
+    typedef std::map<txiter, TxLinks, CompareIteratorByHash> txlinksMap;
+    txlinksMap mapLinks;
+
+    void UpdateParent(txiter entry, txiter parent, bool fAdd);
+    void UpdateChild(txiter entry, txiter child, bool fAdd);
+    /** Recompute the ancestor totals of an entry from its ancestor set */
+    void UpdateEntryAncestorState(txiter entry);
+    /** Recompute the descendant totals of an entry from its descendant set */
+    void UpdateEntryDescendantState(txiter entry);
+    void UpdateTypeStats(txiter entry, bool fAdd);
+    /**
+     * Remove the entries in stage together. The package totals of the
+     * entries left behind are updated before any link goes. Requires cs.
+     */
+    void RemoveStaged(const setEntries& stage, std::list<CTransaction>& removed);
+
+public:
+    static const int ROLLING_FEE_HALFLIFE = 60 * 60 * 12; //! public only for testing
+
     std::map<COutPoint, CInPoint> mapNextTx;
     std::map<uint256, std::pair<double, CAmount> > mapDeltas;
 
@@ -129,6 +366,20 @@ public:
     void queryHashes(std::vector<uint256>& vtxid);
     void getTransactions(std::set<uint256>& setTxid);
     void pruneSpent(const uint256& hash, CCoins& coins);
+
+    const setEntries& GetMemPoolParents(txiter entry) const;
+    const setEntries& GetMemPoolChildren(txiter entry) const;
+    /** All in-mempool ancestors of an entry, not including the entry itself. Requires cs. */
+    void CalculateMemPoolAncestors(txiter entry, setEntries& setAncestors) const;
+    /** Add an entry and all its in-mempool descendants to setDescendants. Requires cs. */
+    void CalculateDescendants(txiter entry, setEntries& setDescendants) const;
+    /**
+     * Check that adding tx, of nSize bytes, keeps it and each of its
+     * in-mempool ancestors within the given package limits. Sizes are in
+     * bytes. On failure errString says which limit was hit.
+     */
+    bool CheckPackageLimits(const CTransaction& tx, uint64_t nSize, uint64_t limitAncestorCount, uint64_t limitAncestorSize,
+                            uint64_t limitDescendantCount, uint64_t limitDescendantSize, std::string& errString) const;
     unsigned int GetTransactionsUpdated() const;
     void AddTransactionsUpdated(unsigned int n);
 
@@ -148,6 +399,23 @@ public:
         return totalTxSize;
     }
 
+    /** Memory used by the pool, including the transactions and the index overhead */
+    size_t DynamicMemoryUsage() const;
+    /** Totals per transaction type */
+    std::map<int32_t, TxMempoolTypeStats> GetTypeStats() const;
+
+    /**
+     * Evict the transactions with the lowest descendant fee rate, together
+     * with their descendants, until the pool uses at most sizelimit bytes.
+     */
+    void TrimToSize(size_t sizelimit);
+    /**
+     * The fee rate a transaction needs to get into a pool limited to
+     * sizelimit bytes. It is raised above the fee rate of whatever was last
+     * evicted and decays back to zero as the pool drains.
+     */
+    CFeeRate GetMinFee(size_t sizelimit) const;
+
     bool exists(uint256 hash)
     {
         LOCK(cs);
@@ -10,6 +10,7 @@
 
 #include "accumulators.h"
 #include "base58.h"
+#include "blockstream.h"
 #include "checkpoints.h"
 #include "coincontrol.h"
 #include "kernel.h"
@@ -451,6 +452,7 @@ bool CWallet::IsSpent(const uint256& hash, unsigned int n) const
 void CWallet::AddToSpends(const COutPoint& outpoint, const uint256& wtxid)
 {
     mapTxSpends.insert(make_pair(outpoint, wtxid));
+    UpdateStakeableCoin(outpoint, true);
     pair<TxSpends::iterator, TxSpends::iterator> range;
     range = mapTxSpends.equal_range(outpoint);
     SyncMetaData(range);
@@ -468,6 +470,51 @@ void CWallet::AddToSpends(const uint256& wtxid)
         AddToSpends(txin.prevout, wtxid);
 }
 
+/** Add or remove one output in the stakeable coin index. Requires cs_wallet. */
+void CWallet::UpdateStakeableCoin(const COutPoint& outpoint, bool fSpent)
+{
+    bool fStakeable = false;
+    if (!fSpent) {
+        map<uint256, CWalletTx>::const_iterator it = mapWallet.find(outpoint.hash);
+        if (it != mapWallet.end() && outpoint.n < it->second.vout.size()) {
+            // Same ownership and type filter as AvailableCoins(STAKABLE_COINS)
+            const CTxOut& txout = it->second.vout[outpoint.n];
+            isminetype mine = IsMine(txout);
+            fStakeable = (mine == ISMINE_SPENDABLE || mine == ISMINE_MULTISIG) && !txout.IsZerocoinMint() && txout.nValue > 0;
+        }
+    }
+
+    if (fStakeable ? setStakeableCoins.insert(outpoint).second : setStakeableCoins.erase(outpoint) > 0)
+        pStakeableSnapshot.reset();
+}
+
+void CWallet::UpdateStakeableCoins(const uint256& wtxid)
+{
+    const CWalletTx& wtx = mapWallet[wtxid];
+    for (unsigned int i = 0; i < wtx.vout.size(); i++) {
+        const COutPoint outpoint(wtxid, i);
+        UpdateStakeableCoin(outpoint, mapTxSpends.count(outpoint) > 0);
+    }
+}
+
+void CWallet::RebuildStakeableCoins()
+{
+    LOCK(cs_wallet);
+    setStakeableCoins.clear();
+    pStakeableSnapshot.reset();
+    for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        UpdateStakeableCoins(it->first);
+}
+
+std::shared_ptr<const std::vector<COutPoint> > CWallet::GetStakeableCoins() const
+{
+    LOCK(cs_wallet);
+    if (!pStakeableSnapshot) {
+        pStakeableSnapshot = std::make_shared<const std::vector<COutPoint> >(setStakeableCoins.begin(), setStakeableCoins.end());
+    }
+    return pStakeableSnapshot;
+}
+
 bool CWallet::GetMasternodeVinAndKeys(CTxIn& txinRet, CPubKey& pubKeyRet, CKey& keyRet, std::string strTxHash, std::string strOutputIndex)
 {
     // wait for reindex and/or import to finish
@@ -651,6 +698,7 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet)
         CWalletTx& wtx = mapWallet[hash];
         wtx.BindWallet(this);
         wtxOrdered.insert(make_pair(wtx.nOrderPos, TxPair(&wtx, (CAccountingEntry*)0)));
+        // Keys may load after their transactions, LoadWallet indexes these once it is done
         AddToSpends(hash);
     } else {
         LOCK(cs_wallet);
@@ -666,6 +714,7 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet)
             wtxOrdered.insert(make_pair(wtx.nOrderPos, TxPair(&wtx, (CAccountingEntry*)0)));
             wtx.nTimeSmart = ComputeTimeSmart(wtx);
             AddToSpends(hash);
+            UpdateStakeableCoins(hash);
         }
 
         bool fUpdated = false;
@@ -745,8 +794,11 @@ void CWallet::SyncTransaction(const CTransaction& tx, const CBlock* pblock)
     // available of the outputs it spends. So force those to be
     // recomputed, also:
     BOOST_FOREACH (const CTxIn& txin, tx.vin) {
-        if (!tx.IsZerocoinSpend() && mapWallet.count(txin.prevout.hash))
+        if (!tx.IsZerocoinSpend() && mapWallet.count(txin.prevout.hash)) {
             mapWallet[txin.prevout.hash].MarkDirty();
+            // A conflicted spend gives the coin back to the staker
+            UpdateStakeableCoin(txin.prevout, IsSpent(txin.prevout.hash, txin.prevout.n));
+        }
     }
 }
 
@@ -756,6 +808,11 @@ void CWallet::EraseFromWallet(const uint256& hash)
         return;
     {
         LOCK(cs_wallet);
+        map<uint256, CWalletTx>::const_iterator it = mapWallet.find(hash);
+        if (it != mapWallet.end()) {
+            for (unsigned int i = 0; i < it->second.vout.size(); i++)
+                UpdateStakeableCoin(COutPoint(hash, i), true);
+        }
         if (mapWallet.erase(hash))
             CWalletDB(strWalletFile).EraseTx(hash);
     }
@@ -1456,12 +1513,12 @@ int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate)
         double dProgressStart = Checkpoints::GuessVerificationProgress(pindex, false);
         double dProgressTip = Checkpoints::GuessVerificationProgress(chainActive.Tip(), false);
         set<uint256> setAddedToWallet;
-        while (pindex) {
+        CBlockStream stream(pindex ? GetChainRange(chainActive, pindex->nHeight) : std::vector<CBlockIndex*>());
+        CBlock block;
+        while (stream.Next(pindex, block)) {
             if (pindex->nHeight % 100 == 0 && dProgressTip - dProgressStart > 0.0)
                 ShowProgress(_("Rescanning..."), std::max(1, std::min(99, (int)((Checkpoints::GuessVerificationProgress(pindex, false) - dProgressStart) / (dProgressTip - dProgressStart) * 100))));
 
-            CBlock block;
-            ReadBlockFromDisk(block, pindex);
             BOOST_FOREACH (CTransaction& tx, block.vtx) {
                 if (AddToWalletIfInvolvingMe(tx, &block, fUpdate))
                     ret++;
@@ -1513,12 +1570,15 @@ int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate)
                 }
             }
 
-            pindex = chainActive.Next(pindex);
             if (GetTime() >= nNow + 60) {
                 nNow = GetTime();
                 LogPrintf("Still rescanning. At block %d. Progress=%f\n", pindex->nHeight, Checkpoints::GuessVerificationProgress(pindex));
             }
         }
+        if (stream.Failed())
+            LogPrintf("%s : failed to read block %d, rescan stopped early\n", __func__, pindex->nHeight);
+        // Rescans follow key imports, which can make existing transactions ours
+        RebuildStakeableCoins();
         ShowProgress(_("Rescanning..."), 100); // hide progress dialog in GUI
     }
     return ret;
@@ -2088,40 +2148,69 @@ bool less_then_denom(const COutput& out1, const COutput& out2)
     return (!found1 && found2);
 }
 
-bool CWallet::SelectStakeCoins(std::list<std::unique_ptr<CStakeInput> >& listInputs, CAmount nTargetAmount)
+bool CWallet::SelectStakeCoins(std::list<std::unique_ptr<CStakeInput> >& listInputs, CAmount nReserveAmount)
 {
-    LOCK(cs_main);
+    LOCK2(cs_main, cs_wallet);
     //Add PDG
-    vector<COutput> vCoins;
-    AvailableCoins(vCoins, true, NULL, false, STAKABLE_COINS);
-    CAmount nAmountSelected = 0;
     if (GetBoolArg("-pdgstake", true)) {
-        for (const COutput &out : vCoins) {
+        // The index only knows which outputs are ours and unspent; everything
+        // that depends on the current tip is checked here
+        std::shared_ptr<const std::vector<COutPoint> > pCoins = GetStakeableCoins();
+        std::vector<std::pair<const CWalletTx*, unsigned int> > vCoins;
+        CAmount nSpendable = 0;
+        for (const COutPoint& outpoint : *pCoins) {
+            map<uint256, CWalletTx>::const_iterator it = mapWallet.find(outpoint.hash);
+            if (it == mapWallet.end())
+                continue;
+            const CWalletTx* pcoin = &it->second;
+
+            //check that it is matured
+            int nDepth = pcoin->GetDepthInMainChain(false);
+            if (nDepth < (pcoin->IsCoinStake() ? Params().COINBASE_MATURITY() : 10))
+                continue;
+            if ((pcoin->IsCoinBase() || pcoin->IsCoinStake()) && pcoin->GetBlocksToMaturity() > 0)
+                continue;
+
+            if (!CheckFinalTx(*pcoin) || !pcoin->IsTrusted())
+                continue;
+            if (IsSpent(outpoint.hash, outpoint.n) || IsLockedCoin(outpoint.hash, outpoint.n))
+                continue;
+
+            nSpendable += pcoin->vout[outpoint.n].nValue;
+            vCoins.push_back(std::make_pair(pcoin, outpoint.n));
+        }
+
+        // The reserve is kept out of the mature, spendable coins only
+        if (nSpendable > 0 && nSpendable <= nReserveAmount)
+            return false;
+
+        CAmount nTargetAmount = nSpendable - nReserveAmount;
+        CAmount nAmountSelected = 0;
+        for (const std::pair<const CWalletTx*, unsigned int>& coin : vCoins) {
+            const CWalletTx* pcoin = coin.first;
+            CAmount nValue = pcoin->vout[coin.second].nValue;
+
             //make sure not to outrun target amount
-            if (nAmountSelected + out.tx->vout[out.i].nValue > nTargetAmount)
+            if (nAmountSelected + nValue > nTargetAmount)
                 continue;
 
             //if zerocoinspend, then use the block time
-            int64_t nTxTime = out.tx->GetTxTime();
-            if (out.tx->IsZerocoinSpend()) {
-                if (!out.tx->IsInMainChain())
+            int64_t nTxTime = pcoin->GetTxTime();
+            if (pcoin->IsZerocoinSpend()) {
+                if (!pcoin->IsInMainChain())
                     continue;
-                nTxTime = mapBlockIndex.at(out.tx->hashBlock)->GetBlockTime();
+                nTxTime = mapBlockIndex.at(pcoin->hashBlock)->GetBlockTime();
             }
 
             //check for min age
             if (GetAdjustedTime() - nTxTime < nStakeMinAge)
                 continue;
 
-            //check that it is matured
-            if (out.nDepth < (out.tx->IsCoinStake() ? Params().COINBASE_MATURITY() : 10))
-                continue;
-
             //add to our stake set
-            nAmountSelected += out.tx->vout[out.i].nValue;
+            nAmountSelected += nValue;
 
             std::unique_ptr<CPivStake> input(new CPivStake());
-            input->SetInput((CTransaction) *out.tx, out.i);
+            input->SetInput((CTransaction) *pcoin, coin.second);
             listInputs.emplace_back(std::move(input));
         }
     }
@@ -2972,30 +3061,26 @@ bool CWallet::CreateCoinStake(const CKeyStore& keystore, unsigned int nBits, int
     txNew.vout.push_back(CTxOut(0, scriptEmpty));
 
     // Choose coins to use
-    CAmount nBalance = GetBalance();
-
     if (mapArgs.count("-reservebalance") && !ParseMoney(mapArgs["-reservebalance"], nReserveBalance))
         return error("CreateCoinStake : invalid reserve balance amount");
 
-    if (nBalance > 0 && nBalance <= nReserveBalance)
-        return false;
+    // Wait before selecting so the inputs reflect the wallet after the pause
+    if (GetAdjustedTime() - chainActive.Tip()->GetBlockTime() < 60)
+        MilliSleep(10000);
 
-    // Get the list of stakable inputs
+    // Get the list of stakable inputs, leaving the reserve out
     std::list<std::unique_ptr<CStakeInput> > listInputs;
-    if (!SelectStakeCoins(listInputs, nBalance - nReserveBalance))
+    if (!SelectStakeCoins(listInputs, nReserveBalance))
         return false;
 
     if (listInputs.empty())
         return false;
 
-    if (GetAdjustedTime() - chainActive.Tip()->GetBlockTime() < 60)
-        MilliSleep(10000);
-
-    CAmount nCredit;
-    CScript scriptPubKeyKernel;
-    bool fKernelFound = false;
+    // Set up the kernel of every input first, so the search only hashes the varying timestamp
+    unsigned int nTimeSearch = GetAdjustedTime();
+    std::vector<CStakeInput*> vStakeInputs;
+    std::vector<CStakeKernel> vKernels;
     for (std::unique_ptr<CStakeInput>& stakeInput : listInputs) {
-        nCredit = 0;
         // Make sure the wallet is unlocked and shutdown hasn't been requested
         if (IsLocked() || ShutdownRequested())
             return false;
@@ -3007,13 +3092,33 @@ bool CWallet::CreateCoinStake(const CKeyStore& keystore, unsigned int nBits, int
             continue;
         }
 
-        // Read block header
-        CBlockHeader block = pindex->GetBlockHeader();
+        CStakeKernel kernel;
+        if (!GetStakeKernel(stakeInput.get(), nBits, pindex->GetBlockTime(), nTimeSearch, kernel))
+            continue;
+        vStakeInputs.push_back(stakeInput.get());
+        vKernels.push_back(kernel);
+    }
+
+    CAmount nCredit;
+    CScript scriptPubKeyKernel;
+    bool fKernelFound = false;
+    int nStakeThreads = std::min((int)GetArg("-stakethreads", DEFAULT_STAKE_THREADS), MAX_STAKE_KERNEL_THREADS);
+    size_t nSearchFrom = 0;
+    while (!fKernelFound) {
+        nCredit = 0;
+        // Make sure the wallet is unlocked and shutdown hasn't been requested
+        if (IsLocked() || ShutdownRequested())
+            return false;
+
+        // Search the remaining inputs in parallel; the first one in list order that hits is used
         uint256 hashProofOfStake = 0;
-        nTxNewTime = GetAdjustedTime();
+        int nFound = SearchStakeKernels(vKernels, nSearchFrom, nTimeSearch, nTxNewTime, hashProofOfStake, nStakeThreads);
+        if (nFound < 0)
+            break;
+        nSearchFrom = nFound + 1;
+        CStakeInput* stakeInput = vStakeInputs[nFound];
 
-        //iterates each utxo inside of CheckStakeKernelHash()
-        if (Stake(stakeInput.get(), nBits, block.GetBlockTime(), nTxNewTime, hashProofOfStake)) {
+        {
             LOCK(cs_main);
             //Double check that this will pass time requirements
             if (nTxNewTime <= chainActive.Tip()->GetMedianTimePast()) {
@@ -3068,16 +3173,13 @@ bool CWallet::CreateCoinStake(const CKeyStore& keystore, unsigned int nBits, int
 
             //Mark mints as spent
             if (stakeInput->IsZPIV()) {
-                CZPivStake* z = (CZPivStake*)stakeInput.get();
+                CZPivStake* z = (CZPivStake*)stakeInput;
                 if (!z->MarkSpent(this, txNew.GetHash()))
                     return error("%s: failed to mark mint as used\n", __func__);
             }
 
             fKernelFound = true;
-            break;
         }
-        if (fKernelFound)
-            break; // if kernel is found stop searching
     }
     if (!fKernelFound)
         return false;
@@ -3373,6 +3475,8 @@ DBErrors CWallet::LoadWallet(bool& fFirstRunRet)
         return nLoadWalletRet;
     fFirstRunRet = !vchDefaultKey.IsValid();
 
+    RebuildStakeableCoins();
+
     uiInterface.LoadWallet(this);
 
     return DB_LOAD_OK;
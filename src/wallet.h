@@ -28,6 +28,7 @@
 
 #include <algorithm>
 #include <map>
+#include <memory>
 #include <set>
 #include <stdexcept>
 #include <stdint.h>
@@ -194,6 +195,18 @@ private:
 
     void SyncMetaData(std::pair<TxSpends::iterator, TxSpends::iterator>);
 
+    /**
+     * Outputs that can stake once they are deep enough. Kept up to date as
+     * transactions are added, spent, synced and erased so a staking attempt
+     * does not have to walk mapWallet. Depth, maturity and lock checks change
+     * with every block and are left to SelectStakeCoins.
+     */
+    std::set<COutPoint> setStakeableCoins;
+    //! Copy of setStakeableCoins handed to the staker, rebuilt after a change
+    mutable std::shared_ptr<const std::vector<COutPoint> > pStakeableSnapshot;
+    void UpdateStakeableCoin(const COutPoint& outpoint, bool fSpent);
+    void UpdateStakeableCoins(const uint256& wtxid);
+
     void ProcessFileTransaction(const CTransaction& tx, const CBlock* pblock);
     bool OnPaymentConfirmed(const CWalletTx* tx);
 
@@ -202,7 +215,11 @@ private:
 
 public:
     bool MintableCoins();
-    bool SelectStakeCoins(std::list<std::unique_ptr<CStakeInput> >& listInputs, CAmount nTargetAmount);
+    //! Inputs that can stake now, leaving nReserveAmount of the mature, spendable PDG out
+    bool SelectStakeCoins(std::list<std::unique_ptr<CStakeInput> >& listInputs, CAmount nReserveAmount);
+    std::shared_ptr<const std::vector<COutPoint> > GetStakeableCoins() const;
+    //! Rebuild the stakeable coin index after keys or scripts were loaded or imported
+    void RebuildStakeableCoins();
     bool SelectCoinsDark(CAmount nValueMin, CAmount nValueMax, std::vector<CTxIn>& setCoinsRet, CAmount& nValueRet, int nObfuscationRoundsMin, int nObfuscationRoundsMax) const;
     bool SelectCoinsByDenominations(int nDenom, CAmount nValueMin, CAmount nValueMax, std::vector<CTxIn>& vCoinsRet, std::vector<COutput>& vCoinsRet2, CAmount& nValueRet, int nObfuscationRoundsMin, int nObfuscationRoundsMax);
     bool SelectCoinsDarkDenominated(CAmount nTargetValue, std::vector<CTxIn>& setCoinsRet, CAmount& nValueRet) const;
@@ -0,0 +1,93 @@
+// Copyright (c) 2018-2019 The PDG developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "zpivspendcache.h"
+
+#include "crypto/sha256.h"
+#include "cuckoocache.h"
+#include "hash.h"
+#include "libzerocoin/Accumulator.h"
+#include "libzerocoin/CoinSpend.h"
+#include "random.h"
+#include "version.h"
+
+#include <string.h>
+
+#include <boost/thread.hpp>
+
+namespace
+{
+/** Entries are salted SHA-256 hashes, so each hash is just a slice of the entry */
+class ZerocoinSpendCacheHasher
+{
+public:
+    template <uint8_t hash_select>
+    uint32_t operator()(const uint256& key) const
+    {
+        static_assert(hash_select < 8, "ZerocoinSpendCacheHasher only has 8 hashes available.");
+        uint32_t u;
+        memcpy(&u, key.begin() + 4 * hash_select, 4);
+        return u;
+    }
+};
+
+/**
+ * Verified zerocoin spend cache, to avoid checking the same proof twice:
+ * once when the spend is accepted into the memory pool, and again when the
+ * block containing it is connected.
+ */
+class CZerocoinSpendCache
+{
+private:
+    //! Entries are SHA256(nonce || proof key), so peers cannot aim spends at one bucket
+    uint256 nonce;
+    CuckooCache::cache<uint256, ZerocoinSpendCacheHasher> setValid;
+    boost::shared_mutex cs_spendcache;
+
+    uint256 ComputeEntry(const uint256& hashProof) const
+    {
+        uint256 entry;
+        CSHA256().Write(nonce.begin(), 32).Write(hashProof.begin(), 32).Finalize(entry.begin());
+        return entry;
+    }
+
+public:
+    CZerocoinSpendCache()
+    {
+        GetRandBytes(nonce.begin(), 32);
+        setValid.setup(DEFAULT_MAX_ZEROCOIN_SPEND_CACHE);
+    }
+
+    bool Get(const uint256& hashProof)
+    {
+        boost::shared_lock<boost::shared_mutex> lock(cs_spendcache);
+        return setValid.contains(ComputeEntry(hashProof), false);
+    }
+
+    void Set(const uint256& hashProof)
+    {
+        boost::unique_lock<boost::shared_mutex> lock(cs_spendcache);
+        setValid.insert(ComputeEntry(hashProof));
+    }
+};
+
+CZerocoinSpendCache spendCache;
+}
+
+uint256 GetZerocoinSpendCacheKey(const libzerocoin::CoinSpend& spend, const libzerocoin::Accumulator& accumulator, bool fUseV1Params)
+{
+    CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
+    ss << spend << accumulator << fUseV1Params;
+    return ss.GetHash();
+}
+
+bool IsZerocoinSpendVerified(const uint256& hashProof)
+{
+    return spendCache.Get(hashProof);
+}
+
+void SetZerocoinSpendVerified(const uint256& hashProof)
+{
+    spendCache.Set(hashProof);
+}
@@ -0,0 +1,32 @@
+// Copyright (c) 2018-2019 The PDG developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef PDG_ZPIVSPENDCACHE_H
+#define PDG_ZPIVSPENDCACHE_H
+
+#include "uint256.h"
+
+namespace libzerocoin
+{
+class Accumulator;
+class CoinSpend;
+}
+
+/** Number of verified zerocoin spend proofs remembered */
+static const unsigned int DEFAULT_MAX_ZEROCOIN_SPEND_CACHE = 10000;
+
+/**
+ * Identifies a spend proof checked against one accumulator. The whole
+ * serialized spend is hashed, signature of knowledge included, so a
+ * malleated proof never matches a cached one.
+ */
+uint256 GetZerocoinSpendCacheKey(const libzerocoin::CoinSpend& spend, const libzerocoin::Accumulator& accumulator, bool fUseV1Params);
+
+/** Whether the spend proof with this key has been verified before */
+bool IsZerocoinSpendVerified(const uint256& hashProof);
+
+/** Remember a spend proof that verified, so that block connection does not verify it again */
+void SetZerocoinSpendVerified(const uint256& hashProof);
+
+#endif // PDG_ZPIVSPENDCACHE_H